@@ -0,0 +1,329 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Everything that happens to a single board, from opening it
+ * to u-boot running.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "board.h"
+#include "clock.h"
+#include "dfu.h"
+#include "image.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "plan.h"
+#include "pool.h"
+#include "sstarscsi.h"
+#include "topology.h"
+#include "transport.h"
+#include "ums.h"
+#include "usbms.h"
+#include "log.h"
+#include "report.h"
+#include "xfer.h"
+
+#include "main_log.h"
+
+static void board_identify(struct p3udl_cntx *cntx, libusb_device *dev)
+{
+	cntx->tag = 1;
+	cntx->stage = P3UDL_STAGE_PROBE;
+	report_begin(cntx, REPORT_PHASE_PROBE);
+	cntx->bus = libusb_get_bus_number(dev);
+	cntx->address = libusb_get_device_address(dev);
+	cntx->nports = libusb_get_port_numbers(dev, cntx->ports, sizeof(cntx->ports));
+	/* The slot if it has one, otherwise where it's plugged in */
+	if (!topology_assign(cntx)) {
+		if (cntx->nports > 0)
+			snprintf(cntx->name, sizeof(cntx->name), "%s", cntx->port);
+		else
+			snprintf(cntx->name, sizeof(cntx->name), "%03u:%03u", cntx->bus, cntx->address);
+	}
+}
+
+/* Get the board away from the kernel, the handle is closed if that can't be done */
+static int board_claim(struct p3udl_cntx *cntx, libusb_device_handle *lu_handle)
+{
+	int ret;
+
+	cntx->lu_handle = lu_handle;
+
+	if (cntx->sg) {
+		ret = transport_sg_open(cntx);
+		if (ret) {
+			libusb_close(lu_handle);
+			cntx->lu_handle = NULL;
+		}
+		return ret;
+	}
+
+	/* check if the kernel driver is attached */
+	ret = libusb_kernel_driver_active(lu_handle, 0);
+	if (ret == 1) {
+		/* detach kernel device */
+		ret = libusb_detach_kernel_driver(lu_handle, 0);
+		if (ret) {
+			p3udl_err(cntx, "failed to detach kernel driver: %d\n", ret);
+			libusb_close(lu_handle);
+			cntx->lu_handle = NULL;
+			return -ENODEV;
+		}
+	}
+
+	cntx->transport = &transport_libusb;
+	return 0;
+}
+
+int board_open(struct p3udl_cntx *cntx, libusb_device *dev)
+{
+	libusb_device_handle *lu_handle;
+
+	board_identify(cntx, dev);
+
+	int ret = libusb_open(dev, &lu_handle);
+	if (ret) {
+		p3udl_err(cntx, "failed to open device: %s\n", libusb_strerror((enum libusb_error) ret));
+		return -ENODEV;
+	}
+
+	return board_claim(cntx, lu_handle);
+}
+
+/* For a handle someone else opened, the board owns it from here on */
+int board_open_handle(struct p3udl_cntx *cntx, libusb_device_handle *lu_handle)
+{
+	board_identify(cntx, libusb_get_device(lu_handle));
+
+	return board_claim(cntx, lu_handle);
+}
+
+static int scsi_probe(struct p3udl_cntx *cntx)
+{
+	/* get the max lun to check the device is present */
+	int ret = usb_massstorage_get_maxlun(cntx);
+	if (ret < 0) {
+		p3udl_err(cntx, "Couldn't request maxlun %d, need reset?\n", ret);
+		return ret;
+	}
+
+	struct mass_storage_inquiry_result inquiry_result;
+	ret = usb_massstorage_inquiry(cntx, &inquiry_result);
+	if (ret)
+		return ret;
+
+	p3udl_info(cntx, "VID:PID:REV \"%8s\":\"%8s\":\"%4s\"\n",
+			inquiry_result.vid, inquiry_result.pid, inquiry_result.rev);
+
+	snprintf(cntx->chip, sizeof(cntx->chip), "%s:%s:%s",
+			inquiry_result.vid, inquiry_result.pid, inquiry_result.rev);
+	for (char *c = cntx->chip; *c; c++) {
+		if (!isgraph((unsigned char) *c) || *c == '"' || *c == '\\')
+			*c = '_';
+	}
+
+	cntx->fast = !strcmp(inquiry_result.vid, SSTARSCSI_FAST_VID) &&
+			!strcmp(inquiry_result.pid, SSTARSCSI_FAST_PID);
+	if (cntx->fast)
+		p3udl_info(cntx, "u-boot's fast download gadget (rev %s), no IPL needed\n", inquiry_result.rev);
+
+	return 0;
+}
+
+static int upload_ipl(struct p3udl_cntx *cntx)
+{
+	struct plan_stage stage;
+
+	plan_bootrom(cntx, &stage);
+
+	p3udl_info(cntx, "Uploading IPL via boot ROM...\n");
+
+	int ret = sstarscsi_upload_bootrom(cntx, (void *) stage.data, stage.len);
+	if (ret)
+		p3udl_err(cntx, "Failed! :(\n");
+
+	return ret;
+}
+
+/* Everything in the manifest goes in before u-boot, which the updater then runs */
+static int upload_images(struct p3udl_cntx *cntx)
+{
+	for (int i = 0; i < cntx->manifest->count; i++) {
+		struct manifest_entry *entry = &cntx->manifest->entries[i];
+
+		if (board_cancelled(cntx))
+			return -ECANCELED;
+
+		int ret = image_loader_wait(&entry->loader);
+		if (ret)
+			return ret;
+
+		const struct p3udl_image *image = &entry->loader.image;
+
+		if (entry->packed.data) {
+			cntx->report.saved += image->len - entry->packed.len;
+			image = &entry->packed;
+		}
+
+		p3udl_info(cntx, "Uploading %s to 0x%08x via IPL...\n", entry->path, entry->addr);
+
+		ret = sstarscsi_upload_usbupdater(cntx, entry->addr, image->data, image->len,
+				image->len == image->size ? image->md5 : NULL);
+		if (ret) {
+			p3udl_err(cntx, "Failed! :(\n");
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int upload_uboot(struct p3udl_cntx *cntx)
+{
+	/* Should have been ready long before the IPL finished */
+	int ret = image_loader_wait(cntx->uboot);
+	if (ret)
+		return ret;
+
+	const struct p3udl_image *uboot = &cntx->uboot->image;
+
+	p3udl_info(cntx, "Uploading u-boot via IPL...\n");
+
+	/* the usb updater wants a u-boot binary? */
+	/* note for the usb update bin the load addr seems to be ingored and it's always 0x23d00000
+	 * and the u-boot binary is moved to 0x23e00000? */
+	ret = sstarscsi_upload_usbupdater(cntx, 0xFFFFFFFF, uboot->data, uboot->len,
+			uboot->len == uboot->size ? uboot->md5 : NULL);
+	if (ret)
+		p3udl_err(cntx, "Failed! :(\n");
+
+	return ret;
+}
+
+static const char * const stage_names[] = {
+	[P3UDL_STAGE_PROBE] = "probe",
+	[P3UDL_STAGE_SETUP] = "setup",
+	[P3UDL_STAGE_SCSI] = "SCSI probe",
+	[P3UDL_STAGE_IPL] = "IPL upload",
+	[P3UDL_STAGE_IMAGES] = "image upload",
+	[P3UDL_STAGE_UBOOT] = "u-boot upload",
+	[P3UDL_STAGE_DFU] = "DFU download",
+	[P3UDL_STAGE_UMS] = "UMS write",
+	[P3UDL_STAGE_DONE] = "done",
+};
+
+int board_flash(struct p3udl_cntx *cntx)
+{
+	int ret;
+
+	cntx->stage = P3UDL_STAGE_SETUP;
+	xfer_reset(cntx);
+	transport_trace_attach(cntx);
+	metrics_board_start(cntx);
+	ret = cntx->transport->setup(cntx);
+	report_end(cntx, REPORT_PHASE_PROBE);
+	if (ret)
+		return ret;
+
+	cntx->stage = P3UDL_STAGE_SCSI;
+	report_begin(cntx, REPORT_PHASE_INQUIRY);
+	ret = scsi_probe(cntx);
+	report_end(cntx, REPORT_PHASE_INQUIRY);
+	if (ret)
+		return ret;
+
+	/* From here on the board is using the bus in anger */
+	cntx->stage = P3UDL_STAGE_IPL;
+	ret = topology_acquire(cntx);
+	if (ret)
+		return ret;
+
+	/* The fast gadget is already where the IPL would get it */
+	if (!cntx->fast) {
+		report_begin(cntx, REPORT_PHASE_IPL);
+		ret = upload_ipl(cntx);
+		report_end(cntx, REPORT_PHASE_IPL);
+		if (ret)
+			goto out_release;
+
+		/* The usb updater is a different animal to the boot ROM, start measuring again */
+		xfer_reset(cntx);
+	}
+
+	if (cntx->manifest) {
+		cntx->stage = P3UDL_STAGE_IMAGES;
+		ret = upload_images(cntx);
+		if (ret)
+			goto out_release;
+	}
+
+	cntx->stage = P3UDL_STAGE_UBOOT;
+	ret = board_cancelled(cntx) ? -ECANCELED : upload_uboot(cntx);
+	/* The pool belongs to the handle that goes away when the board re-enumerates */
+	pool_free(cntx);
+	/* Nothing to send while u-boot boots, let another board have the bus */
+	topology_release(cntx);
+	if (ret)
+		return ret;
+
+	if (cntx->dfu) {
+		cntx->stage = P3UDL_STAGE_DFU;
+		ret = board_cancelled(cntx) ? -ECANCELED : dfu_flash(cntx);
+		if (ret)
+			return ret;
+	}
+
+	if (cntx->ums) {
+		cntx->stage = P3UDL_STAGE_UMS;
+		ret = board_cancelled(cntx) ? -ECANCELED : ums_flash(cntx);
+		if (ret)
+			return ret;
+	}
+
+	cntx->stage = P3UDL_STAGE_DONE;
+	return 0;
+
+out_release:
+	topology_release(cntx);
+	return ret;
+}
+
+void *board_thread(void *data)
+{
+	struct p3udl_cntx *cntx = data;
+
+	log_set_device(cntx->name);
+	uint64_t cpu_start = clock_thread_ns();
+	cntx->result = board_flash(cntx);
+	cntx->report.cpu_ns = clock_thread_ns() - cpu_start;
+	metrics_board_end(cntx);
+	log_end_device(cntx->result);
+
+	return NULL;
+}
+
+const char *board_stage_name(enum p3udl_stage stage)
+{
+	return stage_names[stage];
+}
+
+/* Bytes that actually went to the board */
+void board_progress(struct p3udl_cntx *cntx, uint64_t bytes)
+{
+	metrics_bytes(cntx->metrics_port, bytes);
+	if (cntx->progress)
+		cntx->progress(cntx, bytes);
+}
+
+void board_close(struct p3udl_cntx *cntx)
+{
+	pool_free(cntx);
+	if (cntx->transport)
+		cntx->transport->close(cntx);
+	cntx->transport = NULL;
+	cntx->lu_handle = NULL;
+}
@@ -0,0 +1,26 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __BOARD_H_
+#define __BOARD_H_
+
+#include <libusb.h>
+
+#include "cntx.h"
+
+/* Stages are only ever added to the end of enum p3udl_stage */
+#define BOARD_STAGES	(P3UDL_STAGE_DONE + 1)
+
+int board_open(struct p3udl_cntx *cntx, libusb_device *dev);
+int board_open_handle(struct p3udl_cntx *cntx, libusb_device_handle *lu_handle);
+int board_flash(struct p3udl_cntx *cntx);
+void *board_thread(void *data);
+void board_close(struct p3udl_cntx *cntx);
+const char *board_stage_name(enum p3udl_stage stage);
+void board_progress(struct p3udl_cntx *cntx, uint64_t bytes);
+
+static inline bool board_cancelled(struct p3udl_cntx *cntx)
+{
+	return __atomic_load_n(&cntx->cancel, __ATOMIC_RELAXED);
+}
+
+#endif /* __BOARD_H_ */
@@ -0,0 +1,281 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Things worth remembering between runs live in ~/.cache/p3udl.
+ *
+ * The image cache saves hashing the same IPL and u-boot on every run.
+ * It's a text file of "<key> <md5>" lines where the key is made from
+ * the file's device, inode, size, mtime and ctime, so any write to the
+ * file or replacing it gives a new key and the old line is just never
+ * matched again. Like the tune cache it only gets appended to and the
+ * last matching line wins, until it gets big enough to be compacted.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/md5.h>
+
+#include "cache.h"
+#include "cntx.h"
+
+#include "cache_log.h"
+
+#define CACHE_IMAGE_FILE	"images"
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t cache_compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int cache_hits, cache_misses;
+
+int cache_path(char *path, size_t len, const char *file, bool create)
+{
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	int ret;
+
+	if (cache && *cache)
+		ret = snprintf(path, len, "%s/p3udl", cache);
+	else if (home && *home)
+		ret = snprintf(path, len, "%s/.cache/p3udl", home);
+	else
+		return -ENOENT;
+
+	if (ret >= len)
+		return -ENAMETOOLONG;
+
+	if (create) {
+		char *slash = strrchr(path, '/');
+
+		/* ~/.cache might not exist yet either */
+		*slash = '\0';
+		mkdir(path, 0755);
+		*slash = '/';
+		mkdir(path, 0755);
+	}
+
+	ret += snprintf(path + ret, len - ret, "/%s", file);
+	if (ret >= len)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/*
+ * Rewrite an append only file once it is over CACHE_COMPACT_SIZE with just
+ * the last line for each key, keylen() says how much of a line that is. If
+ * that isn't enough the oldest lines go too, down to half the limit so this
+ * doesn't happen again on the next append. The new file is renamed over
+ * the old one so readers get one or the other. A line another process
+ * appends meanwhile can get lost, which only costs hashing or tuning again.
+ */
+void cache_compact(struct p3udl_cntx *cntx, const char *file, size_t (*keylen)(const char *line))
+{
+	char path[256], tmp[264], line[256];
+	char **lines = NULL;
+	bool *keep = NULL;
+	size_t nlines = 0, kept = 0, bytes = 0;
+	struct stat st;
+
+	if (cache_path(path, sizeof(path), file, false))
+		return;
+
+	pthread_mutex_lock(&cache_compact_lock);
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		goto out;
+	if (fstat(fileno(f), &st) || st.st_size <= CACHE_COMPACT_SIZE)
+		goto out_close;
+
+	bool torn = false;
+
+	while (fgets(line, sizeof(line), f)) {
+		bool whole = strchr(line, '\n') != NULL;
+
+		/* Cut short by a crash or too long for the readers to have made sense of either */
+		if (torn || !whole) {
+			torn = !whole;
+			continue;
+		}
+
+		char **more = realloc(lines, (nlines + 1) * sizeof(*lines));
+		if (!more)
+			goto out_close;
+		lines = more;
+
+		lines[nlines] = strdup(line);
+		if (!lines[nlines])
+			goto out_close;
+		nlines++;
+	}
+
+	keep = calloc(nlines ? nlines : 1, sizeof(*keep));
+	if (!keep)
+		goto out_close;
+
+	/* Newest first, a line is only kept if nothing after it has its key */
+	for (size_t i = nlines; i-- > 0;) {
+		size_t klen = keylen(lines[i]), len = strlen(lines[i]);
+		bool newer = false;
+
+		for (size_t j = i + 1; j < nlines && !newer; j++)
+			newer = keylen(lines[j]) == klen && !memcmp(lines[i], lines[j], klen);
+
+		if (newer)
+			continue;
+		if (bytes + len > CACHE_COMPACT_SIZE / 2)
+			break;
+
+		keep[i] = true;
+		bytes += len;
+		kept++;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		cache_dbg(cntx, "Can't compact %s: %s\n", path, strerror(errno));
+		goto out_close;
+	}
+	fchmod(fd, 0644);
+
+	FILE *out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		unlink(tmp);
+		goto out_close;
+	}
+
+	for (size_t i = 0; i < nlines; i++) {
+		if (keep[i])
+			fputs(lines[i], out);
+	}
+
+	if (fclose(out) || rename(tmp, path)) {
+		cache_dbg(cntx, "Can't compact %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	} else
+		cache_dbg(cntx, "Compacted %s, kept %zu of %zu lines\n", path, kept, nlines);
+
+out_close:
+	fclose(f);
+out:
+	pthread_mutex_unlock(&cache_compact_lock);
+	for (size_t i = 0; i < nlines; i++)
+		free(lines[i]);
+	free(lines);
+	free(keep);
+}
+
+static void cache_image_key(const struct stat *st, char *key, size_t len)
+{
+	snprintf(key, len, "%llx:%llu:%lld:%lld.%09ld:%lld.%09ld",
+			(unsigned long long) st->st_dev, (unsigned long long) st->st_ino,
+			(long long) st->st_size,
+			(long long) st->st_mtim.tv_sec, st->st_mtim.tv_nsec,
+			(long long) st->st_ctim.tv_sec, st->st_ctim.tv_nsec);
+}
+
+static void cache_count(bool hit)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (hit)
+		cache_hits++;
+	else
+		cache_misses++;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* Lines for the same device and inode, only the newest of them can still match */
+static size_t cache_image_keylen(const char *line)
+{
+	const char *colon = strchr(line, ':');
+
+	if (colon)
+		colon = strchr(colon + 1, ':');
+
+	return colon ? colon - line : strcspn(line, " ");
+}
+
+/* Fill in md5 if this exact file has been hashed before */
+bool cache_image_lookup(struct p3udl_cntx *cntx, const struct stat *st, uint8_t *md5)
+{
+	char path[256], key[128], line[256];
+	bool found = false;
+
+	cache_image_key(st, key, sizeof(key));
+
+	if (!cache_path(path, sizeof(path), CACHE_IMAGE_FILE, false)) {
+		FILE *f = fopen(path, "r");
+
+		while (f && fgets(line, sizeof(line), f)) {
+			char k[sizeof(key)], hex[(MD5_DIGEST_LENGTH * 2) + 1];
+			uint8_t digest[MD5_DIGEST_LENGTH];
+			int i;
+
+			if (sscanf(line, "%127s %32s", k, hex) != 2 || strcmp(k, key))
+				continue;
+
+			for (i = 0; i < MD5_DIGEST_LENGTH; i++) {
+				unsigned int byte;
+
+				if (sscanf(hex + (i * 2), "%2x", &byte) != 1)
+					break;
+				digest[i] = byte;
+			}
+
+			if (i == MD5_DIGEST_LENGTH) {
+				memcpy(md5, digest, sizeof(digest));
+				found = true;
+			}
+		}
+
+		if (f)
+			fclose(f);
+	}
+
+	cache_count(found);
+	cache_dbg(cntx, "%s %s\n", key, found ? "hit" : "miss");
+
+	return found;
+}
+
+void cache_image_store(struct p3udl_cntx *cntx, const struct stat *st, const uint8_t *md5)
+{
+	char path[256], key[128], line[256];
+
+	if (cache_path(path, sizeof(path), CACHE_IMAGE_FILE, true))
+		return;
+
+	/* O_APPEND so images being loaded at the same time don't trample each other */
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		cache_dbg(cntx, "Can't write %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	cache_image_key(st, key, sizeof(key));
+
+	int len = snprintf(line, sizeof(line), "%s ", key);
+	for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+		len += snprintf(line + len, sizeof(line) - len, "%02x", md5[i]);
+	line[len++] = '\n';
+
+	if (write(fd, line, len) != len)
+		cache_dbg(cntx, "Short write to %s\n", path);
+
+	close(fd);
+
+	cache_compact(cntx, CACHE_IMAGE_FILE, cache_image_keylen);
+}
+
+void cache_image_stats(unsigned int *hits, unsigned int *misses)
+{
+	pthread_mutex_lock(&cache_lock);
+	*hits = cache_hits;
+	*misses = cache_misses;
+	pthread_mutex_unlock(&cache_lock);
+}
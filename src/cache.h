@@ -0,0 +1,23 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __CACHE_H_
+#define __CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+struct p3udl_cntx;
+
+/* Append only files get rewritten once they are bigger than this */
+#define CACHE_COMPACT_SIZE	(64 * 1024)
+
+int cache_path(char *path, size_t len, const char *file, bool create);
+void cache_compact(struct p3udl_cntx *cntx, const char *file, size_t (*keylen)(const char *line));
+
+bool cache_image_lookup(struct p3udl_cntx *cntx, const struct stat *st, uint8_t *md5);
+void cache_image_store(struct p3udl_cntx *cntx, const struct stat *st, const uint8_t *md5);
+void cache_image_stats(unsigned int *hits, unsigned int *misses);
+
+#endif /* __CACHE_H_ */
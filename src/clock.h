@@ -0,0 +1,60 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __CLOCK_H_
+#define __CLOCK_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
+
+/* Monotonic timestamp in nanoseconds, for measuring intervals only */
+static inline uint64_t clock_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((uint64_t) ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+/* CPU time used by the calling thread so far */
+static inline uint64_t clock_thread_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+
+	return ((uint64_t) ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+}
+
+/* Bytes per second over an interval in MB/s */
+static inline double clock_mbps(uint64_t bytes, uint64_t ns)
+{
+	if (!ns)
+		return 0;
+
+	return ((double) bytes / (1024 * 1024)) / ((double) ns / NSEC_PER_SEC);
+}
+
+/* Bytes per second over an interval, in double so big images can't overflow */
+static inline uint64_t clock_rate(uint64_t bytes, uint64_t ns)
+{
+	if (!ns)
+		return 0;
+
+	return (double) bytes * NSEC_PER_SEC / ns;
+}
+
+/* How long bytes take at rate bytes per second */
+static inline uint64_t clock_ns_at(uint64_t bytes, uint64_t rate)
+{
+	if (!rate)
+		return 0;
+
+	return (double) bytes * NSEC_PER_SEC / rate;
+}
+
+#endif /* __CLOCK_H_ */
@@ -4,17 +4,106 @@
 #define __CNTX_H
 
 #include <libusb.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <dgputil.h>
 
+#include "image.h"
+#include "p3udl.h"
+#include "report.h"
+#include "xfer.h"
+
+struct p3udl_transport;
+struct manifest;
+struct metrics_port;
+struct pool;
+struct topology;
+struct trace;
+
 struct p3udl_cntx {
 	libusb_context *lu_cntx;
 	libusb_device_handle *lu_handle;
+	const struct p3udl_transport *transport;
+	void *transport_priv;
+	/* buffers and transfers for queued commands, kept between uploads */
+	struct pool *pool;
+	/* where everything the transport does is written down, NULL for nowhere */
+	struct trace *trace;
+	/* the transport being traced and this board's number in the trace */
+	const struct p3udl_transport *trace_inner;
+	uint16_t trace_board;
 	uint8_t ep_in, ep_out, lun;
+	/* smallest wMaxPacketSize of the two bulk endpoints */
+	uint16_t ep_maxpacket;
+	/* next CBW tag, per device so boards can share a process */
+	uint32_t tag;
+	/* station slot or port path of the board, used to tell boards apart in logs */
+	char name[32];
+	/* where the board is plugged in, it stays there when it re-enumerates */
+	uint8_t bus, address;
+	uint8_t ports[7];
+	int nports;
+	/* "<bus>-<port>.<port>..." */
+	char port[32];
+	/* where the board's throughput shows up in the metrics, NULL if there wasn't room */
+	struct metrics_port *metrics_port;
+	/* holding one of the bus's upload slots and report.bytes when it was taken */
+	bool bus_held;
+	uint64_t bus_bytes;
+	enum p3udl_stage stage;
+	int result;
+	/* set from another thread to stop the board, checked before each segment */
+	bool cancel;
+	/* told about every byte that goes out, NULL if nobody is asking */
+	void (*progress)(struct p3udl_cntx *cntx, uint64_t bytes);
+	/* "vid:pid:rev" from INQUIRY with spaces squashed */
+	char chip[24];
+	/* INQUIRY said u-boot's fast download gadget, not the boot ROM */
+	bool fast;
+	struct report report;
+	struct xfer_policy xfer;
 	log_cb log_cb;
+	/* commands kept in flight by the upload loop, 1 for synchronous */
+	unsigned int queue_depth;
+	/* usb updater segment size, 0 to use the tuned or probed size */
+	uint32_t max_transfer;
+	/* send commands through the kernel's usb-storage and SG_IO instead of detaching it */
+	bool sg;
 
+	/* send manifest images LZ4 compressed where bootm can unpack them */
+	bool compress;
+	/* give the boot ROM the IPL's zero padding too instead of stopping after its last segment */
+	bool ipl_pad;
+	/* read back what the board has and only write the blocks of UMS images that differ */
+	bool delta;
+	/* number of fake boards to flash instead of real ones */
+	unsigned int simulate;
+	/* slot map and per bus upload limits, shared by all boards */
+	struct topology *topology;
+	/* where station mode writes JSON reports, NULL for none */
+	FILE *report_out;
 
 	char *ipl_path;
 	char *uboot_path;
+	/* trace to play back instead of looking on USB, NULL for none */
+	char *replay_path;
+	/* uploads allowed at once on one bus, 0 for no limit */
+	unsigned int per_bus;
+
+	/*
+	 * images are loaded once at startup and shared by all boards, u-boot
+	 * carries on loading while the boards take the IPL
+	 */
+	struct p3udl_image ipl;
+	struct image_loader *uboot;
+	/* extra images to put in RAM before u-boot, NULL for none */
+	struct manifest *manifest;
+	/* images to download once u-boot's DFU gadget is up, NULL for none */
+	struct manifest *dfu;
+	/* images to write through u-boot's mass storage gadget, NULL for none */
+	struct manifest *ums;
+	/* hex MD5 of the IPL, what was tuned for one IPL might not work for another */
+	char ipl_hash[33];
 };
 #endif
@@ -0,0 +1,72 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * The USB link is much slower than the SoC so images with a legacy
+ * u-boot header can be sent LZ4 compressed and left for bootm to unpack
+ * to ih_load. The header is rewritten to say so, with the size and
+ * CRCs of the compressed data, so as far as u-boot is concerned it was
+ * built that way.
+ *
+ * u-boot's LZ4 support only takes frames made of independent blocks.
+ * The content checksum is left out, ih_dcrc already covers the data.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <lz4frame.h>
+#include <zlib.h>
+
+#include "cntx.h"
+#include "compress.h"
+#include "uboot.h"
+
+#include "compress_log.h"
+
+/* Compressing happens once on the loader thread so it's worth going for size */
+#define COMPRESS_LEVEL		9
+
+int compress_legacy(struct p3udl_cntx *cntx, const struct p3udl_image *in, struct p3udl_image *out)
+{
+	const struct legacy_img_hdr *hdr = in->data;
+	const LZ4F_preferences_t prefs = {
+		.frameInfo = {
+			.blockSizeID = LZ4F_max4MB,
+			.blockMode = LZ4F_blockIndependent,
+		},
+		.compressionLevel = COMPRESS_LEVEL,
+	};
+	size_t size = ntohl(hdr->ih_size);
+	const uint8_t *payload = (const uint8_t *) in->data + sizeof(*hdr);
+
+	memset(out, 0, sizeof(*out));
+
+	size_t bound = sizeof(*hdr) + LZ4F_compressFrameBound(size, &prefs);
+	uint8_t *buf = malloc(bound);
+	if (!buf)
+		return -ENOMEM;
+
+	size_t packed = LZ4F_compressFrame(buf + sizeof(*hdr), bound - sizeof(*hdr), payload, size, &prefs);
+	if (LZ4F_isError(packed)) {
+		compress_err(cntx, "LZ4 compression failed: %s\n", LZ4F_getErrorName(packed));
+		free(buf);
+		return -EINVAL;
+	}
+
+	struct legacy_img_hdr *newhdr = (struct legacy_img_hdr *) buf;
+
+	memcpy(newhdr, hdr, sizeof(*newhdr));
+	newhdr->ih_size = htonl(packed);
+	newhdr->ih_comp = IH_COMP_LZ4;
+	newhdr->ih_dcrc = htonl(crc32(0, buf + sizeof(*hdr), packed));
+	newhdr->ih_hcrc = 0;
+	newhdr->ih_hcrc = htonl(crc32(0, buf, sizeof(*newhdr)));
+
+	out->data = buf;
+	out->len = out->size = sizeof(*hdr) + packed;
+	MD5(buf, out->size, out->md5);
+
+	compress_dbg(cntx, "%zu -> %zu bytes\n", size, packed);
+
+	return 0;
+}
@@ -0,0 +1,12 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __COMPRESS_H_
+#define __COMPRESS_H_
+
+#include "image.h"
+
+struct p3udl_cntx;
+
+int compress_legacy(struct p3udl_cntx *cntx, const struct p3udl_image *in, struct p3udl_image *out);
+
+#endif /* __COMPRESS_H_ */
@@ -0,0 +1,662 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * DFU client for once u-boot is up. Instead of a second tool doing a
+ * second enumeration the board is picked up again on the port it was
+ * on when it comes back as u-boot's DFU gadget and the images in the
+ * DFU manifest are streamed to the alt settings they name.
+ *
+ * DFU is strictly DNLOAD, GETSTATUS, DNLOAD... but nothing stops the
+ * next pair being queued on ep0 while the current one is on the wire,
+ * the device works through them in order. Pairs are only queued up
+ * like that once the device has answered a block without asking for
+ * poll time. u-boot asks for it each time it writes out a buffer, then
+ * whatever is already queued is seen through, the device gets its time
+ * and blocks go in lockstep as the spec describes until it stops
+ * asking. Async control transfers also aren't limited to a page like
+ * synchronous ones are with usbfs so the full wTransferSize the device
+ * advertises can be used.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "board.h"
+#include "clock.h"
+#include "cntx.h"
+#include "dfu.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "report.h"
+#include "topology.h"
+#include "transport.h"
+#include "tune.h"
+#include "xfer.h"
+
+#include "dfu_log.h"
+
+#define DFU_MAX_ALTS		32
+/* DNLOAD/GETSTATUS pairs kept queued once the device has shown it can take it */
+#define DFU_PIPELINE		2
+/* Flash writes happen behind GETSTATUS so give them time */
+#define DFU_TIMEOUT_MS		5000
+
+#define DFU_REQTYPE_OUT		(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+#define DFU_REQTYPE_IN		(LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE)
+
+struct dfu_function {
+	uint8_t interface;
+	uint8_t attributes;
+	uint16_t transfer_size;
+	unsigned int nalts;
+	struct {
+		uint8_t altsetting;
+		uint8_t istring;
+		char name[64];
+	} alts[DFU_MAX_ALTS];
+};
+
+#define DFU_SLOT_DNLOAD		(1 << 0)
+#define DFU_SLOT_STATUS		(1 << 1)
+
+struct dfu_slot {
+	struct dfu_pipe *pipe;
+	struct libusb_transfer *dnload, *status;
+	/* setup packet followed by the data */
+	uint8_t *dnload_buf;
+	uint8_t status_buf[LIBUSB_CONTROL_SETUP_SIZE + sizeof(struct dfu_status)];
+	/* DFU_SLOT_* bits for the transfers still owned by libusb */
+	unsigned int pending;
+	uint16_t block;
+};
+
+struct dfu_pipe {
+	struct p3udl_cntx *cntx;
+	struct dfu_slot slots[DFU_PIPELINE];
+	unsigned int depth;
+	int event;
+};
+
+static const char * const dfu_state_names[] = {
+	[DFU_STATE_APP_IDLE] = "appIDLE",
+	[DFU_STATE_APP_DETACH] = "appDETACH",
+	[DFU_STATE_IDLE] = "dfuIDLE",
+	[DFU_STATE_DNLOAD_SYNC] = "dfuDNLOAD-SYNC",
+	[DFU_STATE_DNBUSY] = "dfuDNBUSY",
+	[DFU_STATE_DNLOAD_IDLE] = "dfuDNLOAD-IDLE",
+	[DFU_STATE_MANIFEST_SYNC] = "dfuMANIFEST-SYNC",
+	[DFU_STATE_MANIFEST] = "dfuMANIFEST",
+	[DFU_STATE_MANIFEST_WAIT_RESET] = "dfuMANIFEST-WAIT-RESET",
+	[DFU_STATE_UPLOAD_IDLE] = "dfuUPLOAD-IDLE",
+	[DFU_STATE_ERROR] = "dfuERROR",
+};
+
+const char *dfu_state_name(uint8_t state)
+{
+	if (state > DFU_STATE_ERROR)
+		return "unknown";
+
+	return dfu_state_names[state];
+}
+
+static unsigned int dfu_poll_timeout(const struct dfu_status *status)
+{
+	return status->bwPollTimeout[0] | (status->bwPollTimeout[1] << 8) |
+			(status->bwPollTimeout[2] << 16);
+}
+
+static void dfu_sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * NSEC_PER_MSEC,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+static int dfu_get_descriptor(struct p3udl_cntx *cntx, uint8_t type, uint8_t index, uint16_t langid,
+		uint8_t *buf, uint16_t len)
+{
+	return cntx->transport->control(cntx, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, (type << 8) | index, langid, buf, len, XFER_TIMEOUT_MS);
+}
+
+/* Alt setting names are what dfu_alt_info calls things, only ASCII is expected */
+static void dfu_get_string(struct p3udl_cntx *cntx, uint8_t index, uint16_t langid, char *str, size_t len)
+{
+	uint8_t buf[255];
+
+	str[0] = '\0';
+	if (!index)
+		return;
+
+	int ret = dfu_get_descriptor(cntx, LIBUSB_DT_STRING, index, langid, buf, sizeof(buf));
+	if (ret < 2 || buf[1] != LIBUSB_DT_STRING)
+		return;
+
+	size_t n = 0;
+	for (int i = 2; i + 1 < ret && i < buf[0] && n < len - 1; i += 2)
+		str[n++] = (buf[i + 1] || buf[i] < 0x20 || buf[i] > 0x7e) ? '?' : buf[i];
+	str[n] = '\0';
+}
+
+/* Walk the config descriptor for the first DFU mode interface, its alt settings and functional descriptor */
+static int dfu_parse_config(struct p3udl_cntx *cntx, const uint8_t *desc, int len, struct dfu_function *func)
+{
+	bool found = false, in_dfu = false;
+
+	memset(func, 0, sizeof(*func));
+
+	for (int off = 0; off + 2 <= len; off += desc[off]) {
+		const uint8_t *d = desc + off;
+
+		if (d[0] < 2 || off + d[0] > len)
+			break;
+
+		if (d[1] == LIBUSB_DT_INTERFACE && d[0] >= 9) {
+			in_dfu = d[5] == DFU_INTERFACE_CLASS && d[6] == DFU_INTERFACE_SUBCLASS &&
+					d[7] == DFU_PROTOCOL_DFU_MODE && (!found || d[2] == func->interface);
+			if (!in_dfu)
+				continue;
+
+			found = true;
+			func->interface = d[2];
+			if (func->nalts < DFU_MAX_ALTS) {
+				func->alts[func->nalts].altsetting = d[3];
+				func->alts[func->nalts].istring = d[8];
+				func->nalts++;
+			}
+		}
+		else if (d[1] == DFU_DT_FUNCTIONAL && d[0] >= 7 && in_dfu) {
+			func->attributes = d[2];
+			func->transfer_size = d[5] | (d[6] << 8);
+		}
+	}
+
+	if (!found) {
+		dfu_err(cntx, "Device has no DFU interface\n");
+		return -ENODEV;
+	}
+
+	if (!func->transfer_size) {
+		dfu_err(cntx, "No usable DFU functional descriptor\n");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int dfu_probe(struct p3udl_cntx *cntx, struct dfu_function *func)
+{
+	uint8_t header[LIBUSB_DT_CONFIG_SIZE], langids[4];
+	uint16_t langid = 0;
+
+	int ret = dfu_get_descriptor(cntx, LIBUSB_DT_CONFIG, 0, 0, header, sizeof(header));
+	if (ret < (int) sizeof(header)) {
+		dfu_err(cntx, "Couldn't get config descriptor: %d\n", ret);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	uint16_t total = header[2] | (header[3] << 8);
+	uint8_t *desc = malloc(total);
+	if (!desc)
+		return -ENOMEM;
+
+	ret = dfu_get_descriptor(cntx, LIBUSB_DT_CONFIG, 0, 0, desc, total);
+	if (ret < 0) {
+		dfu_err(cntx, "Couldn't get config descriptor: %d\n", ret);
+		free(desc);
+		return ret;
+	}
+
+	ret = dfu_parse_config(cntx, desc, ret, func);
+	free(desc);
+	if (ret)
+		return ret;
+
+	if (dfu_get_descriptor(cntx, LIBUSB_DT_STRING, 0, 0, langids, sizeof(langids)) >= 4)
+		langid = langids[2] | (langids[3] << 8);
+
+	for (int i = 0; i < func->nalts; i++) {
+		dfu_get_string(cntx, func->alts[i].istring, langid, func->alts[i].name, sizeof(func->alts[i].name));
+		dfu_dbg(cntx, "alt %u: \"%s\"\n", func->alts[i].altsetting, func->alts[i].name);
+	}
+
+	dfu_info(cntx, "DFU interface %u, %u alt settings, %u byte transfers%s\n",
+			func->interface, func->nalts, func->transfer_size,
+			(func->attributes & DFU_ATTR_MANIFEST_TOLERANT) ? "" : ", not manifestation tolerant");
+
+	return 0;
+}
+
+static int dfu_get_status(struct p3udl_cntx *cntx, const struct dfu_function *func, struct dfu_status *status)
+{
+	int ret = cntx->transport->control(cntx, DFU_REQTYPE_IN, DFU_REQUEST_GETSTATUS, 0, func->interface,
+			(uint8_t *) status, sizeof(*status), DFU_TIMEOUT_MS);
+
+	if (ret < 0)
+		return ret;
+	if (ret != sizeof(*status))
+		return -EIO;
+
+	return 0;
+}
+
+static int dfu_request(struct p3udl_cntx *cntx, const struct dfu_function *func, uint8_t request)
+{
+	int ret = cntx->transport->control(cntx, DFU_REQTYPE_OUT, request, 0, func->interface,
+			NULL, 0, DFU_TIMEOUT_MS);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* Get the alt setting into dfuIDLE whatever the last user left it in */
+static int dfu_make_idle(struct p3udl_cntx *cntx, const struct dfu_function *func)
+{
+	struct dfu_status status;
+
+	int ret = dfu_get_status(cntx, func, &status);
+	if (ret)
+		return ret;
+
+	switch (status.bState) {
+	case DFU_STATE_IDLE:
+		return 0;
+	case DFU_STATE_ERROR:
+		ret = dfu_request(cntx, func, DFU_REQUEST_CLRSTATUS);
+		break;
+	default:
+		ret = dfu_request(cntx, func, DFU_REQUEST_ABORT);
+		break;
+	}
+	if (ret)
+		return ret;
+
+	ret = dfu_get_status(cntx, func, &status);
+	if (ret)
+		return ret;
+
+	if (status.bState != DFU_STATE_IDLE) {
+		dfu_err(cntx, "Device stuck in %s\n", dfu_state_name(status.bState));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Wait out poll timeouts until the device leaves the busy states */
+static int dfu_wait_state(struct p3udl_cntx *cntx, const struct dfu_function *func,
+		struct dfu_status *status)
+{
+	for (;;) {
+		if (status->bStatus != DFU_STATUS_OK) {
+			dfu_err(cntx, "Device reported status 0x%02x in %s\n",
+					status->bStatus, dfu_state_name(status->bState));
+			return -EIO;
+		}
+
+		if (status->bState != DFU_STATE_DNBUSY && status->bState != DFU_STATE_DNLOAD_SYNC &&
+				status->bState != DFU_STATE_MANIFEST && status->bState != DFU_STATE_MANIFEST_SYNC)
+			return 0;
+
+		dfu_sleep_ms(dfu_poll_timeout(status));
+
+		int ret = dfu_get_status(cntx, func, status);
+		if (ret)
+			return ret;
+	}
+}
+
+static void dfu_slot_cb(struct libusb_transfer *xfer)
+{
+	struct dfu_slot *slot = xfer->user_data;
+
+	slot->pipe->event = 1;
+	slot->pending &= ~(xfer == slot->dnload ? DFU_SLOT_DNLOAD : DFU_SLOT_STATUS);
+}
+
+static void dfu_pipe_free(struct dfu_pipe *pipe)
+{
+	for (int i = 0; i < DFU_PIPELINE; i++) {
+		libusb_free_transfer(pipe->slots[i].dnload);
+		libusb_free_transfer(pipe->slots[i].status);
+		free(pipe->slots[i].dnload_buf);
+	}
+}
+
+static int dfu_pipe_init(struct p3udl_cntx *cntx, const struct dfu_function *func, struct dfu_pipe *pipe)
+{
+	memset(pipe, 0, sizeof(*pipe));
+	pipe->cntx = cntx;
+	pipe->depth = cntx->queue_depth > 1 ? DFU_PIPELINE : 1;
+
+	for (int i = 0; i < DFU_PIPELINE; i++) {
+		struct dfu_slot *slot = &pipe->slots[i];
+
+		slot->pipe = pipe;
+		slot->dnload = libusb_alloc_transfer(0);
+		slot->status = libusb_alloc_transfer(0);
+		slot->dnload_buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + func->transfer_size);
+		if (!slot->dnload || !slot->status || !slot->dnload_buf) {
+			dfu_pipe_free(pipe);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+/* Queue DNLOAD of one block and the GETSTATUS that goes with it */
+static int dfu_slot_submit(struct p3udl_cntx *cntx, const struct dfu_function *func, struct dfu_slot *slot,
+		uint16_t block, const uint8_t *data, uint16_t len)
+{
+	slot->block = block;
+
+	libusb_fill_control_setup(slot->dnload_buf, DFU_REQTYPE_OUT, DFU_REQUEST_DNLOAD, block, func->interface, len);
+	memcpy(slot->dnload_buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+	libusb_fill_control_transfer(slot->dnload, cntx->lu_handle, slot->dnload_buf, dfu_slot_cb, slot, DFU_TIMEOUT_MS);
+
+	libusb_fill_control_setup(slot->status_buf, DFU_REQTYPE_IN, DFU_REQUEST_GETSTATUS, 0, func->interface,
+			sizeof(struct dfu_status));
+	libusb_fill_control_transfer(slot->status, cntx->lu_handle, slot->status_buf, dfu_slot_cb, slot, DFU_TIMEOUT_MS);
+
+	int ret = cntx->transport->submit(cntx, slot->dnload);
+	if (ret)
+		return ret;
+	slot->pending = DFU_SLOT_DNLOAD;
+
+	ret = cntx->transport->submit(cntx, slot->status);
+	if (ret)
+		return ret;
+	slot->pending |= DFU_SLOT_STATUS;
+
+	return 0;
+}
+
+static int dfu_pipe_wait(struct dfu_pipe *pipe, struct dfu_slot *slot)
+{
+	struct p3udl_cntx *cntx = pipe->cntx;
+
+	/* Cleared before pending is looked at so a completion in between still ends the wait */
+	pipe->event = 0;
+	while (slot->pending) {
+		struct timeval tv = {
+			.tv_usec = 100 * 1000,
+		};
+
+		int ret = cntx->transport->handle_events(cntx, &tv, &pipe->event);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+			return ret;
+		pipe->event = 0;
+	}
+
+	return 0;
+}
+
+/* Something went wrong, take back everything that is still queued */
+static void dfu_pipe_abort(struct dfu_pipe *pipe)
+{
+	struct p3udl_cntx *cntx = pipe->cntx;
+
+	for (int i = 0; i < DFU_PIPELINE; i++) {
+		struct dfu_slot *slot = &pipe->slots[i];
+
+		if (slot->pending & DFU_SLOT_DNLOAD)
+			cntx->transport->cancel(cntx, slot->dnload);
+		if (slot->pending & DFU_SLOT_STATUS)
+			cntx->transport->cancel(cntx, slot->status);
+	}
+
+	for (int i = 0; i < DFU_PIPELINE; i++) {
+		if (dfu_pipe_wait(pipe, &pipe->slots[i]))
+			break;
+	}
+}
+
+static int dfu_xfer_error(struct libusb_transfer *xfer)
+{
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return 0;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+/* Wait for a block's DNLOAD and GETSTATUS and check both went through */
+static int dfu_slot_finish(struct p3udl_cntx *cntx, struct dfu_pipe *pipe, struct dfu_slot *slot)
+{
+	int ret = dfu_pipe_wait(pipe, slot);
+	if (ret)
+		return ret;
+
+	ret = dfu_xfer_error(slot->dnload);
+	if (!ret)
+		ret = dfu_xfer_error(slot->status);
+	if (!ret && slot->status->actual_length != sizeof(struct dfu_status))
+		ret = -EIO;
+	if (ret) {
+		dfu_err(cntx, "Block %u failed: %d\n", slot->block, ret);
+		return ret;
+	}
+
+	board_progress(cntx, slot->dnload->actual_length);
+
+	return 0;
+}
+
+static int dfu_download(struct p3udl_cntx *cntx, const struct dfu_function *func,
+		const uint8_t *data, uint32_t len)
+{
+	struct dfu_pipe pipe;
+	unsigned int head = 0, inflight = 0;
+	/* lockstep until the device shows it never wants poll time */
+	bool pipelined = false;
+	uint32_t off = 0;
+	uint16_t block = 0;
+	int ret;
+
+	ret = dfu_pipe_init(cntx, func, &pipe);
+	if (ret)
+		return ret;
+
+	while (off < len || inflight) {
+		while (off < len && inflight < (pipelined ? pipe.depth : 1)) {
+			struct dfu_slot *slot = &pipe.slots[(head + inflight) % pipe.depth];
+			uint16_t txsz = len - off < func->transfer_size ? len - off : func->transfer_size;
+
+			if (board_cancelled(cntx)) {
+				ret = -ECANCELED;
+				goto abort;
+			}
+
+			ret = dfu_slot_submit(cntx, func, slot, block++, data + off, txsz);
+			if (ret) {
+				dfu_err(cntx, "Failed to queue block %u: %s\n", slot->block, libusb_strerror(ret));
+				goto abort;
+			}
+
+			off += txsz;
+			inflight++;
+		}
+
+		struct dfu_slot *slot = &pipe.slots[head];
+
+		ret = dfu_slot_finish(cntx, &pipe, slot);
+		if (ret)
+			goto abort;
+
+		struct dfu_status *status = (void *) (slot->status_buf + LIBUSB_CONTROL_SETUP_SIZE);
+
+		if (status->bState == DFU_STATE_DNLOAD_IDLE && !dfu_poll_timeout(status) &&
+				status->bStatus == DFU_STATUS_OK)
+			pipelined = true;
+		else {
+			unsigned int poll = dfu_poll_timeout(status);
+
+			pipelined = false;
+
+			/* What is queued behind this block is already on its way, see it through first */
+			while (inflight > 1 && status->bStatus == DFU_STATUS_OK) {
+				head = (head + 1) % pipe.depth;
+				inflight--;
+				slot = &pipe.slots[head];
+
+				ret = dfu_slot_finish(cntx, &pipe, slot);
+				if (ret)
+					goto abort;
+
+				status = (void *) (slot->status_buf + LIBUSB_CONTROL_SETUP_SIZE);
+				if (dfu_poll_timeout(status) > poll)
+					poll = dfu_poll_timeout(status);
+			}
+
+			/* u-boot is back in dfuDNLOAD-IDLE when it asks but still wants the time */
+			if (status->bState == DFU_STATE_DNLOAD_IDLE && status->bStatus == DFU_STATUS_OK)
+				dfu_sleep_ms(poll);
+
+			ret = dfu_wait_state(cntx, func, status);
+			if (ret)
+				goto abort;
+			if (status->bState != DFU_STATE_DNLOAD_IDLE) {
+				dfu_err(cntx, "Block %u left the device in %s\n", slot->block,
+						dfu_state_name(status->bState));
+				ret = -EIO;
+				goto abort;
+			}
+		}
+
+		head = (head + 1) % pipe.depth;
+		inflight--;
+	}
+
+	dfu_pipe_free(&pipe);
+
+	/* A zero length DNLOAD ends the download, then wait for the device to finish up */
+	ret = cntx->transport->control(cntx, DFU_REQTYPE_OUT, DFU_REQUEST_DNLOAD, block, func->interface,
+			NULL, 0, DFU_TIMEOUT_MS);
+	if (ret < 0)
+		return ret;
+
+	struct dfu_status status;
+
+	ret = dfu_get_status(cntx, func, &status);
+	if (!ret)
+		ret = dfu_wait_state(cntx, func, &status);
+	if (ret)
+		return ret;
+
+	if (status.bState != DFU_STATE_IDLE && status.bState != DFU_STATE_MANIFEST_WAIT_RESET) {
+		dfu_err(cntx, "Download finished in %s\n", dfu_state_name(status.bState));
+		return -EIO;
+	}
+
+	return 0;
+
+abort:
+	dfu_pipe_abort(&pipe);
+	dfu_pipe_free(&pipe);
+
+	/* Leave the device somewhere the next attempt can start from */
+	struct dfu_status err;
+	if (!dfu_get_status(cntx, func, &err) && err.bStatus != DFU_STATUS_OK)
+		dfu_err(cntx, "Device status 0x%02x in %s\n", err.bStatus, dfu_state_name(err.bState));
+
+	return ret < 0 ? ret : -EIO;
+}
+
+static int dfu_find_alt(const struct dfu_function *func, const char *name)
+{
+	for (int i = 0; i < func->nalts; i++) {
+		if (!strcmp(func->alts[i].name, name))
+			return i;
+	}
+
+	return -1;
+}
+
+int dfu_flash(struct p3udl_cntx *cntx)
+{
+	struct dfu_function func;
+	int ret;
+
+	dfu_info(cntx, "Waiting for u-boot's DFU gadget...\n");
+
+	report_begin(cntx, REPORT_PHASE_REENUM);
+	ret = cntx->transport->reconnect(cntx, DFU_ENUM_TIMEOUT_MS);
+	report_end(cntx, REPORT_PHASE_REENUM);
+	if (ret) {
+		if (board_cancelled(cntx))
+			return -ECANCELED;
+		dfu_err(cntx, "Board didn't come back as a DFU device: %s\n", libusb_strerror(ret));
+		return ret;
+	}
+
+	ret = topology_acquire(cntx);
+	if (ret)
+		return ret;
+	report_begin(cntx, REPORT_PHASE_DFU);
+
+	ret = dfu_probe(cntx, &func);
+	if (ret)
+		goto out;
+
+	ret = cntx->transport->claim_interface(cntx, func.interface);
+	if (ret) {
+		dfu_err(cntx, "Couldn't claim DFU interface: %s\n", libusb_strerror(ret));
+		goto out;
+	}
+
+	for (int i = 0; i < cntx->dfu->count; i++) {
+		struct manifest_entry *entry = &cntx->dfu->entries[i];
+		const struct p3udl_image *image = &entry->loader.image;
+
+		int alt = dfu_find_alt(&func, entry->target);
+		if (alt < 0) {
+			dfu_err(cntx, "Device has no DFU alt setting called \"%s\"\n", entry->target);
+			ret = -ENOENT;
+			goto out;
+		}
+
+		ret = image_loader_wait(&entry->loader);
+		if (ret)
+			goto out;
+
+		ret = cntx->transport->set_altsetting(cntx, func.interface, func.alts[alt].altsetting);
+		if (!ret)
+			ret = dfu_make_idle(cntx, &func);
+		if (ret) {
+			dfu_err(cntx, "Couldn't select \"%s\": %d\n", entry->target, ret);
+			goto out;
+		}
+
+		dfu_info(cntx, "Downloading %s to \"%s\"...\n", entry->path, entry->target);
+
+		uint64_t begin = clock_now_ns();
+
+		ret = dfu_download(cntx, &func, image->data, image->len);
+		if (ret)
+			goto out;
+
+		uint64_t elapsed = clock_now_ns() - begin;
+
+		cntx->report.bytes += image->len;
+		tune_put_rate(cntx, "dfu", image->len, elapsed);
+		dfu_info(cntx, "Downloaded %zu bytes in %llu ms, %.2f MB/s\n", image->len,
+				(unsigned long long) (elapsed / NSEC_PER_MSEC), clock_mbps(image->len, elapsed));
+	}
+
+out:
+	report_end(cntx, REPORT_PHASE_DFU);
+	topology_release(cntx);
+	return ret;
+}
@@ -0,0 +1,56 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __DFU_H_
+#define __DFU_H_
+
+#include <stdint.h>
+
+#include "cntx.h"
+
+/* USB Device Firmware Upgrade 1.1 */
+#define DFU_INTERFACE_CLASS	0xfe
+#define DFU_INTERFACE_SUBCLASS	0x01
+#define DFU_PROTOCOL_DFU_MODE	0x02
+
+#define DFU_DT_FUNCTIONAL	0x21
+#define DFU_FUNCTIONAL_LENGTH	9
+#define DFU_ATTR_MANIFEST_TOLERANT	(1 << 2)
+
+#define DFU_REQUEST_DETACH	0
+#define DFU_REQUEST_DNLOAD	1
+#define DFU_REQUEST_UPLOAD	2
+#define DFU_REQUEST_GETSTATUS	3
+#define DFU_REQUEST_CLRSTATUS	4
+#define DFU_REQUEST_GETSTATE	5
+#define DFU_REQUEST_ABORT	6
+
+#define DFU_STATUS_OK		0x00
+
+enum dfu_state {
+	DFU_STATE_APP_IDLE,
+	DFU_STATE_APP_DETACH,
+	DFU_STATE_IDLE,
+	DFU_STATE_DNLOAD_SYNC,
+	DFU_STATE_DNBUSY,
+	DFU_STATE_DNLOAD_IDLE,
+	DFU_STATE_MANIFEST_SYNC,
+	DFU_STATE_MANIFEST,
+	DFU_STATE_MANIFEST_WAIT_RESET,
+	DFU_STATE_UPLOAD_IDLE,
+	DFU_STATE_ERROR,
+};
+
+struct dfu_status {
+	uint8_t bStatus;
+	uint8_t bwPollTimeout[3];
+	uint8_t bState;
+	uint8_t iString;
+};
+
+/* How long u-boot gets to boot and bring up its DFU gadget */
+#define DFU_ENUM_TIMEOUT_MS	30000
+
+const char *dfu_state_name(uint8_t state);
+int dfu_flash(struct p3udl_cntx *cntx);
+
+#endif /* __DFU_H_ */
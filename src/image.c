@@ -0,0 +1,297 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Image loading. Regular files are mapped read-only so the upload
+ * loop reads segments straight out of the page cache. Anything that
+ * can't be mapped (pipes etc) is read in chunks into memory. Either
+ * way the MD5 is worked out as the data comes in, unless the image
+ * cache already knows it for a mapped file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "cntx.h"
+#include "image.h"
+
+#include "image_log.h"
+
+#define IMAGE_CHUNK	(64 * 1024)
+
+static size_t image_page_align(size_t len)
+{
+	size_t pagesz = sysconf(_SC_PAGESIZE);
+
+	return (len + pagesz - 1) & ~(pagesz - 1);
+}
+
+/*
+ * Reserve a zeroed anonymous area big enough for the padded image
+ * and then map the file over the start of it. The tail of the last
+ * file page is zero filled by the kernel and the rest is anonymous
+ * memory that is never written, so padding costs nothing.
+ */
+static int image_map(struct p3udl_cntx *cntx, int fd, const struct stat *st, size_t minlen,
+		struct p3udl_image *image)
+{
+	size_t size = st->st_size;
+	size_t len = minlen > size ? minlen : size;
+	size_t maplen = image_page_align(len);
+	void *area;
+
+	area = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED)
+		return -errno;
+
+	if (size) {
+		void *file = mmap(area, image_page_align(size), PROT_READ,
+				MAP_PRIVATE | MAP_FIXED, fd, 0);
+		if (file == MAP_FAILED) {
+			int ret = -errno;
+
+			munmap(area, maplen);
+			return ret;
+		}
+	}
+
+	/* Hashing and then the uploads walk the image front to back */
+	madvise(area, maplen, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+	/* Hashing is what pulls the file in, a chunk at a time */
+	if (!cache_image_lookup(cntx, st, image->md5)) {
+		MD5_CTX md5;
+
+		MD5_Init(&md5);
+		for (size_t off = 0; off < size; off += IMAGE_CHUNK)
+			MD5_Update(&md5, (uint8_t *) area + off, size - off < IMAGE_CHUNK ? size - off : IMAGE_CHUNK);
+		MD5_Final(image->md5, &md5);
+
+		cache_image_store(cntx, st, image->md5);
+	}
+
+	image->data = area;
+	image->len = len;
+	image->size = size;
+	image->maplen = maplen;
+	image->mapped = true;
+
+	return 0;
+}
+
+static int image_read(struct p3udl_cntx *cntx, int fd, size_t minlen, struct p3udl_image *image)
+{
+	size_t size = 0, alloced = 0;
+	uint8_t *buf = NULL;
+	MD5_CTX md5;
+
+	MD5_Init(&md5);
+
+	for (;;) {
+		if (alloced - size < IMAGE_CHUNK) {
+			size_t newsz = alloced ? alloced * 2 : IMAGE_CHUNK * 4;
+			uint8_t *tmp = realloc(buf, newsz);
+
+			if (!tmp) {
+				free(buf);
+				return -ENOMEM;
+			}
+
+			buf = tmp;
+			alloced = newsz;
+		}
+
+		ssize_t ret = read(fd, buf + size, IMAGE_CHUNK);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			ret = -errno;
+			free(buf);
+			return ret;
+		}
+
+		if (!ret)
+			break;
+
+		MD5_Update(&md5, buf + size, ret);
+		size += ret;
+	}
+
+	MD5_Final(image->md5, &md5);
+
+	size_t len = minlen > size ? minlen : size;
+	if (len > alloced) {
+		uint8_t *tmp = realloc(buf, len);
+
+		if (!tmp) {
+			free(buf);
+			return -ENOMEM;
+		}
+		buf = tmp;
+	}
+	memset(buf + size, 0, len - size);
+
+	image->data = buf;
+	image->len = len;
+	image->size = size;
+	image->maplen = 0;
+	image->mapped = false;
+
+	return 0;
+}
+
+int image_load(struct p3udl_cntx *cntx, const char *path, size_t minlen, struct p3udl_image *image)
+{
+	struct stat st;
+	int ret;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+		image_err(cntx, "Failed to open %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		goto out;
+	}
+
+	if (S_ISREG(st.st_mode))
+		ret = image_map(cntx, fd, &st, minlen, image);
+	else
+		ret = image_read(cntx, fd, minlen, image);
+
+	if (ret)
+		goto out;
+
+	/* The upload paths all take 32 bit lengths */
+	if (image->len > UINT32_MAX) {
+		image_free(image);
+		ret = -EFBIG;
+		goto out;
+	}
+
+	image_dbg(cntx, "Loaded %s, %zu bytes (%s)\n", path, image->size,
+			image->mapped ? "mapped" : "read");
+
+out:
+	if (ret)
+		image_err(cntx, "Failed to load %s: %s\n", path, strerror(-ret));
+
+	close(fd);
+	return ret;
+}
+
+/* For images that are handed over in memory, the caller's buffer isn't needed afterwards */
+int image_copy(struct p3udl_cntx *cntx, const void *buf, size_t size, size_t minlen,
+		struct p3udl_image *image)
+{
+	size_t len = minlen > size ? minlen : size;
+
+	/* The upload paths all take 32 bit lengths */
+	if (len > UINT32_MAX)
+		return -EFBIG;
+
+	uint8_t *data = malloc(len ? len : 1);
+	if (!data)
+		return -ENOMEM;
+
+	memcpy(data, buf, size);
+	memset(data + size, 0, len - size);
+	MD5(data, size, image->md5);
+
+	image->data = data;
+	image->len = len;
+	image->size = size;
+	image->maplen = 0;
+	image->mapped = false;
+
+	return 0;
+}
+
+void image_free(struct p3udl_image *image)
+{
+	if (!image->data)
+		return;
+
+	if (image->mapped)
+		munmap(image->data, image->maplen);
+	else
+		free(image->data);
+
+	image->data = NULL;
+}
+
+static void *image_loader_thread(void *data)
+{
+	struct image_loader *loader = data;
+	int ret = 0;
+
+	/* Images that were handed over in memory only need checking */
+	if (!loader->image.data)
+		ret = image_load(loader->cntx, loader->path, loader->minlen, &loader->image);
+	if (!ret && loader->check) {
+		ret = loader->check(loader->cntx, &loader->image, loader->priv);
+		if (ret)
+			image_free(&loader->image);
+	}
+
+	pthread_mutex_lock(&loader->lock);
+	loader->result = ret;
+	loader->done = true;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+
+	return NULL;
+}
+
+/* Kick off loading in the background, falls back to loading right here if there are no threads to be had */
+int image_loader_start(struct image_loader *loader)
+{
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->cond, NULL);
+	loader->done = false;
+
+	int ret = pthread_create(&loader->thread, NULL, image_loader_thread, loader);
+	if (ret) {
+		image_dbg(loader->cntx, "Couldn't start loader thread (%d), loading %s now\n", ret, loader->path);
+		image_loader_thread(loader);
+		return loader->result;
+	}
+
+	loader->started = true;
+	return 0;
+}
+
+/* Wait for the image to be ready, safe to call from any number of threads */
+int image_loader_wait(struct image_loader *loader)
+{
+	int ret;
+
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->done)
+		pthread_cond_wait(&loader->cond, &loader->lock);
+	ret = loader->result;
+	pthread_mutex_unlock(&loader->lock);
+
+	return ret;
+}
+
+void image_loader_free(struct image_loader *loader)
+{
+	if (loader->started)
+		pthread_join(loader->thread, NULL);
+	loader->started = false;
+
+	image_free(&loader->image);
+	pthread_cond_destroy(&loader->cond);
+	pthread_mutex_destroy(&loader->lock);
+}
@@ -0,0 +1,56 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __IMAGE_H_
+#define __IMAGE_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <openssl/md5.h>
+
+struct p3udl_cntx;
+
+struct p3udl_image {
+	/* read-only, zero padded up to len */
+	void *data;
+	/* bytes to send, the file size or the minimum length asked for */
+	size_t len;
+	/* bytes that actually came from the file and their MD5 */
+	size_t size;
+	uint8_t md5[MD5_DIGEST_LENGTH];
+
+	/* how data was allocated */
+	size_t maplen;
+	bool mapped;
+};
+
+/* An image being loaded, checked and hashed on its own thread while the boards get on with something else */
+struct image_loader {
+	struct p3udl_cntx *cntx;
+	/* image is loaded from here unless it is already in memory */
+	const char *path;
+	size_t minlen;
+	/* optional sanity check of the contents, runs on the loader thread */
+	int (*check)(struct p3udl_cntx *cntx, const struct p3udl_image *image, void *priv);
+	void *priv;
+
+	struct p3udl_image image;
+	int result;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool started, done;
+};
+
+int image_load(struct p3udl_cntx *cntx, const char *path, size_t minlen, struct p3udl_image *image);
+int image_copy(struct p3udl_cntx *cntx, const void *buf, size_t size, size_t minlen,
+		struct p3udl_image *image);
+void image_free(struct p3udl_image *image);
+
+int image_loader_start(struct image_loader *loader);
+int image_loader_wait(struct image_loader *loader);
+void image_loader_free(struct image_loader *loader);
+
+#endif /* __IMAGE_H_ */
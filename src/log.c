@@ -1,18 +1,696 @@
 //SPDX-License-Identifier: GPL-3.0-or-later
 /*
- *
+ * Board threads don't format anything. Each call is captured as a fixed
+ * size record in the board's own ring, with the format pointer and the
+ * arguments, and a background thread turns the records into text. A ring
+ * has one writer, its board thread, and is only read under log_lock so
+ * the writer never waits for anything. When the writer laps the reader
+ * the oldest records are lost and counted rather than blocking a transfer.
  */
 
-#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "clock.h"
+#include "log.h"
+
+/* Records kept per board, a power of two */
+#define LOG_RING_SIZE		1024
+#define LOG_RECORD_ARGS		8
+#define LOG_RECORD_TEXT		160
+/* Formats remembered per board */
+#define LOG_FORMAT_CACHE	64
+/* How often the formatting thread looks at the rings */
+#define LOG_FLUSH_MS		10
+
+/* args[] value of a %s that was given NULL */
+#define LOG_STR_NULL		UINT16_MAX
+
+enum log_arg_type {
+	LOG_ARG_LITERAL,
+	LOG_ARG_INT,
+	LOG_ARG_UINT,
+	LOG_ARG_CHAR,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_PTR,
+	LOG_ARG_STR,
+};
+
+union log_arg {
+	long long i;
+	unsigned long long u;
+	double d;
+	const void *p;
+};
+
+struct log_record {
+	/* position in the ring plus one once written, 0 while being written */
+	uint64_t seq;
+	uint64_t ns;
+	const char *tag;
+	/* NULL when the caller had to format it, text then has the result */
+	const char *format;
+	unsigned int nargs;
+	union log_arg args[LOG_RECORD_ARGS];
+	/* copies of %s arguments, their args[] are offsets into here */
+	char text[LOG_RECORD_TEXT];
+};
+
+/* What a format's arguments are, worked out the first time the board uses it */
+struct log_format_info {
+	const char *format;
+	/* false when the caller has to format it */
+	bool capturable;
+	unsigned int nargs;
+	uint8_t get[LOG_RECORD_ARGS];
+};
+
+struct log_ring {
+	struct log_record records[LOG_RING_SIZE];
+	/* formats are all string literals so the pointer is as good as an id */
+	struct log_format_info formats[LOG_FORMAT_CACHE];
+	/* records written so far, only the board thread changes it */
+	uint64_t head;
+	/* reader side, under log_lock */
+	uint64_t tail, lost;
+	struct log_record next;
+	bool have_next;
+	char device[32];
+	struct log_ring *list;
+};
+
+/* A conversion in a format string */
+struct log_spec {
+	enum log_arg_type type;
+	/* "%", flags, width and precision, without the length modifier */
+	const char *start;
+	size_t len;
+	char length[3];
+	char conv;
+	/* width and/or precision given as * */
+	unsigned int stars;
+};
+
+/* The board the calling thread is working on, if any */
+static __thread const char *log_device;
+static __thread struct log_ring *log_ring;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *log_rings;
+static pthread_t log_thread;
+static bool log_running, log_stopping, log_failed_only;
+
+/*
+ * Parse the conversion at p, which points at a '%'. Returns where the
+ * format carries on or NULL for anything the records can't carry, those
+ * calls get formatted straight away instead.
+ */
+static const char *log_parse_spec(const char *p, struct log_spec *spec)
+{
+	memset(spec, 0, sizeof(*spec));
+	spec->start = p++;
+
+	if (*p == '%') {
+		spec->type = LOG_ARG_LITERAL;
+		spec->len = 2;
+		return p + 1;
+	}
+
+	while (*p && strchr("-+ #0'", *p))
+		p++;
+
+	if (*p == '*') {
+		spec->stars++;
+		p++;
+	}
+	else
+		while (*p >= '0' && *p <= '9')
+			p++;
+
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->stars++;
+			p++;
+		}
+		else
+			while (*p >= '0' && *p <= '9')
+				p++;
+	}
+
+	spec->len = p - spec->start;
+
+	for (int i = 0; i < 2 && *p && strchr("hljztq", *p); i++)
+		spec->length[i] = *p++;
+
+	spec->conv = *p;
+	switch (*p) {
+	case 'd':
+	case 'i':
+		spec->type = LOG_ARG_INT;
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		spec->type = LOG_ARG_UINT;
+		break;
+	case 'c':
+		spec->type = LOG_ARG_CHAR;
+		if (spec->length[0])
+			return NULL;
+		break;
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		spec->type = LOG_ARG_DOUBLE;
+		if (spec->length[0] && strcmp(spec->length, "l"))
+			return NULL;
+		break;
+	case 'p':
+		spec->type = LOG_ARG_PTR;
+		break;
+	case 's':
+		spec->type = LOG_ARG_STR;
+		if (spec->length[0])
+			return NULL;
+		break;
+	default:
+		/* %n, %m, wide strings and long doubles */
+		return NULL;
+	}
+
+	return p + 1;
+}
+
+/* How an argument comes off the va_list */
+enum log_get {
+	LOG_GET_INT,
+	LOG_GET_UINT,
+	LOG_GET_SCHAR,
+	LOG_GET_UCHAR,
+	LOG_GET_SHORT,
+	LOG_GET_USHORT,
+	LOG_GET_LONG,
+	LOG_GET_ULONG,
+	LOG_GET_LLONG,
+	LOG_GET_ULLONG,
+	LOG_GET_INTMAX,
+	LOG_GET_UINTMAX,
+	LOG_GET_SSIZE,
+	LOG_GET_SIZE,
+	LOG_GET_PTRDIFF,
+	LOG_GET_DOUBLE,
+	LOG_GET_PTR,
+	LOG_GET_STR,
+};
+
+static enum log_get log_spec_get(const struct log_spec *spec)
+{
+	bool is_signed = spec->type == LOG_ARG_INT;
+
+	switch (spec->type) {
+	case LOG_ARG_CHAR:
+		return LOG_GET_INT;
+	case LOG_ARG_DOUBLE:
+		return LOG_GET_DOUBLE;
+	case LOG_ARG_PTR:
+		return LOG_GET_PTR;
+	case LOG_ARG_STR:
+		return LOG_GET_STR;
+	default:
+		break;
+	}
+
+	switch (spec->length[0]) {
+	case 'h':
+		if (spec->length[1] == 'h')
+			return is_signed ? LOG_GET_SCHAR : LOG_GET_UCHAR;
+		return is_signed ? LOG_GET_SHORT : LOG_GET_USHORT;
+	case 'l':
+		if (spec->length[1] == 'l')
+			return is_signed ? LOG_GET_LLONG : LOG_GET_ULLONG;
+		return is_signed ? LOG_GET_LONG : LOG_GET_ULONG;
+	case 'q':
+		return is_signed ? LOG_GET_LLONG : LOG_GET_ULLONG;
+	case 'j':
+		return is_signed ? LOG_GET_INTMAX : LOG_GET_UINTMAX;
+	case 'z':
+		return is_signed ? LOG_GET_SSIZE : LOG_GET_SIZE;
+	case 't':
+		return LOG_GET_PTRDIFF;
+	default:
+		return is_signed ? LOG_GET_INT : LOG_GET_UINT;
+	}
+}
+
+/* Work out once what a format's arguments are, false if a record can't carry them */
+static bool log_describe(const char *format, struct log_format_info *info)
+{
+	struct log_spec spec;
+
+	info->format = format;
+	info->nargs = 0;
+	info->capturable = false;
+
+	for (const char *p = strchr(format, '%'); p; p = strchr(p, '%')) {
+		p = log_parse_spec(p, &spec);
+		if (!p)
+			return false;
+
+		if (spec.type == LOG_ARG_LITERAL)
+			continue;
+
+		if (info->nargs + spec.stars + 1 > LOG_RECORD_ARGS)
+			return false;
+
+		for (int i = 0; i < spec.stars; i++)
+			info->get[info->nargs++] = LOG_GET_INT;
+		info->get[info->nargs++] = log_spec_get(&spec);
+	}
+
+	info->capturable = true;
+
+	return true;
+}
+
+static const struct log_format_info *log_lookup(struct log_ring *ring, const char *format)
+{
+	struct log_format_info *info = &ring->formats[((uintptr_t) format >> 3) % LOG_FORMAT_CACHE];
+
+	if (info->format != format)
+		log_describe(format, info);
+
+	return info;
+}
+
+/* Pull the arguments out of args into rec */
+static void log_capture(struct log_record *rec, const struct log_format_info *info, va_list *args)
+{
+	size_t textlen = 0;
+
+	rec->nargs = info->nargs;
+
+	for (int i = 0; i < info->nargs; i++) {
+		union log_arg *arg = &rec->args[i];
+
+		switch (info->get[i]) {
+		case LOG_GET_INT:
+			arg->i = va_arg(*args, int);
+			break;
+		case LOG_GET_UINT:
+			arg->u = va_arg(*args, unsigned int);
+			break;
+		case LOG_GET_SCHAR:
+			arg->i = (signed char) va_arg(*args, int);
+			break;
+		case LOG_GET_UCHAR:
+			arg->u = (unsigned char) va_arg(*args, unsigned int);
+			break;
+		case LOG_GET_SHORT:
+			arg->i = (short) va_arg(*args, int);
+			break;
+		case LOG_GET_USHORT:
+			arg->u = (unsigned short) va_arg(*args, unsigned int);
+			break;
+		case LOG_GET_LONG:
+			arg->i = va_arg(*args, long);
+			break;
+		case LOG_GET_ULONG:
+			arg->u = va_arg(*args, unsigned long);
+			break;
+		case LOG_GET_LLONG:
+			arg->i = va_arg(*args, long long);
+			break;
+		case LOG_GET_ULLONG:
+			arg->u = va_arg(*args, unsigned long long);
+			break;
+		case LOG_GET_INTMAX:
+			arg->i = va_arg(*args, intmax_t);
+			break;
+		case LOG_GET_UINTMAX:
+			arg->u = va_arg(*args, uintmax_t);
+			break;
+		case LOG_GET_SSIZE:
+			arg->i = va_arg(*args, ssize_t);
+			break;
+		case LOG_GET_SIZE:
+			arg->u = va_arg(*args, size_t);
+			break;
+		case LOG_GET_PTRDIFF:
+			arg->i = va_arg(*args, ptrdiff_t);
+			break;
+		case LOG_GET_DOUBLE:
+			arg->d = va_arg(*args, double);
+			break;
+		case LOG_GET_PTR:
+			arg->p = va_arg(*args, void *);
+			break;
+		case LOG_GET_STR: {
+			const char *str = va_arg(*args, const char *);
+
+			if (!str) {
+				arg->u = LOG_STR_NULL;
+				break;
+			}
+
+			/* Long strings are cut short rather than losing the whole line */
+			size_t n = strnlen(str, LOG_RECORD_TEXT - 1 - textlen);
+
+			arg->u = textlen;
+			memcpy(rec->text + textlen, str, n);
+			textlen += n;
+			rec->text[textlen++] = '\0';
+			if (textlen >= LOG_RECORD_TEXT)
+				textlen = LOG_RECORD_TEXT - 1;
+			break;
+		}
+		}
+	}
+}
+
+static void log_record(struct log_ring *ring, const char *tag, const char *format, va_list args)
+{
+	uint64_t n = ring->head;
+	struct log_record *rec = &ring->records[n & (LOG_RING_SIZE - 1)];
+	va_list copy;
+
+	/* Readers check seq on both sides of their copy so they can tell this was rewritten */
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	const struct log_format_info *info = log_lookup(ring, format);
+
+	rec->ns = clock_now_ns();
+	rec->tag = tag;
+
+	if (info->capturable) {
+		rec->format = format;
+		va_copy(copy, args);
+		log_capture(rec, info, &copy);
+		va_end(copy);
+	}
+	else {
+		rec->format = NULL;
+		vsnprintf(rec->text, sizeof(rec->text), format, args);
+	}
+
+	__atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/* Copy out record n, false if it has been written over since */
+static bool log_read(struct log_ring *ring, uint64_t n, struct log_record *out)
+{
+	const struct log_record *rec = &ring->records[n & (LOG_RING_SIZE - 1)];
+	uint64_t seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+
+	if (seq != n + 1)
+		return false;
+
+	memcpy(out, rec, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq;
+}
+
+static void log_prefix(FILE *out, const char *device, const char *tag)
+{
+	if (device)
+		fprintf(out, "%-8s ", device);
+	fprintf(out, "%-14s: ", tag);
+}
+
+/* printf() the record one conversion at a time */
+static void log_format(FILE *out, const char *device, const struct log_record *rec)
+{
+	const char *p = rec->format;
+	unsigned int argn = 0;
+	struct log_spec spec;
+
+	flockfile(out);
+	log_prefix(out, device, rec->tag);
+
+	if (!p) {
+		fputs(rec->text, out);
+		funlockfile(out);
+		return;
+	}
+
+	for (const char *pct = strchr(p, '%'); pct; pct = strchr(p, '%')) {
+		fwrite(p, 1, pct - p, out);
+		p = log_parse_spec(pct, &spec);
+
+		if (spec.type == LOG_ARG_LITERAL) {
+			fputc('%', out);
+			continue;
+		}
+
+		/* Rebuild the conversion with any * filled in and the length widened to what was stored */
+		char conv[48];
+		size_t len = 0;
+		int star = 0;
+
+		for (size_t i = 0; i < spec.len && len < sizeof(conv) - 16; i++) {
+			if (spec.start[i] == '*')
+				len += snprintf(conv + len, sizeof(conv) - len, "%d", (int) rec->args[argn + star++].i);
+			else
+				conv[len++] = spec.start[i];
+		}
+		argn += spec.stars;
+
+		if (spec.type == LOG_ARG_INT || spec.type == LOG_ARG_UINT)
+			len += snprintf(conv + len, sizeof(conv) - len, "ll");
+		snprintf(conv + len, sizeof(conv) - len, "%c", spec.conv);
+
+		const union log_arg *arg = &rec->args[argn++];
+
+		switch (spec.type) {
+		case LOG_ARG_INT:
+		case LOG_ARG_CHAR:
+			fprintf(out, conv, arg->i);
+			break;
+		case LOG_ARG_UINT:
+			fprintf(out, conv, arg->u);
+			break;
+		case LOG_ARG_DOUBLE:
+			fprintf(out, conv, arg->d);
+			break;
+		case LOG_ARG_PTR:
+			fprintf(out, conv, arg->p);
+			break;
+		case LOG_ARG_STR:
+			fprintf(out, conv, arg->u == LOG_STR_NULL ? "(null)" : rec->text + arg->u);
+			break;
+		default:
+			break;
+		}
+	}
+
+	fputs(p, out);
+	funlockfile(out);
+}
+
+/* The oldest record this ring has that hasn't been printed yet, under log_lock */
+static struct log_record *log_peek(struct log_ring *ring)
+{
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	while (!ring->have_next && ring->tail < head) {
+		if (head - ring->tail > LOG_RING_SIZE) {
+			ring->lost += head - LOG_RING_SIZE - ring->tail;
+			ring->tail = head - LOG_RING_SIZE;
+		}
+
+		if (log_read(ring, ring->tail, &ring->next))
+			ring->have_next = true;
+		else
+			ring->lost++;
+		ring->tail++;
+	}
+
+	return ring->have_next ? &ring->next : NULL;
+}
+
+/* Print everything the rings have, oldest first across all boards, under log_lock */
+static void log_drain(void)
+{
+	for (;;) {
+		struct log_ring *oldest = NULL;
+
+		for (struct log_ring *ring = log_rings; ring; ring = ring->list) {
+			struct log_record *rec = log_peek(ring);
+
+			if (rec && (!oldest || rec->ns < oldest->next.ns))
+				oldest = ring;
+		}
+
+		if (!oldest)
+			break;
+
+		if (oldest->lost) {
+			log_prefix(stdout, oldest->device, "log");
+			printf("%llu message(s) lost\n", (unsigned long long) oldest->lost);
+			oldest->lost = 0;
+		}
+
+		log_format(stdout, oldest->device, &oldest->next);
+		oldest->have_next = false;
+	}
+
+	fflush(stdout);
+}
+
+/* What a board that failed got up to, as much of it as the ring still has */
+static void log_dump(struct log_ring *ring)
+{
+	uint64_t first = ring->head > LOG_RING_SIZE ? ring->head - LOG_RING_SIZE : 0;
+	struct log_record rec;
+
+	log_prefix(stdout, ring->device, "log");
+	printf("last %llu message(s) before failing:\n", (unsigned long long) (ring->head - first));
+
+	for (uint64_t n = first; n < ring->head; n++) {
+		if (log_read(ring, n, &rec))
+			log_format(stdout, ring->device, &rec);
+	}
+
+	fflush(stdout);
+}
+
+static void *log_thread_fn(void *data)
+{
+	const struct timespec period = {
+		.tv_sec = 0,
+		.tv_nsec = LOG_FLUSH_MS * NSEC_PER_MSEC,
+	};
+
+	for (;;) {
+		nanosleep(&period, NULL);
+
+		pthread_mutex_lock(&log_lock);
+		if (!log_failed_only)
+			log_drain();
+		bool stop = log_stopping;
+		pthread_mutex_unlock(&log_lock);
+
+		if (stop)
+			break;
+	}
+
+	return NULL;
+}
+
+int log_start(bool failed_only)
+{
+	log_failed_only = failed_only;
+
+	int ret = pthread_create(&log_thread, NULL, log_thread_fn, NULL);
+	if (ret)
+		return -ret;
+
+	log_running = true;
+
+	return 0;
+}
+
+void log_stop(void)
+{
+	if (!log_running)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+	log_stopping = true;
+	pthread_mutex_unlock(&log_lock);
+
+	pthread_join(log_thread, NULL);
+	log_running = false;
+}
+
+void log_set_device(const char *name)
+{
+	log_device = name;
+
+	if (!name || !log_running || log_ring)
+		return;
+
+	/* Without a ring the board logs the slow way, which still works */
+	struct log_ring *ring = calloc(1, sizeof(*ring));
+	if (!ring)
+		return;
+
+	snprintf(ring->device, sizeof(ring->device), "%s", name);
+
+	pthread_mutex_lock(&log_lock);
+	ring->list = log_rings;
+	log_rings = ring;
+	pthread_mutex_unlock(&log_lock);
+
+	log_ring = ring;
+}
+
+void log_end_device(int result)
+{
+	struct log_ring *ring = log_ring;
+
+	log_device = NULL;
+	log_ring = NULL;
+
+	if (!ring)
+		return;
+
+	pthread_mutex_lock(&log_lock);
+
+	if (!log_failed_only)
+		log_drain();
+	else if (result)
+		log_dump(ring);
+
+	for (struct log_ring **pp = &log_rings; *pp; pp = &(*pp)->list) {
+		if (*pp == ring) {
+			*pp = ring->list;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&log_lock);
+
+	free(ring);
+}
 
 int log_printf(int level, const char *tag, const char *format,...)
 {
 	va_list(args);
+	int ret = 0;
 
-	printf("%-14s: ", tag);
 	va_start(args, format);
 
-	return vprintf(format, args);
-}
+	if (log_ring)
+		log_record(log_ring, tag, format, args);
+	else {
+		/* Keep lines from different boards from getting mixed up */
+		flockfile(stdout);
 
+		log_prefix(stdout, log_device, tag);
+		ret = vprintf(format, args);
+
+		funlockfile(stdout);
+	}
+
+	va_end(args);
+
+	return ret;
+}
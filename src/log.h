@@ -5,6 +5,12 @@
 #ifndef SRC_LOG_H_
 #define SRC_LOG_H_
 
+#include <stdbool.h>
+
+int log_start(bool failed_only);
+void log_stop(void);
+void log_set_device(const char *name);
+void log_end_device(int result);
 int log_printf(int level, const char *tag, const char *format,...) __attribute__ ((format (printf, 3, 4)));
 
 #endif /* SRC_LOG_H_ */
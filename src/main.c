@@ -1,100 +1,35 @@
 //SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * The p3udl command, everything it does goes through libp3udl's
+ * p3udl.h like any other program that flashes boards.
+ */
 
-#include <arpa/inet.h>
 #include <argtable2.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
-#include <stdint.h>
-#include <libusb.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 #include <stdbool.h>
 
-#include "sstarscsi.h"
-#include "usbms.h"
-#include "log.h"
-#include "uboot.h"
+#include "p3udl.h"
 
-#include "main_log.h"
+/* What the command line asks for that isn't a session setting */
+struct cmdline {
+	bool station;
+	bool log_failed;
+	bool plan;
+	FILE *report_out;
+	const char *manifest, *dfu, *ums, *slots;
+	const char *metrics_socket, *metrics_file;
+};
 
-static int usb_libusbinit(struct p3udl_cntx *cntx)
+static int parse_cmdline(int argc, char **argv, struct p3udl_session *session, struct cmdline *cmd)
 {
-	int ret = libusb_init(&cntx->lu_cntx);
-	if (ret < 0) {
-		printf("failed to init libusb\n");
-		return ret;
-	}
-
-	return 0;
-}
-
-static int usb_probe(struct p3udl_cntx *cntx)
-{
-	libusb_device_handle *lu_handle;
-
-	lu_handle = libusb_open_device_with_vid_pid(cntx->lu_cntx, SSTARSCSI_VID, SSTARSCSI_PID);
-	if (!lu_handle) {
-		printf("failed to find device\n");
-		return -ENODEV;
-	}
-
-	/* check if the kernel driver is attached */
-	int ret = libusb_kernel_driver_active(lu_handle, 0);
-	if (ret == 1) {
-		/* detach kernel device */
-		ret = libusb_detach_kernel_driver(lu_handle, 0);
-		if (ret) {
-			printf("failed to detach kernel driver: %d\n", ret);
-			return -ENODEV;
-		}
-	}
-
-	cntx->lu_handle = lu_handle;
-	return 0;
-}
-
-// TODO find the endpoints
-static int usb_setup(struct p3udl_cntx *cntx)
-{
-	//struct libusb_device_descriptor dev_desc;
-	//libusb_device *dev;
-
-	//dev = libusb_get_device(lu_handle);
-
-	//libusb_get_device_descriptor(dev, &dev_desc);
-
-	cntx->ep_in = 0x81;
-	cntx->ep_out = 0x02;
-
-	return 0;
-}
-
-static int scsi_probe(struct p3udl_cntx *cntx)
-{
-	/* get the max lun to check the device is present */
-	int ret = usb_massstorage_get_maxlun(cntx);
-	if (ret < 0) {
-		p3udl_err(cntx, "Couldn't request maxlun %d, need reset?\n", ret);
-		return ret;
-	}
-
-	struct mass_storage_inquiry_result inquiry_result;
-	ret = usb_massstorage_inquiry(cntx, &inquiry_result);
-	if (ret)
-		return ret;
-
-	printf("VID:PID:REV \"%8s\":\"%8s\":\"%4s\"\n",
-			inquiry_result.vid, inquiry_result.pid, inquiry_result.rev);
-
-	return 0;
-}
-
-static int parse_cmdline(int argc, char **argv, struct p3udl_cntx *cntx)
-{
-	struct arg_lit *help;
-	struct arg_file *ipl, *uboot;
+	struct arg_lit *help, *station, *compress, *log_failed, *ipl_pad, *plan, *delta;
+	struct arg_file *ipl, *uboot, *manifest, *dfu, *ums, *slots, *report_file, *trace, *replay;
+	struct arg_file *metrics_socket, *metrics_file;
+	struct arg_str *report, *sim_opts_str, *transport;
+	struct arg_int *queue_depth, *max_transfer, *simulate, *per_bus;
 	struct arg_end *end;
 
 	void *argtable[] = {
@@ -102,8 +37,48 @@ static int parse_cmdline(int argc, char **argv, struct p3udl_cntx *cntx)
 			help = arg_lit0("h", "help", "Display this help text"),
 			/* the IPL file */
 			ipl = arg_file0(NULL, "ipl", "<file path>", "Binary to use for the IPL"),
+			/* for boot ROMs that turn out to want the full 64KiB */
+			ipl_pad = arg_lit0(NULL, "ipl-pad", "Send the IPL zero padded to 64KiB instead of stopping after its last segment"),
 			/* the u-boot file */
 			uboot = arg_file0(NULL, "uboot", "<file path>", "u-boot image file path"),
+			/* kernel, dtb etc to put in RAM before u-boot */
+			manifest = arg_file0(NULL, "manifest", "<file path>", "List of extra images and load addresses to send before u-boot"),
+			/* trade the board's CPU for time on the wire */
+			compress = arg_lit0(NULL, "compress", "LZ4 compress manifest images with u-boot headers for bootm to unpack"),
+			/* images to write with u-boot's DFU gadget once it's up */
+			dfu = arg_file0(NULL, "dfu", "<file path>", "List of images and DFU alt settings to download once u-boot is running"),
+			/* or to write with its mass storage gadget */
+			ums = arg_file0(NULL, "ums", "<file path>", "List of images and disk offsets to write with u-boot's ums once it is running"),
+			/* boards being reflashed mostly have most of it already */
+			delta = arg_lit0(NULL, "delta", "Read back what the disk has and only write the blocks of --ums images that differ"),
+			/* how many segments to keep queued, 1 disables pipelining */
+			queue_depth = arg_int0(NULL, "queue-depth", "<n>", "Commands kept in flight during uploads, 1 for synchronous"),
+			/* skip probing the usb updater's segment size */
+			max_transfer = arg_int0(NULL, "max-transfer", "<bytes>", "Segment size for the usb updater stage, default is probed"),
+			/* let the kernel's usb-storage do the Bulk-Only Transport */
+			transport = arg_str0(NULL, "transport", "<libusb|sg>", "How to talk to boards, sg goes through /dev/sg* and SG_IO"),
+			/* dry run, nothing is sent */
+			plan = arg_lit0(NULL, "plan", "Print the bytes, segments and estimated time of each stage and exit"),
+			/* machine readable timing */
+			report = arg_str0(NULL, "report", "json", "Write a per board timing report"),
+			report_file = arg_file0(NULL, "report-file", "<file path>", "Where to write the report, default is stdout"),
+			/* boards that work don't need their logs read */
+			log_failed = arg_lit0(NULL, "log-failed", "Only print the log of boards that fail"),
+			/* everything that went over the wire, for p3udl-trace and --replay */
+			trace = arg_file0(NULL, "trace", "<file path>", "Record every transfer with timestamps"),
+			replay = arg_file0(NULL, "replay", "<file path>", "Play a trace back instead of talking to boards"),
+			/* totals for a Prometheus scraper */
+			metrics_socket = arg_file0(NULL, "metrics-socket", "<file path>", "Serve Prometheus metrics on a Unix socket"),
+			metrics_file = arg_file0(NULL, "metrics-file", "<file path>", "Keep Prometheus metrics in a file for a textfile collector"),
+			/* stay resident and flash boards as they turn up */
+			station = arg_lit0(NULL, "station", "Keep running and flash boards as they are plugged in"),
+			/* which board is which on a station */
+			slots = arg_file0(NULL, "slots", "<file path>", "Map of port paths to station slots, only mapped ports are used"),
+			/* boards behind one host controller share its bandwidth */
+			per_bus = arg_int0(NULL, "per-bus", "<n>", "Uploads allowed at once on each USB bus, default is no limit"),
+			/* no hardware needed, for benchmarking the host side */
+			simulate = arg_int0(NULL, "simulate", "<n>", "Flash n simulated boards instead of real ones"),
+			sim_opts_str = arg_str0(NULL, "sim-opts", "<opts>", "Simulated board behaviour, latency=<us>,bandwidth=<MB/s>,timeout=<n>,stall=<n>,partial=<n>,segment=<bytes>,boot=<ms>,dfu=<bytes>,poll=<ms>,flush=<n>,ums=<MiB>,disk=<file>,fast=<0|1>,buses=<n>"),
 			end = arg_end(1),
 	};
 
@@ -129,120 +104,259 @@ static int parse_cmdline(int argc, char **argv, struct p3udl_cntx *cntx)
 		exit(1);
 	}
 
-	cntx->ipl_path = strdup(ipl->filename[0]);
-	cntx->uboot_path = strdup(uboot->filename[0]);
+	if (queue_depth->count && p3udl_session_set(session, P3UDL_OPT_QUEUE_DEPTH, queue_depth->ival[0])) {
+		printf("Queue depth must be at least 1\n");
+		return -EINVAL;
+	}
+
+	if (max_transfer->count && (max_transfer->ival[0] < 1 ||
+			p3udl_session_set(session, P3UDL_OPT_MAX_TRANSFER, max_transfer->ival[0]))) {
+		printf("Max transfer is smaller than the boot ROM's segments\n");
+		return -EINVAL;
+	}
 
-	return 0;
-}
+	if (report->count) {
+		if (strcmp(report->sval[0], "json")) {
+			printf("Unknown report format \"%s\"\n", report->sval[0]);
+			return -EINVAL;
+		}
 
-static int upload_ipl(struct p3udl_cntx *cntx)
-{
-	p3udl_info(cntx, "Uploading IPL via boot ROM...\n");
-	uint32_t len = 64 * 1024;
-	void *buffer = malloc(len);
-	int ret;
+		cmd->report_out = stdout;
+		if (report_file->count) {
+			cmd->report_out = fopen(report_file->filename[0], "a");
+			if (!cmd->report_out) {
+				printf("Can't open %s: %s\n", report_file->filename[0], strerror(errno));
+				return -errno;
+			}
+		}
+	}
 
-	memset(buffer, 0, len);
+	cmd->station = station->count > 0;
+	cmd->log_failed = log_failed->count > 0;
+	cmd->plan = plan->count > 0;
+	p3udl_session_set(session, P3UDL_OPT_COMPRESS, compress->count > 0);
+	p3udl_session_set(session, P3UDL_OPT_IPL_PAD, ipl_pad->count > 0);
 
-	int iplfd = open(cntx->ipl_path, O_RDONLY);
-	if (iplfd < 0) {
-		p3udl_err(cntx, "Failed to open IPL binary: %d\n", iplfd);
-		return -1;
+	if (simulate->count) {
+		if (simulate->ival[0] < 1) {
+			printf("Need at least one simulated board\n");
+			return -EINVAL;
+		}
+		if (cmd->station) {
+			printf("Station mode needs real boards\n");
+			return -EINVAL;
+		}
+		p3udl_session_set(session, P3UDL_OPT_SIMULATE, simulate->ival[0]);
+	}
+
+	if (replay->count) {
+		if (cmd->station || simulate->count) {
+			printf("Replaying can't be mixed with station mode or simulated boards\n");
+			return -EINVAL;
+		}
+		if (p3udl_session_set_replay(session, replay->filename[0]))
+			return -ENOMEM;
 	}
 
-	int actuallen = read(iplfd, buffer, len);
-	p3udl_info(cntx, "Read %d bytes of IPL\n", actuallen);
+	if (transport->count) {
+		bool sg = !strcmp(transport->sval[0], "sg");
 
-	ret = sstarscsi_upload_bootrom(cntx, buffer, len);
-	if (ret)
-		p3udl_err(cntx, "Failed! :(\n");
+		if (!sg && strcmp(transport->sval[0], "libusb")) {
+			printf("Unknown transport \"%s\"\n", transport->sval[0]);
+			return -EINVAL;
+		}
+		if (sg && (simulate->count || replay->count)) {
+			printf("The sg transport needs real boards\n");
+			return -EINVAL;
+		}
+		p3udl_session_set(session, P3UDL_OPT_SG, sg);
+	}
+
+	if (sim_opts_str->count && p3udl_session_set_sim_opts(session, sim_opts_str->sval[0])) {
+		printf("Can't parse simulation options \"%s\"\n", sim_opts_str->sval[0]);
+		return -EINVAL;
+	}
+
+	if (p3udl_session_set_ipl_file(session, ipl->filename[0]) ||
+			p3udl_session_set_uboot_file(session, uboot->filename[0]))
+		return -ENOMEM;
+	if (manifest->count)
+		cmd->manifest = manifest->filename[0];
+	if (dfu->count && ums->count) {
+		printf("u-boot can only come back as a DFU or a mass storage gadget, not both\n");
+		return -EINVAL;
+	}
+
+	if (dfu->count)
+		cmd->dfu = dfu->filename[0];
+	if (ums->count)
+		cmd->ums = ums->filename[0];
+	if (delta->count) {
+		if (!ums->count) {
+			printf("--delta only works with --ums\n");
+			return -EINVAL;
+		}
+		p3udl_session_set(session, P3UDL_OPT_DELTA, 1);
+	}
+	if (slots->count)
+		cmd->slots = slots->filename[0];
+	if (metrics_socket->count)
+		cmd->metrics_socket = metrics_socket->filename[0];
+	if (metrics_file->count)
+		cmd->metrics_file = metrics_file->filename[0];
+
+	if (per_bus->count && (per_bus->ival[0] < 1 ||
+			p3udl_session_set(session, P3UDL_OPT_PER_BUS, per_bus->ival[0]))) {
+		printf("Uploads per bus must be at least 1\n");
+		return -EINVAL;
+	}
 
-	free(buffer);
+	if (trace->count) {
+		ret = p3udl_session_set_trace(session, trace->filename[0]);
+		if (ret) {
+			printf("Can't create trace %s: %s\n", trace->filename[0], strerror(-ret));
+			return ret;
+		}
+	}
 
 	return 0;
 }
 
-static int upload_uboot(struct p3udl_cntx *cntx)
+static int board_summary(struct p3udl_board **boards, const int *results, int nboards)
 {
-	p3udl_info(cntx, "Uploading u-boot via IPL...\n");
+	int failed = 0;
+
+	for (int i = 0; i < nboards; i++) {
+		if (results[i])
+			failed++;
+	}
 
-	uint32_t len = 2048 * 1024;
-	void *buffer = malloc(len);
+	printf("\n%d board(s): %d passed, %d failed\n", nboards, nboards - failed, failed);
+	for (int i = 0; i < nboards; i++) {
+		const char *name = p3udl_board_name(boards[i]);
+
+		if (results[i])
+			printf("  %s FAILED during %s (%d)\n", name,
+					p3udl_stage_name(p3udl_board_stage(boards[i])), results[i]);
+		else
+			printf("  %s pass\n", name);
+	}
+
+	return failed;
+}
+
+/* Flash whatever boards are connected right now and exit */
+static int flash_connected(struct p3udl_session *session, struct cmdline *cmd)
+{
+	struct p3udl_board **boards;
+	int *results;
 	int ret;
 
-	memset(buffer, 0, len);
+	int nboards = p3udl_session_open_all(session, &boards);
+	if (nboards == -ENODEV)
+		printf("failed to find device\n");
+	if (nboards < 0)
+		return nboards;
 
-	int ubootfd = open(cntx->uboot_path, O_RDONLY);
-	if (ubootfd < 0) {
-		p3udl_err(cntx, "Failed to open u-boot image: %d\n", ubootfd);
-		return -1;
+	results = calloc(nboards, sizeof(*results));
+	if (!results) {
+		ret = -ENOMEM;
+		goto out_free;
 	}
 
-	int actuallen = read(ubootfd, buffer, len);
-	p3udl_info(cntx, "Read %d bytes of u-boot image\n", actuallen);
+	/* Every board that could be opened gets a thread and they all run in parallel */
+	for (int i = 0; i < nboards; i++)
+		results[i] = p3udl_board_start(boards[i]);
 
-	struct legacy_img_hdr *hdr = buffer;
-	uint32_t magic = ntohl(hdr->ih_magic);
-	if (magic != IH_MAGIC) {
-		p3udl_err(cntx, "Doesn't look like a u-boot image to me buddy\n");
-		return -EINVAL;
+	for (int i = 0; i < nboards; i++) {
+		if (!results[i])
+			results[i] = p3udl_board_wait(boards[i]);
 	}
-	uint32_t loadaddr = ntohl(hdr->ih_load);
-	uint32_t loadsz = ntohl(hdr->ih_size);
 
-	p3udl_info(cntx, "u-boot info: load addr 0x%04x, load size 0x%04x\n",
-			loadaddr, loadsz);
+	ret = board_summary(boards, results, nboards) ? EXIT_FAILURE : 0;
 
-	/* the usb updater wants a u-boot binary? */
-	/* note for the usb update bin the load addr seems to be ingored and it's always 0x23d00000
-	 * and the u-boot binary is moved to 0x23e00000? */
-	ret = sstarscsi_upload_usbupdater(cntx, 0xFFFFFFFF, buffer, actuallen);
-	if (ret)
-		p3udl_err(cntx, "Failed! :(\n");
+	if (cmd->report_out) {
+		for (int i = 0; i < nboards; i++)
+			p3udl_board_report_json(boards[i], cmd->report_out);
+	}
 
-	free(buffer);
+out_free:
+	free(results);
+	for (int i = 0; i < nboards; i++)
+		p3udl_board_close(boards[i]);
+	free(boards);
 
-	return 0;
+	return ret;
 }
 
 int main(int argc, char **argv)
 {
-	struct p3udl_cntx cntx;
+	struct cmdline cmd = { 0 };
 
-	cntx.log_cb = log_printf;
+	struct p3udl_session *session = p3udl_session_new(NULL);
+	if (!session) {
+		printf("Can't create a session\n");
+		return -ENOMEM;
+	}
 
-	int ret = parse_cmdline(argc, argv, &cntx);
+	int ret = parse_cmdline(argc, argv, session, &cmd);
 	if (ret)
-		return ret;
+		goto out_free_session;
 
-	ret = usb_libusbinit(&cntx);
-	if (ret)
-		return ret;
+	/* Boards log into rings that this formats in the background, without it they print as they go */
+	if (p3udl_log_start(cmd.log_failed))
+		printf("Can't start the log thread, logging synchronously\n");
 
-	ret = usb_probe(&cntx);
+	ret = p3udl_metrics_start(session, cmd.metrics_socket, cmd.metrics_file);
 	if (ret)
-		goto out_deinit;
+		goto out_stop_log;
 
-	ret = usb_setup(&cntx);
-	if (ret)
-		goto out_close;
+	if (cmd.slots) {
+		ret = p3udl_session_load_slots(session, cmd.slots);
+		if (ret)
+			goto out_stop_metrics;
+	}
 
-	ret = scsi_probe(&cntx);
-	if (ret)
-		goto out_close;
+	if (cmd.manifest) {
+		ret = p3udl_session_load_manifest(session, cmd.manifest);
+		if (ret)
+			goto out_stop_metrics;
+	}
 
-	ret = upload_ipl(&cntx);
-	if (ret)
-		goto out_close;
+	if (cmd.dfu) {
+		ret = p3udl_session_load_dfu(session, cmd.dfu);
+		if (ret)
+			goto out_stop_metrics;
+	}
+
+	if (cmd.ums) {
+		ret = p3udl_session_load_ums(session, cmd.ums);
+		if (ret)
+			goto out_stop_metrics;
+	}
 
-	ret = upload_uboot(&cntx);
+	ret = p3udl_session_load(session);
 	if (ret)
-		goto out_close;
+		goto out_stop_metrics;
 
-out_close:
-	libusb_close(cntx.lu_handle);
-out_deinit:
-	libusb_exit(cntx.lu_cntx);
+	if (cmd.plan) {
+		ret = p3udl_session_print_plan(session, stdout);
+		goto out_stop_metrics;
+	}
 
-	return 0;
+	if (cmd.station) {
+		p3udl_session_set_report(session, cmd.report_out);
+		ret = p3udl_session_run_station(session);
+	} else
+		ret = flash_connected(session, &cmd);
+
+	p3udl_session_log_summary(session);
+out_stop_metrics:
+	p3udl_metrics_stop();
+out_stop_log:
+	p3udl_log_stop();
+out_free_session:
+	p3udl_session_free(session);
+
+	return ret;
 }
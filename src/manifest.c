@@ -0,0 +1,299 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Images to load into RAM through the usb updater before u-boot, so a
+ * RAM boot doesn't need a second pass through u-boot and dfu-util.
+ *
+ * The manifest is a text file with one image per line:
+ *
+ *   # path          load address
+ *   uImage
+ *   board.dtb       0x21f00000
+ *   rootfs.cpio.gz  0x22000000
+ *
+ * Relative paths are relative to the manifest. The address can be left
+ * out for images with a legacy u-boot header, they are then placed so the
+ * payload lands on ih_load and bootm doesn't have to move it.
+ *
+ * With --compress images with a legacy header and an address that is
+ * clear of ih_load are sent LZ4 compressed for bootm to unpack.
+ *
+ * A DFU manifest has the same layout but the second column is the name
+ * of the DFU alt setting to send the image to, as in u-boot's dfu_alt_info:
+ *
+ *   u-boot.img  u-boot
+ *   uImage      kernel
+ *
+ * For u-boot's mass storage gadget the second column is the byte offset
+ * on the disk to write the image at, 0 if it is left out:
+ *
+ *   boot.img    0x100000
+ *   rootfs.img  0x2100000
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cntx.h"
+#include "compress.h"
+#include "manifest.h"
+#include "uboot.h"
+
+#include "manifest_log.h"
+
+/* Only worth it if it saves at least this fraction of the image */
+#define MANIFEST_COMPRESS_MIN_SAVING	16
+
+static void manifest_compress(struct p3udl_cntx *cntx, struct manifest_entry *entry,
+		const struct p3udl_image *image)
+{
+	const struct legacy_img_hdr *hdr = image->data;
+	uint32_t load = ntohl(hdr->ih_load);
+	uint32_t size = ntohl(hdr->ih_size);
+
+	if (hdr->ih_comp != IH_COMP_NONE) {
+		manifest_dbg(cntx, "%s is already compressed\n", entry->path);
+		return;
+	}
+
+	/* bootm won't unpack over itself */
+	if (entry->from_header) {
+		manifest_info(cntx, "%s: not compressing, needs a load address clear of 0x%08x - 0x%08x\n",
+				entry->path, load, load + size);
+		return;
+	}
+
+	/* Anything going wrong here just means the image goes as it is */
+	if (compress_legacy(cntx, image, &entry->packed))
+		return;
+
+	if (entry->packed.len > image->size - (image->size / MANIFEST_COMPRESS_MIN_SAVING)) {
+		manifest_info(cntx, "%s: not compressing, only gets to %zu bytes\n", entry->path,
+				entry->packed.len);
+		image_free(&entry->packed);
+		return;
+	}
+
+	if (entry->addr < (uint64_t) load + size && load < (uint64_t) entry->addr + entry->packed.len) {
+		manifest_info(cntx, "%s: not compressing, 0x%08x overlaps 0x%08x - 0x%08x\n",
+				entry->path, entry->addr, load, load + size);
+		image_free(&entry->packed);
+		return;
+	}
+
+	manifest_info(cntx, "%s: compressed %zu -> %zu bytes (%.1f%%)\n", entry->path, image->size,
+			entry->packed.len, (entry->packed.len * 100.0) / image->size);
+}
+
+/* Runs on the image's loader thread, nothing looks at the entry until it's done */
+static int manifest_check(struct p3udl_cntx *cntx, const struct p3udl_image *image, void *priv)
+{
+	struct manifest_entry *entry = priv;
+	const struct legacy_img_hdr *hdr = image->data;
+
+	if (image->size < sizeof(*hdr) || ntohl(hdr->ih_magic) != IH_MAGIC) {
+		if (entry->from_header) {
+			manifest_err(cntx, "%s has no load address and no u-boot header to get one from\n",
+					entry->path);
+			return -EINVAL;
+		}
+
+		manifest_info(cntx, "%s: %zu bytes at 0x%08x\n", entry->path, image->size, entry->addr);
+		return 0;
+	}
+
+	uint32_t load = ntohl(hdr->ih_load);
+	uint32_t size = ntohl(hdr->ih_size);
+
+	if (size > image->size - sizeof(*hdr)) {
+		manifest_err(cntx, "%s is truncated, header says %u bytes of data but there are only %zu\n",
+				entry->path, size, image->size - sizeof(*hdr));
+		return -EINVAL;
+	}
+
+	if (entry->from_header)
+		entry->addr = load - sizeof(*hdr);
+
+	manifest_info(cntx, "%s: \"%.*s\", %u bytes for 0x%08x, loading at 0x%08x\n",
+			entry->path, IH_NMLEN, (const char *) hdr->ih_name, size, load, entry->addr);
+
+	if (cntx->compress)
+		manifest_compress(cntx, entry, image);
+
+	return 0;
+}
+
+static int manifest_add(struct p3udl_cntx *cntx, struct manifest *manifest, const char *dir,
+		const char *file, const char *arg)
+{
+	struct manifest_entry *tmp = realloc(manifest->entries, (manifest->count + 1) * sizeof(*tmp));
+
+	if (!tmp)
+		return -ENOMEM;
+	manifest->entries = tmp;
+
+	struct manifest_entry *entry = &manifest->entries[manifest->count];
+
+	memset(entry, 0, sizeof(*entry));
+
+	if (*file == '/' || !dir)
+		entry->path = strdup(file);
+	else if (asprintf(&entry->path, "%s/%s", dir, file) < 0)
+		entry->path = NULL;
+	if (!entry->path)
+		return -ENOMEM;
+
+	if (manifest->type == MANIFEST_DFU) {
+		entry->target = arg ? strdup(arg) : NULL;
+		if (!entry->target) {
+			free(entry->path);
+			return arg ? -ENOMEM : -EINVAL;
+		}
+	}
+	else if (arg) {
+		char *end;
+
+		errno = 0;
+		unsigned long long v = strtoull(arg, &end, 0);
+		if (errno || *end || *arg == '-' || (manifest->type == MANIFEST_RAM && v > UINT32_MAX)) {
+			free(entry->path);
+			return -EINVAL;
+		}
+		if (manifest->type == MANIFEST_UMS)
+			entry->offset = v;
+		else
+			entry->addr = v;
+	}
+	else if (manifest->type == MANIFEST_RAM)
+		entry->from_header = true;
+
+	manifest->count++;
+
+	return 0;
+}
+
+/* An image handed over in memory, arg is what would be in the second column of a manifest */
+int manifest_add_image(struct p3udl_cntx *cntx, struct manifest *manifest, const char *name,
+		const char *arg, const void *buf, size_t len)
+{
+	int ret = manifest_add(cntx, manifest, NULL, name, arg);
+	if (ret)
+		return ret;
+
+	struct manifest_entry *entry = &manifest->entries[manifest->count - 1];
+
+	ret = image_copy(cntx, buf, len, 0, &entry->loader.image);
+	if (ret) {
+		free(entry->path);
+		free(entry->target);
+		manifest->count--;
+	}
+
+	return ret;
+}
+
+/* Parse the manifest, manifest_start() then loads everything in it */
+int manifest_load(struct p3udl_cntx *cntx, const char *path, enum manifest_type type,
+		struct manifest *manifest)
+{
+	char line[1024], *copy, *dir;
+	unsigned int lineno = 0;
+	int ret = 0;
+
+	memset(manifest, 0, sizeof(*manifest));
+	manifest->type = type;
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		ret = -errno;
+		manifest_err(cntx, "Can't open %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	copy = strdup(path);
+	dir = copy ? dirname(copy) : NULL;
+
+	while (fgets(line, sizeof(line), f)) {
+		char *save, *file, *arg, *extra;
+
+		lineno++;
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		file = strtok_r(line, " \t\r\n", &save);
+		if (!file)
+			continue;
+		arg = strtok_r(NULL, " \t\r\n", &save);
+		extra = strtok_r(NULL, " \t\r\n", &save);
+
+		ret = extra ? -EINVAL : manifest_add(cntx, manifest, dir, file, arg);
+		if (ret) {
+			manifest_err(cntx, "%s:%u: can't make sense of this line\n", path, lineno);
+			break;
+		}
+	}
+
+	free(copy);
+	fclose(f);
+
+	if (ret)
+		goto err;
+
+	if (!manifest->count) {
+		manifest_err(cntx, "%s doesn't list any images\n", path);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	manifest_free(manifest);
+	return ret;
+}
+
+/* Nothing can be added once this has been called, the loaders point into the entries */
+int manifest_start(struct p3udl_cntx *cntx, struct manifest *manifest)
+{
+	for (int i = 0; i < manifest->count; i++) {
+		struct manifest_entry *entry = &manifest->entries[i];
+
+		entry->loader.cntx = cntx;
+		entry->loader.path = entry->path;
+		/* DFU and UMS images go wherever the manifest says, nothing to work out */
+		if (manifest->type == MANIFEST_RAM) {
+			entry->loader.check = manifest_check;
+			entry->loader.priv = entry;
+		}
+
+		int ret = image_loader_start(&entry->loader);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+void manifest_free(struct manifest *manifest)
+{
+	for (int i = 0; i < manifest->count; i++) {
+		struct manifest_entry *entry = &manifest->entries[i];
+
+		if (entry->loader.cntx)
+			image_loader_free(&entry->loader);
+		else
+			image_free(&entry->loader.image);
+		image_free(&entry->packed);
+		free(entry->path);
+		free(entry->target);
+	}
+
+	free(manifest->entries);
+	manifest->entries = NULL;
+	manifest->count = 0;
+}
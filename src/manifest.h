@@ -0,0 +1,51 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __MANIFEST_H_
+#define __MANIFEST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "image.h"
+
+struct p3udl_cntx;
+
+enum manifest_type {
+	/* images for the usb updater to put in RAM */
+	MANIFEST_RAM,
+	/* images for u-boot's DFU gadget to write out */
+	MANIFEST_DFU,
+	/* images to write to the disk u-boot's mass storage gadget shows */
+	MANIFEST_UMS,
+};
+
+struct manifest_entry {
+	char *path;
+	/* where the usb updater should put the image */
+	uint32_t addr;
+	/* no address in the manifest, addr is filled in from the legacy header once loaded */
+	bool from_header;
+	/* DFU alt setting name the image goes to */
+	char *target;
+	/* bytes into the mass storage gadget's disk */
+	uint64_t offset;
+	struct image_loader loader;
+	/* what actually gets sent if the image was worth compressing, data is NULL otherwise */
+	struct p3udl_image packed;
+};
+
+struct manifest {
+	enum manifest_type type;
+	struct manifest_entry *entries;
+	unsigned int count;
+};
+
+int manifest_load(struct p3udl_cntx *cntx, const char *path, enum manifest_type type,
+		struct manifest *manifest);
+int manifest_add_image(struct p3udl_cntx *cntx, struct manifest *manifest, const char *name,
+		const char *arg, const void *buf, size_t len);
+int manifest_start(struct p3udl_cntx *cntx, struct manifest *manifest);
+void manifest_free(struct manifest *manifest);
+
+#endif /* __MANIFEST_H_ */
@@ -0,0 +1,408 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Counters are plain uint64_ts bumped with relaxed atomics from wherever
+ * the thing happens, nothing in a board thread takes a lock for them.
+ * A thread serves the Prometheus text format to anything that connects
+ * to a Unix socket and/or rewrites a file for node_exporter's textfile
+ * collector every so often.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "board.h"
+#include "clock.h"
+#include "cntx.h"
+#include "metrics.h"
+
+#include "metrics_log.h"
+
+/* Boards being flashed at once that get their own throughput */
+#define METRICS_PORTS		64
+/* How often the textfile collector's file is rewritten */
+#define METRICS_FILE_INTERVAL_MS	10000
+/* Don't let a scraper that stopped reading hold things up */
+#define METRICS_SEND_TIMEOUT_MS	1000
+
+static const uint64_t phase_buckets_ms[] = {
+	1, 5, 10, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000, 60000,
+};
+#define METRICS_BUCKETS	(sizeof(phase_buckets_ms) / sizeof(phase_buckets_ms[0]))
+
+static const char * const metric_names[] = {
+	[METRIC_BYTES] = "bytes_sent",
+	[METRIC_RETRIES] = "retries",
+	[METRIC_TIMEOUTS] = "timeouts",
+	[METRIC_STALLS] = "stalls",
+	[METRIC_CLEAR_HALTS] = "clear_halts",
+	[METRIC_RECOVERIES] = "recoveries",
+	[METRIC_RESTARTS] = "restarts",
+};
+
+static const char * const metric_help[] = {
+	[METRIC_BYTES] = "Bytes sent to boards.",
+	[METRIC_RETRIES] = "Segments sent again after a timeout or stall.",
+	[METRIC_TIMEOUTS] = "Transfers that timed out.",
+	[METRIC_STALLS] = "Bulk transfers the device answered with a STALL.",
+	[METRIC_CLEAR_HALTS] = "Endpoint halts cleared.",
+	[METRIC_RECOVERIES] = "Mass storage reset recoveries.",
+	[METRIC_RESTARTS] = "Images sent again from the start.",
+};
+
+uint64_t metrics_counters[METRIC_MAX];
+
+static uint64_t boards_passed;
+static uint64_t boards_failed[BOARD_STAGES];
+/* not cumulative, the last bucket is everything past the biggest bound */
+static uint64_t phase_hist[REPORT_PHASE_MAX][METRICS_BUCKETS + 1];
+static uint64_t phase_ns[REPORT_PHASE_MAX];
+
+static struct metrics_port ports[METRICS_PORTS];
+
+static struct {
+	struct p3udl_cntx *cntx;
+	pthread_t thread;
+	bool running;
+	int stop[2];
+	int listen_fd;
+	char *file_path;
+	char *socket_path;
+} exporter = {
+	.listen_fd = -1,
+	.stop = { -1, -1 },
+};
+
+static uint64_t metrics_get(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void metrics_phase(enum report_phase phase, uint64_t ns)
+{
+	int bucket = 0;
+
+	while (bucket < METRICS_BUCKETS && ns > phase_buckets_ms[bucket] * NSEC_PER_MSEC)
+		bucket++;
+
+	__atomic_fetch_add(&phase_hist[phase][bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&phase_ns[phase], ns, __ATOMIC_RELAXED);
+}
+
+/* Take a port slot, if they're all in use the board just doesn't get one */
+void metrics_board_start(struct p3udl_cntx *cntx)
+{
+	if (cntx->metrics_port)
+		return;
+
+	for (int i = 0; i < METRICS_PORTS; i++) {
+		struct metrics_port *port = &ports[i];
+		bool unused = false;
+
+		if (!__atomic_compare_exchange_n(&port->used, &unused, true, false,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+
+		__atomic_fetch_add(&port->seq, 1, __ATOMIC_ACQ_REL);
+		snprintf(port->port, sizeof(port->port), "%s", cntx->port);
+		snprintf(port->name, sizeof(port->name), "%s", cntx->name);
+		port->start_ns = clock_now_ns();
+		__atomic_store_n(&port->bytes, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&port->seq, 1, __ATOMIC_RELEASE);
+
+		cntx->metrics_port = port;
+		return;
+	}
+}
+
+void metrics_board_end(struct p3udl_cntx *cntx)
+{
+	struct metrics_port *port = cntx->metrics_port;
+
+	if (cntx->result)
+		__atomic_fetch_add(&boards_failed[cntx->stage], 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&boards_passed, 1, __ATOMIC_RELAXED);
+
+	/* A board's whole time in a phase, however many goes it took */
+	for (int i = 0; i < REPORT_PHASE_MAX; i++) {
+		if (cntx->report.phase_ns[i])
+			metrics_phase(i, cntx->report.phase_ns[i]);
+	}
+
+	if (!port)
+		return;
+
+	__atomic_store_n(&port->used, false, __ATOMIC_RELEASE);
+	cntx->metrics_port = NULL;
+}
+
+static void metrics_header(FILE *out, const char *name, const char *type, const char *help)
+{
+	fprintf(out, "# HELP p3udl_%s %s\n# TYPE p3udl_%s %s\n", name, help, name, type);
+}
+
+void metrics_write(FILE *out)
+{
+	uint64_t now = clock_now_ns();
+
+	metrics_header(out, "boards_flashed_total", "counter", "Boards that got u-boot running.");
+	fprintf(out, "p3udl_boards_flashed_total %llu\n", (unsigned long long) metrics_get(&boards_passed));
+
+	metrics_header(out, "boards_failed_total", "counter", "Boards that failed, by the stage they failed in.");
+	for (int i = 0; i < BOARD_STAGES; i++)
+		fprintf(out, "p3udl_boards_failed_total{stage=\"%s\"} %llu\n", board_stage_name(i),
+				(unsigned long long) metrics_get(&boards_failed[i]));
+
+	for (int i = 0; i < METRIC_MAX; i++) {
+		char name[48];
+
+		snprintf(name, sizeof(name), "%s_total", metric_names[i]);
+		metrics_header(out, name, "counter", metric_help[i]);
+		fprintf(out, "p3udl_%s %llu\n", name, (unsigned long long) metrics_get(&metrics_counters[i]));
+	}
+
+	metrics_header(out, "phase_seconds", "histogram", "Time boards spent in each phase.");
+	for (int i = 0; i < REPORT_PHASE_MAX; i++) {
+		const char *phase = report_phase_name(i);
+		uint64_t count = 0;
+
+		for (int b = 0; b <= METRICS_BUCKETS; b++) {
+			count += metrics_get(&phase_hist[i][b]);
+			if (b < METRICS_BUCKETS)
+				fprintf(out, "p3udl_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %llu\n", phase,
+						(double) phase_buckets_ms[b] / 1000, (unsigned long long) count);
+			else
+				fprintf(out, "p3udl_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase,
+						(unsigned long long) count);
+		}
+		fprintf(out, "p3udl_phase_seconds_sum{phase=\"%s\"} %.6f\n", phase,
+				(double) metrics_get(&phase_ns[i]) / NSEC_PER_SEC);
+		fprintf(out, "p3udl_phase_seconds_count{phase=\"%s\"} %llu\n", phase, (unsigned long long) count);
+	}
+
+	metrics_header(out, "port_mbps", "gauge", "MB/s of the board being flashed in each port since it started.");
+	for (int i = 0; i < METRICS_PORTS; i++) {
+		struct metrics_port *port = &ports[i];
+		char port_path[sizeof(port->port)], name[sizeof(port->name)];
+		uint32_t seq = __atomic_load_n(&port->seq, __ATOMIC_ACQUIRE);
+		uint64_t start;
+
+		if (!__atomic_load_n(&port->used, __ATOMIC_ACQUIRE) || (seq & 1))
+			continue;
+
+		memcpy(port_path, port->port, sizeof(port_path));
+		memcpy(name, port->name, sizeof(name));
+		start = port->start_ns;
+		if (__atomic_load_n(&port->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+		port_path[sizeof(port_path) - 1] = '\0';
+		name[sizeof(name) - 1] = '\0';
+
+		fprintf(out, "p3udl_port_mbps{port=\"%s\",board=\"%s\"} %.3f\n", port_path, name,
+				clock_mbps(__atomic_load_n(&port->bytes, __ATOMIC_RELAXED), now - start));
+	}
+}
+
+static void metrics_serve(int fd)
+{
+	struct timeval tv = {
+		.tv_sec = METRICS_SEND_TIMEOUT_MS / 1000,
+		.tv_usec = (METRICS_SEND_TIMEOUT_MS % 1000) * 1000,
+	};
+	char *text = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&text, &len);
+
+	if (!out)
+		return;
+	metrics_write(out);
+	fclose(out);
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	for (size_t sent = 0; sent < len;) {
+		ssize_t ret = send(fd, text + sent, len - sent, MSG_NOSIGNAL);
+
+		if (ret <= 0)
+			break;
+		sent += ret;
+	}
+
+	free(text);
+}
+
+/* Written next to it and renamed over it so the collector never sees half a file */
+static void metrics_write_file(const char *path)
+{
+	size_t len = strlen(path) + sizeof(".tmp");
+	char *tmp = malloc(len);
+	FILE *out;
+
+	if (!tmp)
+		return;
+
+	snprintf(tmp, len, "%s.tmp", path);
+	out = fopen(tmp, "w");
+	if (!out) {
+		metrics_warn(exporter.cntx, "Can't write metrics to %s: %s\n", tmp, strerror(errno));
+		goto out_free;
+	}
+
+	metrics_write(out);
+	if (fclose(out) || rename(tmp, path)) {
+		metrics_warn(exporter.cntx, "Can't write metrics to %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+	}
+
+out_free:
+	free(tmp);
+}
+
+static void *metrics_thread(void *data)
+{
+	uint64_t next_file = clock_now_ns();
+
+	for (;;) {
+		struct pollfd fds[2] = {
+			{ .fd = exporter.stop[0], .events = POLLIN },
+			{ .fd = exporter.listen_fd, .events = POLLIN },
+		};
+		uint64_t now = clock_now_ns();
+
+		if (exporter.file_path && now >= next_file) {
+			metrics_write_file(exporter.file_path);
+			next_file = now + (METRICS_FILE_INTERVAL_MS * NSEC_PER_MSEC);
+		}
+
+		int timeout = exporter.file_path ? (next_file - now) / NSEC_PER_MSEC + 1 : -1;
+
+		if (poll(fds, exporter.listen_fd >= 0 ? 2 : 1, timeout) < 0 && errno != EINTR)
+			break;
+
+		if (fds[0].revents)
+			break;
+
+		if (fds[1].revents & POLLIN) {
+			int fd = accept(exporter.listen_fd, NULL, NULL);
+
+			if (fd >= 0) {
+				metrics_serve(fd);
+				close(fd);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int metrics_listen(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	/* A socket that is already there is left over from the last run, anything else isn't ours */
+	struct stat st;
+
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode))
+			return -EEXIST;
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, 4)) {
+		int ret = -errno;
+
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+int metrics_start(struct p3udl_cntx *cntx, const char *socket_path, const char *file_path)
+{
+	int ret;
+
+	if (!socket_path && !file_path)
+		return 0;
+
+	exporter.cntx = cntx;
+
+	if (socket_path) {
+		exporter.listen_fd = metrics_listen(socket_path);
+		if (exporter.listen_fd < 0) {
+			ret = exporter.listen_fd;
+			metrics_err(cntx, "Can't listen on %s: %s\n", socket_path, strerror(-ret));
+			return ret;
+		}
+		exporter.socket_path = strdup(socket_path);
+	}
+
+	if (file_path)
+		exporter.file_path = strdup(file_path);
+
+	if (pipe(exporter.stop)) {
+		ret = -errno;
+		goto err_close;
+	}
+
+	ret = pthread_create(&exporter.thread, NULL, metrics_thread, NULL);
+	if (ret) {
+		ret = -ret;
+		goto err_close;
+	}
+	exporter.running = true;
+
+	return 0;
+
+err_close:
+	metrics_err(cntx, "Can't start the metrics thread: %s\n", strerror(-ret));
+	metrics_stop();
+	return ret;
+}
+
+/* The file gets written one last time so it has the final totals */
+void metrics_stop(void)
+{
+	if (exporter.running) {
+		if (write(exporter.stop[1], "", 1) == 1)
+			pthread_join(exporter.thread, NULL);
+		exporter.running = false;
+	}
+
+	if (exporter.file_path)
+		metrics_write_file(exporter.file_path);
+
+	for (int i = 0; i < 2; i++) {
+		if (exporter.stop[i] >= 0)
+			close(exporter.stop[i]);
+		exporter.stop[i] = -1;
+	}
+
+	if (exporter.listen_fd >= 0) {
+		close(exporter.listen_fd);
+		unlink(exporter.socket_path);
+		exporter.listen_fd = -1;
+	}
+
+	free(exporter.socket_path);
+	free(exporter.file_path);
+	exporter.socket_path = NULL;
+	exporter.file_path = NULL;
+}
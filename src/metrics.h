@@ -0,0 +1,68 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Totals over every board this process has flashed, for a station
+ * to be watched with Prometheus. Board threads only ever do relaxed
+ * atomic adds, the text is put together when someone asks for it.
+ */
+
+#ifndef __METRICS_H_
+#define __METRICS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "report.h"
+
+struct p3udl_cntx;
+
+enum metric {
+	METRIC_BYTES,
+	METRIC_RETRIES,
+	METRIC_TIMEOUTS,
+	METRIC_STALLS,
+	METRIC_CLEAR_HALTS,
+	METRIC_RECOVERIES,
+	METRIC_RESTARTS,
+	METRIC_MAX,
+};
+
+/* A board that is being flashed right now, for per port throughput */
+struct metrics_port {
+	/* odd while the strings are being changed */
+	uint32_t seq;
+	bool used;
+	char port[32];
+	char name[32];
+	uint64_t start_ns;
+	uint64_t bytes;
+};
+
+extern uint64_t metrics_counters[METRIC_MAX];
+
+static inline void metrics_add(enum metric metric, uint64_t n)
+{
+	__atomic_fetch_add(&metrics_counters[metric], n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_inc(enum metric metric)
+{
+	metrics_add(metric, 1);
+}
+
+/* Bytes that went to a board, counted against its port too */
+static inline void metrics_bytes(struct metrics_port *port, uint64_t n)
+{
+	metrics_add(METRIC_BYTES, n);
+	if (port)
+		__atomic_fetch_add(&port->bytes, n, __ATOMIC_RELAXED);
+}
+
+void metrics_board_start(struct p3udl_cntx *cntx);
+void metrics_board_end(struct p3udl_cntx *cntx);
+void metrics_write(FILE *out);
+
+int metrics_start(struct p3udl_cntx *cntx, const char *socket_path, const char *file_path);
+void metrics_stop(void);
+
+#endif /* __METRICS_H_ */
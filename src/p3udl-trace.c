@@ -0,0 +1,491 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Looks at traces written by p3udl --trace. Lists them, sums up how
+ * long things took per board, or turns them into a pcap that
+ * wireshark reads as if usbmon had captured it.
+ */
+
+#include <argtable2.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "clock.h"
+#include "trace.h"
+
+#define PCAP_MAGIC_NSEC			0xa1b23c4d
+#define LINKTYPE_USB_LINUX_MMAPPED	220
+
+struct pcap_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_record {
+	uint32_t ts_sec;
+	uint32_t ts_nsec;
+	uint32_t caplen;
+	uint32_t len;
+};
+
+/* What the kernel's usbmon hands out through its binary interface */
+struct usbmon_header {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[8];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+enum usbmon_xfer_type {
+	USBMON_ISO,
+	USBMON_INTERRUPT,
+	USBMON_CONTROL,
+	USBMON_BULK,
+};
+
+struct trace_board {
+	char name[32];
+	uint8_t bus;
+	/* count, total and worst per record type */
+	uint64_t count[TRACE_CLOSE + 1];
+	uint64_t total_ns[TRACE_CLOSE + 1];
+	uint64_t max_ns[TRACE_CLOSE + 1];
+	uint64_t bytes;
+	uint64_t records, first_ns, last_ns;
+};
+
+/* One half of a transfer as usbmon would have seen it */
+struct trace_event {
+	uint64_t ns;
+	uint64_t seq;
+	struct usbmon_header hdr;
+	const uint8_t *data;
+};
+
+struct trace_events {
+	struct trace_event *events;
+	size_t count, size;
+};
+
+static int usbmon_xfer_type(uint8_t libusb_type)
+{
+	switch (libusb_type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		return USBMON_CONTROL;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return USBMON_ISO;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return USBMON_INTERRUPT;
+	default:
+		return USBMON_BULK;
+	}
+}
+
+/* usbmon has the kernel's errno where libusb has its own codes */
+static int32_t usbmon_status(const struct trace_record *rec)
+{
+	if (rec->type == TRACE_COMPLETE) {
+		switch (rec->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return -ETIMEDOUT;
+		case LIBUSB_TRANSFER_STALL:
+			return -EPIPE;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return -ENOENT;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return -ENODEV;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return -EOVERFLOW;
+		default:
+			return -EPROTO;
+		}
+	}
+
+	switch (rec->status) {
+	case LIBUSB_SUCCESS:
+		return 0;
+	case LIBUSB_ERROR_TIMEOUT:
+		return -ETIMEDOUT;
+	case LIBUSB_ERROR_PIPE:
+		return -EPIPE;
+	case LIBUSB_ERROR_OVERFLOW:
+		return -EOVERFLOW;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -ENODEV;
+	case LIBUSB_ERROR_IO:
+		return -EIO;
+	default:
+		return -EPROTO;
+	}
+}
+
+static int trace_event_add(struct trace_events *events, uint64_t ns, const struct usbmon_header *hdr,
+		const uint8_t *data)
+{
+	if (events->count == events->size) {
+		size_t size = events->size ? events->size * 2 : 1024;
+		struct trace_event *more = realloc(events->events, size * sizeof(*more));
+
+		if (!more)
+			return -ENOMEM;
+		events->events = more;
+		events->size = size;
+	}
+
+	struct trace_event *event = &events->events[events->count];
+
+	event->ns = ns;
+	event->seq = events->count++;
+	event->hdr = *hdr;
+	event->data = data;
+
+	return 0;
+}
+
+static int trace_event_cmp(const void *a, const void *b)
+{
+	const struct trace_event *ea = a, *eb = b;
+
+	if (ea->ns != eb->ns)
+		return ea->ns < eb->ns ? -1 : 1;
+
+	return ea->seq < eb->seq ? -1 : (ea->seq > eb->seq);
+}
+
+/*
+ * Turn a record into the submission and completion usbmon would have
+ * logged. Clearing halts and picking altsettings are standard requests
+ * so they get made up, setting up and reconnecting aren't on the wire.
+ */
+static int trace_to_usbmon(struct trace_events *events, const struct trace_record *rec,
+		const uint8_t *data, uint64_t seq, uint8_t bus)
+{
+	struct usbmon_header hdr = {
+		.id = seq,
+		.xfer_type = usbmon_xfer_type(rec->xfer_type),
+		.epnum = rec->endpoint,
+		.devnum = rec->board + 1,
+		.busnum = bus,
+	};
+	bool in = rec->endpoint & LIBUSB_ENDPOINT_IN, submit = true, complete = true;
+	int ret;
+
+	switch (rec->type) {
+	case TRACE_BULK:
+	case TRACE_CONTROL:
+		break;
+	case TRACE_CLEAR_HALT:
+		hdr.xfer_type = USBMON_CONTROL;
+		hdr.epnum = 0;
+		memcpy(hdr.setup, (uint8_t []) { LIBUSB_RECIPIENT_ENDPOINT, LIBUSB_REQUEST_CLEAR_FEATURE,
+				0, 0, rec->endpoint, 0, 0, 0 }, sizeof(hdr.setup));
+		in = false;
+		break;
+	case TRACE_ALTSETTING:
+		hdr.xfer_type = USBMON_CONTROL;
+		memcpy(hdr.setup, rec->setup, sizeof(hdr.setup));
+		hdr.setup[0] = LIBUSB_RECIPIENT_INTERFACE;
+		hdr.setup[1] = LIBUSB_REQUEST_SET_INTERFACE;
+		break;
+	case TRACE_SUBMIT:
+		hdr.id = ((uint64_t) 1 << 63) | rec->id;
+		complete = false;
+		break;
+	case TRACE_COMPLETE:
+		hdr.id = ((uint64_t) 1 << 63) | rec->id;
+		submit = false;
+		break;
+	default:
+		return 0;
+	}
+
+	if (hdr.xfer_type == USBMON_CONTROL && rec->type != TRACE_CLEAR_HALT && rec->type != TRACE_ALTSETTING)
+		memcpy(hdr.setup, rec->setup, sizeof(hdr.setup));
+
+	if (submit) {
+		struct usbmon_header s = hdr;
+		bool out_data = !in && rec->caplen;
+
+		s.type = 'S';
+		s.flag_setup = s.xfer_type == USBMON_CONTROL ? 0 : '-';
+		s.flag_data = out_data ? 0 : (in ? '<' : '>');
+		s.status = -EINPROGRESS;
+		s.length = rec->length;
+		s.len_cap = out_data ? rec->caplen : 0;
+
+		ret = trace_event_add(events, rec->ns, &s, out_data ? data : NULL);
+		if (ret)
+			return ret;
+	}
+
+	if (complete) {
+		struct usbmon_header c = hdr;
+		bool in_data = in && rec->caplen;
+
+		c.type = 'C';
+		c.flag_setup = '-';
+		c.flag_data = in_data ? 0 : '>';
+		c.status = usbmon_status(rec);
+		c.length = rec->actual;
+		c.len_cap = in_data ? rec->caplen : 0;
+		memset(c.setup, 0, sizeof(c.setup));
+
+		ret = trace_event_add(events, rec->ns + rec->duration_ns, &c, in_data ? data : NULL);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int trace_write_pcap(const char *path, const struct trace_header *th,
+		struct trace_events *events)
+{
+	struct pcap_header hdr = {
+		.magic = PCAP_MAGIC_NSEC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = 0x40000,
+		.linktype = LINKTYPE_USB_LINUX_MMAPPED,
+	};
+	FILE *f = fopen(path, "wb");
+	int ret = 0;
+
+	if (!f)
+		return -errno;
+
+	qsort(events->events, events->count, sizeof(*events->events), trace_event_cmp);
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		ret = -EIO;
+
+	for (size_t i = 0; !ret && i < events->count; i++) {
+		struct trace_event *event = &events->events[i];
+		uint64_t ns = th->start_ns + event->ns;
+		uint32_t data_len = event->hdr.len_cap;
+		struct pcap_record rec;
+
+		event->hdr.ts_sec = ns / NSEC_PER_SEC;
+		event->hdr.ts_usec = (ns % NSEC_PER_SEC) / NSEC_PER_USEC;
+
+		rec.ts_sec = ns / NSEC_PER_SEC;
+		rec.ts_nsec = ns % NSEC_PER_SEC;
+		rec.caplen = sizeof(event->hdr) + data_len;
+		rec.len = sizeof(event->hdr) + data_len;
+
+		if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+				fwrite(&event->hdr, sizeof(event->hdr), 1, f) != 1 ||
+				(data_len && fwrite(event->data, data_len, 1, f) != 1))
+			ret = -EIO;
+	}
+
+	if (fclose(f) && !ret)
+		ret = -EIO;
+
+	return ret;
+}
+
+static void trace_print(const struct trace_record *rec, const struct trace_board *board)
+{
+	printf("%12.6f %-12s %-10s ep 0x%02x len %-7u actual %-7u status %-3d %10.3f ms",
+			(double) rec->ns / NSEC_PER_SEC, board ? board->name : "?",
+			trace_type_name(rec->type), rec->endpoint, rec->length, rec->actual,
+			rec->status, (double) rec->duration_ns / NSEC_PER_MSEC);
+	if (rec->type == TRACE_CONTROL || (rec->type == TRACE_SUBMIT && rec->xfer_type == LIBUSB_TRANSFER_TYPE_CONTROL))
+		printf(" setup %02x %02x %02x%02x %02x%02x %02x%02x", rec->setup[0], rec->setup[1],
+				rec->setup[3], rec->setup[2], rec->setup[5], rec->setup[4],
+				rec->setup[7], rec->setup[6]);
+	printf("\n");
+}
+
+static void trace_account(struct trace_board *board, const struct trace_record *rec)
+{
+	uint64_t end = rec->ns + rec->duration_ns;
+
+	if (!board->records++)
+		board->first_ns = rec->ns;
+	if (end > board->last_ns)
+		board->last_ns = end;
+
+	board->count[rec->type]++;
+	board->total_ns[rec->type] += rec->duration_ns;
+	if (rec->duration_ns > board->max_ns[rec->type])
+		board->max_ns[rec->type] = rec->duration_ns;
+	if (rec->type == TRACE_BULK || rec->type == TRACE_CONTROL || rec->type == TRACE_COMPLETE)
+		board->bytes += rec->actual;
+}
+
+static void trace_summary(const struct trace_board *boards, int nboards)
+{
+	/* Submits only say how long handing them over took, completions have the latency */
+	static const uint8_t types[] = {
+		TRACE_BULK, TRACE_CONTROL, TRACE_COMPLETE, TRACE_CLEAR_HALT, TRACE_RECONNECT,
+	};
+
+	for (int i = 0; i < nboards; i++) {
+		const struct trace_board *board = &boards[i];
+		uint64_t span = board->last_ns - board->first_ns;
+
+		printf("%s: %llu bytes in %.3f s, %.2f MB/s\n", board->name,
+				(unsigned long long) board->bytes, (double) span / NSEC_PER_SEC,
+				clock_mbps(board->bytes, span));
+
+		for (int t = 0; t < sizeof(types); t++) {
+			uint8_t type = types[t];
+
+			if (!board->count[type])
+				continue;
+
+			printf("  %-10s %8llu, mean %9.3f ms, max %9.3f ms\n", trace_type_name(type),
+					(unsigned long long) board->count[type],
+					(double) board->total_ns[type] / board->count[type] / NSEC_PER_MSEC,
+					(double) board->max_ns[type] / NSEC_PER_MSEC);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct arg_lit *help, *list, *summary;
+	struct arg_file *pcap, *trace_file;
+	struct arg_end *end;
+
+	void *argtable[] = {
+			help = arg_lit0("h", "help", "Display this help text"),
+			/* one line per record */
+			list = arg_lit0(NULL, "list", "Print every record in the trace"),
+			/* where the time went */
+			summary = arg_lit0(NULL, "summary", "Print per board latency and throughput"),
+			/* for wireshark */
+			pcap = arg_file0(NULL, "pcap", "<file path>", "Write the USB traffic as a usbmon pcap"),
+			trace_file = arg_file1(NULL, NULL, "<trace>", "Trace written by p3udl --trace"),
+			end = arg_end(1),
+	};
+
+	int ret = arg_parse(argc, argv, argtable);
+
+	if (help->count > 0) {
+		arg_print_syntax(stdout, argtable, "\n");
+		arg_print_glossary(stdout, argtable, "  %-30s %s\n");
+		return 0;
+	}
+
+	if (ret) {
+		arg_print_errors(stdout, end, "p3udl-trace");
+		return 1;
+	}
+
+	struct trace_events events = { 0 };
+	struct trace_board *boards = NULL;
+	struct trace_header hdr;
+	struct trace_record rec;
+	uint8_t **datas = NULL;
+	size_t ndatas = 0;
+	int nboards = 0;
+	uint8_t *data;
+	FILE *f;
+
+	ret = trace_open(&f, trace_file->filename[0], &hdr);
+	if (ret) {
+		printf("Can't read trace %s: %s\n", trace_file->filename[0], strerror(-ret));
+		return 1;
+	}
+
+	while ((ret = trace_read(f, &rec, &data)) > 0) {
+		/* usbmon events point into the data so it has to stay around until the pcap is out */
+		if (data) {
+			uint8_t **more = realloc(datas, (ndatas + 1) * sizeof(*datas));
+
+			if (!more) {
+				free(data);
+				ret = -ENOMEM;
+				break;
+			}
+			datas = more;
+			datas[ndatas++] = data;
+		}
+
+		if (rec.type == TRACE_BOARD) {
+			struct trace_board *more = realloc(boards, (nboards + 1) * sizeof(*boards));
+
+			if (!more) {
+				ret = -ENOMEM;
+				break;
+			}
+			boards = more;
+			memset(&boards[nboards], 0, sizeof(*boards));
+			snprintf(boards[nboards].name, sizeof(boards[nboards].name), "%s", data ? (char *) data : "");
+			boards[nboards].bus = rec.endpoint;
+			nboards++;
+			continue;
+		}
+
+		struct trace_board *board = rec.board < nboards ? &boards[rec.board] : NULL;
+
+		if (list->count)
+			trace_print(&rec, board);
+
+		if (!board || rec.type > TRACE_CLOSE)
+			continue;
+
+		trace_account(board, &rec);
+
+		if (pcap->count) {
+			ret = trace_to_usbmon(&events, &rec, data, events.count, board->bus);
+			if (ret)
+				break;
+		}
+	}
+	fclose(f);
+
+	if (ret < 0)
+		printf("Trace is damaged or truncated: %s\n", strerror(-ret));
+
+	if (summary->count || (!list->count && !pcap->count))
+		trace_summary(boards, nboards);
+
+	if (pcap->count) {
+		int err = trace_write_pcap(pcap->filename[0], &hdr, &events);
+
+		if (err) {
+			printf("Can't write %s: %s\n", pcap->filename[0], strerror(-err));
+			ret = err;
+		}
+		else
+			printf("Wrote %zu usbmon events to %s\n", events.count, pcap->filename[0]);
+	}
+
+	for (size_t i = 0; i < ndatas; i++)
+		free(datas[i]);
+	free(datas);
+	free(events.events);
+	free(boards);
+	arg_freetable(argtable, sizeof(argtable) / sizeof(argtable[0]));
+
+	return ret < 0 ? 1 : 0;
+}
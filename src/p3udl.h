@@ -0,0 +1,204 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * libp3udl, for flashing boards from inside another program instead of
+ * running p3udl once per board.
+ *
+ * A session holds the images and options and one libusb context. It is
+ * set up once and then any number of boards are opened against it,
+ * by port path or with a handle the caller already has, and flashed
+ * either on the caller's thread or on a thread of their own.
+ *
+ * Everything returns 0 or a negative errno/libusb error. Only what is
+ * in this header is stable, nothing else the library exports is.
+ */
+
+#ifndef __P3UDL_H_
+#define __P3UDL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <libusb.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Bumped whenever something is added, nothing is ever taken away */
+#define P3UDL_API_VERSION	1
+
+/* The library is built with everything hidden apart from what is marked with this */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define P3UDL_API	__attribute__((visibility("default")))
+#else
+#define P3UDL_API
+#endif
+
+/* Where a board has got to, a failed board stays at the stage it failed in */
+enum p3udl_stage {
+	P3UDL_STAGE_PROBE,
+	P3UDL_STAGE_SETUP,
+	P3UDL_STAGE_SCSI,
+	P3UDL_STAGE_IPL,
+	P3UDL_STAGE_IMAGES,
+	P3UDL_STAGE_UBOOT,
+	P3UDL_STAGE_DFU,
+	P3UDL_STAGE_UMS,
+	P3UDL_STAGE_DONE,
+};
+
+enum p3udl_option {
+	/* commands kept in flight during uploads, 1 for synchronous, default 8 */
+	P3UDL_OPT_QUEUE_DEPTH,
+	/* usb updater segment size in bytes, 0 (the default) probes for it */
+	P3UDL_OPT_MAX_TRANSFER,
+	/* LZ4 compress images with u-boot headers for bootm to unpack */
+	P3UDL_OPT_COMPRESS,
+	/* send the IPL zero padded to 64KiB */
+	P3UDL_OPT_IPL_PAD,
+	/* uploads allowed at once on one USB bus, 0 (the default) for no limit */
+	P3UDL_OPT_PER_BUS,
+	/* leave boards with usb-storage and go through SG_IO */
+	P3UDL_OPT_SG,
+	/* read back UMS images' blocks and only write the ones that differ */
+	P3UDL_OPT_DELTA,
+	/* boards p3udl_session_open_all() makes up instead of looking on USB, 0 (the default) for none */
+	P3UDL_OPT_SIMULATE,
+};
+
+/* For p3udl_session_add_image(), take the address from the image's u-boot header */
+#define P3UDL_ADDR_FROM_HEADER	(1ULL << 32)
+
+struct p3udl_session;
+struct p3udl_board;
+
+/* Same as printf() apart from the level (0 error to 3 debug) and the part of p3udl that is talking */
+typedef int (*p3udl_log_fn)(int level, const char *tag, const char *format, ...);
+
+/*
+ * Called from whichever thread is flashing the board. sent and total
+ * are bytes for the whole board. sent counts everything that went out,
+ * the usb updater's load info and segments that were sent again too,
+ * so it ends up a little over total.
+ */
+typedef void (*p3udl_progress_fn)(struct p3udl_board *board, enum p3udl_stage stage,
+		uint64_t sent, uint64_t total, void *priv);
+/*
+ * The last thing that happens on the board's thread. A board that was
+ * started can't be closed from here, closing waits for the thread.
+ */
+typedef void (*p3udl_done_fn)(struct p3udl_board *board, int result, void *priv);
+
+/*
+ * usb can be a context the caller already uses, it has to outlive the
+ * session. NULL makes the session create its own the first time it
+ * needs one.
+ */
+P3UDL_API struct p3udl_session *p3udl_session_new(libusb_context *usb);
+P3UDL_API void p3udl_session_free(struct p3udl_session *session);
+
+P3UDL_API int p3udl_session_set(struct p3udl_session *session, enum p3udl_option option, long value);
+P3UDL_API void p3udl_session_set_log(struct p3udl_session *session, p3udl_log_fn log);
+
+/*
+ * Images from memory are copied, the caller's buffer can go as soon as
+ * these return. They can only be given before the session is loaded.
+ */
+P3UDL_API int p3udl_session_set_ipl(struct p3udl_session *session, const void *data, size_t len);
+P3UDL_API int p3udl_session_set_uboot(struct p3udl_session *session, const void *data, size_t len);
+/* Put in RAM by the usb updater before u-boot, name is only used in logs */
+P3UDL_API int p3udl_session_add_image(struct p3udl_session *session, const char *name, uint64_t addr,
+		const void *data, size_t len);
+/* Downloaded to the DFU alt setting called target once u-boot is up */
+P3UDL_API int p3udl_session_add_dfu(struct p3udl_session *session, const char *target,
+		const void *data, size_t len);
+/* Written offset bytes into the disk u-boot's mass storage gadget once it is up, instead of DFU */
+P3UDL_API int p3udl_session_add_ums(struct p3udl_session *session, const char *name, uint64_t offset,
+		const void *data, size_t len);
+
+/* The same from files, manifests are the ones p3udl's --manifest, --dfu and --ums take */
+P3UDL_API int p3udl_session_set_ipl_file(struct p3udl_session *session, const char *path);
+P3UDL_API int p3udl_session_set_uboot_file(struct p3udl_session *session, const char *path);
+P3UDL_API int p3udl_session_load_manifest(struct p3udl_session *session, const char *path);
+P3UDL_API int p3udl_session_load_dfu(struct p3udl_session *session, const char *path);
+P3UDL_API int p3udl_session_load_ums(struct p3udl_session *session, const char *path);
+
+/* p3udl's --slots file, p3udl_session_open_all() leaves boards in ports it doesn't list alone */
+P3UDL_API int p3udl_session_load_slots(struct p3udl_session *session, const char *path);
+/* How the boards P3UDL_OPT_SIMULATE makes up behave, the string p3udl's --sim-opts takes */
+P3UDL_API int p3udl_session_set_sim_opts(struct p3udl_session *session, const char *opts);
+/* Record every transfer for p3udl-trace and replaying, the trace is finished when the session is freed */
+P3UDL_API int p3udl_session_set_trace(struct p3udl_session *session, const char *path);
+/* p3udl_session_open_all() plays the boards in a trace back instead of looking on USB */
+P3UDL_API int p3udl_session_set_replay(struct p3udl_session *session, const char *path);
+/* Where p3udl_session_run_station() writes each board's JSON report, NULL (the default) for nowhere */
+P3UDL_API void p3udl_session_set_report(struct p3udl_session *session, FILE *out);
+
+/*
+ * Check and hash the images. Returns once the IPL is ready, the rest
+ * carry on in the background. The first board to be opened does this
+ * if the caller hasn't.
+ */
+P3UDL_API int p3udl_session_load(struct p3udl_session *session);
+
+/* The bytes, segments and time each stage should take, without touching USB */
+P3UDL_API int p3udl_session_print_plan(struct p3udl_session *session, FILE *out);
+
+/*
+ * Every board in USB boot mode the slot map wants, or the simulated or
+ * replayed ones. Boards that couldn't be opened are there too, flashing
+ * them fails with why. Returns how many, the caller closes the boards
+ * and frees the array.
+ */
+P3UDL_API int p3udl_session_open_all(struct p3udl_session *session, struct p3udl_board ***boards);
+/* Flash boards as they are plugged in until SIGINT or SIGTERM, -EIO if any of them failed */
+P3UDL_API int p3udl_session_run_station(struct p3udl_session *session);
+/* Log what each bus moved and how the image hash cache did */
+P3UDL_API void p3udl_session_log_summary(struct p3udl_session *session);
+
+/* port is "<bus>-<port>.<port>..." as in sysfs */
+P3UDL_API int p3udl_board_open_port(struct p3udl_session *session, const char *port,
+		struct p3udl_board **board);
+/* The handle has to be from the session's context, the board closes it */
+P3UDL_API int p3udl_board_open_handle(struct p3udl_session *session, libusb_device_handle *handle,
+		struct p3udl_board **board);
+P3UDL_API void p3udl_board_close(struct p3udl_board *board);
+
+P3UDL_API void p3udl_board_set_callbacks(struct p3udl_board *board, p3udl_progress_fn progress,
+		p3udl_done_fn done, void *priv);
+
+/* Flash the board on this thread */
+P3UDL_API int p3udl_board_flash(struct p3udl_board *board);
+/* Flash the board on a thread of its own, p3udl_board_wait() gets the result */
+P3UDL_API int p3udl_board_start(struct p3udl_board *board);
+P3UDL_API int p3udl_board_wait(struct p3udl_board *board);
+/*
+ * Stops the board at the next segment, or while it waits for its bus or
+ * to come back after re-enumerating. It then fails with -ECANCELED. Safe
+ * from any thread.
+ */
+P3UDL_API void p3udl_board_cancel(struct p3udl_board *board);
+
+P3UDL_API const char *p3udl_board_name(struct p3udl_board *board);
+P3UDL_API enum p3udl_stage p3udl_board_stage(struct p3udl_board *board);
+P3UDL_API const char *p3udl_stage_name(enum p3udl_stage stage);
+/* The same JSON object p3udl --report=json writes, once the board is done */
+P3UDL_API void p3udl_board_report_json(struct p3udl_board *board, FILE *out);
+
+/*
+ * Format the boards' logs on a thread of their own instead of printing
+ * them as they go, failed_only drops the logs of boards that pass.
+ */
+P3UDL_API int p3udl_log_start(int failed_only);
+P3UDL_API void p3udl_log_stop(void);
+
+/* Serve Prometheus metrics on a Unix socket and/or keep them in a file, either can be NULL */
+P3UDL_API int p3udl_metrics_start(struct p3udl_session *session, const char *socket_path,
+		const char *file_path);
+P3UDL_API void p3udl_metrics_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __P3UDL_H_ */
@@ -0,0 +1,231 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Works out what every stage is going to send, in what size segments
+ * and roughly how long it should take, from the images alone. The
+ * estimate uses the rates the tune cache has for this IPL.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "clock.h"
+#include "cntx.h"
+#include "manifest.h"
+#include "plan.h"
+#include "sstarscsi.h"
+#include "tune.h"
+#include "ums.h"
+
+static const char * const via_names[] = {
+	[PLAN_VIA_BOOTROM] = "boot ROM",
+	[PLAN_VIA_UPDATER] = "usb updater",
+	[PLAN_VIA_DFU] = "DFU",
+	[PLAN_VIA_UMS] = "UMS",
+};
+
+static const char * const via_rates[] = {
+	[PLAN_VIA_BOOTROM] = "bootrom",
+	[PLAN_VIA_UPDATER] = "updater",
+	[PLAN_VIA_DFU] = "dfu",
+	[PLAN_VIA_UMS] = "ums",
+};
+
+static void plan_segments(struct p3udl_cntx *cntx, struct plan_stage *stage)
+{
+	uint64_t rate;
+
+	if (stage->segsz) {
+		stage->segments = (stage->len + stage->segsz - 1) / stage->segsz;
+		stage->last = stage->len - ((stage->segments - 1) * stage->segsz);
+	}
+
+	if (!tune_get_rate(cntx, via_rates[stage->via], &rate))
+		stage->estimate_ns = clock_ns_at(stage->len, rate);
+}
+
+/*
+ * The zero padding after the IPL is only there for the boot ROMs that
+ * might want it, everything else gets the IPL up to the end of the
+ * segment it ends in.
+ */
+void plan_bootrom(struct p3udl_cntx *cntx, struct plan_stage *stage)
+{
+	const struct p3udl_image *ipl = &cntx->ipl;
+	size_t len = ipl->size ? ipl->size : 1;
+
+	len = (len + SSTARSCSI_BOOTROM_MAXTRANSFER - 1) & ~((size_t) SSTARSCSI_BOOTROM_MAXTRANSFER - 1);
+	if (cntx->ipl_pad || len > ipl->len)
+		len = ipl->len;
+
+	*stage = (struct plan_stage) {
+		.via = PLAN_VIA_BOOTROM,
+		.name = "IPL",
+		.data = ipl->data,
+		.len = len,
+		.size = ipl->size,
+		.padded = ipl->len,
+		.segsz = SSTARSCSI_BOOTROM_MAXTRANSFER,
+	};
+
+	plan_segments(cntx, stage);
+}
+
+static void plan_updater(struct p3udl_cntx *cntx, struct plan_stage *stage, const char *name,
+		uint32_t addr, const struct p3udl_image *image)
+{
+	uint32_t tuned;
+
+	*stage = (struct plan_stage) {
+		.via = PLAN_VIA_UPDATER,
+		.name = name,
+		.addr = addr,
+		.data = image->data,
+		.len = image->len,
+		.size = image->size,
+		.padded = image->len,
+		.segsz = sstarscsi_updater_transfer(cntx, &tuned),
+		.probe = !cntx->max_transfer,
+	};
+
+	plan_segments(cntx, stage);
+}
+
+/* Waits for the images that are still loading, nothing is sent */
+int plan_build(struct p3udl_cntx *cntx, struct plan *plan)
+{
+	unsigned int count = 2;
+	int ret;
+
+	*plan = (struct plan) { 0 };
+
+	if (cntx->manifest)
+		count += cntx->manifest->count;
+	if (cntx->dfu)
+		count += cntx->dfu->count;
+	if (cntx->ums)
+		count += cntx->ums->count;
+
+	plan->stages = calloc(count, sizeof(*plan->stages));
+	if (!plan->stages)
+		return -ENOMEM;
+
+	plan_bootrom(cntx, &plan->stages[plan->count++]);
+
+	for (int i = 0; cntx->manifest && i < cntx->manifest->count; i++) {
+		struct manifest_entry *entry = &cntx->manifest->entries[i];
+
+		ret = image_loader_wait(&entry->loader);
+		if (ret)
+			goto err;
+
+		plan_updater(cntx, &plan->stages[plan->count++], entry->path, entry->addr,
+				entry->packed.data ? &entry->packed : &entry->loader.image);
+	}
+
+	ret = image_loader_wait(cntx->uboot);
+	if (ret)
+		goto err;
+	plan_updater(cntx, &plan->stages[plan->count++], "u-boot", 0xFFFFFFFF, &cntx->uboot->image);
+
+	for (int i = 0; cntx->dfu && i < cntx->dfu->count; i++) {
+		struct manifest_entry *entry = &cntx->dfu->entries[i];
+		struct plan_stage *stage = &plan->stages[plan->count++];
+
+		ret = image_loader_wait(&entry->loader);
+		if (ret)
+			goto err;
+
+		*stage = (struct plan_stage) {
+			.via = PLAN_VIA_DFU,
+			.name = entry->target,
+			.data = entry->loader.image.data,
+			.len = entry->loader.image.len,
+			.size = entry->loader.image.size,
+			.padded = entry->loader.image.len,
+		};
+		plan_segments(cntx, stage);
+	}
+
+	for (int i = 0; cntx->ums && i < cntx->ums->count; i++) {
+		struct manifest_entry *entry = &cntx->ums->entries[i];
+		struct plan_stage *stage = &plan->stages[plan->count++];
+
+		ret = image_loader_wait(&entry->loader);
+		if (ret)
+			goto err;
+
+		*stage = (struct plan_stage) {
+			.via = PLAN_VIA_UMS,
+			.name = entry->path,
+			.offset = entry->offset,
+			.data = entry->loader.image.data,
+			.len = entry->loader.image.size,
+			.size = entry->loader.image.size,
+			.padded = entry->loader.image.size,
+			.segsz = UMS_TRANSFER,
+		};
+		plan_segments(cntx, stage);
+	}
+
+	for (int i = 0; i < plan->count; i++) {
+		const struct plan_stage *stage = &plan->stages[i];
+
+		plan->bytes += stage->len;
+		plan->segments += stage->segments;
+		plan->estimate_ns += stage->estimate_ns;
+		if (!stage->estimate_ns)
+			plan->unknown++;
+	}
+
+	return 0;
+
+err:
+	plan_free(plan);
+	return ret;
+}
+
+void plan_print(const struct plan *plan, FILE *out)
+{
+	for (int i = 0; i < plan->count; i++) {
+		const struct plan_stage *stage = &plan->stages[i];
+
+		fprintf(out, "%-12s %s", via_names[stage->via], stage->name);
+		if (stage->via == PLAN_VIA_UPDATER)
+			fprintf(out, " -> 0x%08x", stage->addr);
+		else if (stage->via == PLAN_VIA_UMS)
+			fprintf(out, " -> disk 0x%llx", (unsigned long long) stage->offset);
+		fprintf(out, "\n  %u bytes", stage->len);
+		if (stage->len != stage->size)
+			fprintf(out, " (%u from the file)", stage->size);
+		if (stage->padded > stage->len)
+			fprintf(out, ", %u bytes of padding not sent", stage->padded - stage->len);
+
+		if (stage->via == PLAN_VIA_UMS)
+			fprintf(out, "\n  %u WRITE of up to %u bytes", stage->segments, stage->segsz);
+		else if (stage->segsz)
+			fprintf(out, "\n  %u DOWNLOAD_KEEP of %u bytes%s then DOWNLOAD_END of %u bytes",
+					stage->segments - 1, stage->segsz, stage->probe ? " or smaller" : "", stage->last);
+		else
+			fprintf(out, "\n  blocks the size the DFU gadget asks for");
+
+		if (stage->estimate_ns)
+			fprintf(out, "\n  ~%llu ms\n", (unsigned long long) (stage->estimate_ns / NSEC_PER_MSEC));
+		else
+			fprintf(out, "\n  not measured yet\n");
+	}
+
+	fprintf(out, "\n%llu bytes in %llu segment(s) per board, ",
+			(unsigned long long) plan->bytes, (unsigned long long) plan->segments);
+	if (plan->unknown)
+		fprintf(out, "~%llu ms plus %u stage(s) not measured yet\n",
+				(unsigned long long) (plan->estimate_ns / NSEC_PER_MSEC), plan->unknown);
+	else
+		fprintf(out, "~%llu ms\n", (unsigned long long) (plan->estimate_ns / NSEC_PER_MSEC));
+}
+
+void plan_free(struct plan *plan)
+{
+	free(plan->stages);
+	plan->stages = NULL;
+	plan->count = 0;
+}
@@ -0,0 +1,54 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __PLAN_H_
+#define __PLAN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct p3udl_cntx;
+
+enum plan_via {
+	PLAN_VIA_BOOTROM,
+	PLAN_VIA_UPDATER,
+	PLAN_VIA_DFU,
+	PLAN_VIA_UMS,
+};
+
+/* How one image goes over, worked out before there is any USB traffic */
+struct plan_stage {
+	enum plan_via via;
+	const char *name;
+	/* where the usb updater puts it */
+	uint32_t addr;
+	/* where on the disk for UMS */
+	uint64_t offset;
+	const void *data;
+	/* bytes sent, the bytes that came from the file and what the image was padded to */
+	uint32_t len, size, padded;
+	/*
+	 * DOWNLOAD_KEEP for every segment but the last, which is DOWNLOAD_END
+	 * and last bytes long. segsz is 0 when the DFU gadget picks it.
+	 */
+	uint32_t segsz, segments, last;
+	/* the usb updater only starts at segsz and goes smaller if it has to */
+	bool probe;
+	/* from what this IPL managed last time, 0 if it hasn't been measured */
+	uint64_t estimate_ns;
+};
+
+struct plan {
+	struct plan_stage *stages;
+	unsigned int count;
+	uint64_t bytes, segments, estimate_ns;
+	/* stages with no measurement to go on */
+	unsigned int unknown;
+};
+
+void plan_bootrom(struct p3udl_cntx *cntx, struct plan_stage *stage);
+int plan_build(struct p3udl_cntx *cntx, struct plan *plan);
+void plan_print(const struct plan *plan, FILE *out);
+void plan_free(struct plan *plan);
+
+#endif /* __PLAN_H_ */
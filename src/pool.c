@@ -0,0 +1,111 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "cntx.h"
+#include "pool.h"
+#include "transport.h"
+
+#include "pool_log.h"
+
+static size_t pool_page_align(size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	return (len + page - 1) & ~(page - 1);
+}
+
+static void pool_release(struct p3udl_cntx *cntx, struct pool *pool)
+{
+	if (pool->slots) {
+		for (int i = 0; i < pool->nslots; i++) {
+			for (int j = 0; j < POOL_XFERS; j++)
+				libusb_free_transfer(pool->slots[i].xfers[j]);
+		}
+		free(pool->slots);
+	}
+
+	if (pool->devmem)
+		cntx->transport->mem_free(cntx, pool->mem, pool->len);
+	else
+		free(pool->mem);
+
+	free(pool);
+}
+
+/*
+ * The board's pool if it is big enough, otherwise a bigger one in its place.
+ * Without device memory nothing is staged so there are no data slots.
+ */
+struct pool *pool_get(struct p3udl_cntx *cntx, unsigned int nslots, size_t data_len)
+{
+	struct pool *pool = cntx->pool;
+
+	if (pool && pool->nslots >= nslots && (!pool->devmem || pool->data_len >= data_len))
+		return pool;
+
+	pool_free(cntx);
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	size_t hdr_len = pool_page_align(nslots * POOL_HDR_SIZE);
+	size_t slot_len = pool_page_align(data_len);
+
+	pool->nslots = nslots;
+
+	if (cntx->transport->mem_alloc) {
+		pool->len = hdr_len + (nslots * slot_len);
+		pool->mem = cntx->transport->mem_alloc(cntx, pool->len);
+		pool->devmem = pool->mem != NULL;
+	}
+	if (pool->devmem)
+		pool->data_len = data_len;
+	else {
+		pool->len = hdr_len;
+		if (posix_memalign((void **) &pool->mem, sysconf(_SC_PAGESIZE), pool->len)) {
+			pool->mem = NULL;
+			goto err;
+		}
+	}
+
+	pool->slots = calloc(nslots, sizeof(*pool->slots));
+	if (!pool->slots)
+		goto err;
+
+	for (int i = 0; i < nslots; i++) {
+		struct pool_slot *slot = &pool->slots[i];
+
+		slot->hdr = pool->mem + (i * POOL_HDR_SIZE);
+		slot->data = pool->devmem ? pool->mem + hdr_len + (i * slot_len) : NULL;
+		for (int j = 0; j < POOL_XFERS; j++) {
+			slot->xfers[j] = libusb_alloc_transfer(0);
+			if (!slot->xfers[j])
+				goto err;
+		}
+	}
+
+	if (pool->devmem)
+		pool_dbg(cntx, "%u slot(s) of %zu bytes in device memory\n", nslots, data_len);
+	else
+		pool_dbg(cntx, "%u slot(s) of headers only, data goes from where it is\n", nslots);
+
+	cntx->pool = pool;
+	return pool;
+
+err:
+	pool_release(cntx, pool);
+	return NULL;
+}
+
+/* Before the handle the memory came from goes away */
+void pool_free(struct p3udl_cntx *cntx)
+{
+	if (!cntx->pool)
+		return;
+
+	pool_release(cntx, cntx->pool);
+	cntx->pool = NULL;
+}
@@ -0,0 +1,47 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Buffers and transfers for a board's queued commands, allocated once
+ * and used for every segment after that. Where the transport can get
+ * memory the kernel hands to the host controller as it is (usbfs DMA
+ * memory) the data is copied into it instead of usbfs copying it into a
+ * buffer it allocates per transfer, otherwise the pool only has the
+ * CBWs and CSWs and data is sent from where it already is.
+ */
+
+#ifndef __POOL_H_
+#define __POOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <libusb.h>
+
+struct p3udl_cntx;
+
+/* Room for a CBW and a CSW, a cache line each */
+#define POOL_HDR_SIZE	128
+#define POOL_XFERS	3
+
+struct pool_slot {
+	uint8_t *hdr;
+	/* data_len bytes for one segment, NULL without device memory */
+	uint8_t *data;
+	struct libusb_transfer *xfers[POOL_XFERS];
+};
+
+struct pool {
+	uint8_t *mem;
+	size_t len;
+	/* came from the transport, data is staged in it instead of usbfs copying it */
+	bool devmem;
+
+	struct pool_slot *slots;
+	unsigned int nslots;
+	/* 0 without device memory */
+	size_t data_len;
+};
+
+struct pool *pool_get(struct p3udl_cntx *cntx, unsigned int nslots, size_t data_len);
+void pool_free(struct p3udl_cntx *cntx);
+
+#endif /* __POOL_H_ */
@@ -0,0 +1,13 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __REPLAY_H_
+#define __REPLAY_H_
+
+#include "cntx.h"
+#include "transport.h"
+
+extern const struct p3udl_transport transport_replay;
+
+int replay_probe(struct p3udl_cntx *template, const char *path, struct p3udl_cntx **boards);
+
+#endif /* __REPLAY_H_ */
@@ -0,0 +1,136 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Per board timing. Everything is only touched by the thread
+ * working on the board so nothing here needs locking.
+ */
+
+#include <stdbool.h>
+
+#include "clock.h"
+#include "cntx.h"
+#include "board.h"
+#include "report.h"
+#include "xfer.h"
+
+static const char * const phase_names[] = {
+	[REPORT_PHASE_PROBE] = "probe",
+	[REPORT_PHASE_INQUIRY] = "inquiry",
+	[REPORT_PHASE_IPL] = "ipl",
+	[REPORT_PHASE_LOADINFO] = "loadinfo",
+	[REPORT_PHASE_UBOOT] = "uboot",
+	[REPORT_PHASE_RESULT] = "get_result",
+	[REPORT_PHASE_REENUM] = "reenumerate",
+	[REPORT_PHASE_DFU] = "dfu",
+	[REPORT_PHASE_UMS] = "ums",
+	[REPORT_PHASE_BUS_WAIT] = "bus_wait",
+};
+
+const char *report_phase_name(enum report_phase phase)
+{
+	return phase_names[phase];
+}
+
+void report_begin(struct p3udl_cntx *cntx, enum report_phase phase)
+{
+	cntx->report.phase_start[phase] = clock_now_ns();
+}
+
+void report_end(struct p3udl_cntx *cntx, enum report_phase phase)
+{
+	struct report *report = &cntx->report;
+
+	if (!report->phase_start[phase])
+		return;
+
+	report->phase_ns[phase] += clock_now_ns() - report->phase_start[phase];
+	report->phase_start[phase] = 0;
+}
+
+void report_cmd(struct p3udl_cntx *cntx, uint64_t ns)
+{
+	struct report *report = &cntx->report;
+	uint64_t us = ns / NSEC_PER_USEC;
+	int bucket = 0;
+
+	while (us > 1 && bucket < REPORT_HIST_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	report->cmd_hist[bucket]++;
+	report->cmds++;
+	report->cmd_ns_total += ns;
+	if (!report->cmd_ns_min || ns < report->cmd_ns_min)
+		report->cmd_ns_min = ns;
+	if (ns > report->cmd_ns_max)
+		report->cmd_ns_max = ns;
+}
+
+/* One object per board on a single line so it can be consumed as JSON lines */
+void report_json(FILE *out, struct p3udl_cntx *cntx)
+{
+	struct report *report = &cntx->report;
+	uint64_t total = 0;
+
+	flockfile(out);
+
+	fprintf(out, "{\"board\":\"%s\",\"port\":\"%s\",\"chip\":\"%s\",\"result\":%d,\"stage\":\"%s\",",
+			cntx->name, cntx->port, cntx->chip, cntx->result, board_stage_name(cntx->stage));
+
+	fprintf(out, "\"phases_us\":{");
+	for (int i = 0; i < REPORT_PHASE_MAX; i++) {
+		fprintf(out, "%s\"%s\":%llu", i ? "," : "", phase_names[i],
+				(unsigned long long) (report->phase_ns[i] / NSEC_PER_USEC));
+		total += report->phase_ns[i];
+	}
+	fprintf(out, "},\"total_us\":%llu,", (unsigned long long) (total / NSEC_PER_USEC));
+
+	uint64_t wire_ns = report->phase_ns[REPORT_PHASE_IPL] + report->phase_ns[REPORT_PHASE_UBOOT] +
+			report->phase_ns[REPORT_PHASE_DFU] + report->phase_ns[REPORT_PHASE_UMS];
+	uint64_t payload = report->bytes + report->saved;
+
+	/* effective_mbps is what the link would have needed to move the uncompressed images in the same time */
+	fprintf(out, "\"bytes\":%llu,\"mbps\":%.3f,\"payload_bytes\":%llu,\"ratio\":%.3f,\"effective_mbps\":%.3f,",
+			(unsigned long long) report->bytes, clock_mbps(report->bytes, wire_ns),
+			(unsigned long long) payload, payload ? (double) report->bytes / payload : 1.0,
+			clock_mbps(payload, wire_ns));
+
+	/* saved_us goes negative when reading back took longer than writing everything would have */
+	if (cntx->delta)
+		fprintf(out, "\"skipped_bytes\":%llu,\"saved_us\":%lld,",
+				(unsigned long long) report->skipped, (long long) (report->skipped_ns / (int64_t) NSEC_PER_USEC));
+
+	fprintf(out, "\"retries\":%u,\"timeouts\":%u,\"recoveries\":%u,\"restarts\":%u,"
+			"\"cpu_us\":%llu,\"cpu_us_per_mb\":%llu,\"dma_pool\":%s,\"srtt_us\":%llu,\"timeout_ms\":%u,",
+			report->retries, report->timeouts, report->recoveries, report->restarts,
+			(unsigned long long) (report->cpu_ns / NSEC_PER_USEC),
+			(unsigned long long) (report->bytes ? (report->cpu_ns * 1024 * 1024) / report->bytes / NSEC_PER_USEC : 0),
+			report->dma_pool ? "true" : "false",
+			(unsigned long long) (cntx->xfer.srtt_ns / NSEC_PER_USEC), xfer_timeout(cntx));
+
+	fprintf(out, "\"commands\":%llu,\"cmd_us\":{\"min\":%llu,\"avg\":%llu,\"max\":%llu,\"histogram\":[",
+			(unsigned long long) report->cmds,
+			(unsigned long long) (report->cmd_ns_min / NSEC_PER_USEC),
+			(unsigned long long) (report->cmds ? report->cmd_ns_total / report->cmds / NSEC_PER_USEC : 0),
+			(unsigned long long) (report->cmd_ns_max / NSEC_PER_USEC));
+
+	/* [upper bound in us, count], null for the overflow bucket */
+	bool first = true;
+	for (int i = 0; i < REPORT_HIST_BUCKETS; i++) {
+		if (!report->cmd_hist[i])
+			continue;
+
+		if (i == REPORT_HIST_BUCKETS - 1)
+			fprintf(out, "%s[null,%llu]", first ? "" : ",",
+					(unsigned long long) report->cmd_hist[i]);
+		else
+			fprintf(out, "%s[%llu,%llu]", first ? "" : ",", 2ULL << i,
+					(unsigned long long) report->cmd_hist[i]);
+		first = false;
+	}
+
+	fprintf(out, "]}}\n");
+	fflush(out);
+
+	funlockfile(out);
+}
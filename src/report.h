@@ -0,0 +1,61 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __REPORT_H_
+#define __REPORT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct p3udl_cntx;
+
+enum report_phase {
+	REPORT_PHASE_PROBE,
+	REPORT_PHASE_INQUIRY,
+	REPORT_PHASE_IPL,
+	REPORT_PHASE_LOADINFO,
+	REPORT_PHASE_UBOOT,
+	REPORT_PHASE_RESULT,
+	REPORT_PHASE_REENUM,
+	REPORT_PHASE_DFU,
+	REPORT_PHASE_UMS,
+	REPORT_PHASE_BUS_WAIT,
+	REPORT_PHASE_MAX,
+};
+
+/* Command round trips in power of two microsecond buckets, the last catches everything */
+#define REPORT_HIST_BUCKETS	24
+
+struct report {
+	uint64_t phase_start[REPORT_PHASE_MAX];
+	uint64_t phase_ns[REPORT_PHASE_MAX];
+
+	/* CBW -> data -> CSW round trips */
+	uint64_t cmd_start;
+	uint64_t cmds, cmd_ns_total, cmd_ns_min, cmd_ns_max;
+	uint64_t cmd_hist[REPORT_HIST_BUCKETS];
+
+	/* from the segment attempt loop */
+	unsigned int retries, timeouts;
+	/* mass storage reset recoveries and images started again from the top */
+	unsigned int recoveries, restarts;
+	uint64_t bytes;
+	/* bytes compression kept off the wire */
+	uint64_t saved;
+	/* bytes --delta found already on the board and what not writing them saved, less the read back */
+	uint64_t skipped;
+	int64_t skipped_ns;
+
+	/* host cpu burnt by the board's thread */
+	uint64_t cpu_ns;
+	/* queued data was staged in usbfs DMA memory instead of usbfs copying it */
+	bool dma_pool;
+};
+
+void report_begin(struct p3udl_cntx *cntx, enum report_phase phase);
+void report_end(struct p3udl_cntx *cntx, enum report_phase phase);
+void report_cmd(struct p3udl_cntx *cntx, uint64_t ns);
+void report_json(FILE *out, struct p3udl_cntx *cntx);
+const char *report_phase_name(enum report_phase phase);
+
+#endif /* __REPORT_H_ */
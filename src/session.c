@@ -0,0 +1,892 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * The library side of p3udl. A session is the template context every
+ * board gets a copy of, plus the images, the slot map and the libusb
+ * context they all share. The p3udl command is just another user.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libusb.h>
+
+#include "board.h"
+#include "cache.h"
+#include "image.h"
+#include "log.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "p3udl.h"
+#include "plan.h"
+#include "replay.h"
+#include "report.h"
+#include "session.h"
+#include "sstarscsi.h"
+#include "station.h"
+#include "topology.h"
+#include "uboot.h"
+
+#include "main_log.h"
+
+#define DEFAULT_QUEUE_DEPTH	8
+
+/*
+ * The boot ROM used to always be given at least a full 64KiB, padded
+ * with zeros. The padding is still there for --ipl-pad but by default
+ * the upload stops after the segment the IPL ends in.
+ */
+#define IPL_MINLEN	(64 * 1024)
+
+struct p3udl_session *p3udl_session_new(libusb_context *usb)
+{
+	struct p3udl_session *session = calloc(1, sizeof(*session));
+
+	if (!session)
+		return NULL;
+
+	if (topology_init(&session->topology)) {
+		free(session);
+		return NULL;
+	}
+
+	pthread_mutex_init(&session->lock, NULL);
+
+	session->template.lu_cntx = usb;
+	session->template.log_cb = log_printf;
+	session->template.queue_depth = DEFAULT_QUEUE_DEPTH;
+	session->template.topology = &session->topology;
+	session->sim_opts = (struct simdev_opts) SIMDEV_OPTS_DEFAULT;
+	session->manifest.type = MANIFEST_RAM;
+	session->dfu.type = MANIFEST_DFU;
+	session->ums.type = MANIFEST_UMS;
+
+	return session;
+}
+
+void p3udl_session_free(struct p3udl_session *session)
+{
+	if (!session)
+		return;
+
+	struct p3udl_cntx *cntx = &session->template;
+
+	if (cntx->trace && trace_finish(cntx->trace))
+		p3udl_err(cntx, "Trace is incomplete, writing it failed\n");
+
+	manifest_free(&session->ums);
+	manifest_free(&session->dfu);
+	manifest_free(&session->manifest);
+	image_loader_free(&session->uboot);
+	image_free(&cntx->ipl);
+	topology_free(&session->topology);
+
+	if (session->own_usb)
+		libusb_exit(cntx->lu_cntx);
+
+	free(cntx->ipl_path);
+	free(cntx->uboot_path);
+	free(cntx->replay_path);
+	free(session->sim_opts.disk_path);
+
+	pthread_mutex_destroy(&session->lock);
+	free(session);
+}
+
+/* Only done when something actually needs USB so --plan never touches it */
+int session_usb(struct p3udl_session *session)
+{
+	struct p3udl_cntx *cntx = &session->template;
+	int ret = 0;
+
+	pthread_mutex_lock(&session->lock);
+	if (!cntx->lu_cntx) {
+		ret = libusb_init(&cntx->lu_cntx);
+		if (ret)
+			p3udl_err(cntx, "failed to init libusb: %s\n", libusb_strerror((enum libusb_error) ret));
+		else
+			session->own_usb = true;
+	}
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
+
+static bool session_loaded(struct p3udl_session *session)
+{
+	pthread_mutex_lock(&session->lock);
+	bool loaded = session->loaded;
+	pthread_mutex_unlock(&session->lock);
+
+	return loaded;
+}
+
+int p3udl_session_set(struct p3udl_session *session, enum p3udl_option option, long value)
+{
+	struct p3udl_cntx *cntx = &session->template;
+
+	switch (option) {
+	case P3UDL_OPT_QUEUE_DEPTH:
+		if (value < 1 || value > UINT16_MAX)
+			return -EINVAL;
+		cntx->queue_depth = value;
+		break;
+	case P3UDL_OPT_MAX_TRANSFER:
+		if (value && (value < SSTARSCSI_BOOTROM_MAXTRANSFER || value > UINT32_MAX))
+			return -EINVAL;
+		cntx->max_transfer = value;
+		break;
+	case P3UDL_OPT_COMPRESS:
+		/* Decided when the images are checked */
+		if (session_loaded(session))
+			return -EBUSY;
+		cntx->compress = value;
+		break;
+	case P3UDL_OPT_IPL_PAD:
+		cntx->ipl_pad = value;
+		break;
+	case P3UDL_OPT_PER_BUS:
+		if (value < 0 || value > UINT16_MAX)
+			return -EINVAL;
+		cntx->per_bus = value;
+		session->topology.per_bus = value;
+		break;
+	case P3UDL_OPT_SG:
+		cntx->sg = value;
+		break;
+	case P3UDL_OPT_DELTA:
+		cntx->delta = value;
+		break;
+	case P3UDL_OPT_SIMULATE:
+		if (value < 0 || value > UINT16_MAX)
+			return -EINVAL;
+		cntx->simulate = value;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+void p3udl_session_set_log(struct p3udl_session *session, p3udl_log_fn log)
+{
+	session->template.log_cb = log ? log : log_printf;
+}
+
+int p3udl_session_set_ipl(struct p3udl_session *session, const void *data, size_t len)
+{
+	struct p3udl_cntx *cntx = &session->template;
+
+	if (session_loaded(session))
+		return -EBUSY;
+
+	free(cntx->ipl_path);
+	cntx->ipl_path = NULL;
+	image_free(&cntx->ipl);
+
+	return image_copy(cntx, data, len, IPL_MINLEN, &cntx->ipl);
+}
+
+int p3udl_session_set_uboot(struct p3udl_session *session, const void *data, size_t len)
+{
+	struct p3udl_cntx *cntx = &session->template;
+
+	if (session_loaded(session))
+		return -EBUSY;
+
+	free(cntx->uboot_path);
+	cntx->uboot_path = NULL;
+	image_free(&session->uboot.image);
+
+	return image_copy(cntx, data, len, 0, &session->uboot.image);
+}
+
+int p3udl_session_add_image(struct p3udl_session *session, const char *name, uint64_t addr,
+		const void *data, size_t len)
+{
+	char arg[16];
+
+	if (session_loaded(session))
+		return -EBUSY;
+
+	if (addr > P3UDL_ADDR_FROM_HEADER)
+		return -EINVAL;
+
+	/* Goes through the same parsing as a manifest line */
+	if (addr != P3UDL_ADDR_FROM_HEADER)
+		snprintf(arg, sizeof(arg), "0x%08x", (uint32_t) addr);
+
+	return manifest_add_image(&session->template, &session->manifest, name,
+			addr == P3UDL_ADDR_FROM_HEADER ? NULL : arg, data, len);
+}
+
+int p3udl_session_add_dfu(struct p3udl_session *session, const char *target,
+		const void *data, size_t len)
+{
+	if (session_loaded(session))
+		return -EBUSY;
+
+	return manifest_add_image(&session->template, &session->dfu, target, target, data, len);
+}
+
+int p3udl_session_add_ums(struct p3udl_session *session, const char *name, uint64_t offset,
+		const void *data, size_t len)
+{
+	char arg[24];
+
+	if (session_loaded(session))
+		return -EBUSY;
+
+	snprintf(arg, sizeof(arg), "0x%llx", (unsigned long long) offset);
+
+	return manifest_add_image(&session->template, &session->ums, name, arg, data, len);
+}
+
+static int session_set_path(struct p3udl_session *session, char **dst, const char *path)
+{
+	if (session_loaded(session))
+		return -EBUSY;
+
+	char *copy = strdup(path);
+	if (!copy)
+		return -ENOMEM;
+
+	free(*dst);
+	*dst = copy;
+
+	return 0;
+}
+
+int p3udl_session_set_ipl_file(struct p3udl_session *session, const char *path)
+{
+	int ret = session_set_path(session, &session->template.ipl_path, path);
+
+	if (!ret)
+		image_free(&session->template.ipl);
+
+	return ret;
+}
+
+int p3udl_session_set_uboot_file(struct p3udl_session *session, const char *path)
+{
+	int ret = session_set_path(session, &session->template.uboot_path, path);
+
+	if (!ret)
+		image_free(&session->uboot.image);
+
+	return ret;
+}
+
+static int session_load_manifest(struct p3udl_session *session, const char *path,
+		enum manifest_type type, struct manifest *manifest)
+{
+	if (session_loaded(session))
+		return -EBUSY;
+
+	/* One manifest each, the entries from it can't be mixed with others */
+	if (manifest->count)
+		return -EEXIST;
+
+	return manifest_load(&session->template, path, type, manifest);
+}
+
+int p3udl_session_load_manifest(struct p3udl_session *session, const char *path)
+{
+	return session_load_manifest(session, path, MANIFEST_RAM, &session->manifest);
+}
+
+int p3udl_session_load_dfu(struct p3udl_session *session, const char *path)
+{
+	return session_load_manifest(session, path, MANIFEST_DFU, &session->dfu);
+}
+
+int p3udl_session_load_ums(struct p3udl_session *session, const char *path)
+{
+	return session_load_manifest(session, path, MANIFEST_UMS, &session->ums);
+}
+
+int p3udl_session_load_slots(struct p3udl_session *session, const char *path)
+{
+	return topology_load_slots(&session->template, path, &session->topology);
+}
+
+int p3udl_session_set_sim_opts(struct p3udl_session *session, const char *opts)
+{
+	return simdev_parse_opts(opts, &session->sim_opts);
+}
+
+int p3udl_session_set_trace(struct p3udl_session *session, const char *path)
+{
+	struct p3udl_cntx *cntx = &session->template;
+
+	/* Every board goes in the one trace */
+	if (cntx->trace)
+		return -EEXIST;
+
+	int ret = trace_create(&session->trace, path);
+	if (ret)
+		return ret;
+
+	cntx->trace = &session->trace;
+	return 0;
+}
+
+int p3udl_session_set_replay(struct p3udl_session *session, const char *path)
+{
+	struct p3udl_cntx *cntx = &session->template;
+	char *copy = strdup(path);
+
+	if (!copy)
+		return -ENOMEM;
+
+	free(cntx->replay_path);
+	cntx->replay_path = copy;
+	return 0;
+}
+
+void p3udl_session_set_report(struct p3udl_session *session, FILE *out)
+{
+	session->template.report_out = out;
+}
+
+static int load_ipl(struct p3udl_cntx *cntx)
+{
+	if (!cntx->ipl.data) {
+		int ret = image_load(cntx, cntx->ipl_path, IPL_MINLEN, &cntx->ipl);
+		if (ret)
+			return ret;
+	}
+
+	p3udl_info(cntx, "Read %zu bytes of IPL\n", cntx->ipl.size);
+
+	for (int i = 0; i < sizeof(cntx->ipl.md5); i++)
+		sprintf(cntx->ipl_hash + (i * 2), "%02x", cntx->ipl.md5[i]);
+
+	return 0;
+}
+
+/* Runs on the loader thread once the u-boot image is in */
+static int check_uboot(struct p3udl_cntx *cntx, const struct p3udl_image *uboot, void *priv)
+{
+	p3udl_info(cntx, "Read %zu bytes of u-boot image\n", uboot->size);
+
+	const struct legacy_img_hdr *hdr = uboot->data;
+	if (uboot->size < sizeof(*hdr) || ntohl(hdr->ih_magic) != IH_MAGIC) {
+		p3udl_err(cntx, "Doesn't look like a u-boot image to me buddy\n");
+		return -EINVAL;
+	}
+	uint32_t loadaddr = ntohl(hdr->ih_load);
+	uint32_t loadsz = ntohl(hdr->ih_size);
+
+	p3udl_info(cntx, "u-boot info: load addr 0x%04x, load size 0x%04x\n",
+			loadaddr, loadsz);
+
+	return 0;
+}
+
+/* u-boot isn't needed until the IPL is up so it loads while the boards get on with that */
+static int load_uboot(struct p3udl_session *session)
+{
+	struct p3udl_cntx *cntx = &session->template;
+	struct image_loader *loader = &session->uboot;
+
+	loader->cntx = cntx;
+	loader->path = cntx->uboot_path ? cntx->uboot_path : "u-boot";
+	loader->minlen = 0;
+	loader->check = check_uboot;
+	cntx->uboot = loader;
+
+	return image_loader_start(loader);
+}
+
+static int session_load(struct p3udl_session *session)
+{
+	struct p3udl_cntx *cntx = &session->template;
+	int ret;
+
+	if (!cntx->ipl.data && !cntx->ipl_path) {
+		p3udl_err(cntx, "No IPL to send\n");
+		return -EINVAL;
+	}
+
+	if (!session->uboot.image.data && !cntx->uboot_path) {
+		p3udl_err(cntx, "No u-boot to send\n");
+		return -EINVAL;
+	}
+
+	/* u-boot comes back as one gadget or the other */
+	if (session->dfu.count && session->ums.count) {
+		p3udl_err(cntx, "Images can go through DFU or UMS but not both\n");
+		return -EINVAL;
+	}
+
+	ret = load_ipl(cntx);
+	if (ret)
+		return ret;
+
+	ret = load_uboot(session);
+	if (ret)
+		return ret;
+
+	if (session->manifest.count) {
+		ret = manifest_start(cntx, &session->manifest);
+		if (ret)
+			return ret;
+		cntx->manifest = &session->manifest;
+	}
+
+	if (session->dfu.count) {
+		ret = manifest_start(cntx, &session->dfu);
+		if (ret)
+			return ret;
+		cntx->dfu = &session->dfu;
+	}
+
+	if (session->ums.count) {
+		ret = manifest_start(cntx, &session->ums);
+		if (ret)
+			return ret;
+		cntx->ums = &session->ums;
+	}
+
+	return 0;
+}
+
+int p3udl_session_load(struct p3udl_session *session)
+{
+	pthread_mutex_lock(&session->lock);
+	if (!session->loaded) {
+		session->load_result = session_load(session);
+		session->loaded = true;
+	}
+	int ret = session->load_result;
+	pthread_mutex_unlock(&session->lock);
+
+	return ret;
+}
+
+/* Waits for every image so only boards that want progress pay for it, and only the first one */
+static uint64_t session_total(struct p3udl_session *session)
+{
+	struct plan plan;
+
+	pthread_mutex_lock(&session->lock);
+	if (!session->total && !plan_build(&session->template, &plan)) {
+		session->total = plan.bytes;
+		plan_free(&plan);
+	}
+	uint64_t total = session->total;
+	pthread_mutex_unlock(&session->lock);
+
+	return total;
+}
+
+int p3udl_session_print_plan(struct p3udl_session *session, FILE *out)
+{
+	struct p3udl_cntx *cntx = &session->template;
+	struct plan plan;
+
+	int ret = p3udl_session_load(session);
+	if (ret)
+		return ret;
+
+	ret = plan_build(cntx, &plan);
+	if (ret) {
+		p3udl_err(cntx, "Can't plan the upload: %d\n", ret);
+		return ret;
+	}
+
+	plan_print(&plan, out);
+	plan_free(&plan);
+
+	return 0;
+}
+
+/* A copy of the template that hasn't been opened yet */
+static struct p3udl_board *session_board_new(struct p3udl_session *session)
+{
+	struct p3udl_board *board = calloc(1, sizeof(*board));
+
+	if (!board)
+		return NULL;
+
+	board->cntx = session->template;
+	board->session = session;
+
+	return board;
+}
+
+static int session_board_open(struct p3udl_session *session, libusb_device *dev,
+		libusb_device_handle *lu_handle, struct p3udl_board **ret_board)
+{
+	struct p3udl_board *board = session_board_new(session);
+
+	if (!board) {
+		if (lu_handle)
+			libusb_close(lu_handle);
+		return -ENOMEM;
+	}
+
+	int ret = dev ? board_open(&board->cntx, dev) : board_open_handle(&board->cntx, lu_handle);
+	if (ret) {
+		free(board);
+		return ret;
+	}
+
+	*ret_board = board;
+	return 0;
+}
+
+int p3udl_board_open_port(struct p3udl_session *session, const char *port,
+		struct p3udl_board **board)
+{
+	libusb_device **list;
+
+	int ret = p3udl_session_load(session);
+	if (ret)
+		return ret;
+
+	ret = session_usb(session);
+	if (ret)
+		return ret;
+
+	ssize_t count = libusb_get_device_list(session->template.lu_cntx, &list);
+	if (count < 0)
+		return count;
+
+	ret = -ENODEV;
+	for (ssize_t i = 0; i < count; i++) {
+		struct libusb_device_descriptor desc;
+		uint8_t ports[7];
+		char path[32];
+
+		if (libusb_get_device_descriptor(list[i], &desc))
+			continue;
+
+		if (desc.idVendor != SSTARSCSI_VID || desc.idProduct != SSTARSCSI_PID)
+			continue;
+
+		int nports = libusb_get_port_numbers(list[i], ports, sizeof(ports));
+		topology_port_path(libusb_get_bus_number(list[i]), ports, nports > 0 ? nports : 0,
+				path, sizeof(path));
+		if (strcmp(path, port))
+			continue;
+
+		ret = session_board_open(session, list[i], NULL, board);
+		break;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	return ret;
+}
+
+int p3udl_board_open_handle(struct p3udl_session *session, libusb_device_handle *handle,
+		struct p3udl_board **board)
+{
+	struct libusb_device_descriptor desc;
+
+	int ret = p3udl_session_load(session);
+	if (!ret && libusb_get_device_descriptor(libusb_get_device(handle), &desc))
+		ret = -ENODEV;
+	if (!ret && (desc.idVendor != SSTARSCSI_VID || desc.idProduct != SSTARSCSI_PID))
+		ret = -ENODEV;
+	if (ret) {
+		libusb_close(handle);
+		return ret;
+	}
+
+	return session_board_open(session, NULL, handle, board);
+}
+
+/* Every board in USB boot mode the slot map wants, the ones that can't be opened too */
+static int session_probe_usb(struct p3udl_session *session, struct p3udl_board ***boards)
+{
+	struct p3udl_cntx *template = &session->template;
+	struct p3udl_board **found = NULL;
+	libusb_device **list;
+	int nboards = 0;
+
+	int ret = session_usb(session);
+	if (ret)
+		return ret;
+
+	ssize_t count = libusb_get_device_list(template->lu_cntx, &list);
+	if (count < 0) {
+		p3udl_err(template, "failed to list devices: %s\n", libusb_strerror((enum libusb_error) count));
+		return count;
+	}
+
+	for (ssize_t i = 0; i < count; i++) {
+		struct libusb_device_descriptor desc;
+
+		if (libusb_get_device_descriptor(list[i], &desc))
+			continue;
+
+		if (desc.idVendor != SSTARSCSI_VID || desc.idProduct != SSTARSCSI_PID)
+			continue;
+
+		if (!topology_wanted(template, list[i])) {
+			p3udl_dbg(template, "Board on %03u:%03u isn't in a slot, leaving it alone\n",
+					libusb_get_bus_number(list[i]), libusb_get_device_address(list[i]));
+			continue;
+		}
+
+		struct p3udl_board **tmp = realloc(found, (nboards + 1) * sizeof(*found));
+		if (!tmp)
+			break;
+		found = tmp;
+
+		struct p3udl_board *board = session_board_new(session);
+		if (!board)
+			break;
+
+		board->open_result = board_open(&board->cntx, list[i]);
+		board->cntx.result = board->open_result;
+		found[nboards++] = board;
+	}
+
+	libusb_free_device_list(list, 1);
+
+	if (!nboards) {
+		free(found);
+		return -ENODEV;
+	}
+
+	*boards = found;
+	return nboards;
+}
+
+/* In-process fake boards instead */
+static int session_probe_sim(struct p3udl_session *session, struct p3udl_board ***boards)
+{
+	int nboards = session->template.simulate;
+	struct p3udl_board **found = calloc(nboards, sizeof(*found));
+
+	if (!found)
+		return -ENOMEM;
+
+	for (int i = 0; i < nboards; i++) {
+		found[i] = session_board_new(session);
+		if (!found[i]) {
+			while (i--)
+				p3udl_board_close(found[i]);
+			free(found);
+			return -ENOMEM;
+		}
+
+		found[i]->open_result = simdev_open(&found[i]->cntx, &session->sim_opts, i);
+		found[i]->cntx.result = found[i]->open_result;
+		topology_assign(&found[i]->cntx);
+	}
+
+	*boards = found;
+	return nboards;
+}
+
+/* The boards in a trace, each one plays back what it did */
+static int session_probe_replay(struct p3udl_session *session, struct p3udl_board ***boards)
+{
+	struct p3udl_cntx *template = &session->template;
+	struct p3udl_cntx *replayed;
+
+	int nboards = replay_probe(template, template->replay_path, &replayed);
+	if (nboards < 0)
+		return nboards;
+
+	struct p3udl_board **found = calloc(nboards, sizeof(*found));
+	int made = 0;
+
+	while (found && made < nboards && (found[made] = session_board_new(session)))
+		made++;
+
+	if (made < nboards) {
+		for (int i = 0; i < nboards; i++) {
+			if (i < made)
+				free(found[i]);
+			board_close(&replayed[i]);
+		}
+		free(found);
+		free(replayed);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < nboards; i++)
+		found[i]->cntx = replayed[i];
+	free(replayed);
+
+	*boards = found;
+	return nboards;
+}
+
+int p3udl_session_open_all(struct p3udl_session *session, struct p3udl_board ***boards)
+{
+	struct p3udl_cntx *cntx = &session->template;
+
+	int ret = p3udl_session_load(session);
+	if (ret)
+		return ret;
+
+	if (cntx->replay_path)
+		return session_probe_replay(session, boards);
+	if (cntx->simulate)
+		return session_probe_sim(session, boards);
+
+	return session_probe_usb(session, boards);
+}
+
+int p3udl_session_run_station(struct p3udl_session *session)
+{
+	int ret = p3udl_session_load(session);
+	if (ret)
+		return ret;
+
+	ret = session_usb(session);
+	if (ret)
+		return ret;
+
+	return station_run(&session->template);
+}
+
+void p3udl_session_log_summary(struct p3udl_session *session)
+{
+	struct p3udl_cntx *cntx = &session->template;
+	unsigned int hits, misses;
+
+	topology_summary(cntx);
+
+	cache_image_stats(&hits, &misses);
+	p3udl_info(cntx, "Image cache: %u hit(s), %u miss(es)\n", hits, misses);
+}
+
+void p3udl_board_close(struct p3udl_board *board)
+{
+	if (!board)
+		return;
+
+	p3udl_board_wait(board);
+	board_close(&board->cntx);
+	free(board);
+}
+
+static void board_progress_hook(struct p3udl_cntx *cntx, uint64_t bytes)
+{
+	struct p3udl_board *board = (struct p3udl_board *) cntx;
+
+	board->sent += bytes;
+	board->progress(board, cntx->stage, board->sent, board->total, board->priv);
+}
+
+void p3udl_board_set_callbacks(struct p3udl_board *board, p3udl_progress_fn progress,
+		p3udl_done_fn done, void *priv)
+{
+	board->progress = progress;
+	board->done = done;
+	board->priv = priv;
+	board->cntx.progress = progress ? board_progress_hook : NULL;
+}
+
+int p3udl_board_flash(struct p3udl_board *board)
+{
+	struct p3udl_cntx *cntx = &board->cntx;
+
+	if (board->open_result)
+		cntx->result = board->open_result;
+	else {
+		if (board->progress)
+			board->total = session_total(board->session);
+
+		board_thread(cntx);
+	}
+
+	if (board->done)
+		board->done(board, cntx->result, board->priv);
+
+	return cntx->result;
+}
+
+static void *board_start_thread(void *data)
+{
+	p3udl_board_flash(data);
+
+	return NULL;
+}
+
+int p3udl_board_start(struct p3udl_board *board)
+{
+	if (board->started)
+		return -EBUSY;
+	if (board->open_result)
+		return board->open_result;
+
+	int ret = pthread_create(&board->thread, NULL, board_start_thread, board);
+	if (ret)
+		return -ret;
+
+	board->started = true;
+	return 0;
+}
+
+int p3udl_board_wait(struct p3udl_board *board)
+{
+	if (board->started) {
+		pthread_join(board->thread, NULL);
+		board->started = false;
+	}
+
+	return board->cntx.result;
+}
+
+void p3udl_board_cancel(struct p3udl_board *board)
+{
+	__atomic_store_n(&board->cntx.cancel, true, __ATOMIC_RELAXED);
+	if (board->cntx.topology)
+		topology_wake(board->cntx.topology);
+}
+
+const char *p3udl_board_name(struct p3udl_board *board)
+{
+	return board->cntx.name;
+}
+
+enum p3udl_stage p3udl_board_stage(struct p3udl_board *board)
+{
+	return board->cntx.stage;
+}
+
+const char *p3udl_stage_name(enum p3udl_stage stage)
+{
+	if (stage >= BOARD_STAGES)
+		return "unknown";
+
+	return board_stage_name(stage);
+}
+
+void p3udl_board_report_json(struct p3udl_board *board, FILE *out)
+{
+	report_json(out, &board->cntx);
+}
+
+int p3udl_log_start(int failed_only)
+{
+	return log_start(failed_only);
+}
+
+void p3udl_log_stop(void)
+{
+	log_stop();
+}
+
+int p3udl_metrics_start(struct p3udl_session *session, const char *socket_path,
+		const char *file_path)
+{
+	return metrics_start(&session->template, socket_path, file_path);
+}
+
+void p3udl_metrics_stop(void)
+{
+	metrics_stop();
+}
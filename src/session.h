@@ -0,0 +1,59 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __SESSION_H_
+#define __SESSION_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "cntx.h"
+#include "image.h"
+#include "manifest.h"
+#include "p3udl.h"
+#include "simdev.h"
+#include "topology.h"
+#include "trace.h"
+
+struct p3udl_session {
+	/* what every board starts off as */
+	struct p3udl_cntx template;
+	/* libusb_exit() the context when the session goes */
+	bool own_usb;
+
+	struct topology topology;
+	/* how P3UDL_OPT_SIMULATE's boards behave */
+	struct simdev_opts sim_opts;
+	/* template.trace points here once there is one */
+	struct trace trace;
+	struct image_loader uboot;
+	struct manifest manifest;
+	struct manifest dfu;
+	struct manifest ums;
+
+	pthread_mutex_t lock;
+	bool loaded;
+	int load_result;
+	/* bytes every board gets sent, 0 until the first board with a progress callback works it out */
+	uint64_t total;
+};
+
+struct p3udl_board {
+	/* first so the progress hook can get from one to the other */
+	struct p3udl_cntx cntx;
+	struct p3udl_session *session;
+
+	p3udl_progress_fn progress;
+	p3udl_done_fn done;
+	void *priv;
+	uint64_t sent, total;
+	/* opening it failed with this, flashing it fails the same way */
+	int open_result;
+
+	pthread_t thread;
+	bool started;
+};
+
+int session_usb(struct p3udl_session *session);
+
+#endif /* __SESSION_H_ */
@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+#SPDX-License-Identifier: GPL-3.0-or-later
+#
+# Made up images for the simulated board benchmark: an IPL, a u-boot.img
+# with a legacy header and a manifest with a 4MiB ramdisk. The bytes are
+# the same every time so runs can be compared.
+#
+
+import os
+import random
+import struct
+import sys
+import zlib
+
+IH_MAGIC = 0x27051956
+UBOOT_LOAD = 0x21000000
+RAMDISK_ADDR = 0x22000000
+
+
+def legacy_image(payload, load, name):
+    hdr = struct.pack('>7I4B32s', IH_MAGIC, 0, 0, len(payload), load, load,
+                      zlib.crc32(payload), 5, 2, 5, 0, name.encode())
+    hcrc = zlib.crc32(hdr)
+    return hdr[:4] + struct.pack('>I', hcrc) + hdr[8:] + payload
+
+
+def main():
+    out = sys.argv[1]
+    rnd = random.Random(0x93d1)
+
+    def write(name, data):
+        with open(os.path.join(out, name), 'wb') as f:
+            f.write(data)
+
+    write('sim-ipl.bin', rnd.randbytes(40000))
+    write('sim-u-boot.img', legacy_image(rnd.randbytes(256 * 1024), UBOOT_LOAD, 'u-boot'))
+    write('sim-ramdisk.img', rnd.randbytes(4 * 1024 * 1024))
+    write('sim-manifest.txt', ('sim-ramdisk.img 0x%x\n' % RAMDISK_ADDR).encode())
+
+
+if __name__ == '__main__':
+    main()
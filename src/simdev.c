@@ -0,0 +1,1214 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * A pretend SigmaStar board in USB boot mode, for trying protocol
+ * changes and measuring them without hardware.
+ *
+ * It speaks enough Bulk-Only Transport to get through GET_MAX_LUN,
+ * INQUIRY and REQUEST SENSE, and the 0xE8 vendor command subcodes.
+ * The "boot ROM" takes segments until DOWNLOAD_END and then pretends
+ * to run the IPL, after which the "usb updater" checks LOADINFO's size
+ * and MD5 against what it received. Once u-boot has been sent it comes
+ * back as a DFU gadget with a few alt settings that take whatever they
+ * are given, or with ums=<MiB> as a mass storage gadget with a disk in
+ * memory that READ and WRITE work on. With fast=1 the board starts out
+ * as u-boot's fast download gadget, an updater that takes 1MiB segments.
+ *
+ * The wire is modelled as a fixed turnaround latency per synchronous
+ * transfer plus bytes / bandwidth. Transfers that are queued behind
+ * each other only pay the turnaround once, which is the point of
+ * queueing them.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/md5.h>
+
+#include "board.h"
+#include "clock.h"
+#include "cntx.h"
+#include "dfu.h"
+#include "simdev.h"
+#include "sstarscsi.h"
+#include "transport.h"
+
+#include "simdev_log.h"
+
+#define SIMDEV_CBW_LEN		31
+#define SIMDEV_CSW_LEN		13
+
+#define SCSI_TEST_UNIT_READY	0x00
+#define SCSI_INQUIRY		0x12
+#define SCSI_REQUEST_SENSE	0x03
+#define SCSI_READ_CAPACITY	0x25
+#define SCSI_READ_10		0x28
+#define SCSI_WRITE_10		0x2a
+#define SCSI_SYNC_CACHE		0x35
+#define SCSI_READ_16		0x88
+#define SCSI_WRITE_16		0x8a
+#define SCSI_SERVICE_ACTION_IN	0x9e
+#define SAI_READ_CAPACITY_16	0x10
+
+#define SENSE_ILLEGAL_REQUEST	0x05
+#define SENSE_UNIT_ATTENTION	0x06
+#define ASC_LBA_OUT_OF_RANGE	0x21
+#define ASC_INVALID_COMMAND	0x20
+#define ASC_INVALID_FIELD	0x24
+#define ASC_RESET		0x29
+
+#define SIMDEV_UMS_BLOCK	512
+
+enum simdev_phase {
+	SIMDEV_PHASE_CBW,
+	SIMDEV_PHASE_DATA_OUT,
+	SIMDEV_PHASE_DATA_IN,
+	SIMDEV_PHASE_CSW,
+};
+
+enum simdev_stage {
+	SIMDEV_STAGE_BOOTROM,
+	SIMDEV_STAGE_UPDATER,
+	/* u-boot is booting, nothing answers until it re-enumerates */
+	SIMDEV_STAGE_UBOOT,
+	SIMDEV_STAGE_DFU,
+	SIMDEV_STAGE_UMS,
+};
+
+/* What u-boot's dfu_alt_info would have */
+static const char * const simdev_dfu_alts[] = {
+	"u-boot",
+	"kernel",
+	"dtb",
+	"rootfs",
+};
+
+#define SIMDEV_DFU_NALTS	(sizeof(simdev_dfu_alts) / sizeof(simdev_dfu_alts[0]))
+/* string descriptor index of the first alt's name */
+#define SIMDEV_DFU_ISTRING	4
+
+#define DFU_STATUS_ERR_UNKNOWN		0x0e
+#define DFU_STATUS_ERR_STALLEDPKT	0x0f
+
+struct simdev_xfer {
+	struct libusb_transfer *xfer;
+	/* when the transfer finishes on the wire */
+	uint64_t done;
+	enum libusb_transfer_status status;
+	int actual_length;
+	/* never completes unless cancelled or it has a timeout, how timeouts look */
+	bool hung;
+	bool cancelled, timed_out;
+	/* when libusb would give up on it, 0 for never */
+	uint64_t deadline;
+	struct simdev_xfer *next;
+};
+
+struct simdev {
+	struct simdev_opts opts;
+
+	enum simdev_phase phase;
+	enum simdev_stage stage;
+
+	/* the command being worked on */
+	uint32_t tag;
+	uint32_t expected;
+	uint32_t residue;
+	uint8_t status;
+	uint8_t opcode, subcode;
+
+	uint8_t in[64];
+	/* what a data in phase sends, in or somewhere on the disk */
+	const uint8_t *indata;
+	int inlen;
+
+	uint8_t sense_key, asc;
+	bool halted;
+
+	/* what has been downloaded so far */
+	uint8_t *rx;
+	size_t rxlen, rxcap;
+	struct sstarscsi_loadinfo loadinfo;
+	bool have_loadinfo;
+	uint8_t result[4];
+
+	unsigned long nbulk, ncbw, nsegment;
+	uint64_t busy_until;
+
+	/* u-boot's DFU gadget */
+	struct {
+		uint8_t state, status;
+		uint8_t alt;
+		uint16_t block;
+		/* the last DNLOAD hasn't been reported busy yet */
+		bool busy;
+		size_t bytes;
+		MD5_CTX md5;
+	} dfu;
+
+	/* u-boot's mass storage gadget */
+	struct {
+		uint8_t *disk;
+		uint64_t blocks;
+		/* where the data of the WRITE being worked on goes */
+		uint8_t *wr;
+		/* everything after a reset fails once, like a real disk */
+		bool attention;
+	} ums;
+
+	/* submitted transfers in the order they'll complete */
+	struct simdev_xfer *queue, **queue_tail;
+	bool hung;
+};
+
+static uint32_t simdev_get_be32(const uint8_t *buf)
+{
+	return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+			((uint32_t) buf[2] << 8) | buf[3];
+}
+
+static void simdev_put_be32(uint8_t *buf, uint32_t v)
+{
+	buf[0] = v >> 24;
+	buf[1] = v >> 16;
+	buf[2] = v >> 8;
+	buf[3] = v;
+}
+
+static void simdev_sleep_until(uint64_t when)
+{
+	struct timespec ts = {
+		.tv_sec = when / NSEC_PER_SEC,
+		.tv_nsec = when % NSEC_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* How long the bytes take on the wire */
+static uint64_t simdev_wire_ns(struct simdev *sim, int len)
+{
+	return ((uint64_t) len * NSEC_PER_SEC) / ((uint64_t) sim->opts.bandwidth * 1024 * 1024);
+}
+
+static void simdev_fail(struct simdev *sim, uint8_t sense_key, uint8_t asc)
+{
+	sim->status = 1;
+	sim->sense_key = sense_key;
+	sim->asc = asc;
+}
+
+static void simdev_store(struct simdev *sim, const uint8_t *data, int len)
+{
+	if (sim->rxlen + len > sim->rxcap) {
+		size_t newcap = sim->rxcap ? sim->rxcap : (64 * 1024);
+		uint8_t *tmp;
+
+		while (newcap < sim->rxlen + len)
+			newcap *= 2;
+
+		tmp = realloc(sim->rx, newcap);
+		if (!tmp) {
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			return;
+		}
+
+		sim->rx = tmp;
+		sim->rxcap = newcap;
+	}
+
+	memcpy(sim->rx + sim->rxlen, data, len);
+	sim->rxlen += len;
+}
+
+/* DOWNLOAD_END, the ROM runs the IPL or the updater checks the payload */
+static void simdev_download_end(struct p3udl_cntx *cntx, struct simdev *sim)
+{
+	uint8_t digest[MD5_DIGEST_LENGTH];
+
+	if (sim->stage == SIMDEV_STAGE_BOOTROM) {
+		simdev_dbg(cntx, "boot ROM got %zu bytes, jumping to IPL\n", sim->rxlen);
+		sim->stage = SIMDEV_STAGE_UPDATER;
+		sim->rxlen = 0;
+		return;
+	}
+
+	memset(sim->result, 0, sizeof(sim->result));
+
+	if (!sim->have_loadinfo || sim->loadinfo.size != sim->rxlen) {
+		simdev_info(cntx, "updater got %zu bytes but LOADINFO said %u\n",
+				sim->rxlen, sim->have_loadinfo ? sim->loadinfo.size : 0);
+		sim->result[0] = 1;
+	}
+	else {
+		MD5(sim->rx, sim->rxlen, digest);
+		if (memcmp(digest, sim->loadinfo.md5, sizeof(digest))) {
+			simdev_info(cntx, "updater MD5 mismatch\n");
+			sim->result[0] = 2;
+		}
+		/* The updater jumps to u-boot once it has it */
+		else if (sim->loadinfo.addr == 0xFFFFFFFF) {
+			simdev_dbg(cntx, "updater got u-boot, booting it\n");
+			sim->stage = SIMDEV_STAGE_UBOOT;
+		}
+	}
+
+	sim->rxlen = 0;
+	sim->have_loadinfo = false;
+}
+
+/* READ and WRITE point the data phase straight at the disk */
+static void simdev_ums_rw(struct p3udl_cntx *cntx, struct simdev *sim, const uint8_t *cdb)
+{
+	bool is16 = cdb[0] == SCSI_READ_16 || cdb[0] == SCSI_WRITE_16;
+	bool write = cdb[0] == SCSI_WRITE_10 || cdb[0] == SCSI_WRITE_16;
+	uint64_t lba = is16 ? ((uint64_t) simdev_get_be32(cdb + 2) << 32) | simdev_get_be32(cdb + 6) :
+			simdev_get_be32(cdb + 2);
+	uint64_t blocks = is16 ? simdev_get_be32(cdb + 10) : (cdb[7] << 8) | cdb[8];
+
+	if (lba > sim->ums.blocks || blocks > sim->ums.blocks - lba) {
+		simdev_dbg(cntx, "ums: %llu blocks at %llu are off the end\n",
+				(unsigned long long) blocks, (unsigned long long) lba);
+		simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+		sim->residue = sim->expected;
+		return;
+	}
+
+	if (!blocks)
+		return;
+
+	if (blocks * SIMDEV_UMS_BLOCK != sim->expected) {
+		simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+		sim->residue = sim->expected;
+		return;
+	}
+
+	if (write) {
+		sim->ums.wr = sim->ums.disk + (lba * SIMDEV_UMS_BLOCK);
+		sim->phase = SIMDEV_PHASE_DATA_OUT;
+	}
+	else {
+		sim->indata = sim->ums.disk + (lba * SIMDEV_UMS_BLOCK);
+		sim->inlen = sim->expected;
+		sim->phase = SIMDEV_PHASE_DATA_IN;
+	}
+}
+
+static void simdev_ums_cbw(struct p3udl_cntx *cntx, struct simdev *sim, const uint8_t *cdb)
+{
+	if (sim->ums.attention) {
+		sim->ums.attention = false;
+		simdev_fail(sim, SENSE_UNIT_ATTENTION, ASC_RESET);
+		sim->residue = sim->expected;
+		return;
+	}
+
+	switch (cdb[0]) {
+	case SCSI_TEST_UNIT_READY:
+	case SCSI_SYNC_CACHE:
+		break;
+	case SCSI_READ_CAPACITY:
+		simdev_put_be32(sim->in, sim->ums.blocks - 1);
+		simdev_put_be32(sim->in + 4, SIMDEV_UMS_BLOCK);
+		sim->inlen = 8;
+		sim->phase = SIMDEV_PHASE_DATA_IN;
+		break;
+	case SCSI_SERVICE_ACTION_IN:
+		if ((cdb[1] & 0x1f) != SAI_READ_CAPACITY_16) {
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			break;
+		}
+		memset(sim->in, 0, 32);
+		simdev_put_be32(sim->in, (sim->ums.blocks - 1) >> 32);
+		simdev_put_be32(sim->in + 4, sim->ums.blocks - 1);
+		simdev_put_be32(sim->in + 8, SIMDEV_UMS_BLOCK);
+		sim->inlen = 32;
+		sim->phase = SIMDEV_PHASE_DATA_IN;
+		break;
+	case SCSI_READ_10:
+	case SCSI_WRITE_10:
+	case SCSI_READ_16:
+	case SCSI_WRITE_16:
+		simdev_ums_rw(cntx, sim, cdb);
+		break;
+	default:
+		simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+		break;
+	}
+}
+
+static void simdev_cbw(struct p3udl_cntx *cntx, struct simdev *sim, const uint8_t *cbw)
+{
+	const uint8_t *cdb = cbw + 15;
+
+	sim->tag = cbw[4] | (cbw[5] << 8) | (cbw[6] << 16) | ((uint32_t) cbw[7] << 24);
+	sim->expected = cbw[8] | (cbw[9] << 8) | (cbw[10] << 16) | ((uint32_t) cbw[11] << 24);
+	sim->residue = 0;
+	sim->status = 0;
+	sim->opcode = cdb[0];
+	sim->subcode = cdb[1];
+	sim->phase = SIMDEV_PHASE_CSW;
+	sim->indata = sim->in;
+
+	switch (cdb[0]) {
+	case SCSI_INQUIRY:
+		memset(sim->in, 0, sizeof(sim->in));
+		if (sim->stage == SIMDEV_STAGE_UMS) {
+			memcpy(sim->in + 8, "Linux   ", 8);
+			memcpy(sim->in + 16, "File-Stor Gadget", 16);
+		}
+		else if (sim->opts.fast) {
+			memcpy(sim->in + 8, SSTARSCSI_FAST_VID, 8);
+			memcpy(sim->in + 16, SSTARSCSI_FAST_PID, 8);
+		}
+		else {
+			memcpy(sim->in + 8, "SigmaSta", 8);
+			memcpy(sim->in + 16, sim->stage == SIMDEV_STAGE_BOOTROM ? "BootROM " : "Updater ", 8);
+		}
+		memcpy(sim->in + 32, "SIM0", 4);
+		sim->inlen = 36;
+		sim->phase = SIMDEV_PHASE_DATA_IN;
+		break;
+	case SCSI_REQUEST_SENSE:
+		memset(sim->in, 0, sizeof(sim->in));
+		sim->in[0] = 0x70;
+		sim->in[2] = sim->sense_key;
+		sim->in[7] = 10;
+		sim->in[12] = sim->asc;
+		sim->inlen = 18;
+		sim->sense_key = 0;
+		sim->asc = 0;
+		sim->phase = SIMDEV_PHASE_DATA_IN;
+		break;
+	case SSTARSCSI_OPCODE:
+		if (sim->stage == SIMDEV_STAGE_UMS) {
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+			break;
+		}
+		sim->expected = simdev_get_be32(cdb + 6);
+		switch (sim->subcode) {
+		case SSTARSCSI_SUBCODE_DOWNLOAD_KEEP:
+		case SSTARSCSI_SUBCODE_DOWNLOAD_END:
+		case SSTARSCSI_SUBCODE_SUBCODE_UFU_LOADINFO:
+			sim->phase = SIMDEV_PHASE_DATA_OUT;
+			break;
+		case SSTARSCSI_SUBCODE_GET_RESULT:
+			memcpy(sim->in, sim->result, sizeof(sim->result));
+			sim->inlen = sizeof(sim->result);
+			sim->phase = SIMDEV_PHASE_DATA_IN;
+			break;
+		case SSTARSCSI_SUBCODE_GET_STATE:
+			memset(sim->in, 0, 4);
+			sim->in[0] = sim->stage;
+			sim->inlen = 4;
+			sim->phase = SIMDEV_PHASE_DATA_IN;
+			break;
+		default:
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			break;
+		}
+		break;
+	default:
+		if (sim->stage == SIMDEV_STAGE_UMS)
+			simdev_ums_cbw(cntx, sim, cdb);
+		else
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_COMMAND);
+		break;
+	}
+}
+
+/* Returns how much of the data phase was taken, a short one stalls the rest */
+static int simdev_data_out(struct p3udl_cntx *cntx, struct simdev *sim, const uint8_t *data, int len)
+{
+	uint32_t limit = sim->stage == SIMDEV_STAGE_BOOTROM ? SSTARSCSI_BOOTROM_MAXTRANSFER :
+			sim->opts.fast ? SSTARSCSI_FAST_MAXTRANSFER : sim->opts.max_segment;
+
+	sim->residue = len < sim->expected ? sim->expected - len : 0;
+	sim->phase = SIMDEV_PHASE_CSW;
+
+	if (sim->stage == SIMDEV_STAGE_UMS) {
+		memcpy(sim->ums.wr, data, min(len, (int) sim->expected));
+		return len;
+	}
+
+	switch (sim->subcode) {
+	case SSTARSCSI_SUBCODE_SUBCODE_UFU_LOADINFO:
+		memset(&sim->loadinfo, 0, sizeof(sim->loadinfo));
+		memcpy(&sim->loadinfo, data, min(len, (int) sizeof(sim->loadinfo)));
+		sim->have_loadinfo = true;
+		sim->rxlen = 0;
+		break;
+	case SSTARSCSI_SUBCODE_DOWNLOAD_KEEP:
+	case SSTARSCSI_SUBCODE_DOWNLOAD_END:
+		if (len > limit) {
+			simdev_dbg(cntx, "refusing %d byte segment\n", len);
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			sim->residue = sim->expected;
+			break;
+		}
+
+		/* Only the updater, nothing can get the boot ROM going again */
+		if (sim->stage == SIMDEV_STAGE_UPDATER && sim->opts.partial_every && len > 1 &&
+				!(++sim->nsegment % sim->opts.partial_every)) {
+			simdev_dbg(cntx, "stalling segment %lu half way\n", sim->nsegment);
+			simdev_store(sim, data, len / 2);
+			simdev_fail(sim, SENSE_ILLEGAL_REQUEST, ASC_INVALID_FIELD);
+			sim->residue = sim->expected - len / 2;
+			sim->halted = true;
+			return len / 2;
+		}
+
+		simdev_store(sim, data, len);
+		if (sim->subcode == SSTARSCSI_SUBCODE_DOWNLOAD_END)
+			simdev_download_end(cntx, sim);
+		break;
+	}
+
+	return len;
+}
+
+static bool simdev_is_cbw(const uint8_t *data, int len)
+{
+	return len == SIMDEV_CBW_LEN && !memcmp(data, "USBC", 4);
+}
+
+/* The device end of a bulk OUT transfer */
+static int simdev_out(struct p3udl_cntx *cntx, struct simdev *sim, const uint8_t *data, int len, int *actual)
+{
+	*actual = 0;
+
+	if (sim->halted)
+		return LIBUSB_ERROR_PIPE;
+
+	/*
+	 * A CBW in any phase means the host gave up on the last command
+	 * (timed out and retried), start again like a real device would
+	 * after a reset.
+	 */
+	if (simdev_is_cbw(data, len) &&
+			(sim->phase != SIMDEV_PHASE_DATA_OUT || sim->expected != SIMDEV_CBW_LEN)) {
+		sim->ncbw++;
+		if (sim->opts.stall_every && !(sim->ncbw % sim->opts.stall_every)) {
+			simdev_dbg(cntx, "stalling CBW %lu\n", sim->ncbw);
+			sim->halted = true;
+			return LIBUSB_ERROR_PIPE;
+		}
+
+		simdev_cbw(cntx, sim, data);
+		*actual = len;
+		return LIBUSB_SUCCESS;
+	}
+
+	if (sim->phase != SIMDEV_PHASE_DATA_OUT) {
+		sim->halted = true;
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	*actual = simdev_data_out(cntx, sim, data, len);
+	return *actual < len ? LIBUSB_ERROR_PIPE : LIBUSB_SUCCESS;
+}
+
+/* The device end of a bulk IN transfer, nothing to send looks like a timeout */
+static int simdev_in(struct p3udl_cntx *cntx, struct simdev *sim, uint8_t *data, int len, int *actual)
+{
+	*actual = 0;
+
+	switch (sim->phase) {
+	case SIMDEV_PHASE_DATA_IN: {
+		int n = min(len, sim->inlen);
+
+		memcpy(data, sim->indata, n);
+		*actual = n;
+		sim->residue = sim->expected > n ? sim->expected - n : 0;
+		sim->phase = SIMDEV_PHASE_CSW;
+		return LIBUSB_SUCCESS;
+	}
+	case SIMDEV_PHASE_CSW:
+		if (len < SIMDEV_CSW_LEN)
+			return LIBUSB_ERROR_OVERFLOW;
+
+		memcpy(data, "USBS", 4);
+		for (int i = 0; i < 4; i++) {
+			data[4 + i] = (sim->tag >> (i * 8)) & 0xff;
+			data[8 + i] = (sim->residue >> (i * 8)) & 0xff;
+		}
+		data[12] = sim->status;
+		*actual = SIMDEV_CSW_LEN;
+		sim->phase = SIMDEV_PHASE_CBW;
+		return LIBUSB_SUCCESS;
+	default:
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+}
+
+static int simdev_transfer(struct p3udl_cntx *cntx, struct simdev *sim, uint8_t endpoint,
+		uint8_t *data, int len, int *actual)
+{
+	if (endpoint & LIBUSB_ENDPOINT_IN)
+		return simdev_in(cntx, sim, data, len, actual);
+
+	return simdev_out(cntx, sim, data, len, actual);
+}
+
+/* A config with one DFU interface, an alt setting per target and the functional descriptor at the end */
+static int simdev_dfu_config(struct simdev *sim, uint8_t *data, uint16_t length)
+{
+	uint8_t desc[LIBUSB_DT_CONFIG_SIZE + (SIMDEV_DFU_NALTS * 9) + DFU_FUNCTIONAL_LENGTH];
+	uint8_t *d = desc;
+
+	*d++ = LIBUSB_DT_CONFIG_SIZE;
+	*d++ = LIBUSB_DT_CONFIG;
+	*d++ = sizeof(desc) & 0xff;
+	*d++ = sizeof(desc) >> 8;
+	*d++ = 1;	/* bNumInterfaces */
+	*d++ = 1;	/* bConfigurationValue */
+	*d++ = 0;
+	*d++ = 0x80;
+	*d++ = 50;
+
+	for (int i = 0; i < SIMDEV_DFU_NALTS; i++) {
+		*d++ = 9;
+		*d++ = LIBUSB_DT_INTERFACE;
+		*d++ = 0;	/* bInterfaceNumber */
+		*d++ = i;	/* bAlternateSetting */
+		*d++ = 0;	/* bNumEndpoints */
+		*d++ = DFU_INTERFACE_CLASS;
+		*d++ = DFU_INTERFACE_SUBCLASS;
+		*d++ = DFU_PROTOCOL_DFU_MODE;
+		*d++ = SIMDEV_DFU_ISTRING + i;
+	}
+
+	*d++ = DFU_FUNCTIONAL_LENGTH;
+	*d++ = DFU_DT_FUNCTIONAL;
+	*d++ = 0x01 | DFU_ATTR_MANIFEST_TOLERANT;	/* bitCanDnload */
+	*d++ = 0xff;	/* wDetachTimeOut */
+	*d++ = 0x00;
+	*d++ = sim->opts.dfu_xfer & 0xff;
+	*d++ = sim->opts.dfu_xfer >> 8;
+	*d++ = 0x10;	/* bcdDFUVersion 1.1 */
+	*d++ = 0x01;
+
+	int n = min((int) length, (int) sizeof(desc));
+	memcpy(data, desc, n);
+
+	return n;
+}
+
+static int simdev_dfu_string(uint8_t index, uint8_t *data, uint16_t length)
+{
+	uint8_t desc[64] = { 0, LIBUSB_DT_STRING };
+
+	if (!index) {
+		desc[0] = 4;
+		desc[2] = 0x09;
+		desc[3] = 0x04;
+	}
+	else if (index >= SIMDEV_DFU_ISTRING && index < SIMDEV_DFU_ISTRING + SIMDEV_DFU_NALTS) {
+		const char *name = simdev_dfu_alts[index - SIMDEV_DFU_ISTRING];
+
+		desc[0] = 2;
+		for (; *name; name++) {
+			desc[desc[0]++] = *name;
+			desc[desc[0]++] = 0;
+		}
+	}
+	else
+		return LIBUSB_ERROR_PIPE;
+
+	int n = min((int) length, (int) desc[0]);
+	memcpy(data, desc, n);
+
+	return n;
+}
+
+static void simdev_dfu_reset(struct simdev *sim)
+{
+	sim->dfu.state = DFU_STATE_IDLE;
+	sim->dfu.status = DFU_STATUS_OK;
+	sim->dfu.block = 0;
+	sim->dfu.busy = false;
+	sim->dfu.bytes = 0;
+	MD5_Init(&sim->dfu.md5);
+}
+
+/* Anything unexpected sends the gadget to dfuERROR and stalls, like u-boot does */
+static int simdev_dfu_error(struct p3udl_cntx *cntx, struct simdev *sim, uint8_t status, const char *why)
+{
+	simdev_dbg(cntx, "dfu: %s in %s\n", why, dfu_state_name(sim->dfu.state));
+	sim->dfu.state = DFU_STATE_ERROR;
+	sim->dfu.status = status;
+
+	return LIBUSB_ERROR_PIPE;
+}
+
+static int simdev_dfu_dnload(struct p3udl_cntx *cntx, struct simdev *sim, uint16_t block,
+		const uint8_t *data, uint16_t length)
+{
+	if (sim->dfu.state != DFU_STATE_IDLE && sim->dfu.state != DFU_STATE_DNLOAD_IDLE)
+		return simdev_dfu_error(cntx, sim, DFU_STATUS_ERR_STALLEDPKT, "DNLOAD");
+
+	if (!length) {
+		if (sim->dfu.state != DFU_STATE_DNLOAD_IDLE)
+			return simdev_dfu_error(cntx, sim, DFU_STATUS_ERR_STALLEDPKT, "empty DNLOAD");
+
+		sim->dfu.state = DFU_STATE_MANIFEST_SYNC;
+		return 0;
+	}
+
+	if (length > sim->opts.dfu_xfer)
+		return simdev_dfu_error(cntx, sim, DFU_STATUS_ERR_STALLEDPKT, "oversized DNLOAD");
+	if (block != sim->dfu.block)
+		return simdev_dfu_error(cntx, sim, DFU_STATUS_ERR_UNKNOWN, "out of sequence DNLOAD");
+
+	MD5_Update(&sim->dfu.md5, data, length);
+	sim->dfu.bytes += length;
+	sim->dfu.block++;
+	sim->dfu.busy = sim->opts.dfu_poll_ms && !sim->opts.dfu_flush_every;
+	sim->dfu.state = DFU_STATE_DNLOAD_SYNC;
+
+	return length;
+}
+
+static int simdev_dfu_getstatus(struct p3udl_cntx *cntx, struct simdev *sim, uint8_t *data, uint16_t length)
+{
+	struct dfu_status status = { 0 };
+	unsigned int poll = 0;
+
+	switch (sim->dfu.state) {
+	case DFU_STATE_DNLOAD_SYNC:
+	case DFU_STATE_DNBUSY:
+		/* Report busy once per block then it's done */
+		if (sim->dfu.busy) {
+			sim->dfu.busy = false;
+			sim->dfu.state = DFU_STATE_DNBUSY;
+			poll = sim->opts.dfu_poll_ms;
+		}
+		else {
+			sim->dfu.state = DFU_STATE_DNLOAD_IDLE;
+			/* u-boot doesn't go busy, it writes the buffer out first and then asks for the time */
+			if (sim->opts.dfu_flush_every && !(sim->dfu.block % sim->opts.dfu_flush_every))
+				poll = sim->opts.dfu_poll_ms;
+		}
+		break;
+	case DFU_STATE_MANIFEST_SYNC: {
+		uint8_t digest[MD5_DIGEST_LENGTH];
+		char hex[(MD5_DIGEST_LENGTH * 2) + 1];
+
+		MD5_Final(digest, &sim->dfu.md5);
+		for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+			sprintf(hex + (i * 2), "%02x", digest[i]);
+		simdev_info(cntx, "dfu: \"%s\" got %zu bytes, MD5 %s\n",
+				simdev_dfu_alts[sim->dfu.alt], sim->dfu.bytes, hex);
+
+		simdev_dfu_reset(sim);
+		break;
+	}
+	default:
+		break;
+	}
+
+	status.bStatus = sim->dfu.status;
+	status.bwPollTimeout[0] = poll & 0xff;
+	status.bwPollTimeout[1] = (poll >> 8) & 0xff;
+	status.bwPollTimeout[2] = (poll >> 16) & 0xff;
+	status.bState = sim->dfu.state;
+
+	int n = min((int) length, (int) sizeof(status));
+	memcpy(data, &status, n);
+
+	return n;
+}
+
+/* The device end of a control transfer, returns the length of the data stage */
+static int simdev_control(struct p3udl_cntx *cntx, struct simdev *sim, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint8_t *data, uint16_t length)
+{
+	const uint8_t class_in = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+	const uint8_t class_out = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE;
+
+	/* GET_MAX_LUN and the mass storage reset are the only ones the mass storage stages answer */
+	if (sim->stage != SIMDEV_STAGE_DFU) {
+		if (request_type == class_in && request == 0xfe && length >= 1) {
+			data[0] = 0;
+			return 1;
+		}
+
+		if (request_type == class_out && request == 0xff) {
+			simdev_dbg(cntx, "mass storage reset\n");
+			sim->phase = SIMDEV_PHASE_CBW;
+			sim->halted = false;
+			return 0;
+		}
+
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (request_type == (LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD | LIBUSB_RECIPIENT_DEVICE) &&
+			request == LIBUSB_REQUEST_GET_DESCRIPTOR) {
+		switch (value >> 8) {
+		case LIBUSB_DT_CONFIG:
+			return simdev_dfu_config(sim, data, length);
+		case LIBUSB_DT_STRING:
+			return simdev_dfu_string(value & 0xff, data, length);
+		default:
+			return LIBUSB_ERROR_PIPE;
+		}
+	}
+
+	if (request_type == class_out && request == DFU_REQUEST_DNLOAD)
+		return simdev_dfu_dnload(cntx, sim, value, data, length);
+
+	if (request_type == class_in && request == DFU_REQUEST_GETSTATUS)
+		return simdev_dfu_getstatus(cntx, sim, data, length);
+
+	if (request_type == class_in && request == DFU_REQUEST_GETSTATE && length >= 1) {
+		data[0] = sim->dfu.state;
+		return 1;
+	}
+
+	if (request_type == class_out && request == DFU_REQUEST_CLRSTATUS) {
+		if (sim->dfu.state != DFU_STATE_ERROR)
+			return simdev_dfu_error(cntx, sim, DFU_STATUS_ERR_STALLEDPKT, "CLRSTATUS");
+		simdev_dfu_reset(sim);
+		return 0;
+	}
+
+	if (request_type == class_out && request == DFU_REQUEST_ABORT) {
+		if (sim->dfu.state == DFU_STATE_ERROR)
+			return simdev_dfu_error(cntx, sim, sim->dfu.status, "ABORT");
+		simdev_dfu_reset(sim);
+		return 0;
+	}
+
+	return simdev_dfu_error(cntx, sim, DFU_STATUS_ERR_STALLEDPKT, "unknown request");
+}
+
+static bool simdev_inject_timeout(struct simdev *sim)
+{
+	sim->nbulk++;
+
+	return sim->opts.timeout_every && !(sim->nbulk % sim->opts.timeout_every);
+}
+
+static int transport_sim_setup(struct p3udl_cntx *cntx)
+{
+	cntx->ep_in = 0x81;
+	cntx->ep_out = 0x02;
+	cntx->ep_maxpacket = 512;
+
+	return 0;
+}
+
+static void transport_sim_close(struct p3udl_cntx *cntx)
+{
+	struct simdev *sim = cntx->transport_priv;
+
+	while (sim->queue) {
+		struct simdev_xfer *next = sim->queue->next;
+
+		free(sim->queue);
+		sim->queue = next;
+	}
+
+	free(sim->rx);
+	free(sim->ums.disk);
+	free(sim);
+	cntx->transport_priv = NULL;
+}
+
+static int transport_sim_bulk(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t *data,
+		int length, int *actual_length, unsigned int timeout)
+{
+	struct simdev *sim = cntx->transport_priv;
+	uint64_t now = clock_now_ns();
+
+	if (simdev_inject_timeout(sim)) {
+		simdev_sleep_until(now + timeout * NSEC_PER_MSEC);
+		*actual_length = 0;
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	int ret = simdev_transfer(cntx, sim, endpoint, data, length, actual_length);
+	if (ret == LIBUSB_ERROR_TIMEOUT) {
+		simdev_sleep_until(now + timeout * NSEC_PER_MSEC);
+		return ret;
+	}
+
+	uint64_t start = now + (sim->opts.latency_us * NSEC_PER_USEC);
+	if (sim->busy_until > start)
+		start = sim->busy_until;
+	sim->busy_until = start + simdev_wire_ns(sim, *actual_length);
+	simdev_sleep_until(sim->busy_until);
+
+	return ret;
+}
+
+static int transport_sim_control(struct p3udl_cntx *cntx, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout)
+{
+	struct simdev *sim = cntx->transport_priv;
+	uint64_t start = clock_now_ns() + (sim->opts.latency_us * NSEC_PER_USEC);
+
+	if (sim->busy_until > start)
+		start = sim->busy_until;
+
+	int ret = simdev_control(cntx, sim, request_type, request, value, index, data, length);
+
+	sim->busy_until = start + simdev_wire_ns(sim, ret > 0 ? ret : 0);
+	simdev_sleep_until(sim->busy_until);
+
+	return ret;
+}
+
+static int transport_sim_clear_halt(struct p3udl_cntx *cntx, uint8_t endpoint)
+{
+	struct simdev *sim = cntx->transport_priv;
+
+	sim->halted = false;
+
+	return 0;
+}
+
+/* Look for the board every 100ms like the real thing does, false if it was cancelled meanwhile */
+static bool simdev_reconnect_wait(struct p3udl_cntx *cntx, unsigned int ms)
+{
+	uint64_t deadline = clock_now_ns() + (ms * NSEC_PER_MSEC);
+
+	for (uint64_t now = clock_now_ns(); now < deadline; now = clock_now_ns()) {
+		if (board_cancelled(cntx))
+			return false;
+		simdev_sleep_until(min(deadline, now + (100 * NSEC_PER_MSEC)));
+	}
+
+	return true;
+}
+
+/* Booting u-boot takes a while, then it's there on the same port as a DFU or mass storage gadget */
+static int transport_sim_reconnect(struct p3udl_cntx *cntx, unsigned int timeout_ms)
+{
+	struct simdev *sim = cntx->transport_priv;
+
+	if (sim->stage == SIMDEV_STAGE_DFU || sim->stage == SIMDEV_STAGE_UMS)
+		return 0;
+
+	if (sim->stage != SIMDEV_STAGE_UBOOT || sim->opts.boot_ms > timeout_ms)
+		return simdev_reconnect_wait(cntx, timeout_ms) ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_INTERRUPTED;
+
+	if (!simdev_reconnect_wait(cntx, sim->opts.boot_ms))
+		return LIBUSB_ERROR_INTERRUPTED;
+	sim->busy_until = 0;
+
+	if (sim->opts.ums_mb) {
+		sim->ums.blocks = ((uint64_t) sim->opts.ums_mb * 1024 * 1024) / SIMDEV_UMS_BLOCK;
+		sim->ums.disk = calloc(sim->ums.blocks, SIMDEV_UMS_BLOCK);
+		if (!sim->ums.disk)
+			return LIBUSB_ERROR_NO_MEM;
+
+		if (sim->opts.disk_path) {
+			FILE *f = fopen(sim->opts.disk_path, "rb");
+
+			if (!f) {
+				simdev_err(cntx, "Can't open %s: %s\n", sim->opts.disk_path, strerror(errno));
+				return LIBUSB_ERROR_IO;
+			}
+			size_t n = fread(sim->ums.disk, SIMDEV_UMS_BLOCK, sim->ums.blocks, f);
+			fclose(f);
+			simdev_dbg(cntx, "ums: disk starts with %zu blocks of %s\n", n, sim->opts.disk_path);
+		}
+
+		sim->stage = SIMDEV_STAGE_UMS;
+		sim->phase = SIMDEV_PHASE_CBW;
+		sim->halted = false;
+		sim->ums.attention = true;
+		return 0;
+	}
+
+	sim->stage = SIMDEV_STAGE_DFU;
+	simdev_dfu_reset(sim);
+
+	return 0;
+}
+
+static int transport_sim_claim_interface(struct p3udl_cntx *cntx, uint8_t interface)
+{
+	struct simdev *sim = cntx->transport_priv;
+
+	return ((sim->stage == SIMDEV_STAGE_DFU || sim->stage == SIMDEV_STAGE_UMS) && !interface) ?
+			0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int transport_sim_set_altsetting(struct p3udl_cntx *cntx, uint8_t interface, uint8_t altsetting)
+{
+	struct simdev *sim = cntx->transport_priv;
+
+	if (sim->stage != SIMDEV_STAGE_DFU || interface || altsetting >= SIMDEV_DFU_NALTS)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	sim->dfu.alt = altsetting;
+	simdev_dfu_reset(sim);
+
+	return 0;
+}
+
+/*
+ * The device end is run as soon as the transfer is submitted, in
+ * submission order, and the completion is delivered from handle_events
+ * once the modelled wire time has passed.
+ */
+static int transport_sim_submit(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct simdev *sim = cntx->transport_priv;
+	struct simdev_xfer *sx = calloc(1, sizeof(*sx));
+	uint64_t now = clock_now_ns();
+
+	if (!sx)
+		return LIBUSB_ERROR_NO_MEM;
+
+	sx->xfer = xfer;
+	if (xfer->timeout)
+		sx->deadline = now + (xfer->timeout * NSEC_PER_MSEC);
+
+	/* Once something hangs everything behind it on the wire waits too */
+	if (sim->hung || simdev_inject_timeout(sim))
+		sim->hung = sx->hung = true;
+	else {
+		int ret;
+
+		if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			const uint8_t *setup = xfer->buffer;
+
+			ret = simdev_control(cntx, sim, setup[0], setup[1], setup[2] | (setup[3] << 8),
+					setup[4] | (setup[5] << 8), xfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+					setup[6] | (setup[7] << 8));
+			sx->actual_length = ret > 0 ? ret : 0;
+			if (ret > 0)
+				ret = LIBUSB_SUCCESS;
+		}
+		else
+			ret = simdev_transfer(cntx, sim, xfer->endpoint, xfer->buffer, xfer->length,
+					&sx->actual_length);
+
+		switch (ret) {
+		case LIBUSB_SUCCESS:
+			sx->status = LIBUSB_TRANSFER_COMPLETED;
+			break;
+		case LIBUSB_ERROR_PIPE:
+			sx->status = LIBUSB_TRANSFER_STALL;
+			break;
+		case LIBUSB_ERROR_OVERFLOW:
+			sx->status = LIBUSB_TRANSFER_OVERFLOW;
+			break;
+		case LIBUSB_ERROR_TIMEOUT:
+			sim->hung = sx->hung = true;
+			break;
+		default:
+			sx->status = LIBUSB_TRANSFER_ERROR;
+			break;
+		}
+
+		/* Only an idle pipe pays the turnaround */
+		uint64_t start = sim->busy_until > now ? sim->busy_until :
+				now + (sim->opts.latency_us * NSEC_PER_USEC);
+		sim->busy_until = sx->done = start + simdev_wire_ns(sim, sx->actual_length);
+	}
+
+	if (!sim->queue)
+		sim->queue_tail = &sim->queue;
+	*sim->queue_tail = sx;
+	sim->queue_tail = &sx->next;
+
+	return 0;
+}
+
+static int transport_sim_cancel(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct simdev *sim = cntx->transport_priv;
+
+	for (struct simdev_xfer *sx = sim->queue; sx; sx = sx->next) {
+		if (sx->xfer != xfer)
+			continue;
+
+		/* Anything that isn't stuck is already on the wire and will complete */
+		if (!sx->hung)
+			return LIBUSB_ERROR_NOT_FOUND;
+
+		sx->cancelled = true;
+		return 0;
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int transport_sim_handle_events(struct p3udl_cntx *cntx, struct timeval *tv, int *completed)
+{
+	struct simdev *sim = cntx->transport_priv;
+	uint64_t deadline = clock_now_ns() + (tv->tv_sec * NSEC_PER_SEC) + (tv->tv_usec * NSEC_PER_USEC);
+	struct simdev_xfer *sx = sim->queue;
+
+	/* Stuck transfers with a timeout come back like libusb would hand them back */
+	for (struct simdev_xfer *it = sx; it; it = it->next) {
+		if (it->hung && !it->cancelled && it->deadline && clock_now_ns() >= it->deadline)
+			it->cancelled = it->timed_out = true;
+	}
+
+	if (!sx || (sx->hung && !sx->cancelled)) {
+		/* Cancelled transfers further back still get handed back */
+		for (struct simdev_xfer **pp = sx ? &sx->next : NULL; pp && *pp; pp = &(*pp)->next) {
+			if ((*pp)->cancelled) {
+				sx = *pp;
+				*pp = sx->next;
+				if (!*pp)
+					sim->queue_tail = pp;
+				goto complete;
+			}
+		}
+
+		simdev_sleep_until(deadline);
+		return 0;
+	}
+
+	if (!sx->cancelled) {
+		if (sx->done > deadline) {
+			simdev_sleep_until(deadline);
+			return 0;
+		}
+		simdev_sleep_until(sx->done);
+	}
+
+	sim->queue = sx->next;
+	if (!sim->queue)
+		sim->queue_tail = &sim->queue;
+
+complete:
+	if (sx->cancelled) {
+		sx->status = sx->timed_out ? LIBUSB_TRANSFER_TIMED_OUT : LIBUSB_TRANSFER_CANCELLED;
+		sx->actual_length = 0;
+	}
+
+	/* Nothing stuck left means the wire is free again */
+	if (sim->hung) {
+		bool hung = false;
+
+		for (struct simdev_xfer *it = sim->queue; it; it = it->next)
+			hung |= it->hung && !it->cancelled;
+		sim->hung = hung;
+	}
+
+	struct libusb_transfer *xfer = sx->xfer;
+
+	xfer->status = sx->status;
+	xfer->actual_length = sx->actual_length;
+	free(sx);
+
+	xfer->callback(xfer);
+
+	return 0;
+}
+
+const struct p3udl_transport transport_sim = {
+	.name = "sim",
+	.setup = transport_sim_setup,
+	.close = transport_sim_close,
+	.bulk = transport_sim_bulk,
+	.control = transport_sim_control,
+	.clear_halt = transport_sim_clear_halt,
+	.reconnect = transport_sim_reconnect,
+	.claim_interface = transport_sim_claim_interface,
+	.set_altsetting = transport_sim_set_altsetting,
+	.submit = transport_sim_submit,
+	.cancel = transport_sim_cancel,
+	.handle_events = transport_sim_handle_events,
+};
+
+int simdev_open(struct p3udl_cntx *cntx, const struct simdev_opts *opts, int index)
+{
+	struct simdev *sim = calloc(1, sizeof(*sim));
+
+	if (!sim)
+		return -ENOMEM;
+
+	sim->opts = *opts;
+	sim->queue_tail = &sim->queue;
+	/* Nothing to go through the boot ROM for */
+	if (opts->fast)
+		sim->stage = SIMDEV_STAGE_UPDATER;
+
+	cntx->tag = 1;
+	cntx->stage = P3UDL_STAGE_PROBE;
+	snprintf(cntx->name, sizeof(cntx->name), "sim%d", index);
+	/* Round robin over the buses, one hub port each */
+	cntx->bus = 1 + (index % opts->buses);
+	cntx->ports[0] = 1 + (index / opts->buses);
+	cntx->nports = 1;
+	cntx->transport = &transport_sim;
+	cntx->transport_priv = sim;
+
+	return 0;
+}
+
+/*
+ * "latency=<us>,bandwidth=<MB/s>,timeout=<n>,stall=<n>,partial=<n>,segment=<bytes>,
+ *  boot=<ms>,dfu=<bytes>,poll=<ms>,flush=<n>,ums=<MiB>,disk=<file>,fast=<0|1>,buses=<n>"
+ */
+int simdev_parse_opts(const char *str, struct simdev_opts *opts)
+{
+	char *copy = strdup(str), *save, *tok;
+	int ret = 0;
+
+	if (!copy)
+		return -ENOMEM;
+
+	for (tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(tok, '=');
+
+		if (!value) {
+			ret = -EINVAL;
+			break;
+		}
+		*value++ = '\0';
+
+		unsigned long v = strtoul(value, NULL, 0);
+
+		if (!strcmp(tok, "latency"))
+			opts->latency_us = v;
+		else if (!strcmp(tok, "bandwidth") && v)
+			opts->bandwidth = v;
+		else if (!strcmp(tok, "timeout"))
+			opts->timeout_every = v;
+		else if (!strcmp(tok, "stall"))
+			opts->stall_every = v;
+		else if (!strcmp(tok, "partial"))
+			opts->partial_every = v;
+		else if (!strcmp(tok, "segment") && v)
+			opts->max_segment = v;
+		else if (!strcmp(tok, "boot"))
+			opts->boot_ms = v;
+		else if (!strcmp(tok, "dfu") && v && v <= UINT16_MAX)
+			opts->dfu_xfer = v;
+		else if (!strcmp(tok, "poll"))
+			opts->dfu_poll_ms = v;
+		else if (!strcmp(tok, "flush"))
+			opts->dfu_flush_every = v;
+		else if (!strcmp(tok, "ums"))
+			opts->ums_mb = v;
+		else if (!strcmp(tok, "disk") && *value) {
+			free(opts->disk_path);
+			opts->disk_path = strdup(value);
+		}
+		else if (!strcmp(tok, "fast"))
+			opts->fast = v != 0;
+		else if (!strcmp(tok, "buses") && v && v < 255)
+			opts->buses = v;
+		else {
+			ret = -EINVAL;
+			break;
+		}
+	}
+
+	free(copy);
+
+	return ret;
+}
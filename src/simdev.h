@@ -0,0 +1,58 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __SIMDEV_H_
+#define __SIMDEV_H_
+
+#include "cntx.h"
+#include "transport.h"
+
+struct simdev_opts {
+	/* host <-> device turnaround for a transfer on an idle pipe */
+	unsigned int latency_us;
+	/* MB/s once data is moving */
+	unsigned int bandwidth;
+	/* every nth bulk transfer times out, 0 for never */
+	unsigned int timeout_every;
+	/* every nth CBW gets a STALL, 0 for never */
+	unsigned int stall_every;
+	/* every nth segment the updater gets stalls half way through its data, 0 for never */
+	unsigned int partial_every;
+	/* biggest segment the pretend usb updater takes */
+	unsigned int max_segment;
+	/* how long u-boot takes to come back as a DFU or mass storage gadget */
+	unsigned int boot_ms;
+	/* DFU wTransferSize */
+	unsigned int dfu_xfer;
+	/* bwPollTimeout after each DFU block, 0 for never busy */
+	unsigned int dfu_poll_ms;
+	/*
+	 * only every nth DFU block asks for the poll time, and already back in
+	 * dfuDNLOAD-IDLE like u-boot writing out its buffer, 0 for every block
+	 */
+	unsigned int dfu_flush_every;
+	/* u-boot comes back as a mass storage gadget with a disk this big instead of DFU, 0 for DFU */
+	unsigned int ums_mb;
+	/* what the disk starts out with, for trying --delta against, NULL for zeroes */
+	char *disk_path;
+	/* boards are already running u-boot's fast download gadget instead of the boot ROM */
+	bool fast;
+	/* pretend buses the boards are spread over */
+	unsigned int buses;
+};
+
+/* Roughly a high speed link with a boot ROM on the other end */
+#define SIMDEV_OPTS_DEFAULT {			\
+	.latency_us = 250,			\
+	.bandwidth = 35,			\
+	.max_segment = 16 * 1024,		\
+	.boot_ms = 500,				\
+	.dfu_xfer = 4096,			\
+	.buses = 1,				\
+}
+
+extern const struct p3udl_transport transport_sim;
+
+int simdev_open(struct p3udl_cntx *cntx, const struct simdev_opts *opts, int index);
+int simdev_parse_opts(const char *str, struct simdev_opts *opts);
+
+#endif /* __SIMDEV_H_ */
@@ -8,8 +8,15 @@
 #include <unistd.h>
 #include <openssl/md5.h>
 
+#include "board.h"
+#include "clock.h"
+#include "metrics.h"
 #include "usbms.h"
 #include "sstarscsi.h"
+#include "transport.h"
+#include "tune.h"
+#include "report.h"
+#include "xfer.h"
 
 #include "sstarscsi_log.h"
 
@@ -23,98 +30,322 @@ static void sstarscsi_setup_cdb(uint8_t *cdb, uint8_t subcmd, uint32_t len)
 	cdb[9]  = (uint8_t)(len & 0xff);
 }
 
-static int sstarscsi_do_op(struct p3udl_cntx *cntx, uint8_t subcmd, void *buf, uint32_t len, bool writebuffer)
+/*
+ * torn, if not NULL, is set when the CSW of a failed command says the
+ * device kept part of buf. Anything else either went all the way or
+ * didn't happen and can be sent again, a data phase that timed out is
+ * thrown away by the reset recovery that follows it.
+ */
+static int sstarscsi_do_op(struct p3udl_cntx *cntx, uint8_t subcmd, void *buf, uint32_t len, bool writebuffer,
+		bool *torn)
 {
 	uint8_t cdb[16] = { 0 };
-	uint32_t expected_tag;
+	uint8_t data_ep = writebuffer ? cntx->ep_out : cntx->ep_in;
+	uint32_t expected_tag, residue = len;
+	int actual_txed = 0;
+	bool unused;
+	/*
+	 * Only plain segments take a predictable amount of time, anything
+	 * else can have the device go off and do something before answering.
+	 */
+	unsigned int timeout = subcmd == SSTARSCSI_SUBCODE_DOWNLOAD_KEEP ? xfer_timeout(cntx) : XFER_TIMEOUT_MS;
+
+	if (!torn)
+		torn = &unused;
+	*torn = false;
 
 	sstarscsi_setup_cdb(cdb, subcmd, len);
 
 	/* Send the command */
 	sstarscsi_dbg(cntx, "Sending cmd...\n");
 	int ret = usb_massstorage_send_command(cntx, cntx->ep_out, cntx->lun, cdb,
-			LIBUSB_ENDPOINT_OUT, len, &expected_tag);
+			LIBUSB_ENDPOINT_OUT, len, &expected_tag, timeout);
 	if (ret < 0)
 		return ret;
 
-	if (writebuffer) {
-		/* Send the buffer */
-		sstarscsi_dbg(cntx, "Sending buffer...\n");
-		int actual_txed;
-		ret = libusb_bulk_transfer(cntx->lu_handle, cntx->ep_out, buf, len, &actual_txed, 1000);
-		if (ret < 0) {
-			sstarscsi_err(cntx, "Failed to send buffer: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
+	/* Send or read the buffer */
+	sstarscsi_dbg(cntx, "%s buffer...\n", writebuffer ? "Sending" : "Reading");
+	ret = cntx->transport->bulk(cntx, data_ep, buf, len, &actual_txed, timeout);
+	if (writebuffer)
+		board_progress(cntx, actual_txed);
+	if (ret < 0) {
+		sstarscsi_err(cntx, "Failed to %s buffer: %s (%d)\n", writebuffer ? "send" : "read",
+				libusb_strerror((enum libusb_error) ret), ret);
+		if (ret != LIBUSB_ERROR_PIPE)
 			return ret;
-		}
-		sstarscsi_dbg(cntx, "Wanted to send %d bytes, actually sent %d\n", len, actual_txed);
+
+		/* A stalled data phase still ends with a CSW, the residue says what the device used */
+		cntx->transport->clear_halt(cntx, data_ep);
+		metrics_inc(METRIC_STALLS);
+		metrics_inc(METRIC_CLEAR_HALTS);
 	}
 	else
-	{
-		/* Read the buffer */
-		sstarscsi_dbg(cntx, "Reading buffer...\n");
-		int actual_txed;
-		ret = libusb_bulk_transfer(cntx->lu_handle, cntx->ep_in, buf, len, &actual_txed, 1000);
-		if (ret < 0) {
-			sstarscsi_err(cntx, "Failed to read buffer: %s (%d)\n", libusb_strerror((enum libusb_error) ret), ret);
-			return ret;
-		}
-		sstarscsi_dbg(cntx, "Wanted to read %d bytes, actually read %d\n", len, actual_txed);
-	}
+		sstarscsi_dbg(cntx, "Wanted to transfer %d bytes, actually did %d\n", len, actual_txed);
 
 	/* Check status */
 	sstarscsi_dbg(cntx, "Check status...\n");
-	if (usb_massstorage_status(cntx, cntx->ep_in, expected_tag) == -2) {
+	int status = usb_massstorage_status(cntx, cntx->ep_in, expected_tag, timeout, &residue);
+	if (status == -2) {
 		usb_massstorage_sense(cntx, cntx->ep_in, cntx->ep_out);
+		/* The device understood the command and refused it */
+		*torn = writebuffer && residue < len;
+		return -EIO;
+	}
+	if (ret < 0) {
+		/* A stall the device still passed, it kept the data the residue doesn't cover */
+		*torn = writebuffer && !status && residue < len;
+		return ret;
+	}
+
+	/*
+	 * The data went out but the device didn't say what it made of it.
+	 * Get it waiting for a CBW again and count the command as done,
+	 * sending it again would be worse if it wasn't.
+	 */
+	if (status == -1) {
+		sstarscsi_info(cntx, "No status for command %02x, assuming it went through\n", subcmd);
+		usb_massstorage_reset_recovery(cntx);
 	}
 
 	return 0;
 }
 
-static int sstarscsi_upload_packet(struct p3udl_cntx *cntx, void *buf, uint32_t len, bool last)
+/* For commands that are safe to send again, retried as long as the transfer policy allows */
+static int sstarscsi_do_op_retry(struct p3udl_cntx *cntx, uint8_t subcmd, void *buf, uint32_t len, bool writebuffer)
+{
+	uint64_t started = clock_now_ns();
+	int ret;
+
+	for (;;) {
+		ret = sstarscsi_do_op(cntx, subcmd, buf, len, writebuffer, NULL);
+		if (ret == LIBUSB_ERROR_PIPE)
+			usb_massstorage_reset_recovery(cntx);
+		if (!ret || !xfer_retry(cntx, ret, started))
+			break;
+	}
+
+	return ret;
+}
+
+static int sstarscsi_upload_packet(struct p3udl_cntx *cntx, void *buf, uint32_t len, bool last, bool *torn)
 {
 	uint8_t subcmd = last ? SSTARSCSI_SUBCODE_DOWNLOAD_END : SSTARSCSI_SUBCODE_DOWNLOAD_KEEP;
 
-	return sstarscsi_do_op(cntx, subcmd, buf, len, true);
+	return sstarscsi_do_op(cntx, subcmd, buf, len, true, torn);
 }
 
-static int sstarscsi_upload_loop(struct p3udl_cntx *cntx, void *buf, uint32_t len)
+static int sstarscsi_upload_loop_sync(struct p3udl_cntx *cntx, void *buf, uint32_t len,
+		uint32_t segsz, uint32_t start)
 {
-	for (int i = 0; i < len; i += SSTARSCSI_BOOTROM_MAXTRANSFER) {
-		bool last = (i + SSTARSCSI_BOOTROM_MAXTRANSFER) >= len;
-		uint32_t txsz = min(len - i, SSTARSCSI_BOOTROM_MAXTRANSFER);
+	for (int i = start; i < len; i += segsz) {
+		bool last = (i + segsz) >= len;
+		uint32_t txsz = min(len - i, segsz);
 
+		uint64_t started = clock_now_ns();
+		bool torn;
 		int ret;
 
-		for (int attempt = 0; attempt < 10; attempt++) {
+		if (board_cancelled(cntx))
+			return -ECANCELED;
+
+		for (int attempt = 0;; attempt++) {
 			sstarscsi_dbg(cntx, "Uploading segment 0x%04x->0x%04x (%d bytes), last: %d, attempt: %d\n",
 					i, i + txsz, txsz, last, attempt);
 
-			ret = sstarscsi_upload_packet(cntx, buf + i, txsz, last);
-
+			ret = sstarscsi_upload_packet(cntx, buf + i, txsz, last, &torn);
 			if (!ret)
 				break;
 
-			if (ret != LIBUSB_ERROR_TIMEOUT) {
-				return -EIO;
+			/* Sending it again would put part of it in twice */
+			if (torn) {
+				sstarscsi_info(cntx, "Segment at 0x%04x was only partly taken\n", i);
+				return -ERESTART;
 			}
 
-			usleep(1000);
+			if (ret == LIBUSB_ERROR_PIPE)
+				usb_massstorage_reset_recovery(cntx);
+
+			if (!xfer_retry(cntx, ret, started))
+				break;
 		}
 
-		/* Catch falling out of the above loop via timeouts */
-		if (ret)
+		if (ret == LIBUSB_ERROR_NO_DEVICE || ret == LIBUSB_ERROR_TIMEOUT)
 			return ret;
+		if (ret)
+			return -EIO;
 	}
 
 	return 0;
 }
 
+/*
+ * Keep up to queue_depth segments queued on the device. If the queue
+ * fails, fall back to the synchronous loop (and its retries) from
+ * the first segment the device didn't take, unless it took something
+ * after that or only part of it.
+ */
+static int sstarscsi_upload_loop_queued(struct p3udl_cntx *cntx, void *buf, uint32_t len,
+		uint32_t segsz, uint32_t start)
+{
+	struct usb_massstorage_queue *queue = usb_massstorage_queue_new(cntx, cntx->queue_depth, segsz);
+	int ret = 0;
+
+	if (!queue)
+		return -ENOMEM;
+
+	/*
+	 * The last segment is left for the synchronous loop, the device can take
+	 * a while to answer it and that shouldn't look like the queue stalling.
+	 */
+	for (int i = start; (i + segsz) < len; i += segsz) {
+		uint8_t cdb[16] = { 0 };
+
+		if (board_cancelled(cntx)) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		sstarscsi_dbg(cntx, "Queueing segment 0x%04x->0x%04x (%d bytes)\n",
+				i, i + segsz, segsz);
+
+		sstarscsi_setup_cdb(cdb, SSTARSCSI_SUBCODE_DOWNLOAD_KEEP, segsz);
+		ret = usb_massstorage_queue_submit(queue, cdb, LIBUSB_ENDPOINT_OUT, buf + i, segsz);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		ret = usb_massstorage_queue_wait(queue);
+
+	uint32_t done = start + usb_massstorage_queue_retired(queue) * segsz;
+	bool torn = usb_massstorage_queue_torn(queue);
+	usb_massstorage_queue_free(queue);
+
+	if (ret == LIBUSB_ERROR_NO_DEVICE || ret == -ECANCELED)
+		return ret;
+	else if (ret && torn) {
+		sstarscsi_info(cntx, "Queued upload failed at 0x%04x with segments out of order\n", done);
+		return -ERESTART;
+	}
+	else if (ret) {
+		/* Cancelled CBWs and data can leave the device anywhere in a command, Bulk-Only wants a reset */
+		sstarscsi_info(cntx, "Queued upload %s at 0x%04x, recovering and continuing synchronously\n",
+				ret == LIBUSB_ERROR_TIMEOUT ? "timed out" : "failed", done);
+		usb_massstorage_reset_recovery(cntx);
+	}
+
+	return sstarscsi_upload_loop_sync(cntx, buf, len, segsz, done);
+}
+
+static int sstarscsi_upload_loop(struct p3udl_cntx *cntx, void *buf, uint32_t len,
+		uint32_t segsz, uint32_t start)
+{
+	bool queued = cntx->queue_depth > 1;
+	uint64_t begin = clock_now_ns();
+	int ret;
+
+	if (queued)
+		ret = sstarscsi_upload_loop_queued(cntx, buf, len, segsz, start);
+	else
+		ret = sstarscsi_upload_loop_sync(cntx, buf, len, segsz, start);
+
+	if (!ret) {
+		uint64_t elapsed = clock_now_ns() - begin;
+
+		cntx->report.bytes += len - start;
+
+		sstarscsi_info(cntx, "Uploaded %u bytes in %llu ms, %.2f MB/s (%s, queue depth %u, %u byte segments)\n",
+				len - start, (unsigned long long) (elapsed / NSEC_PER_MSEC), clock_mbps(len - start, elapsed),
+				queued ? "queued" : "synchronous", queued ? cntx->queue_depth : 1, segsz);
+	}
+
+	return ret;
+}
+
 int sstarscsi_upload_bootrom(struct p3udl_cntx *cntx, void *buf, uint32_t len)
 {
 	sstarscsi_info(cntx, "Doing upload using the boot ROM\n");
 
 	/* Boot ROM just wants packets splatted at it */
-	return sstarscsi_upload_loop(cntx, buf, len);
+	uint64_t begin = clock_now_ns();
+	int ret = sstarscsi_upload_loop(cntx, buf, len, SSTARSCSI_BOOTROM_MAXTRANSFER, 0);
+	if (!ret)
+		tune_put_rate(cntx, "bootrom", len, clock_now_ns() - begin);
+
+	/* and there is no way to tell it to start again */
+	if (ret == -ERESTART) {
+		sstarscsi_err(cntx, "Boot ROM has a damaged IPL, the board needs resetting\n");
+		return -EIO;
+	}
+
+	return ret;
+}
+
+/*
+ * Segments have to be a whole number of packets, otherwise the device
+ * sees a short packet in the middle of the data phase.
+ */
+uint32_t sstarscsi_align_transfer(struct p3udl_cntx *cntx, uint32_t size)
+{
+	uint32_t maxpacket = cntx->ep_maxpacket ? cntx->ep_maxpacket : 512;
+
+	size -= size % maxpacket;
+
+	return size ? size : maxpacket;
+}
+
+/*
+ * Get the start of the payload out at the biggest segment size the
+ * usb updater will take, halving it each time the device refuses.
+ * Returns how much of the buffer has been sent and the size that worked.
+ */
+static int sstarscsi_probe_transfer(struct p3udl_cntx *cntx, void *buf, uint32_t len,
+		uint32_t *segsz, uint32_t *sent)
+{
+	uint32_t size = *segsz;
+	uint64_t started = clock_now_ns();
+
+	for (;;) {
+		uint32_t txsz = min(len, size);
+		bool last = txsz >= len;
+
+		if (board_cancelled(cntx))
+			return -ECANCELED;
+
+		sstarscsi_dbg(cntx, "Probing %u byte segments\n", size);
+
+		bool torn;
+		int ret = sstarscsi_upload_packet(cntx, buf, txsz, last, &torn);
+		if (!ret) {
+			cntx->report.bytes += txsz;
+			*segsz = size;
+			*sent = txsz;
+			return 0;
+		}
+
+		if (torn)
+			return -ERESTART;
+
+		/* Only a refusal says anything about the size */
+		if (ret != -EIO) {
+			if (ret == LIBUSB_ERROR_PIPE)
+				usb_massstorage_reset_recovery(cntx);
+			if (xfer_retry(cntx, ret, started))
+				continue;
+			return ret;
+		}
+
+		if (size <= SSTARSCSI_BOOTROM_MAXTRANSFER)
+			return ret;
+
+		/* Get both pipes going again before trying something smaller */
+		usb_massstorage_reset_recovery(cntx);
+		started = clock_now_ns();
+
+		size = size / 2 > SSTARSCSI_BOOTROM_MAXTRANSFER ? size / 2 : SSTARSCSI_BOOTROM_MAXTRANSFER;
+		size = sstarscsi_align_transfer(cntx, size);
+		sstarscsi_info(cntx, "Segment refused, trying %u bytes\n", size);
+	}
 }
 
 static void sstarscsi_do_md5(struct p3udl_cntx *cntx, uint8_t *digest, uint8_t *buffer, uint32_t len)
@@ -122,39 +353,142 @@ static void sstarscsi_do_md5(struct p3udl_cntx *cntx, uint8_t *digest, uint8_t *
 	MD5(buffer, len, digest);
 }
 
-int sstarscsi_upload_usbupdater(struct p3udl_cntx *cntx, uint32_t loadaddr, void *buf, uint32_t len)
+/* Only used to check the updater is still listening, what the bytes mean isn't known */
+static int sstarscsi_get_state(struct p3udl_cntx *cntx)
 {
-	sstarscsi_info(cntx, "Doing upload using the usb updater..\n");
+	uint8_t state[4];
+	int ret = sstarscsi_do_op_retry(cntx, SSTARSCSI_SUBCODE_GET_STATE, state, sizeof(state), false);
 
-	/* The usb updater IPL expects to get this load address thing first.. */
-	struct sstarscsi_loadinfo info = {
-		.addr = loadaddr,
-		.size = len,
-	};
+	if (!ret)
+		sstarscsi_dbg(cntx, "state 0x%02x:0x%02x:0x%02x:0x%02x\n",
+				state[0], state[1], state[2], state[3]);
 
-	sstarscsi_do_md5(cntx, info.md5, buf, len);
+	return ret;
+}
 
-	int ret = sstarscsi_do_op(cntx, SSTARSCSI_SUBCODE_SUBCODE_UFU_LOADINFO, &info, sizeof(info), true);
+/*
+ * The usb updater is not the boot ROM and can take bigger segments.
+ * Use what was asked for, otherwise probe starting from what worked
+ * last time with this chip and IPL so a stale entry costs one refused
+ * segment instead of the whole upload. tuned is what the cache had,
+ * 0 if it had nothing. The fast gadget says what it takes up front.
+ */
+uint32_t sstarscsi_updater_transfer(struct p3udl_cntx *cntx, uint32_t *tuned)
+{
+	uint32_t segsz;
+
+	*tuned = 0;
+	if (cntx->max_transfer)
+		segsz = cntx->max_transfer;
+	else if (cntx->fast)
+		segsz = SSTARSCSI_FAST_MAXTRANSFER;
+	else if (!tune_get_transfer(cntx, tuned))
+		segsz = *tuned;
+	else
+		segsz = SSTARSCSI_UPDATER_MAXTRANSFER;
+
+	return sstarscsi_align_transfer(cntx, segsz);
+}
+
+/*
+ * One go at getting an image into the updater, LOADINFO resets where it
+ * puts the data so anything it already had is thrown away. -ERESTART
+ * when it is worth another go from the top.
+ */
+static int sstarscsi_usbupdater_send(struct p3udl_cntx *cntx, struct sstarscsi_loadinfo *info,
+		void *buf, uint32_t len)
+{
+	report_begin(cntx, REPORT_PHASE_LOADINFO);
+	int ret = sstarscsi_do_op_retry(cntx, SSTARSCSI_SUBCODE_SUBCODE_UFU_LOADINFO, info, sizeof(*info), true);
+	report_end(cntx, REPORT_PHASE_LOADINFO);
 	if (ret) {
 		sstarscsi_info(cntx, "Failed to set loadinfo: %d\n", ret);
 		return ret;
 	}
 
-	ret = sstarscsi_upload_loop(cntx, buf, len);
+	uint32_t tuned, sent = 0;
+	uint32_t segsz = sstarscsi_updater_transfer(cntx, &tuned);
+	bool probe = !cntx->max_transfer && !cntx->fast;
+	uint64_t begin = clock_now_ns();
+
+	report_begin(cntx, REPORT_PHASE_UBOOT);
+
+	if (probe) {
+		ret = sstarscsi_probe_transfer(cntx, buf, len, &segsz, &sent);
+		if (ret) {
+			report_end(cntx, REPORT_PHASE_UBOOT);
+			sstarscsi_err(cntx, "Failed to find a usable segment size: %d\n", ret);
+			return ret;
+		}
+	}
+
+	ret = sent < len ? sstarscsi_upload_loop(cntx, buf, len, segsz, sent) : 0;
+	report_end(cntx, REPORT_PHASE_UBOOT);
 	if (ret) {
 		sstarscsi_err(cntx, "Failed to upload buffer to usb updater: %d\n", ret);
 		return ret;
 	}
 
+	if (probe && segsz != tuned)
+		tune_put_transfer(cntx, segsz);
+	tune_put_rate(cntx, "updater", len, clock_now_ns() - begin);
+
 	uint8_t result[4];
 
-	ret = sstarscsi_do_op(cntx, SSTARSCSI_SUBCODE_GET_RESULT, result, sizeof(result), false);
+	report_begin(cntx, REPORT_PHASE_RESULT);
+	ret = sstarscsi_do_op_retry(cntx, SSTARSCSI_SUBCODE_GET_RESULT, result, sizeof(result), false);
+	report_end(cntx, REPORT_PHASE_RESULT);
 	if (ret) {
 		sstarscsi_info(cntx, "Failed to get upload result: %d\n", ret);
 		return ret;
 	}
+	/* What the bytes mean isn't known, so they are only printed */
 	sstarscsi_info(cntx, "result 0x%02x:0x%02x:0x%02x:0x%02x\n",
 			result[0],result[1],result[2],result[3]);
 
 	return 0;
 }
+
+/* md5 is the digest of buf if the caller already has it, NULL to work it out here */
+int sstarscsi_upload_usbupdater(struct p3udl_cntx *cntx, uint32_t loadaddr, void *buf, uint32_t len,
+		const uint8_t *md5)
+{
+	sstarscsi_info(cntx, "Doing upload using the usb updater..\n");
+
+	/* The usb updater IPL expects to get this load address thing first.. */
+	struct sstarscsi_loadinfo info = {
+		.addr = loadaddr,
+		.size = len,
+	};
+
+	if (md5)
+		memcpy(info.md5, md5, sizeof(info.md5));
+	else
+		sstarscsi_do_md5(cntx, info.md5, buf, len);
+
+	/*
+	 * Segments that can be sent again have been by now, this is for when
+	 * the device might have some of the data twice or out of order.
+	 */
+	for (int restarts = 0;; restarts++) {
+		int ret = sstarscsi_usbupdater_send(cntx, &info, buf, len);
+		if (ret != -ERESTART)
+			return ret;
+
+		if (restarts == SSTARSCSI_UPDATER_RESTARTS) {
+			sstarscsi_err(cntx, "Giving up after starting the image again %d times\n", restarts);
+			return -EIO;
+		}
+
+		usb_massstorage_reset_recovery(cntx);
+		ret = sstarscsi_get_state(cntx);
+		if (ret) {
+			sstarscsi_err(cntx, "usb updater stopped answering: %d\n", ret);
+			return ret;
+		}
+
+		cntx->report.restarts++;
+		metrics_inc(METRIC_RESTARTS);
+		sstarscsi_info(cntx, "Starting the image again\n");
+	}
+}
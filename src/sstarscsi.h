@@ -19,6 +19,20 @@
 #define SSTARSCSI_SUBCODE_SUBCODE_UFU_LOADINFO	0x5
 
 #define SSTARSCSI_BOOTROM_MAXTRANSFER		1024
+/* Goes at an image from LOADINFO again before giving up on it */
+#define SSTARSCSI_UPDATER_RESTARTS		2
+/* Where probing the usb updater's segment size starts */
+#define SSTARSCSI_UPDATER_MAXTRANSFER		(64 * 1024)
+
+/*
+ * The download gadget in the u-boot built from the submodule. It comes
+ * up with the boot ROM's USB ids and takes the usb updater's commands,
+ * INQUIRY is how it is told apart. Segments don't need probing and the
+ * image is checked against LOADINFO's MD5 on the board as before.
+ */
+#define SSTARSCSI_FAST_VID			"U-Boot  "
+#define SSTARSCSI_FAST_PID			"FastLoad"
+#define SSTARSCSI_FAST_MAXTRANSFER		(1024 * 1024)
 
 struct sstarscsi_loadinfo {
 	uint32_t addr;
@@ -27,6 +41,9 @@ struct sstarscsi_loadinfo {
 };
 
 int sstarscsi_upload_bootrom(struct p3udl_cntx *cntx, void *buf, uint32_t len);
-int sstarscsi_upload_usbupdater(struct p3udl_cntx *cntx, uint32_t loadaddr, void *buf, uint32_t len);
+uint32_t sstarscsi_align_transfer(struct p3udl_cntx *cntx, uint32_t size);
+uint32_t sstarscsi_updater_transfer(struct p3udl_cntx *cntx, uint32_t *tuned);
+int sstarscsi_upload_usbupdater(struct p3udl_cntx *cntx, uint32_t loadaddr, void *buf, uint32_t len,
+		const uint8_t *md5);
 
 #endif /* __SSTARSCSI_H_ */
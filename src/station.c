@@ -0,0 +1,247 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Station mode: stay resident, keep the images loaded and start
+ * flashing each board as soon as it enumerates.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <libusb.h>
+
+#include "board.h"
+#include "clock.h"
+#include "log.h"
+#include "metrics.h"
+#include "sstarscsi.h"
+#include "station.h"
+#include "topology.h"
+#include "report.h"
+
+#include "station_log.h"
+
+struct station;
+
+struct station_board {
+	struct p3udl_cntx cntx;
+	struct station *station;
+	libusb_device *dev;
+	/* when the hotplug arrival was seen */
+	uint64_t arrived;
+	struct station_board *next;
+};
+
+struct station {
+	struct p3udl_cntx *template;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	/* boards that have arrived but don't have a worker yet */
+	struct station_board *pending, **pending_tail;
+	unsigned int running;
+	unsigned int passed, failed;
+};
+
+static volatile sig_atomic_t station_stop;
+
+static void station_signal(int sig)
+{
+	station_stop = 1;
+}
+
+/*
+ * Called from whichever thread is handling libusb events so
+ * this can't do any I/O, just queue the board for the main loop.
+ */
+static int station_hotplug(libusb_context *ctx, libusb_device *dev,
+		libusb_hotplug_event event, void *user_data)
+{
+	struct station *station = user_data;
+	struct p3udl_cntx *template = station->template;
+
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		station_info(template, "board %03u:%03u left\n",
+				libusb_get_bus_number(dev), libusb_get_device_address(dev));
+		return 0;
+	}
+
+	if (!topology_wanted(template, dev)) {
+		station_dbg(template, "board %03u:%03u isn't in a slot, leaving it alone\n",
+				libusb_get_bus_number(dev), libusb_get_device_address(dev));
+		return 0;
+	}
+
+	struct station_board *board = calloc(1, sizeof(*board));
+	if (!board) {
+		station_err(template, "no memory for new board\n");
+		return 0;
+	}
+
+	board->arrived = clock_now_ns();
+	board->cntx = *template;
+	board->station = station;
+	board->dev = libusb_ref_device(dev);
+
+	pthread_mutex_lock(&station->lock);
+	*station->pending_tail = board;
+	station->pending_tail = &board->next;
+	pthread_mutex_unlock(&station->lock);
+
+	return 0;
+}
+
+static void *station_worker(void *data)
+{
+	struct station_board *board = data;
+	struct station *station = board->station;
+	struct p3udl_cntx *cntx = &board->cntx;
+
+	int ret = board_open(cntx, board->dev);
+	libusb_unref_device(board->dev);
+
+	log_set_device(cntx->name);
+
+	if (!ret)
+		ret = board_flash(cntx);
+
+	uint64_t elapsed = clock_now_ns() - board->arrived;
+
+	if (ret)
+		station_err(cntx, "FAILED during %s (%d), %llu ms after enumeration\n",
+				board_stage_name(cntx->stage), ret,
+				(unsigned long long) (elapsed / NSEC_PER_MSEC));
+	else
+		station_info(cntx, "u-boot running %llu ms after enumeration\n",
+				(unsigned long long) (elapsed / NSEC_PER_MSEC));
+
+	cntx->result = ret;
+	metrics_board_end(cntx);
+	/* Get the board's log out before its report */
+	log_end_device(ret);
+	if (cntx->report_out)
+		report_json(cntx->report_out, cntx);
+
+	board_close(cntx);
+
+	pthread_mutex_lock(&station->lock);
+	if (ret)
+		station->failed++;
+	else
+		station->passed++;
+	station->running--;
+	pthread_cond_signal(&station->idle);
+	pthread_mutex_unlock(&station->lock);
+
+	free(board);
+
+	return NULL;
+}
+
+/* Start a worker for every board that has turned up since the last pass */
+static void station_dispatch(struct station *station)
+{
+	struct station_board *board;
+	pthread_attr_t attr;
+
+	pthread_mutex_lock(&station->lock);
+	board = station->pending;
+	station->pending = NULL;
+	station->pending_tail = &station->pending;
+	pthread_mutex_unlock(&station->lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while (board) {
+		struct station_board *next = board->next;
+		pthread_t thread;
+
+		pthread_mutex_lock(&station->lock);
+		station->running++;
+		pthread_mutex_unlock(&station->lock);
+
+		int ret = pthread_create(&thread, &attr, station_worker, board);
+		if (ret) {
+			station_err(station->template, "failed to start worker: %d\n", ret);
+			libusb_unref_device(board->dev);
+			free(board);
+
+			pthread_mutex_lock(&station->lock);
+			station->running--;
+			station->failed++;
+			pthread_mutex_unlock(&station->lock);
+		}
+
+		board = next;
+	}
+
+	pthread_attr_destroy(&attr);
+}
+
+int station_run(struct p3udl_cntx *template)
+{
+	libusb_hotplug_callback_handle hotplug;
+	struct station station = {
+		.template = template,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.idle = PTHREAD_COND_INITIALIZER,
+	};
+	struct sigaction sa = {
+		.sa_handler = station_signal,
+	};
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		station_err(template, "libusb doesn't support hotplug on this platform\n");
+		return -ENOTSUP;
+	}
+
+	station.pending_tail = &station.pending;
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	/* ENUMERATE so boards that are already plugged in get picked up too */
+	int ret = libusb_hotplug_register_callback(template->lu_cntx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, SSTARSCSI_VID, SSTARSCSI_PID,
+			LIBUSB_HOTPLUG_MATCH_ANY, station_hotplug, &station, &hotplug);
+	if (ret) {
+		station_err(template, "failed to register hotplug callback: %s\n",
+				libusb_strerror((enum libusb_error) ret));
+		return ret;
+	}
+
+	station_info(template, "Waiting for boards, ctrl-c to stop\n");
+
+	while (!station_stop) {
+		struct timeval tv = {
+			.tv_sec = 0,
+			.tv_usec = 100 * 1000,
+		};
+
+		station_dispatch(&station);
+		libusb_handle_events_timeout_completed(template->lu_cntx, &tv, NULL);
+	}
+
+	libusb_hotplug_deregister_callback(template->lu_cntx, hotplug);
+
+	/* Boards that arrived but never got started don't count */
+	while (station.pending) {
+		struct station_board *next = station.pending->next;
+
+		libusb_unref_device(station.pending->dev);
+		free(station.pending);
+		station.pending = next;
+	}
+
+	station_info(template, "Stopping, waiting for %u board(s) to finish\n", station.running);
+
+	pthread_mutex_lock(&station.lock);
+	while (station.running)
+		pthread_cond_wait(&station.idle, &station.lock);
+	pthread_mutex_unlock(&station.lock);
+
+	station_info(template, "%u board(s) passed, %u failed\n", station.passed, station.failed);
+
+	return station.failed ? -EIO : 0;
+}
@@ -0,0 +1,10 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __STATION_H_
+#define __STATION_H_
+
+#include "cntx.h"
+
+int station_run(struct p3udl_cntx *template);
+
+#endif /* __STATION_H_ */
@@ -0,0 +1,272 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Where boards are plugged in and how much of the USB they get.
+ *
+ * Boards are known by bus and port path, which stays the same across
+ * re-enumeration and from one board to the next in the same socket.
+ * A slot map can give those port paths station slot names:
+ *
+ *   # port path   slot
+ *   3-1.1         A1
+ *   3-1.2         A2
+ *
+ * Boards on ports that aren't in the map are left alone.
+ *
+ * Each bus is a root hub, in boot mode the boards are high speed so all
+ * of the boards behind one host controller end up on its USB 2 bus and
+ * share its bandwidth. Uploads on a bus can be limited so a full hub
+ * doesn't slow every board on it down, and how much each bus moved is
+ * kept so the cabling can be rebalanced.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "board.h"
+#include "clock.h"
+#include "cntx.h"
+#include "topology.h"
+
+#include "topology_log.h"
+
+int topology_init(struct topology *topo)
+{
+	memset(topo, 0, sizeof(*topo));
+
+	int ret = pthread_mutex_init(&topo->lock, NULL);
+	if (ret)
+		return -ret;
+
+	ret = pthread_cond_init(&topo->cond, NULL);
+	if (ret) {
+		pthread_mutex_destroy(&topo->lock);
+		return -ret;
+	}
+
+	return 0;
+}
+
+int topology_load_slots(struct p3udl_cntx *cntx, const char *path, struct topology *topo)
+{
+	char line[256];
+	unsigned int lineno = 0;
+	int ret = 0;
+
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		ret = -errno;
+		topology_err(cntx, "Can't open %s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *save, *port, *name, *extra;
+
+		lineno++;
+
+		char *comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		port = strtok_r(line, " \t\r\n", &save);
+		if (!port)
+			continue;
+		name = strtok_r(NULL, " \t\r\n", &save);
+		extra = strtok_r(NULL, " \t\r\n", &save);
+
+		if (!name || extra || strlen(port) >= sizeof(topo->slots->port) ||
+				strlen(name) >= sizeof(topo->slots->name)) {
+			topology_err(cntx, "%s:%u: can't make sense of this line\n", path, lineno);
+			ret = -EINVAL;
+			break;
+		}
+
+		struct topology_slot *tmp = realloc(topo->slots, (topo->nslots + 1) * sizeof(*tmp));
+		if (!tmp) {
+			ret = -ENOMEM;
+			break;
+		}
+		topo->slots = tmp;
+
+		strcpy(topo->slots[topo->nslots].port, port);
+		strcpy(topo->slots[topo->nslots].name, name);
+		topo->nslots++;
+	}
+
+	fclose(f);
+
+	if (!ret && !topo->nslots) {
+		topology_err(cntx, "%s doesn't list any slots\n", path);
+		ret = -EINVAL;
+	}
+
+	if (ret) {
+		free(topo->slots);
+		topo->slots = NULL;
+		topo->nslots = 0;
+	}
+
+	return ret;
+}
+
+void topology_free(struct topology *topo)
+{
+	free(topo->slots);
+	topo->slots = NULL;
+	topo->nslots = 0;
+	pthread_cond_destroy(&topo->cond);
+	pthread_mutex_destroy(&topo->lock);
+}
+
+void topology_port_path(uint8_t bus, const uint8_t *ports, int nports, char *buf, size_t len)
+{
+	int n = snprintf(buf, len, "%u", bus);
+
+	for (int i = 0; i < nports && n < len; i++)
+		n += snprintf(buf + n, len - n, "%c%u", i ? '.' : '-', ports[i]);
+}
+
+static const struct topology_slot *topology_find_slot(const struct topology *topo, const char *port)
+{
+	for (int i = 0; i < topo->nslots; i++) {
+		if (!strcmp(topo->slots[i].port, port))
+			return &topo->slots[i];
+	}
+
+	return NULL;
+}
+
+/* With a slot map only boards in mapped ports get flashed */
+bool topology_wanted(struct p3udl_cntx *cntx, libusb_device *dev)
+{
+	struct topology *topo = cntx->topology;
+	uint8_t ports[sizeof(cntx->ports)];
+	char port[sizeof(cntx->port)];
+
+	if (!topo || !topo->nslots)
+		return true;
+
+	int nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	if (nports < 0)
+		nports = 0;
+	topology_port_path(libusb_get_bus_number(dev), ports, nports, port, sizeof(port));
+
+	return topology_find_slot(topo, port) != NULL;
+}
+
+/* Work out the port path once bus and ports are known, true if the board was named after its slot */
+bool topology_assign(struct p3udl_cntx *cntx)
+{
+	struct topology *topo = cntx->topology;
+
+	topology_port_path(cntx->bus, cntx->ports, cntx->nports > 0 ? cntx->nports : 0,
+			cntx->port, sizeof(cntx->port));
+
+	if (!topo)
+		return false;
+
+	pthread_mutex_lock(&topo->lock);
+	topo->buses[cntx->bus].boards++;
+	pthread_mutex_unlock(&topo->lock);
+
+	const struct topology_slot *slot = topology_find_slot(topo, cntx->port);
+	if (!slot)
+		return false;
+
+	snprintf(cntx->name, sizeof(cntx->name), "%s", slot->name);
+
+	return true;
+}
+
+/* Wait for the bus to have room for another upload, or for the board to be cancelled */
+int topology_acquire(struct p3udl_cntx *cntx)
+{
+	struct topology *topo = cntx->topology;
+
+	if (!topo || cntx->bus_held)
+		return 0;
+
+	struct topology_bus *bus = &topo->buses[cntx->bus];
+
+	report_begin(cntx, REPORT_PHASE_BUS_WAIT);
+	pthread_mutex_lock(&topo->lock);
+
+	if (topo->per_bus && bus->active >= topo->per_bus)
+		topology_dbg(cntx, "bus %u is full, waiting\n", cntx->bus);
+
+	while (topo->per_bus && bus->active >= topo->per_bus && !board_cancelled(cntx))
+		pthread_cond_wait(&topo->cond, &topo->lock);
+
+	if (board_cancelled(cntx)) {
+		pthread_mutex_unlock(&topo->lock);
+		report_end(cntx, REPORT_PHASE_BUS_WAIT);
+		return -ECANCELED;
+	}
+
+	if (!bus->active++)
+		bus->busy_start = clock_now_ns();
+
+	pthread_mutex_unlock(&topo->lock);
+	report_end(cntx, REPORT_PHASE_BUS_WAIT);
+
+	cntx->bus_held = true;
+	cntx->bus_bytes = cntx->report.bytes;
+
+	return 0;
+}
+
+void topology_release(struct p3udl_cntx *cntx)
+{
+	struct topology *topo = cntx->topology;
+
+	if (!topo || !cntx->bus_held)
+		return;
+
+	struct topology_bus *bus = &topo->buses[cntx->bus];
+
+	pthread_mutex_lock(&topo->lock);
+
+	bus->bytes += cntx->report.bytes - cntx->bus_bytes;
+	if (!--bus->active)
+		bus->busy_ns += clock_now_ns() - bus->busy_start;
+	pthread_cond_broadcast(&topo->cond);
+
+	pthread_mutex_unlock(&topo->lock);
+
+	cntx->bus_held = false;
+}
+
+/* Boards waiting for a bus look again, for one that was cancelled */
+void topology_wake(struct topology *topo)
+{
+	pthread_mutex_lock(&topo->lock);
+	pthread_cond_broadcast(&topo->cond);
+	pthread_mutex_unlock(&topo->lock);
+}
+
+/* What each bus moved while something was uploading on it */
+void topology_summary(struct p3udl_cntx *cntx)
+{
+	struct topology *topo = cntx->topology;
+
+	if (!topo)
+		return;
+
+	pthread_mutex_lock(&topo->lock);
+
+	for (int i = 0; i < sizeof(topo->buses) / sizeof(topo->buses[0]); i++) {
+		const struct topology_bus *bus = &topo->buses[i];
+
+		if (!bus->boards)
+			continue;
+
+		topology_info(cntx, "bus %d: %u board(s), %llu bytes in %llu ms busy, %.2f MB/s\n", i,
+				bus->boards, (unsigned long long) bus->bytes,
+				(unsigned long long) (bus->busy_ns / NSEC_PER_MSEC),
+				clock_mbps(bus->bytes, bus->busy_ns));
+	}
+
+	pthread_mutex_unlock(&topo->lock);
+}
@@ -0,0 +1,52 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __TOPOLOGY_H_
+#define __TOPOLOGY_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <libusb.h>
+
+struct p3udl_cntx;
+
+struct topology_slot {
+	/* "<bus>-<port>.<port>..." like sysfs */
+	char port[32];
+	char name[16];
+};
+
+struct topology_bus {
+	/* boards uploading right now and boards seen */
+	unsigned int active, boards;
+	uint64_t bytes;
+	/* time with at least one board uploading */
+	uint64_t busy_ns, busy_start;
+};
+
+struct topology {
+	/* port path -> station slot, none means every port is used */
+	struct topology_slot *slots;
+	unsigned int nslots;
+	/* uploads allowed at once on one bus, 0 for no limit */
+	unsigned int per_bus;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct topology_bus buses[256];
+};
+
+int topology_init(struct topology *topo);
+int topology_load_slots(struct p3udl_cntx *cntx, const char *path, struct topology *topo);
+void topology_free(struct topology *topo);
+
+void topology_port_path(uint8_t bus, const uint8_t *ports, int nports, char *buf, size_t len);
+bool topology_wanted(struct p3udl_cntx *cntx, libusb_device *dev);
+bool topology_assign(struct p3udl_cntx *cntx);
+
+int topology_acquire(struct p3udl_cntx *cntx);
+void topology_release(struct p3udl_cntx *cntx);
+void topology_wake(struct topology *topo);
+void topology_summary(struct p3udl_cntx *cntx);
+
+#endif /* __TOPOLOGY_H_ */
@@ -0,0 +1,177 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Reading and writing trace files, shared by p3udl and p3udl-trace.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "trace.h"
+
+/*
+ * IN data is kept whole and the biggest read back in one go is a 2MiB
+ * UMS READ, this is only there to stop a broken file asking for silly
+ * amounts of memory.
+ */
+#define TRACE_MAX_CAPLEN	(16 * 1024 * 1024)
+
+static const char * const trace_type_names[] = {
+	[TRACE_BOARD] = "board",
+	[TRACE_SETUP] = "setup",
+	[TRACE_BULK] = "bulk",
+	[TRACE_CONTROL] = "control",
+	[TRACE_CLEAR_HALT] = "clear_halt",
+	[TRACE_RECONNECT] = "reconnect",
+	[TRACE_CLAIM] = "claim",
+	[TRACE_ALTSETTING] = "altsetting",
+	[TRACE_SUBMIT] = "submit",
+	[TRACE_COMPLETE] = "complete",
+	[TRACE_CLOSE] = "close",
+};
+
+int trace_create(struct trace *trace, const char *path)
+{
+	struct trace_header hdr = { 0 };
+	struct timespec ts;
+
+	memset(trace, 0, sizeof(*trace));
+	trace->f = fopen(path, "wb");
+	if (!trace->f)
+		return -errno;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	trace->start_ns = clock_now_ns();
+
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = TRACE_VERSION;
+	hdr.start_ns = ((uint64_t) ts.tv_sec * NSEC_PER_SEC) + ts.tv_nsec;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, trace->f) != 1) {
+		fclose(trace->f);
+		trace->f = NULL;
+		return -EIO;
+	}
+
+	pthread_mutex_init(&trace->lock, NULL);
+
+	return 0;
+}
+
+/* Returns the first write error, the trace is probably truncated if there was one */
+int trace_finish(struct trace *trace)
+{
+	int ret = trace->error;
+
+	if (!trace->f)
+		return 0;
+
+	if (fclose(trace->f) && !ret)
+		ret = -EIO;
+	trace->f = NULL;
+	pthread_mutex_destroy(&trace->lock);
+
+	return ret;
+}
+
+void trace_write(struct trace *trace, struct trace_record *rec, const void *data)
+{
+	pthread_mutex_lock(&trace->lock);
+	if (!trace->error &&
+			(fwrite(rec, sizeof(*rec), 1, trace->f) != 1 ||
+			(rec->caplen && fwrite(data, rec->caplen, 1, trace->f) != 1)))
+		trace->error = -EIO;
+	pthread_mutex_unlock(&trace->lock);
+}
+
+uint16_t trace_add_board(struct trace *trace, const char *name, uint8_t bus,
+		const uint8_t *ports, int nports)
+{
+	struct trace_record rec = {
+		.type = TRACE_BOARD,
+		.endpoint = bus,
+		.caplen = strlen(name),
+	};
+
+	if (nports > (int) sizeof(rec.setup))
+		nports = sizeof(rec.setup);
+	if (nports > 0) {
+		memcpy(rec.setup, ports, nports);
+		rec.length = nports;
+	}
+
+	/* The number has to be taken and written under the same lock to keep them in order */
+	pthread_mutex_lock(&trace->lock);
+	rec.ns = clock_now_ns() - trace->start_ns;
+	rec.board = trace->boards++;
+	if (!trace->error &&
+			(fwrite(&rec, sizeof(rec), 1, trace->f) != 1 ||
+			fwrite(name, rec.caplen, 1, trace->f) != 1))
+		trace->error = -EIO;
+	pthread_mutex_unlock(&trace->lock);
+
+	return rec.board;
+}
+
+uint32_t trace_next_id(struct trace *trace)
+{
+	return __atomic_add_fetch(&trace->ids, 1, __ATOMIC_RELAXED);
+}
+
+int trace_open(FILE **f, const char *path, struct trace_header *hdr)
+{
+	*f = fopen(path, "rb");
+	if (!*f)
+		return -errno;
+
+	if (fread(hdr, sizeof(*hdr), 1, *f) != 1 ||
+			memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) ||
+			hdr->version != TRACE_VERSION) {
+		fclose(*f);
+		*f = NULL;
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * 1 for a record, 0 at the end of the trace. The data is allocated,
+ * NULL if there isn't any, and belongs to the caller.
+ */
+int trace_read(FILE *f, struct trace_record *rec, uint8_t **data)
+{
+	*data = NULL;
+
+	if (fread(rec, sizeof(*rec), 1, f) != 1)
+		return feof(f) ? 0 : -EIO;
+
+	if (rec->caplen > TRACE_MAX_CAPLEN)
+		return -EINVAL;
+
+	if (!rec->caplen)
+		return 1;
+
+	/* One spare so board names come out terminated */
+	*data = calloc(1, rec->caplen + 1);
+	if (!*data)
+		return -ENOMEM;
+
+	if (fread(*data, rec->caplen, 1, f) != 1) {
+		free(*data);
+		*data = NULL;
+		return -EINVAL;
+	}
+
+	return 1;
+}
+
+const char *trace_type_name(uint8_t type)
+{
+	if (type >= sizeof(trace_type_names) / sizeof(trace_type_names[0]) || !trace_type_names[type])
+		return "unknown";
+
+	return trace_type_names[type];
+}
@@ -0,0 +1,96 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Everything that goes through a board's transport, written down with
+ * timestamps so a run can be looked at in wireshark or played back
+ * without the hardware that made it.
+ *
+ * A trace is a header followed by records, each record followed by
+ * caplen bytes of data. Everything is in the byte order of the machine
+ * that wrote it.
+ */
+
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_MAGIC		"P3UDLTRC"
+#define TRACE_VERSION		1
+/* OUT data past this isn't kept, it covers CBWs and control requests but not images */
+#define TRACE_SNAPLEN		64
+
+struct trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	/* CLOCK_REALTIME when the trace started, records are relative to it */
+	uint64_t start_ns;
+};
+
+enum trace_type {
+	/*
+	 * data is the board's name, endpoint its bus and setup its port path,
+	 * length ports long. Boards are numbered in the order these turn up.
+	 */
+	TRACE_BOARD = 1,
+	/* endpoint is ep_in, value is ep_out and length is ep_maxpacket */
+	TRACE_SETUP,
+	TRACE_BULK,
+	TRACE_CONTROL,
+	TRACE_CLEAR_HALT,
+	/* length is the timeout */
+	TRACE_RECONNECT,
+	TRACE_CLAIM,
+	TRACE_ALTSETTING,
+	/* asynchronous transfers, id pairs a submit with its completion */
+	TRACE_SUBMIT,
+	TRACE_COMPLETE,
+	TRACE_CLOSE,
+};
+
+struct trace_record {
+	/* when it started and how long it took */
+	uint64_t ns;
+	uint64_t duration_ns;
+	uint32_t id;
+	/* libusb error, or libusb_transfer_status for completions */
+	int32_t status;
+	/* asked for and moved, not counting the setup packet */
+	uint32_t length;
+	uint32_t actual;
+	/* bytes of data after the record */
+	uint32_t caplen;
+	uint16_t board;
+	uint8_t type;
+	uint8_t endpoint;
+	/* control requests, interface and altsetting in value and index for the others */
+	uint8_t setup[8];
+	/* LIBUSB_TRANSFER_TYPE_* */
+	uint8_t xfer_type;
+	uint8_t reserved[7];
+};
+
+struct trace {
+	FILE *f;
+	pthread_mutex_t lock;
+	/* CLOCK_MONOTONIC matching the header's start */
+	uint64_t start_ns;
+	uint16_t boards;
+	uint32_t ids;
+	int error;
+};
+
+int trace_create(struct trace *trace, const char *path);
+int trace_finish(struct trace *trace);
+uint16_t trace_add_board(struct trace *trace, const char *name, uint8_t bus,
+		const uint8_t *ports, int nports);
+uint32_t trace_next_id(struct trace *trace);
+void trace_write(struct trace *trace, struct trace_record *rec, const void *data);
+
+int trace_open(FILE **f, const char *path, struct trace_header *hdr);
+int trace_read(FILE *f, struct trace_record *rec, uint8_t **data);
+const char *trace_type_name(uint8_t type);
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,57 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Everything that goes over the wire goes through one of these so
+ * the protocol code can run against something other than libusb.
+ * Asynchronous transfers are still described with libusb_transfer,
+ * the transport just decides how they get completed.
+ */
+
+#ifndef __TRANSPORT_H_
+#define __TRANSPORT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+struct p3udl_cntx;
+
+struct p3udl_transport {
+	const char *name;
+
+	/* find the endpoints etc once the board is open */
+	int (*setup)(struct p3udl_cntx *cntx);
+	void (*close)(struct p3udl_cntx *cntx);
+
+	int (*bulk)(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t *data, int length,
+			int *actual_length, unsigned int timeout);
+	int (*control)(struct p3udl_cntx *cntx, uint8_t request_type, uint8_t request,
+			uint16_t value, uint16_t index, uint8_t *data, uint16_t length,
+			unsigned int timeout);
+	int (*clear_halt)(struct p3udl_cntx *cntx, uint8_t endpoint);
+
+	/* wait for the board to turn up again after it re-enumerated as something else and open it */
+	int (*reconnect)(struct p3udl_cntx *cntx, unsigned int timeout_ms);
+	int (*claim_interface)(struct p3udl_cntx *cntx, uint8_t interface);
+	int (*set_altsetting)(struct p3udl_cntx *cntx, uint8_t interface, uint8_t altsetting);
+
+	int (*submit)(struct p3udl_cntx *cntx, struct libusb_transfer *xfer);
+	int (*cancel)(struct p3udl_cntx *cntx, struct libusb_transfer *xfer);
+	int (*handle_events)(struct p3udl_cntx *cntx, struct timeval *tv, int *completed);
+
+	/* memory transfers can be done from without the kernel copying it, optional */
+	void *(*mem_alloc)(struct p3udl_cntx *cntx, size_t len);
+	void (*mem_free)(struct p3udl_cntx *cntx, void *mem, size_t len);
+};
+
+extern const struct p3udl_transport transport_libusb;
+extern const struct p3udl_transport transport_trace;
+extern const struct p3udl_transport transport_sg;
+
+/* leave the board with usb-storage and go through its /dev/sg node instead */
+int transport_sg_open(struct p3udl_cntx *cntx);
+
+/* put the trace transport in front of whatever the board has if cntx->trace is set */
+void transport_trace_attach(struct p3udl_cntx *cntx);
+
+#endif /* __TRANSPORT_H_ */
@@ -0,0 +1,201 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * The real thing, a board on the end of a USB cable.
+ */
+
+#include <libusb.h>
+#include <string.h>
+#include <time.h>
+
+#include "board.h"
+#include "clock.h"
+#include "cntx.h"
+#include "transport.h"
+
+#include "main_log.h"
+
+/* Find the bulk endpoints and their packet size from the real descriptors */
+static int transport_libusb_setup(struct p3udl_cntx *cntx)
+{
+	struct libusb_config_descriptor *config;
+	libusb_device *dev = libusb_get_device(cntx->lu_handle);
+
+	/* What the boot ROM has always used, in case the descriptors are odd */
+	cntx->ep_in = 0x81;
+	cntx->ep_out = 0x02;
+	cntx->ep_maxpacket = 512;
+
+	int ret = libusb_get_active_config_descriptor(dev, &config);
+	if (ret) {
+		p3udl_info(cntx, "No config descriptor (%d), using default endpoints\n", ret);
+		return 0;
+	}
+
+	if (config->bNumInterfaces && config->interface[0].num_altsetting) {
+		const struct libusb_interface_descriptor *intf = &config->interface[0].altsetting[0];
+		uint16_t in_max = 0, out_max = 0;
+
+		for (int i = 0; i < intf->bNumEndpoints; i++) {
+			const struct libusb_endpoint_descriptor *ep = &intf->endpoint[i];
+
+			if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+				continue;
+
+			if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN) {
+				cntx->ep_in = ep->bEndpointAddress;
+				in_max = ep->wMaxPacketSize;
+			}
+			else {
+				cntx->ep_out = ep->bEndpointAddress;
+				out_max = ep->wMaxPacketSize;
+			}
+		}
+
+		if (in_max && out_max)
+			cntx->ep_maxpacket = min(in_max, out_max);
+	}
+
+	libusb_free_config_descriptor(config);
+
+	p3udl_dbg(cntx, "Endpoints in 0x%02x, out 0x%02x, max packet %u\n",
+			cntx->ep_in, cntx->ep_out, cntx->ep_maxpacket);
+
+	return 0;
+}
+
+static void transport_libusb_close(struct p3udl_cntx *cntx)
+{
+	libusb_close(cntx->lu_handle);
+}
+
+static int transport_libusb_bulk(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t *data,
+		int length, int *actual_length, unsigned int timeout)
+{
+	return libusb_bulk_transfer(cntx->lu_handle, endpoint, data, length, actual_length, timeout);
+}
+
+static int transport_libusb_control(struct p3udl_cntx *cntx, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout)
+{
+	return libusb_control_transfer(cntx->lu_handle, request_type, request, value, index,
+			data, length, timeout);
+}
+
+static int transport_libusb_clear_halt(struct p3udl_cntx *cntx, uint8_t endpoint)
+{
+	return libusb_clear_halt(cntx->lu_handle, endpoint);
+}
+
+/* Is this the same port as the board was on but a new device? */
+static bool transport_libusb_same_port(struct p3udl_cntx *cntx, libusb_device *dev)
+{
+	uint8_t ports[sizeof(cntx->ports)];
+
+	if (libusb_get_bus_number(dev) != cntx->bus || libusb_get_device_address(dev) == cntx->address)
+		return false;
+
+	int nports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+
+	return nports > 0 && nports == cntx->nports && !memcmp(ports, cntx->ports, nports);
+}
+
+/* Poll for the board coming back on the same port, hotplug isn't available everywhere */
+static int transport_libusb_reconnect(struct p3udl_cntx *cntx, unsigned int timeout_ms)
+{
+	uint64_t deadline = clock_now_ns() + (timeout_ms * NSEC_PER_MSEC);
+	const struct timespec poll = {
+		.tv_nsec = 100 * NSEC_PER_MSEC,
+	};
+
+	if (cntx->nports <= 0) {
+		p3udl_err(cntx, "Don't know which port the board is on, can't find it again\n");
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	libusb_close(cntx->lu_handle);
+	cntx->lu_handle = NULL;
+
+	do {
+		libusb_device **list;
+		ssize_t count = libusb_get_device_list(cntx->lu_cntx, &list);
+		int ret = LIBUSB_ERROR_NO_DEVICE;
+
+		for (ssize_t i = 0; i < count; i++) {
+			if (!transport_libusb_same_port(cntx, list[i]))
+				continue;
+
+			ret = libusb_open(list[i], &cntx->lu_handle);
+			if (!ret)
+				cntx->address = libusb_get_device_address(list[i]);
+			break;
+		}
+
+		if (count >= 0)
+			libusb_free_device_list(list, 1);
+
+		if (!ret)
+			return 0;
+		if (board_cancelled(cntx))
+			return LIBUSB_ERROR_INTERRUPTED;
+
+		nanosleep(&poll, NULL);
+	} while (clock_now_ns() < deadline);
+
+	return LIBUSB_ERROR_TIMEOUT;
+}
+
+static int transport_libusb_claim_interface(struct p3udl_cntx *cntx, uint8_t interface)
+{
+	if (libusb_kernel_driver_active(cntx->lu_handle, interface) == 1)
+		libusb_detach_kernel_driver(cntx->lu_handle, interface);
+
+	return libusb_claim_interface(cntx->lu_handle, interface);
+}
+
+static int transport_libusb_set_altsetting(struct p3udl_cntx *cntx, uint8_t interface, uint8_t altsetting)
+{
+	return libusb_set_interface_alt_setting(cntx->lu_handle, interface, altsetting);
+}
+
+static int transport_libusb_submit(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	return libusb_submit_transfer(xfer);
+}
+
+static int transport_libusb_cancel(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	return libusb_cancel_transfer(xfer);
+}
+
+static int transport_libusb_handle_events(struct p3udl_cntx *cntx, struct timeval *tv, int *completed)
+{
+	return libusb_handle_events_timeout_completed(cntx->lu_cntx, tv, completed);
+}
+
+/* NULL where usbfs can't map buffers, the pool falls back to ordinary memory */
+static void *transport_libusb_mem_alloc(struct p3udl_cntx *cntx, size_t len)
+{
+	return libusb_dev_mem_alloc(cntx->lu_handle, len);
+}
+
+static void transport_libusb_mem_free(struct p3udl_cntx *cntx, void *mem, size_t len)
+{
+	libusb_dev_mem_free(cntx->lu_handle, mem, len);
+}
+
+const struct p3udl_transport transport_libusb = {
+	.name = "libusb",
+	.setup = transport_libusb_setup,
+	.close = transport_libusb_close,
+	.bulk = transport_libusb_bulk,
+	.control = transport_libusb_control,
+	.clear_halt = transport_libusb_clear_halt,
+	.reconnect = transport_libusb_reconnect,
+	.claim_interface = transport_libusb_claim_interface,
+	.set_altsetting = transport_libusb_set_altsetting,
+	.submit = transport_libusb_submit,
+	.cancel = transport_libusb_cancel,
+	.handle_events = transport_libusb_handle_events,
+	.mem_alloc = transport_libusb_mem_alloc,
+	.mem_free = transport_libusb_mem_free,
+};
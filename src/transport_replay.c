@@ -0,0 +1,482 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Plays a trace back to the protocol code in place of the boards that
+ * made it, so changes on the host side can be timed against exactly
+ * what the hardware did.
+ *
+ * Each board gets the operations it made in the trace handed back one
+ * after another. Every call has to match the next one in the trace,
+ * the same type, endpoint, length and whatever OUT data was kept, and
+ * gets the recorded status and IN data back after the recorded time.
+ * Asynchronous transfers complete in the recorded order, no sooner than
+ * the recorded time after they were submitted. The first call that
+ * doesn't match fails the board, the trace says nothing about what the
+ * device would have done.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clock.h"
+#include "cntx.h"
+#include "replay.h"
+#include "topology.h"
+#include "trace.h"
+#include "transport.h"
+
+#include "replay_log.h"
+
+struct replay_op {
+	struct trace_record rec;
+	uint8_t *data;
+	/* the completion of a submit, NULL if the trace ended first */
+	struct replay_op *complete;
+};
+
+struct replay_xfer {
+	struct libusb_transfer *xfer;
+	struct replay_op *complete;
+	uint64_t due;
+	/* the trace only has it coming back because it was cancelled */
+	bool waits_cancel, cancelled;
+	struct replay_xfer *next;
+};
+
+struct replay {
+	struct replay_op *ops;
+	size_t nops, next;
+	/* in flight asynchronous transfers in the order the trace has them completing */
+	struct replay_xfer *pending;
+};
+
+static void replay_sleep_until(uint64_t when)
+{
+	struct timespec ts = {
+		.tv_sec = when / NSEC_PER_SEC,
+		.tv_nsec = when % NSEC_PER_SEC,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Hand out the next operation if it's the one being asked for */
+static struct replay_op *replay_next(struct p3udl_cntx *cntx, uint8_t type, uint8_t endpoint,
+		const uint8_t *setup, uint32_t length, const uint8_t *out)
+{
+	struct replay *replay = cntx->transport_priv;
+	struct replay_op *op;
+
+	while (replay->next < replay->nops && replay->ops[replay->next].rec.type == TRACE_COMPLETE)
+		replay->next++;
+
+	if (replay->next == replay->nops) {
+		replay_err(cntx, "replay ran off the end of the trace wanting %s ep 0x%02x len %u\n",
+				trace_type_name(type), endpoint, length);
+		return NULL;
+	}
+
+	op = &replay->ops[replay->next];
+	if (op->rec.type != type || op->rec.endpoint != endpoint || op->rec.length != length ||
+			(setup && memcmp(op->rec.setup, setup, sizeof(op->rec.setup))) ||
+			(out && op->rec.caplen && memcmp(op->data, out, op->rec.caplen))) {
+		replay_err(cntx, "replay diverged at operation %zu, traced %s ep 0x%02x len %u, got %s ep 0x%02x len %u\n",
+				replay->next, trace_type_name(op->rec.type), op->rec.endpoint, op->rec.length,
+				trace_type_name(type), endpoint, length);
+		return NULL;
+	}
+
+	replay->next++;
+
+	return op;
+}
+
+/* The simple operations come back after the time they took and with the same result */
+static int replay_simple(struct p3udl_cntx *cntx, uint8_t type, uint8_t endpoint,
+		uint16_t value, uint16_t index, uint32_t length)
+{
+	uint8_t setup[8] = { 0, 0, value & 0xff, value >> 8, index & 0xff, index >> 8 };
+	uint64_t start = clock_now_ns();
+	struct replay_op *op = replay_next(cntx, type, endpoint, setup, length, NULL);
+
+	if (!op)
+		return LIBUSB_ERROR_IO;
+
+	replay_sleep_until(start + op->rec.duration_ns);
+
+	return op->rec.status;
+}
+
+static int transport_replay_setup(struct p3udl_cntx *cntx)
+{
+	struct replay *replay = cntx->transport_priv;
+	struct replay_op *op;
+
+	if (replay->next == replay->nops || replay->ops[replay->next].rec.type != TRACE_SETUP) {
+		replay_err(cntx, "trace doesn't start with the board being set up\n");
+		return LIBUSB_ERROR_IO;
+	}
+
+	op = &replay->ops[replay->next++];
+	cntx->ep_in = op->rec.endpoint;
+	cntx->ep_out = op->rec.setup[2];
+	cntx->ep_maxpacket = op->rec.length;
+
+	return op->rec.status;
+}
+
+static void replay_free(struct replay *replay)
+{
+	while (replay->pending) {
+		struct replay_xfer *next = replay->pending->next;
+
+		free(replay->pending);
+		replay->pending = next;
+	}
+
+	for (size_t i = 0; i < replay->nops; i++)
+		free(replay->ops[i].data);
+	free(replay->ops);
+	free(replay);
+}
+
+static void transport_replay_close(struct p3udl_cntx *cntx)
+{
+	struct replay *replay = cntx->transport_priv;
+	size_t left = 0;
+
+	for (size_t i = replay->next; i < replay->nops; i++) {
+		uint8_t type = replay->ops[i].rec.type;
+
+		left += type != TRACE_COMPLETE && type != TRACE_CLOSE;
+	}
+	if (left)
+		replay_warn(cntx, "replay stopped %zu operation(s) short of the trace\n", left);
+
+	replay_free(replay);
+	cntx->transport_priv = NULL;
+}
+
+static int transport_replay_bulk(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t *data,
+		int length, int *actual_length, unsigned int timeout)
+{
+	uint64_t start = clock_now_ns();
+	bool in = endpoint & LIBUSB_ENDPOINT_IN;
+	struct replay_op *op = replay_next(cntx, TRACE_BULK, endpoint, NULL, length, in ? NULL : data);
+
+	*actual_length = 0;
+	if (!op)
+		return LIBUSB_ERROR_IO;
+
+	replay_sleep_until(start + op->rec.duration_ns);
+	if (in && op->rec.caplen)
+		memcpy(data, op->data, op->rec.caplen);
+	*actual_length = op->rec.actual;
+
+	return op->rec.status;
+}
+
+static int transport_replay_control(struct p3udl_cntx *cntx, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout)
+{
+	uint8_t setup[8] = {
+		request_type, request, value & 0xff, value >> 8,
+		index & 0xff, index >> 8, length & 0xff, length >> 8,
+	};
+	uint64_t start = clock_now_ns();
+	bool in = request_type & LIBUSB_ENDPOINT_IN;
+	struct replay_op *op = replay_next(cntx, TRACE_CONTROL, request_type & LIBUSB_ENDPOINT_DIR_MASK,
+			setup, length, in ? NULL : data);
+
+	if (!op)
+		return LIBUSB_ERROR_IO;
+
+	replay_sleep_until(start + op->rec.duration_ns);
+	if (op->rec.status)
+		return op->rec.status;
+	if (in && op->rec.caplen)
+		memcpy(data, op->data, op->rec.caplen);
+
+	return op->rec.actual;
+}
+
+static int transport_replay_clear_halt(struct p3udl_cntx *cntx, uint8_t endpoint)
+{
+	return replay_simple(cntx, TRACE_CLEAR_HALT, endpoint, 0, 0, 0);
+}
+
+static int transport_replay_reconnect(struct p3udl_cntx *cntx, unsigned int timeout_ms)
+{
+	return replay_simple(cntx, TRACE_RECONNECT, 0, 0, 0, timeout_ms);
+}
+
+static int transport_replay_claim_interface(struct p3udl_cntx *cntx, uint8_t interface)
+{
+	return replay_simple(cntx, TRACE_CLAIM, 0, 0, interface, 0);
+}
+
+static int transport_replay_set_altsetting(struct p3udl_cntx *cntx, uint8_t interface, uint8_t altsetting)
+{
+	return replay_simple(cntx, TRACE_ALTSETTING, 0, altsetting, interface, 0);
+}
+
+static int transport_replay_submit(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct replay *replay = cntx->transport_priv;
+	uint8_t endpoint = xfer->endpoint;
+	const uint8_t *setup = NULL, *data = xfer->buffer;
+	int length = xfer->length;
+	struct replay_op *op;
+
+	if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		setup = xfer->buffer;
+		endpoint = setup[0] & LIBUSB_ENDPOINT_DIR_MASK;
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+		length -= LIBUSB_CONTROL_SETUP_SIZE;
+	}
+
+	op = replay_next(cntx, TRACE_SUBMIT, endpoint, setup, length,
+			(endpoint & LIBUSB_ENDPOINT_IN) ? NULL : data);
+	if (!op)
+		return LIBUSB_ERROR_IO;
+	if (op->rec.status)
+		return op->rec.status;
+
+	struct replay_xfer *rx = calloc(1, sizeof(*rx));
+
+	if (!rx)
+		return LIBUSB_ERROR_NO_MEM;
+
+	rx->xfer = xfer;
+	rx->complete = op->complete;
+	if (rx->complete)
+		rx->due = clock_now_ns() + rx->complete->rec.duration_ns;
+	rx->waits_cancel = !rx->complete || rx->complete->rec.status == LIBUSB_TRANSFER_CANCELLED;
+
+	/*
+	 * Completions are handed back in the order they were traced, going
+	 * by when they're due would let the host's timing reorder them.
+	 * Ones the trace never saw complete go at the back.
+	 */
+	struct replay_xfer **pp = &replay->pending;
+
+	while (*pp && (*pp)->complete && (!rx->complete || (*pp)->complete < rx->complete))
+		pp = &(*pp)->next;
+	rx->next = *pp;
+	*pp = rx;
+
+	return 0;
+}
+
+static int transport_replay_cancel(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct replay *replay = cntx->transport_priv;
+
+	for (struct replay_xfer *rx = replay->pending; rx; rx = rx->next) {
+		if (rx->xfer != xfer)
+			continue;
+
+		/* Anything the trace has finishing on its own finishes on its own */
+		if (!rx->waits_cancel)
+			return LIBUSB_ERROR_NOT_FOUND;
+
+		rx->cancelled = true;
+		rx->due = clock_now_ns();
+		return 0;
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int transport_replay_handle_events(struct p3udl_cntx *cntx, struct timeval *tv, int *completed)
+{
+	struct replay *replay = cntx->transport_priv;
+	uint64_t deadline = clock_now_ns() + (tv->tv_sec * NSEC_PER_SEC) + (tv->tv_usec * NSEC_PER_USEC);
+	struct replay_xfer *rx = replay->pending;
+
+	if (!rx || (rx->waits_cancel && !rx->cancelled) || rx->due > deadline) {
+		replay_sleep_until(deadline);
+		return 0;
+	}
+
+	replay_sleep_until(rx->due);
+	replay->pending = rx->next;
+
+	struct libusb_transfer *xfer = rx->xfer;
+	struct replay_op *complete = rx->complete;
+
+	free(rx);
+
+	if (complete) {
+		uint8_t *data = xfer->buffer;
+		int room = xfer->length;
+
+		if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+			data += LIBUSB_CONTROL_SETUP_SIZE;
+			room -= LIBUSB_CONTROL_SETUP_SIZE;
+		}
+
+		xfer->status = complete->rec.status;
+		xfer->actual_length = complete->rec.actual;
+		if (complete->rec.caplen)
+			memcpy(data, complete->data, complete->rec.caplen < room ? complete->rec.caplen : room);
+	}
+	else {
+		xfer->status = LIBUSB_TRANSFER_CANCELLED;
+		xfer->actual_length = 0;
+	}
+
+	xfer->callback(xfer);
+
+	return 0;
+}
+
+const struct p3udl_transport transport_replay = {
+	.name = "replay",
+	.setup = transport_replay_setup,
+	.close = transport_replay_close,
+	.bulk = transport_replay_bulk,
+	.control = transport_replay_control,
+	.clear_halt = transport_replay_clear_halt,
+	.reconnect = transport_replay_reconnect,
+	.claim_interface = transport_replay_claim_interface,
+	.set_altsetting = transport_replay_set_altsetting,
+	.submit = transport_replay_submit,
+	.cancel = transport_replay_cancel,
+	.handle_events = transport_replay_handle_events,
+};
+
+static int replay_add(struct replay *replay, const struct trace_record *rec, uint8_t *data)
+{
+	if (!(replay->nops & (replay->nops + 1))) {
+		struct replay_op *ops = realloc(replay->ops, (replay->nops * 2 + 1) * sizeof(*ops));
+
+		if (!ops)
+			return -ENOMEM;
+		replay->ops = ops;
+	}
+
+	replay->ops[replay->nops].rec = *rec;
+	replay->ops[replay->nops].data = data;
+	replay->ops[replay->nops].complete = NULL;
+	replay->nops++;
+
+	return 0;
+}
+
+/* Submits only know their completion by id, and the completion can be anywhere after it */
+static void replay_pair(struct replay *replay)
+{
+	for (size_t i = 0; i < replay->nops; i++) {
+		struct replay_op *op = &replay->ops[i];
+
+		if (op->rec.type != TRACE_SUBMIT)
+			continue;
+
+		/* Usually not far after, but it can be written down before the submit is */
+		for (size_t n = 1; n < replay->nops; n++) {
+			struct replay_op *c = &replay->ops[(i + n) % replay->nops];
+
+			if (c->rec.type == TRACE_COMPLETE && c->rec.id == op->rec.id) {
+				op->complete = c;
+				break;
+			}
+		}
+	}
+}
+
+/* Stand-in for usb_probe() with a board for each one in the trace */
+int replay_probe(struct p3udl_cntx *template, const char *path, struct p3udl_cntx **boards)
+{
+	struct p3udl_cntx *found = NULL;
+	struct trace_header hdr;
+	struct trace_record rec;
+	uint8_t *data;
+	int nboards = 0, ret;
+	FILE *f;
+
+	ret = trace_open(&f, path, &hdr);
+	if (ret) {
+		replay_err(template, "Can't read trace %s: %d\n", path, ret);
+		return ret;
+	}
+
+	while ((ret = trace_read(f, &rec, &data)) > 0) {
+		if (rec.type == TRACE_BOARD) {
+			struct p3udl_cntx *more;
+			struct replay *replay;
+
+			if (rec.board != nboards) {
+				free(data);
+				ret = -EINVAL;
+				break;
+			}
+
+			more = realloc(found, (nboards + 1) * sizeof(*found));
+			if (!more) {
+				free(data);
+				ret = -ENOMEM;
+				break;
+			}
+			found = more;
+
+			replay = calloc(1, sizeof(*replay));
+			if (!replay) {
+				free(data);
+				ret = -ENOMEM;
+				break;
+			}
+
+			struct p3udl_cntx *cntx = &found[nboards++];
+
+			*cntx = *template;
+			cntx->tag = 1;
+			cntx->stage = P3UDL_STAGE_PROBE;
+			snprintf(cntx->name, sizeof(cntx->name), "%s", data ? (char *) data : "");
+			cntx->bus = rec.endpoint;
+			cntx->nports = rec.length;
+			memcpy(cntx->ports, rec.setup, sizeof(cntx->ports));
+			cntx->transport = &transport_replay;
+			cntx->transport_priv = replay;
+			free(data);
+			continue;
+		}
+
+		if (rec.board >= nboards) {
+			free(data);
+			ret = -EINVAL;
+			break;
+		}
+
+		ret = replay_add(found[rec.board].transport_priv, &rec, data);
+		if (ret) {
+			free(data);
+			break;
+		}
+	}
+	fclose(f);
+
+	if (!ret && !nboards)
+		ret = -ENODEV;
+
+	if (ret) {
+		replay_err(template, "Can't replay %s: %d\n", path, ret);
+		for (int i = 0; i < nboards; i++)
+			replay_free(found[i].transport_priv);
+		free(found);
+		return ret;
+	}
+
+	for (int i = 0; i < nboards; i++) {
+		replay_pair(found[i].transport_priv);
+		topology_assign(&found[i]);
+	}
+
+	replay_info(template, "Replaying %d board(s) from %s\n", nboards, path);
+
+	*boards = found;
+	return nboards;
+}
@@ -0,0 +1,668 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Leaves the board with the kernel's usb-storage driver and sends the
+ * commands through SG_IO on its /dev/sg node, the kernel does the CBW,
+ * CSW and recovery. The protocol code still talks Bulk-Only Transport
+ * so a CBW here is taken apart, the command runs once its data phase
+ * turns up and the CSW is made up from how it went.
+ *
+ * Queued commands go to the sg driver with write() and come back with
+ * read(), so the kernel always has the next one ready.
+ *
+ * Once the board re-enumerates as something that isn't a disk,
+ * u-boot's DFU gadget, everything goes to libusb instead.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <scsi/sg.h>
+
+#include "clock.h"
+#include "cntx.h"
+#include "transport.h"
+#include "xfer.h"
+
+#include "main_log.h"
+
+/* usb-storage only scans the device after delay_use, a second by default */
+#define SG_NODE_TIMEOUT_MS	5000
+/* What the kernel keeps per open file, the usb updater's biggest segments fit */
+#define SG_RESERVED_SIZE	(256 * 1024)
+/* For queued commands whose transfers didn't say */
+#define SG_DEFAULT_TIMEOUT_MS	60000
+
+/* SCSI status and the host byte values that mean something here */
+#define SG_STATUS_CHECK_CONDITION	0x02
+#define SG_DID_NO_CONNECT		0x01
+#define SG_DID_TIME_OUT			0x03
+#define SG_DRIVER_SENSE			0x08
+
+#define SG_REQUEST_SENSE		0x03
+
+#define BOMS_RESET		0xFF
+#define BOMS_GET_MAX_LUN	0xFE
+
+#define CBW_LEN			31
+#define CSW_LEN			13
+
+enum sg_phase {
+	SG_PHASE_CBW,
+	SG_PHASE_DATA,
+	SG_PHASE_CSW,
+};
+
+enum sg_xfer {
+	SG_XFER_CBW,
+	SG_XFER_DATA,
+	SG_XFER_CSW,
+	SG_XFER_MAX,
+};
+
+struct sg_cmd {
+	struct sg_cmd *next;
+	uint32_t tag, len;
+	bool in;
+	uint8_t cdb[16], cdb_len;
+
+	/* the BOT transfers that make up a queued command, in the order they complete */
+	struct libusb_transfer *xfers[SG_XFER_MAX];
+	unsigned int delivered;
+
+	sg_io_hdr_t hdr;
+	uint8_t sense[32];
+	bool written, done;
+	/* a libusb error if the command never got an answer, otherwise bCSWStatus and the residue */
+	int result;
+	uint8_t status;
+	uint32_t residue;
+};
+
+struct transport_sg {
+	/* -1 once the board has gone to libusb */
+	int fd;
+	char path[32];
+
+	/* synchronous commands go through here one phase at a time */
+	struct sg_cmd sync;
+	enum sg_phase phase;
+
+	/* queued commands, oldest first, and the one the next data or CSW transfer belongs to */
+	struct sg_cmd *queue, **queue_tail;
+	struct sg_cmd *newest;
+
+	/* sense data of the last command that failed, for the REQUEST SENSE that follows */
+	uint8_t sense[32];
+	uint8_t sense_len;
+};
+
+static const uint8_t cbw_signature[4] = { 'U', 'S', 'B', 'C' };
+
+static uint32_t sg_get_le32(const uint8_t *buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+static void sg_put_le32(uint8_t *buf, uint32_t val)
+{
+	buf[0] = val & 0xff;
+	buf[1] = (val >> 8) & 0xff;
+	buf[2] = (val >> 16) & 0xff;
+	buf[3] = (val >> 24) & 0xff;
+}
+
+static bool sg_parse_cbw(struct sg_cmd *cmd, const uint8_t *cbw, int len)
+{
+	if (len != CBW_LEN || memcmp(cbw, cbw_signature, sizeof(cbw_signature)))
+		return false;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->tag = sg_get_le32(cbw + 4);
+	cmd->len = sg_get_le32(cbw + 8);
+	cmd->in = cbw[12] & LIBUSB_ENDPOINT_IN;
+	cmd->cdb_len = min(cbw[14], (uint8_t) sizeof(cmd->cdb));
+	memcpy(cmd->cdb, cbw + 15, cmd->cdb_len);
+
+	return true;
+}
+
+static void sg_fill_csw(const struct sg_cmd *cmd, uint8_t *csw)
+{
+	memcpy(csw, "USBS", 4);
+	sg_put_le32(csw + 4, cmd->tag);
+	sg_put_le32(csw + 8, cmd->residue);
+	csw[12] = cmd->status;
+}
+
+static void sg_fill_hdr(struct sg_cmd *cmd, void *data, unsigned int timeout)
+{
+	sg_io_hdr_t *hdr = &cmd->hdr;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->interface_id = 'S';
+	hdr->cmdp = cmd->cdb;
+	hdr->cmd_len = cmd->cdb_len;
+	hdr->sbp = cmd->sense;
+	hdr->mx_sb_len = sizeof(cmd->sense);
+	hdr->dxferp = data;
+	hdr->dxfer_len = cmd->len;
+	if (!cmd->len)
+		hdr->dxfer_direction = SG_DXFER_NONE;
+	else
+		hdr->dxfer_direction = cmd->in ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
+	hdr->timeout = timeout ? timeout : SG_DEFAULT_TIMEOUT_MS;
+	/* Falls back to going through the kernel's buffer if direct IO isn't allowed */
+	hdr->flags = SG_FLAG_DIRECT_IO;
+	hdr->pack_id = cmd->tag;
+	hdr->usr_ptr = cmd;
+}
+
+/*
+ * The device's own REQUEST SENSE would say nothing, the kernel already
+ * fetched the sense data when the command failed.
+ */
+static bool sg_answer_sense(struct transport_sg *sg, struct sg_cmd *cmd, uint8_t *data)
+{
+	if (cmd->cdb[0] != SG_REQUEST_SENSE || !cmd->in)
+		return false;
+
+	uint32_t n = min(cmd->len, (uint32_t) sg->sense_len);
+
+	if (n)
+		memcpy(data, sg->sense, n);
+	cmd->residue = cmd->len - n;
+	cmd->status = 0;
+	cmd->result = 0;
+	cmd->done = true;
+	sg->sense_len = 0;
+
+	return true;
+}
+
+/* Work out what the kernel made of a command that came back */
+static void sg_finish(struct transport_sg *sg, struct sg_cmd *cmd)
+{
+	const sg_io_hdr_t *hdr = &cmd->hdr;
+
+	cmd->done = true;
+	cmd->result = 0;
+	cmd->status = 0;
+	cmd->residue = hdr->resid > 0 ? hdr->resid : 0;
+
+	if (hdr->host_status == SG_DID_NO_CONNECT)
+		cmd->result = LIBUSB_ERROR_NO_DEVICE;
+	else if (hdr->host_status == SG_DID_TIME_OUT)
+		cmd->result = LIBUSB_ERROR_TIMEOUT;
+	else if (hdr->host_status || (hdr->driver_status & ~SG_DRIVER_SENSE))
+		cmd->result = LIBUSB_ERROR_IO;
+	else if (hdr->status) {
+		cmd->status = 1;
+		sg->sense_len = hdr->status == SG_STATUS_CHECK_CONDITION ? hdr->sb_len_wr : 0;
+		memcpy(sg->sense, cmd->sense, sg->sense_len);
+	}
+}
+
+static int sg_run(struct p3udl_cntx *cntx, struct transport_sg *sg, struct sg_cmd *cmd, void *data,
+		unsigned int timeout)
+{
+	if (sg_answer_sense(sg, cmd, data))
+		return 0;
+
+	sg_fill_hdr(cmd, data, timeout);
+	if (ioctl(sg->fd, SG_IO, &cmd->hdr) < 0) {
+		int err = errno;
+
+		p3udl_dbg(cntx, "SG_IO on %s: %s\n", sg->path, strerror(err));
+		return err == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+	}
+
+	sg_finish(sg, cmd);
+
+	return cmd->result;
+}
+
+static int transport_sg_setup(struct p3udl_cntx *cntx)
+{
+	/* The endpoints only matter for telling the phases apart and rounding segments */
+	return transport_libusb.setup(cntx);
+}
+
+static void transport_sg_close(struct p3udl_cntx *cntx)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+
+	while (sg->queue) {
+		struct sg_cmd *next = sg->queue->next;
+
+		free(sg->queue);
+		sg->queue = next;
+	}
+
+	if (sg->fd >= 0)
+		close(sg->fd);
+	free(sg);
+	cntx->transport_priv = NULL;
+
+	transport_libusb.close(cntx);
+}
+
+static int transport_sg_bulk(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t *data,
+		int length, int *actual_length, unsigned int timeout)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+	struct sg_cmd *cmd = &sg->sync;
+	int ret;
+
+	if (sg->fd < 0)
+		return transport_libusb.bulk(cntx, endpoint, data, length, actual_length, timeout);
+
+	*actual_length = 0;
+
+	switch (sg->phase) {
+	case SG_PHASE_CBW:
+		if (endpoint & LIBUSB_ENDPOINT_IN || !sg_parse_cbw(cmd, data, length))
+			return LIBUSB_ERROR_PIPE;
+
+		*actual_length = length;
+		if (cmd->len) {
+			sg->phase = SG_PHASE_DATA;
+			return 0;
+		}
+
+		/* No data phase for a failure to show up in, the CBW takes it */
+		ret = sg_run(cntx, sg, cmd, NULL, timeout);
+		if (ret) {
+			*actual_length = 0;
+			sg->phase = SG_PHASE_CBW;
+			return ret;
+		}
+
+		sg->phase = SG_PHASE_CSW;
+		return 0;
+	case SG_PHASE_DATA:
+		/* BOT would stall the pipe for anything longer than the CBW said */
+		if (length > cmd->len)
+			length = cmd->len;
+		cmd->len = length;
+
+		ret = sg_run(cntx, sg, cmd, data, timeout);
+		if (ret) {
+			sg->phase = SG_PHASE_CBW;
+			return ret;
+		}
+
+		*actual_length = length - cmd->residue;
+		sg->phase = SG_PHASE_CSW;
+		return 0;
+	case SG_PHASE_CSW:
+	default:
+		if (!(endpoint & LIBUSB_ENDPOINT_IN) || length < CSW_LEN)
+			return LIBUSB_ERROR_PIPE;
+
+		sg_fill_csw(cmd, data);
+		*actual_length = CSW_LEN;
+		sg->phase = SG_PHASE_CBW;
+		return 0;
+	}
+}
+
+/* The only class requests the mass storage code makes, the sg node is already one LUN */
+static int transport_sg_control(struct p3udl_cntx *cntx, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+
+	if (sg->fd < 0)
+		return transport_libusb.control(cntx, request_type, request, value, index, data, length, timeout);
+
+	if ((request_type & LIBUSB_REQUEST_TYPE_CLASS) && request == BOMS_GET_MAX_LUN && length >= 1) {
+		data[0] = 0;
+		return 1;
+	}
+
+	/* usb-storage does its own resets */
+	if ((request_type & LIBUSB_REQUEST_TYPE_CLASS) && request == BOMS_RESET) {
+		sg->phase = SG_PHASE_CBW;
+		return 0;
+	}
+
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static int transport_sg_clear_halt(struct p3udl_cntx *cntx, uint8_t endpoint)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+
+	if (sg->fd < 0)
+		return transport_libusb.clear_halt(cntx, endpoint);
+
+	return 0;
+}
+
+static int transport_sg_reconnect(struct p3udl_cntx *cntx, unsigned int timeout_ms)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+
+	if (sg->queue)
+		return LIBUSB_ERROR_BUSY;
+
+	if (sg->fd >= 0) {
+		close(sg->fd);
+		sg->fd = -1;
+	}
+
+	return transport_libusb.reconnect(cntx, timeout_ms);
+}
+
+static int transport_sg_claim_interface(struct p3udl_cntx *cntx, uint8_t interface)
+{
+	return transport_libusb.claim_interface(cntx, interface);
+}
+
+static int transport_sg_set_altsetting(struct p3udl_cntx *cntx, uint8_t interface, uint8_t altsetting)
+{
+	return transport_libusb.set_altsetting(cntx, interface, altsetting);
+}
+
+/* Give the command to the sg driver, it comes back through handle_events */
+static void sg_write(struct p3udl_cntx *cntx, struct transport_sg *sg, struct sg_cmd *cmd)
+{
+	struct libusb_transfer *data = cmd->xfers[SG_XFER_DATA];
+	struct libusb_transfer *csw = cmd->xfers[SG_XFER_CSW];
+
+	if (sg_answer_sense(sg, cmd, data ? data->buffer : NULL))
+		return;
+
+	sg_fill_hdr(cmd, data ? data->buffer : NULL, csw->timeout);
+	if (write(sg->fd, &cmd->hdr, sizeof(cmd->hdr)) < 0) {
+		p3udl_dbg(cntx, "Queueing on %s: %s\n", sg->path, strerror(errno));
+		cmd->result = errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+		cmd->done = true;
+		return;
+	}
+
+	cmd->written = true;
+}
+
+/*
+ * A CBW starts a command, the data and CSW transfers that follow belong
+ * to the newest one and the CSW sends it on its way.
+ */
+static int transport_sg_submit(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+	struct sg_cmd *cmd = sg->newest;
+
+	if (sg->fd < 0)
+		return transport_libusb.submit(cntx, xfer);
+
+	if (xfer->type != LIBUSB_TRANSFER_TYPE_BULK)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (!(xfer->endpoint & LIBUSB_ENDPOINT_IN) && xfer->length == CBW_LEN &&
+			!memcmp(xfer->buffer, cbw_signature, sizeof(cbw_signature))) {
+		cmd = calloc(1, sizeof(*cmd));
+		if (!cmd)
+			return LIBUSB_ERROR_NO_MEM;
+
+		sg_parse_cbw(cmd, xfer->buffer, xfer->length);
+		cmd->xfers[SG_XFER_CBW] = xfer;
+
+		if (!sg->queue)
+			sg->queue_tail = &sg->queue;
+		*sg->queue_tail = cmd;
+		sg->queue_tail = &cmd->next;
+		sg->newest = cmd;
+		return 0;
+	}
+
+	if (!cmd || cmd->xfers[SG_XFER_CSW])
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (cmd->len && !cmd->xfers[SG_XFER_DATA]) {
+		cmd->xfers[SG_XFER_DATA] = xfer;
+		cmd->len = min(cmd->len, (uint32_t) xfer->length);
+		return 0;
+	}
+
+	cmd->xfers[SG_XFER_CSW] = xfer;
+	sg_write(cntx, sg, cmd);
+
+	return 0;
+}
+
+/*
+ * Nothing that has gone to the kernel can be pulled back, it completes
+ * as whatever happened to it, like a libusb transfer that was already done.
+ */
+static int transport_sg_cancel(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+
+	if (sg->fd < 0)
+		return transport_libusb.cancel(cntx, xfer);
+
+	for (struct sg_cmd *cmd = sg->queue; cmd; cmd = cmd->next) {
+		for (int i = 0; i < SG_XFER_MAX; i++) {
+			if (cmd->xfers[i] != xfer)
+				continue;
+
+			if (cmd->written || cmd->done)
+				return LIBUSB_ERROR_NOT_FOUND;
+
+			cmd->result = LIBUSB_ERROR_INTERRUPTED;
+			cmd->done = true;
+			return 0;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static enum libusb_transfer_status sg_xfer_status(int result)
+{
+	switch (result) {
+	case 0:
+		return LIBUSB_TRANSFER_COMPLETED;
+	case LIBUSB_ERROR_TIMEOUT:
+		return LIBUSB_TRANSFER_TIMED_OUT;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return LIBUSB_TRANSFER_NO_DEVICE;
+	case LIBUSB_ERROR_INTERRUPTED:
+		return LIBUSB_TRANSFER_CANCELLED;
+	default:
+		return LIBUSB_TRANSFER_ERROR;
+	}
+}
+
+/* Hand back the next transfer of the oldest command, the CBW always went */
+static void sg_deliver(struct transport_sg *sg, struct sg_cmd *cmd)
+{
+	struct libusb_transfer *xfer = NULL;
+	int i;
+
+	while (!xfer && cmd->delivered < SG_XFER_MAX) {
+		i = cmd->delivered++;
+		xfer = cmd->xfers[i];
+	}
+
+	if (xfer) {
+		xfer->status = sg_xfer_status(cmd->result);
+		xfer->actual_length = 0;
+
+		if (i == SG_XFER_CBW && cmd->result != LIBUSB_ERROR_INTERRUPTED) {
+			xfer->status = LIBUSB_TRANSFER_COMPLETED;
+			xfer->actual_length = CBW_LEN;
+		}
+		else if (!cmd->result && i == SG_XFER_DATA)
+			xfer->actual_length = cmd->len - cmd->residue;
+		else if (!cmd->result && i == SG_XFER_CSW) {
+			sg_fill_csw(cmd, xfer->buffer);
+			xfer->actual_length = CSW_LEN;
+		}
+	}
+
+	if (cmd->delivered == SG_XFER_MAX) {
+		sg->queue = cmd->next;
+		if (sg->newest == cmd)
+			sg->newest = NULL;
+		free(cmd);
+	}
+
+	if (xfer)
+		xfer->callback(xfer);
+}
+
+static int transport_sg_handle_events(struct p3udl_cntx *cntx, struct timeval *tv, int *completed)
+{
+	struct transport_sg *sg = cntx->transport_priv;
+	struct sg_cmd *cmd = sg->queue;
+
+	if (sg->fd < 0)
+		return transport_libusb.handle_events(cntx, tv, completed);
+
+	if (cmd && cmd->done) {
+		sg_deliver(sg, cmd);
+		return 0;
+	}
+
+	/* Only commands the kernel has can still finish by themselves */
+	bool waiting = false;
+
+	for (struct sg_cmd *it = cmd; it; it = it->next)
+		waiting |= it->written && !it->done;
+
+	struct pollfd pfd = {
+		.fd = sg->fd,
+		.events = POLLIN,
+	};
+	int ms = (tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+
+	if (!waiting) {
+		struct timespec ts = {
+			.tv_sec = tv->tv_sec,
+			.tv_nsec = tv->tv_usec * NSEC_PER_USEC,
+		};
+
+		nanosleep(&ts, NULL);
+		return 0;
+	}
+
+	int ret = poll(&pfd, 1, ms);
+	if (ret < 0)
+		return errno == EINTR ? LIBUSB_ERROR_INTERRUPTED : LIBUSB_ERROR_IO;
+	if (!ret)
+		return 0;
+
+	sg_io_hdr_t hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.interface_id = 'S';
+	if (read(sg->fd, &hdr, sizeof(hdr)) < 0)
+		return errno == ENODEV ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+
+	struct sg_cmd *done = hdr.usr_ptr;
+
+	done->hdr = hdr;
+	sg_finish(sg, done);
+
+	if (cmd->done)
+		sg_deliver(sg, cmd);
+
+	return 0;
+}
+
+const struct p3udl_transport transport_sg = {
+	.name = "sg",
+	.setup = transport_sg_setup,
+	.close = transport_sg_close,
+	.bulk = transport_sg_bulk,
+	.control = transport_sg_control,
+	.clear_halt = transport_sg_clear_halt,
+	.reconnect = transport_sg_reconnect,
+	.claim_interface = transport_sg_claim_interface,
+	.set_altsetting = transport_sg_set_altsetting,
+	.submit = transport_sg_submit,
+	.cancel = transport_sg_cancel,
+	.handle_events = transport_sg_handle_events,
+};
+
+/* The scsi_generic node under the board's mass storage interface in sysfs */
+static int sg_find_node(struct p3udl_cntx *cntx, char *path, size_t len)
+{
+	char pattern[128];
+	glob_t g;
+
+	snprintf(pattern, sizeof(pattern),
+			"/sys/bus/usb/devices/%s:*/host*/target*/*/scsi_generic/sg*", cntx->port);
+
+	if (glob(pattern, 0, NULL, &g))
+		return -ENOENT;
+
+	const char *node = strrchr(g.gl_pathv[0], '/');
+
+	snprintf(path, len, "/dev%s", node);
+	globfree(&g);
+
+	return 0;
+}
+
+/*
+ * Called instead of detaching the kernel driver, the board is open
+ * with libusb already and keeps the handle for the descriptors and
+ * for after it re-enumerates.
+ */
+int transport_sg_open(struct p3udl_cntx *cntx)
+{
+	uint64_t deadline = clock_now_ns() + (SG_NODE_TIMEOUT_MS * NSEC_PER_MSEC);
+	const struct timespec wait = {
+		.tv_nsec = 100 * NSEC_PER_MSEC,
+	};
+	struct transport_sg *sg = calloc(1, sizeof(*sg));
+	int reserved = SG_RESERVED_SIZE;
+
+	if (!sg)
+		return -ENOMEM;
+
+	if (cntx->nports <= 0) {
+		p3udl_err(cntx, "Don't know which port the board is on, can't find its sg node\n");
+		free(sg);
+		return -ENODEV;
+	}
+
+	while (sg_find_node(cntx, sg->path, sizeof(sg->path))) {
+		if (clock_now_ns() >= deadline) {
+			p3udl_err(cntx, "No sg node for %s, are usb-storage and sg loaded?\n", cntx->port);
+			free(sg);
+			return -ENODEV;
+		}
+		nanosleep(&wait, NULL);
+	}
+
+	sg->fd = open(sg->path, O_RDWR | O_CLOEXEC);
+	if (sg->fd < 0) {
+		int ret = -errno;
+
+		p3udl_err(cntx, "Can't open %s: %s\n", sg->path, strerror(errno));
+		free(sg);
+		return ret;
+	}
+
+	if (ioctl(sg->fd, SG_SET_RESERVED_SIZE, &reserved))
+		p3udl_dbg(cntx, "Couldn't grow the reserved buffer of %s\n", sg->path);
+
+	p3udl_info(cntx, "Talking to the board through %s\n", sg->path);
+
+	cntx->transport = &transport_sg;
+	cntx->transport_priv = sg;
+
+	return 0;
+}
@@ -0,0 +1,309 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Sits in front of a board's real transport and writes down everything
+ * that goes through it. Asynchronous transfers have their callback
+ * swapped for one that records the completion before handing it on,
+ * which works wherever the completion turns up.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "cntx.h"
+#include "trace.h"
+#include "transport.h"
+
+struct trace_xfer {
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	struct p3udl_cntx *cntx;
+	uint32_t id;
+	uint64_t submitted;
+};
+
+static void trace_fill(struct p3udl_cntx *cntx, struct trace_record *rec, uint8_t type,
+		uint64_t start)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->board = cntx->trace_board;
+	rec->ns = start - cntx->trace->start_ns;
+	rec->duration_ns = clock_now_ns() - start;
+}
+
+/* OUT data gets cut short, whatever came IN is kept because replaying needs it */
+static uint32_t trace_caplen(uint8_t endpoint, int length)
+{
+	if (length <= 0)
+		return 0;
+	if (!(endpoint & LIBUSB_ENDPOINT_IN) && length > TRACE_SNAPLEN)
+		return TRACE_SNAPLEN;
+
+	return length;
+}
+
+static void trace_setup_packet(struct trace_record *rec, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint16_t length)
+{
+	rec->setup[0] = request_type;
+	rec->setup[1] = request;
+	rec->setup[2] = value & 0xff;
+	rec->setup[3] = value >> 8;
+	rec->setup[4] = index & 0xff;
+	rec->setup[5] = index >> 8;
+	rec->setup[6] = length & 0xff;
+	rec->setup[7] = length >> 8;
+}
+
+static int transport_trace_setup(struct p3udl_cntx *cntx)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->setup(cntx);
+
+	trace_fill(cntx, &rec, TRACE_SETUP, start);
+	rec.status = ret;
+	rec.endpoint = cntx->ep_in;
+	trace_setup_packet(&rec, 0, 0, cntx->ep_out, 0, 0);
+	rec.length = cntx->ep_maxpacket;
+	trace_write(cntx->trace, &rec, NULL);
+
+	return ret;
+}
+
+static void transport_trace_close(struct p3udl_cntx *cntx)
+{
+	struct trace_record rec;
+
+	trace_fill(cntx, &rec, TRACE_CLOSE, clock_now_ns());
+	trace_write(cntx->trace, &rec, NULL);
+
+	cntx->transport = cntx->trace_inner;
+	cntx->trace_inner = NULL;
+	cntx->transport->close(cntx);
+}
+
+static int transport_trace_bulk(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t *data,
+		int length, int *actual_length, unsigned int timeout)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->bulk(cntx, endpoint, data, length, actual_length, timeout);
+
+	trace_fill(cntx, &rec, TRACE_BULK, start);
+	rec.status = ret;
+	rec.endpoint = endpoint;
+	rec.xfer_type = LIBUSB_TRANSFER_TYPE_BULK;
+	rec.length = length;
+	rec.actual = *actual_length;
+	rec.caplen = trace_caplen(endpoint, (endpoint & LIBUSB_ENDPOINT_IN) ? *actual_length : length);
+	trace_write(cntx->trace, &rec, data);
+
+	return ret;
+}
+
+static int transport_trace_control(struct p3udl_cntx *cntx, uint8_t request_type, uint8_t request,
+		uint16_t value, uint16_t index, uint8_t *data, uint16_t length, unsigned int timeout)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->control(cntx, request_type, request, value, index, data,
+			length, timeout);
+	uint8_t dir = request_type & LIBUSB_ENDPOINT_DIR_MASK;
+
+	trace_fill(cntx, &rec, TRACE_CONTROL, start);
+	rec.status = ret < 0 ? ret : 0;
+	rec.endpoint = dir;
+	rec.xfer_type = LIBUSB_TRANSFER_TYPE_CONTROL;
+	trace_setup_packet(&rec, request_type, request, value, index, length);
+	rec.length = length;
+	rec.actual = ret > 0 ? ret : 0;
+	rec.caplen = trace_caplen(dir, dir ? rec.actual : length);
+	trace_write(cntx->trace, &rec, data);
+
+	return ret;
+}
+
+static int transport_trace_clear_halt(struct p3udl_cntx *cntx, uint8_t endpoint)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->clear_halt(cntx, endpoint);
+
+	trace_fill(cntx, &rec, TRACE_CLEAR_HALT, start);
+	rec.status = ret;
+	rec.endpoint = endpoint;
+	trace_write(cntx->trace, &rec, NULL);
+
+	return ret;
+}
+
+static int transport_trace_reconnect(struct p3udl_cntx *cntx, unsigned int timeout_ms)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->reconnect(cntx, timeout_ms);
+
+	trace_fill(cntx, &rec, TRACE_RECONNECT, start);
+	rec.status = ret;
+	rec.length = timeout_ms;
+	trace_write(cntx->trace, &rec, NULL);
+
+	return ret;
+}
+
+static int transport_trace_claim_interface(struct p3udl_cntx *cntx, uint8_t interface)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->claim_interface(cntx, interface);
+
+	trace_fill(cntx, &rec, TRACE_CLAIM, start);
+	rec.status = ret;
+	trace_setup_packet(&rec, 0, 0, 0, interface, 0);
+	trace_write(cntx->trace, &rec, NULL);
+
+	return ret;
+}
+
+static int transport_trace_set_altsetting(struct p3udl_cntx *cntx, uint8_t interface,
+		uint8_t altsetting)
+{
+	struct trace_record rec;
+	uint64_t start = clock_now_ns();
+	int ret = cntx->trace_inner->set_altsetting(cntx, interface, altsetting);
+
+	trace_fill(cntx, &rec, TRACE_ALTSETTING, start);
+	rec.status = ret;
+	trace_setup_packet(&rec, 0, 0, altsetting, interface, 0);
+	trace_write(cntx->trace, &rec, NULL);
+
+	return ret;
+}
+
+static void transport_trace_complete(struct libusb_transfer *xfer)
+{
+	struct trace_xfer *tx = xfer->user_data;
+	struct p3udl_cntx *cntx = tx->cntx;
+	struct trace_record rec;
+	uint8_t *data = xfer->buffer;
+
+	trace_fill(cntx, &rec, TRACE_COMPLETE, tx->submitted);
+	rec.id = tx->id;
+	rec.status = xfer->status;
+	rec.endpoint = xfer->endpoint;
+	rec.xfer_type = xfer->type;
+	if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		rec.endpoint = xfer->buffer[0] & LIBUSB_ENDPOINT_DIR_MASK;
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+	}
+	rec.actual = xfer->actual_length;
+	rec.caplen = (rec.endpoint & LIBUSB_ENDPOINT_IN) ? xfer->actual_length : 0;
+	trace_write(cntx->trace, &rec, data);
+
+	/* Put it back the way it was, the callback might submit it again */
+	xfer->callback = tx->callback;
+	xfer->user_data = tx->user_data;
+	free(tx);
+
+	xfer->callback(xfer);
+}
+
+static int transport_trace_submit(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	struct trace_xfer *tx = malloc(sizeof(*tx));
+	struct trace_record rec;
+	uint8_t *data = xfer->buffer;
+	int length = xfer->length;
+	int ret;
+
+	if (!tx)
+		return LIBUSB_ERROR_NO_MEM;
+
+	tx->callback = xfer->callback;
+	tx->user_data = xfer->user_data;
+	tx->cntx = cntx;
+	tx->id = trace_next_id(cntx->trace);
+	tx->submitted = clock_now_ns();
+
+	xfer->callback = transport_trace_complete;
+	xfer->user_data = tx;
+
+	trace_fill(cntx, &rec, TRACE_SUBMIT, tx->submitted);
+	rec.id = tx->id;
+	rec.endpoint = xfer->endpoint;
+	rec.xfer_type = xfer->type;
+	if (xfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		memcpy(rec.setup, xfer->buffer, sizeof(rec.setup));
+		rec.endpoint = rec.setup[0] & LIBUSB_ENDPOINT_DIR_MASK;
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+		length -= LIBUSB_CONTROL_SETUP_SIZE;
+	}
+	rec.length = length;
+	rec.caplen = (rec.endpoint & LIBUSB_ENDPOINT_IN) ? 0 : trace_caplen(rec.endpoint, length);
+
+	ret = cntx->trace_inner->submit(cntx, xfer);
+	rec.status = ret;
+	trace_write(cntx->trace, &rec, data);
+
+	if (ret) {
+		xfer->callback = tx->callback;
+		xfer->user_data = tx->user_data;
+		free(tx);
+	}
+
+	return ret;
+}
+
+static int transport_trace_cancel(struct p3udl_cntx *cntx, struct libusb_transfer *xfer)
+{
+	return cntx->trace_inner->cancel(cntx, xfer);
+}
+
+static int transport_trace_handle_events(struct p3udl_cntx *cntx, struct timeval *tv, int *completed)
+{
+	return cntx->trace_inner->handle_events(cntx, tv, completed);
+}
+
+/* Nothing goes over the wire, the traced transport's memory is used as it is */
+static void *transport_trace_mem_alloc(struct p3udl_cntx *cntx, size_t len)
+{
+	if (!cntx->trace_inner->mem_alloc)
+		return NULL;
+
+	return cntx->trace_inner->mem_alloc(cntx, len);
+}
+
+static void transport_trace_mem_free(struct p3udl_cntx *cntx, void *mem, size_t len)
+{
+	cntx->trace_inner->mem_free(cntx, mem, len);
+}
+
+const struct p3udl_transport transport_trace = {
+	.name = "trace",
+	.setup = transport_trace_setup,
+	.close = transport_trace_close,
+	.bulk = transport_trace_bulk,
+	.control = transport_trace_control,
+	.clear_halt = transport_trace_clear_halt,
+	.reconnect = transport_trace_reconnect,
+	.claim_interface = transport_trace_claim_interface,
+	.set_altsetting = transport_trace_set_altsetting,
+	.submit = transport_trace_submit,
+	.cancel = transport_trace_cancel,
+	.handle_events = transport_trace_handle_events,
+	.mem_alloc = transport_trace_mem_alloc,
+	.mem_free = transport_trace_mem_free,
+};
+
+void transport_trace_attach(struct p3udl_cntx *cntx)
+{
+	if (!cntx->trace || cntx->transport == &transport_trace)
+		return;
+
+	cntx->trace_board = trace_add_board(cntx->trace, cntx->name, cntx->bus,
+			cntx->ports, cntx->nports);
+	cntx->trace_inner = cntx->transport;
+	cntx->transport = &transport_trace;
+}
@@ -0,0 +1,155 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Remembers what worked for a chip + IPL combination so the next
+ * board doesn't have to find out again.
+ *
+ * The cache is a text file of "<chip> <ipl md5> <key> <value>" lines
+ * that gets appended to, the last matching line wins, and compacted
+ * down to the last line for each key once it gets big. Without
+ * a chip, which is the case before there is a board to ask, any chip
+ * that has run the IPL will do.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "clock.h"
+#include "tune.h"
+
+#include "tune_log.h"
+
+#define TUNE_FILE	"tune"
+
+/* Everything but the value */
+static size_t tune_keylen(const char *line)
+{
+	const char *space = strrchr(line, ' ');
+
+	return space ? space - line : strlen(line);
+}
+
+static int tune_get(struct p3udl_cntx *cntx, const char *key, char *value, size_t len)
+{
+	char path[256], line[256];
+	int ret = -ENOENT;
+
+	if (!*cntx->ipl_hash)
+		return -ENOENT;
+
+	if (cache_path(path, sizeof(path), TUNE_FILE, false))
+		return -ENOENT;
+
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+
+	while (fgets(line, sizeof(line), f)) {
+		char chip[sizeof(cntx->chip)], hash[sizeof(cntx->ipl_hash)], k[32], v[64];
+
+		if (sscanf(line, "%23s %32s %31s %63s", chip, hash, k, v) != 4)
+			continue;
+
+		if ((*cntx->chip && strcmp(chip, cntx->chip)) || strcmp(hash, cntx->ipl_hash) || strcmp(k, key))
+			continue;
+
+		snprintf(value, len, "%s", v);
+		ret = 0;
+	}
+
+	fclose(f);
+
+	return ret;
+}
+
+static void tune_put(struct p3udl_cntx *cntx, const char *key, const char *value)
+{
+	char path[256], line[256];
+
+	if (!*cntx->chip || !*cntx->ipl_hash)
+		return;
+
+	if (cache_path(path, sizeof(path), TUNE_FILE, true))
+		return;
+
+	/* O_APPEND so boards finishing at the same time don't trample each other */
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		tune_dbg(cntx, "Can't write %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	int len = snprintf(line, sizeof(line), "%s %s %s %s\n", cntx->chip, cntx->ipl_hash, key, value);
+	if (write(fd, line, len) != len)
+		tune_dbg(cntx, "Short write to %s\n", path);
+
+	close(fd);
+
+	cache_compact(cntx, TUNE_FILE, tune_keylen);
+}
+
+int tune_get_transfer(struct p3udl_cntx *cntx, uint32_t *size)
+{
+	char value[16];
+
+	int ret = tune_get(cntx, "transfer", value, sizeof(value));
+	if (ret)
+		return ret;
+
+	*size = strtoul(value, NULL, 0);
+	if (!*size)
+		return -EINVAL;
+
+	tune_info(cntx, "Using %u byte segments that worked before for %s\n", *size,
+			*cntx->chip ? cntx->chip : "this IPL");
+
+	return 0;
+}
+
+void tune_put_transfer(struct p3udl_cntx *cntx, uint32_t size)
+{
+	char value[16];
+
+	snprintf(value, sizeof(value), "%u", size);
+	tune_put(cntx, "transfer", value);
+}
+
+/* Bytes per second a stage managed last time, "rate.<stage>" */
+int tune_get_rate(struct p3udl_cntx *cntx, const char *stage, uint64_t *rate)
+{
+	char key[32], value[24];
+
+	snprintf(key, sizeof(key), "rate.%s", stage);
+	int ret = tune_get(cntx, key, value, sizeof(value));
+	if (ret)
+		return ret;
+
+	*rate = strtoull(value, NULL, 0);
+
+	return *rate ? 0 : -EINVAL;
+}
+
+/*
+ * Only written when it has moved by more than an eighth, otherwise a
+ * station would add a line for every board.
+ */
+void tune_put_rate(struct p3udl_cntx *cntx, const char *stage, uint64_t bytes, uint64_t ns)
+{
+	char key[32], value[24];
+	uint64_t old;
+
+	if (!ns)
+		return;
+
+	uint64_t rate = clock_rate(bytes, ns);
+	if (!tune_get_rate(cntx, stage, &old) && rate > old - (old / 8) && rate < old + (old / 8))
+		return;
+
+	snprintf(key, sizeof(key), "rate.%s", stage);
+	snprintf(value, sizeof(value), "%llu", (unsigned long long) rate);
+	tune_put(cntx, key, value);
+}
@@ -0,0 +1,15 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __TUNE_H_
+#define __TUNE_H_
+
+#include <stdint.h>
+
+#include "cntx.h"
+
+int tune_get_transfer(struct p3udl_cntx *cntx, uint32_t *size);
+void tune_put_transfer(struct p3udl_cntx *cntx, uint32_t size);
+int tune_get_rate(struct p3udl_cntx *cntx, const char *stage, uint64_t *rate);
+void tune_put_rate(struct p3udl_cntx *cntx, const char *stage, uint64_t bytes, uint64_t ns);
+
+#endif /* __TUNE_H_ */
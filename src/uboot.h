@@ -13,6 +13,9 @@
 #define IH_MAGIC	0x27051956	/* Image Magic Number		*/
 #define IH_NMLEN	32	/* Image Name Length		*/
 
+#define IH_COMP_NONE	0	/*  No	 Compression Used	*/
+#define IH_COMP_LZ4	5	/* lz4	 Compression Used	*/
+
 struct legacy_img_hdr {
 	uint32_t	ih_magic;	/* Image Header Magic Number	*/
 	uint32_t	ih_hcrc;	/* Image Header CRC Checksum	*/
@@ -0,0 +1,564 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Writing images straight to the board's storage through u-boot's USB
+ * mass storage gadget, bootcmd running "ums 0 mmc 0" or similar.
+ *
+ * The gadget speaks the same Bulk-Only Transport as the boot ROM so the
+ * queued commands the usb updater gets are used here too, only with
+ * WRITE commands of a couple of MB each instead of vendor segments. That
+ * leaves the board's storage and the bus as the limit rather than DFU's
+ * one control transfer per block.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "board.h"
+#include "clock.h"
+#include "cntx.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "pool.h"
+#include "report.h"
+#include "topology.h"
+#include "transport.h"
+#include "tune.h"
+#include "ums.h"
+#include "usbms.h"
+
+#include "ums_log.h"
+
+/* Writes can sit behind the medium for a long time, especially on SPI NAND */
+#define UMS_TIMEOUT_MS		10000
+/* How long the gadget gets to find its medium after enumerating */
+#define UMS_READY_TIMEOUT_MS	10000
+#define UMS_SYNC_TIMEOUT_MS	60000
+/* Resuming an image after a failed WRITE, the device has the rest already */
+#define UMS_RETRY_MAX		3
+/* What --delta compares, the smallest piece of an image that is written on its own */
+#define UMS_DELTA_BLOCK		(64 * 1024)
+
+#define SENSE_NOT_READY		0x02
+#define SENSE_ILLEGAL_REQUEST	0x05
+#define SENSE_UNIT_ATTENTION	0x06
+#define SENSE_DATA_PROTECT	0x07
+
+struct ums_disk {
+	uint64_t blocks;
+	uint32_t block_size;
+};
+
+static void ums_sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * NSEC_PER_MSEC,
+	};
+
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * Anything but the device saying no to the command leaves the pipes out
+ * of step, put them right and say whether it is worth another go.
+ */
+static bool ums_recover(struct p3udl_cntx *cntx, int ret, int *tries)
+{
+	if (!ret || ret == -EIO || ++*tries > UMS_RETRY_MAX)
+		return false;
+
+	usb_massstorage_reset_recovery(cntx);
+	return true;
+}
+
+/* Every reset leaves a unit attention behind, and the medium might still be coming up */
+static int ums_wait_ready(struct p3udl_cntx *cntx)
+{
+	uint64_t deadline = clock_now_ns() + (UMS_READY_TIMEOUT_MS * NSEC_PER_MSEC);
+	uint8_t key = 0, asc = 0, ascq = 0;
+	int tries = 0;
+
+	for (;;) {
+		int ret = usb_massstorage_test_unit_ready(cntx);
+		if (ums_recover(cntx, ret, &tries))
+			continue;
+		if (ret != -EIO)
+			return ret;
+
+		ret = usb_massstorage_request_sense(cntx, &key, &asc, &ascq);
+		if (ums_recover(cntx, ret, &tries))
+			continue;
+		if (ret)
+			return ret;
+
+		if (key != SENSE_UNIT_ATTENTION && key != SENSE_NOT_READY)
+			break;
+		if (clock_now_ns() > deadline)
+			break;
+
+		if (key == SENSE_NOT_READY)
+			ums_sleep_ms(100);
+	}
+
+	ums_err(cntx, "Storage isn't ready, sense %02x/%02x/%02x\n", key, asc, ascq);
+	return -EIO;
+}
+
+static int ums_probe(struct p3udl_cntx *cntx, struct ums_disk *disk)
+{
+	int ret, tries = 0;
+
+	ret = cntx->transport->setup(cntx);
+	if (ret)
+		return ret;
+
+	ret = cntx->transport->claim_interface(cntx, 0);
+	if (ret) {
+		ums_err(cntx, "Couldn't claim the mass storage interface: %s\n", libusb_strerror(ret));
+		return ret;
+	}
+
+	/* The first device ums was given, whatever else it has */
+	cntx->lun = 0;
+
+	ret = ums_wait_ready(cntx);
+	if (ret)
+		return ret;
+
+	do {
+		ret = usb_massstorage_read_capacity(cntx, &disk->blocks, &disk->block_size);
+	} while (ums_recover(cntx, ret, &tries));
+	if (ret) {
+		ums_err(cntx, "READ CAPACITY failed: %d\n", ret);
+		return ret;
+	}
+
+	if (!disk->block_size || disk->block_size > UMS_TRANSFER || (UMS_TRANSFER % disk->block_size)) {
+		ums_err(cntx, "Can't work with %u byte blocks\n", disk->block_size);
+		return -EINVAL;
+	}
+
+	ums_info(cntx, "%llu blocks of %u bytes, %llu MiB\n", (unsigned long long) disk->blocks,
+			disk->block_size, (unsigned long long) ((disk->blocks * disk->block_size) >> 20));
+
+	return 0;
+}
+
+/* Everything is checked before anything is written so a bad manifest doesn't leave half a disk */
+static int ums_check(struct p3udl_cntx *cntx, const struct ums_disk *disk)
+{
+	uint64_t capacity = disk->blocks * disk->block_size;
+
+	for (int i = 0; i < cntx->ums->count; i++) {
+		struct manifest_entry *entry = &cntx->ums->entries[i];
+
+		int ret = image_loader_wait(&entry->loader);
+		if (ret)
+			return ret;
+
+		uint64_t len = entry->loader.image.size;
+
+		if (entry->offset % disk->block_size) {
+			ums_err(cntx, "%s: offset 0x%llx isn't on a %u byte block\n", entry->path,
+					(unsigned long long) entry->offset, disk->block_size);
+			return -EINVAL;
+		}
+
+		len = (len + disk->block_size - 1) / disk->block_size * disk->block_size;
+		if (entry->offset > capacity || len > capacity - entry->offset) {
+			ums_err(cntx, "%s: %llu bytes at 0x%llx runs off the end of the disk\n", entry->path,
+					(unsigned long long) len, (unsigned long long) entry->offset);
+			return -ENOSPC;
+		}
+	}
+
+	return 0;
+}
+
+/* A WRITE, in bytes from the start of the image */
+struct ums_cmd {
+	size_t off, len;
+	/* the image's last block, sent zero padded out of ums_writes.tail */
+	bool tail;
+};
+
+/* The WRITEs for one image, all of it or only the blocks that changed */
+struct ums_writes {
+	struct ums_cmd *cmds;
+	unsigned int count;
+	size_t bytes;
+	uint8_t *tail;
+};
+
+/* off to off + len of an image size bytes long, in WRITEs of up to UMS_TRANSFER */
+static int ums_writes_add(struct ums_writes *writes, const struct ums_disk *disk, size_t size,
+		size_t off, size_t len)
+{
+	size_t end = off + len;
+	/* an image that doesn't end on a block boundary has its last bit sent on its own */
+	size_t whole = end == size ? end - (size % disk->block_size) : end;
+	unsigned int n = ((whole - off + UMS_TRANSFER - 1) / UMS_TRANSFER) + 1;
+
+	struct ums_cmd *tmp = realloc(writes->cmds, (writes->count + n) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	writes->cmds = tmp;
+
+	for (; off < whole; off += UMS_TRANSFER) {
+		writes->cmds[writes->count++] = (struct ums_cmd) {
+			.off = off,
+			.len = min(whole - off, (size_t) UMS_TRANSFER),
+		};
+	}
+
+	if (whole < end) {
+		writes->cmds[writes->count++] = (struct ums_cmd) {
+			.off = whole,
+			.len = end - whole,
+			.tail = true,
+		};
+	}
+
+	writes->bytes += len;
+
+	return 0;
+}
+
+static void ums_writes_free(struct ums_writes *writes)
+{
+	free(writes->cmds);
+	free(writes->tail);
+	memset(writes, 0, sizeof(*writes));
+}
+
+/*
+ * One go at the WRITE commands from first on. done gets how many of them
+ * the device took all of, which is where to carry on from. WRITE goes to
+ * a fixed place so sending one again is harmless.
+ */
+static int ums_write_from(struct p3udl_cntx *cntx, const struct ums_disk *disk, uint64_t lba,
+		const uint8_t *data, const struct ums_writes *writes, unsigned int first, unsigned int *done)
+{
+	unsigned int depth = min(cntx->queue_depth, UMS_QUEUE_DEPTH);
+	uint8_t cdb[16];
+	int ret = 0;
+
+	*done = 0;
+
+	struct usb_massstorage_queue *queue = usb_massstorage_queue_new(cntx, depth, UMS_TRANSFER);
+	if (!queue)
+		return -ENOMEM;
+	usb_massstorage_queue_set_timeout(queue, UMS_TIMEOUT_MS);
+
+	for (unsigned int i = first; i < writes->count && !ret; i++) {
+		const struct ums_cmd *cmd = &writes->cmds[i];
+		const uint8_t *buf = cmd->tail ? writes->tail : data + cmd->off;
+		size_t n = cmd->tail ? disk->block_size : cmd->len;
+
+		if (board_cancelled(cntx)) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		usb_massstorage_rw_cdb(cdb, true, lba + (cmd->off / disk->block_size), n / disk->block_size);
+		ret = usb_massstorage_queue_submit(queue, cdb, LIBUSB_ENDPOINT_OUT, (void *) buf, n);
+	}
+
+	if (!ret)
+		ret = usb_massstorage_queue_wait(queue);
+
+	*done = usb_massstorage_queue_retired(queue);
+	usb_massstorage_queue_free(queue);
+
+	return ret;
+}
+
+static int ums_write(struct p3udl_cntx *cntx, const struct ums_disk *disk, uint64_t lba,
+		const uint8_t *data, const struct ums_writes *writes)
+{
+	unsigned int first = 0;
+	int ret;
+
+	for (int attempt = 0;; attempt++) {
+		unsigned int done;
+		uint8_t key, asc, ascq;
+
+		ret = ums_write_from(cntx, disk, lba, data, writes, first, &done);
+		if (!ret || ret == -ECANCELED || ret == -ENOMEM)
+			break;
+
+		first += done;
+		usb_massstorage_reset_recovery(cntx);
+
+		/* Some things aren't going to get better for asking again */
+		if (!usb_massstorage_request_sense(cntx, &key, &asc, &ascq) && key) {
+			ums_err(cntx, "WRITE failed, sense %02x/%02x/%02x\n", key, asc, ascq);
+			if (key == SENSE_ILLEGAL_REQUEST || key == SENSE_DATA_PROTECT) {
+				ret = -EIO;
+				break;
+			}
+		}
+
+		if (attempt == UMS_RETRY_MAX) {
+			ums_err(cntx, "Giving up after resuming %d times\n", attempt);
+			break;
+		}
+
+		cntx->report.retries++;
+		metrics_inc(METRIC_RETRIES);
+		/* Everything can have been taken with only a status going missing */
+		if (first < writes->count)
+			ums_info(cntx, "Carrying on from %zu bytes in\n", writes->cmds[first].off);
+	}
+
+	return ret;
+}
+
+/* The blocks of one read back chunk that aren't what the image has, anything past its end doesn't count */
+static void ums_delta_compare(const struct p3udl_image *image, unsigned int chunk, const uint8_t *buf,
+		bool *changed)
+{
+	size_t off = (size_t) chunk * UMS_TRANSFER;
+	size_t end = min(off + UMS_TRANSFER, image->size);
+
+	for (size_t b = off; b < end; b += UMS_DELTA_BLOCK) {
+		size_t n = min(end - b, (size_t) UMS_DELTA_BLOCK);
+
+		changed[b / UMS_DELTA_BLOCK] = memcmp(buf + (b - off), (const uint8_t *) image->data + b, n) != 0;
+	}
+}
+
+/*
+ * Reads back where the image is going, queued the same way the writes
+ * are. The ring has one more buffer than there are commands in flight:
+ * once the read after a buffer has been submitted the one before it is
+ * done, so it can be compared while the rest carry on.
+ */
+static int ums_delta_read(struct p3udl_cntx *cntx, const struct ums_disk *disk,
+		const struct manifest_entry *entry, bool *changed)
+{
+	const struct p3udl_image *image = &entry->loader.image;
+	unsigned int depth = min(cntx->queue_depth, UMS_QUEUE_DEPTH);
+	unsigned int ring = depth + 1;
+	unsigned int count = (image->size + UMS_TRANSFER - 1) / UMS_TRANSFER;
+	uint64_t lba = entry->offset / disk->block_size;
+	uint8_t cdb[16];
+	int ret = 0;
+
+	uint8_t *bufs = malloc((size_t) ring * UMS_TRANSFER);
+	if (!bufs)
+		return -ENOMEM;
+
+	struct usb_massstorage_queue *queue = usb_massstorage_queue_new(cntx, depth, UMS_TRANSFER);
+	if (!queue) {
+		free(bufs);
+		return -ENOMEM;
+	}
+	usb_massstorage_queue_set_timeout(queue, UMS_TIMEOUT_MS);
+
+	for (unsigned int i = 0; i < count + ring && !ret; i++) {
+		if (i == count)
+			ret = usb_massstorage_queue_wait(queue);
+		if (ret)
+			break;
+
+		if (i >= ring)
+			ums_delta_compare(image, i - ring, bufs + ((size_t) (i % ring) * UMS_TRANSFER), changed);
+
+		if (i >= count)
+			continue;
+
+		if (board_cancelled(cntx)) {
+			ret = -ECANCELED;
+			break;
+		}
+
+		size_t off = (size_t) i * UMS_TRANSFER;
+		size_t n = min(image->size - off, (size_t) UMS_TRANSFER);
+
+		n = (n + disk->block_size - 1) / disk->block_size * disk->block_size;
+		usb_massstorage_rw_cdb(cdb, false, lba + (off / disk->block_size), n / disk->block_size);
+		ret = usb_massstorage_queue_submit(queue, cdb, LIBUSB_ENDPOINT_IN,
+				bufs + ((size_t) (i % ring) * UMS_TRANSFER), n);
+	}
+
+	usb_massstorage_queue_free(queue);
+	free(bufs);
+
+	return ret;
+}
+
+/* Only the runs of changed blocks go in writes, anything that can't be read back is written anyway */
+static int ums_delta(struct p3udl_cntx *cntx, const struct ums_disk *disk,
+		const struct manifest_entry *entry, struct ums_writes *writes)
+{
+	size_t size = entry->loader.image.size;
+	unsigned int blocks = (size + UMS_DELTA_BLOCK - 1) / UMS_DELTA_BLOCK;
+	int ret;
+
+	bool *changed = calloc(blocks ? blocks : 1, sizeof(*changed));
+	if (!changed)
+		return -ENOMEM;
+
+	ret = ums_delta_read(cntx, disk, entry, changed);
+	if (ret == -ECANCELED || ret == -ENOMEM)
+		goto out;
+	if (ret) {
+		ums_err(cntx, "%s: couldn't read back what is there (%d), writing all of it\n", entry->path, ret);
+		usb_massstorage_reset_recovery(cntx);
+		ret = ums_writes_add(writes, disk, size, 0, size);
+		goto out;
+	}
+
+	for (unsigned int b = 0; b < blocks && !ret;) {
+		if (!changed[b]) {
+			b++;
+			continue;
+		}
+
+		unsigned int start = b;
+
+		while (b < blocks && changed[b])
+			b++;
+
+		size_t off = (size_t) start * UMS_DELTA_BLOCK;
+		size_t end = min((size_t) b * UMS_DELTA_BLOCK, size);
+
+		ret = ums_writes_add(writes, disk, size, off, end - off);
+	}
+
+out:
+	free(changed);
+	return ret;
+}
+
+static int ums_image(struct p3udl_cntx *cntx, const struct ums_disk *disk, const struct manifest_entry *entry)
+{
+	const struct p3udl_image *image = &entry->loader.image;
+	struct ums_writes writes = { 0 };
+	size_t rem = image->size % disk->block_size;
+	/* Only whole blocks of the disk can be written back */
+	bool delta = cntx->delta && !(UMS_DELTA_BLOCK % disk->block_size);
+	uint64_t begin = clock_now_ns(), read_ns = 0;
+	int ret;
+
+	if (rem) {
+		writes.tail = calloc(1, disk->block_size);
+		if (!writes.tail)
+			return -ENOMEM;
+		memcpy(writes.tail, (const uint8_t *) image->data + image->size - rem, rem);
+	}
+
+	if (delta) {
+		ums_info(cntx, "Reading back %s at 0x%llx...\n", entry->path, (unsigned long long) entry->offset);
+		ret = ums_delta(cntx, disk, entry, &writes);
+		read_ns = clock_now_ns() - begin;
+	}
+	else
+		ret = ums_writes_add(&writes, disk, image->size, 0, image->size);
+	if (ret)
+		goto out;
+
+	if (writes.count)
+		ums_info(cntx, "Writing %zu bytes of %s at 0x%llx...\n", writes.bytes, entry->path,
+				(unsigned long long) entry->offset);
+
+	uint64_t write_begin = clock_now_ns();
+
+	ret = ums_write(cntx, disk, entry->offset / disk->block_size, image->data, &writes);
+	if (ret)
+		goto out;
+
+	uint64_t now = clock_now_ns();
+	uint64_t write_ns = now - write_begin;
+
+	cntx->report.bytes += writes.bytes;
+
+	if (!delta) {
+		tune_put_rate(cntx, "ums", image->size, now - begin);
+		ums_info(cntx, "Wrote %zu bytes in %llu ms, %.2f MB/s\n", image->size,
+				(unsigned long long) ((now - begin) / NSEC_PER_MSEC), clock_mbps(image->size, now - begin));
+		goto out;
+	}
+
+	/*
+	 * What writing all of it would have taken, going by earlier boards or
+	 * by the blocks that were written here if there haven't been any.
+	 */
+	size_t skipped = image->size - writes.bytes;
+	uint64_t rate = 0;
+
+	if (tune_get_rate(cntx, "ums", &rate) && write_ns)
+		rate = clock_rate(writes.bytes, write_ns);
+
+	cntx->report.skipped += skipped;
+	if (rate)
+		cntx->report.skipped_ns += (int64_t) clock_ns_at(skipped, rate) - (int64_t) read_ns;
+
+	ums_info(cntx, "%s: %zu of %zu bytes already there, read back in %llu ms, wrote the rest in %llu ms\n",
+			entry->path, skipped, image->size, (unsigned long long) (read_ns / NSEC_PER_MSEC),
+			(unsigned long long) (write_ns / NSEC_PER_MSEC));
+
+out:
+	ums_writes_free(&writes);
+	return ret;
+}
+
+int ums_flash(struct p3udl_cntx *cntx)
+{
+	struct ums_disk disk;
+	int ret;
+
+	ums_info(cntx, "Waiting for u-boot's mass storage gadget...\n");
+
+	report_begin(cntx, REPORT_PHASE_REENUM);
+	ret = cntx->transport->reconnect(cntx, UMS_ENUM_TIMEOUT_MS);
+	report_end(cntx, REPORT_PHASE_REENUM);
+	if (ret) {
+		if (board_cancelled(cntx))
+			return -ECANCELED;
+		ums_err(cntx, "Board didn't come back as a mass storage device: %s\n", libusb_strerror(ret));
+		return ret;
+	}
+
+	ret = topology_acquire(cntx);
+	if (ret)
+		return ret;
+	report_begin(cntx, REPORT_PHASE_UMS);
+
+	ret = ums_probe(cntx, &disk);
+	if (ret)
+		goto out;
+
+	ret = ums_check(cntx, &disk);
+	if (ret)
+		goto out;
+
+	for (int i = 0; i < cntx->ums->count; i++) {
+		struct manifest_entry *entry = &cntx->ums->entries[i];
+
+		ret = ums_image(cntx, &disk, entry);
+		if (ret) {
+			ums_err(cntx, "Failed to write %s: %d\n", entry->path, ret);
+			goto out;
+		}
+	}
+
+	/* The gadget only promises the data is on the medium once it has been asked to flush */
+	int tries = 0;
+	do {
+		ret = usb_massstorage_sync_cache(cntx, UMS_SYNC_TIMEOUT_MS);
+	} while (ums_recover(cntx, ret, &tries));
+	if (ret)
+		ums_err(cntx, "SYNCHRONIZE CACHE failed: %d\n", ret);
+
+out:
+	/* The pool belongs to this handle, nothing else is going to use it */
+	pool_free(cntx);
+	report_end(cntx, REPORT_PHASE_UMS);
+	topology_release(cntx);
+	return ret;
+}
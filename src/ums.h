@@ -0,0 +1,18 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __UMS_H_
+#define __UMS_H_
+
+#include "cntx.h"
+
+/* WRITE commands are this long apart from the last one of an image */
+#define UMS_TRANSFER		(2 * 1024 * 1024)
+/* Commands in flight, each one has a UMS_TRANSFER buffer in the pool */
+#define UMS_QUEUE_DEPTH		4
+
+/* How long u-boot gets to boot and bring up its mass storage gadget */
+#define UMS_ENUM_TIMEOUT_MS	30000
+
+int ums_flash(struct p3udl_cntx *cntx);
+
+#endif /* __UMS_H_ */
@@ -6,13 +6,23 @@
 
 /* Spec: https://www.usb.org/sites/default/files/usbmassbulk_10.pdf */
 
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <libusb.h>
 
+#include "board.h"
+#include "clock.h"
+#include "metrics.h"
+#include "pool.h"
 #include "sstarscsi.h"
+#include "transport.h"
 #include "usbms.h"
+#include "report.h"
+#include "xfer.h"
 
 #include "usbms_log.h"
 
@@ -20,19 +30,42 @@
 #define REQUEST_SENSE_LENGTH          0x12
 #define INQUIRY_LENGTH                0x24
 #define READ_CAPACITY_LENGTH          0x08
+#define READ_CAPACITY_16_LENGTH       0x20
 
 #define BOMS_RESET		0xFF
 #define BOMS_GET_MAX_LUN	0xFE
 
 int usb_massstorage_get_maxlun(struct p3udl_cntx *cntx)
 {
-	int ret = libusb_control_transfer(cntx->lu_handle,
+	int ret = cntx->transport->control(cntx,
 			LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE,
-			BOMS_GET_MAX_LUN, 0, 0, &cntx->lun, 1, 1000);
+			BOMS_GET_MAX_LUN, 0, 0, &cntx->lun, 1, XFER_TIMEOUT_MS);
 
 	return ret;
 }
 
+/*
+ * Section 5.3.4: Reset Recovery, gets the device waiting for a CBW again
+ * after something went wrong part way through a command. Not everything
+ * implements the class reset so the halts are cleared regardless.
+ */
+int usb_massstorage_reset_recovery(struct p3udl_cntx *cntx)
+{
+	int ret = cntx->transport->control(cntx,
+			LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE,
+			BOMS_RESET, 0, 0, NULL, 0, XFER_TIMEOUT_MS);
+	if (ret < 0)
+		usbms_dbg(cntx, "mass storage reset: %s\n", libusb_strerror((enum libusb_error) ret));
+
+	cntx->transport->clear_halt(cntx, cntx->ep_in);
+	cntx->transport->clear_halt(cntx, cntx->ep_out);
+	cntx->report.recoveries++;
+	metrics_add(METRIC_CLEAR_HALTS, 2);
+	metrics_inc(METRIC_RECOVERIES);
+
+	return ret < 0 ? ret : 0;
+}
+
 // Section 5.1: Command Block Wrapper (CBW)
 struct command_block_wrapper {
 	uint8_t dCBWSignature[4];
@@ -72,11 +105,46 @@ static const uint8_t cdb_length[256] = {
 	00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,00,  //  F
 };
 
+static int usb_massstorage_cdb_len(struct p3udl_cntx *cntx, uint8_t *cdb)
+{
+	uint8_t cdb_len = cdb_length[cdb[0]];
+
+	if ((cdb_len == 0) || (cdb_len > sizeof(((struct command_block_wrapper *) 0)->CBWCB))) {
+		usbms_err(cntx, "send_mass_storage_command: don't know how to handle this command (%02X, length %d)\n",
+			cdb[0], cdb_len);
+		return -1;
+	}
+
+	return cdb_len;
+}
+
+/* The parts of a CBW that are the same for every command */
+static void usb_massstorage_init_cbw(struct command_block_wrapper *cbw, uint8_t lun)
+{
+	memset(cbw, 0, sizeof(*cbw));
+	cbw->dCBWSignature[0] = 'U';
+	cbw->dCBWSignature[1] = 'S';
+	cbw->dCBWSignature[2] = 'B';
+	cbw->dCBWSignature[3] = 'C';
+	cbw->bCBWLUN = lun;
+}
+
+static void usb_massstorage_fill_cbw(struct command_block_wrapper *cbw, uint32_t tag,
+	uint8_t *cdb, uint8_t cdb_len, uint8_t direction, int data_length)
+{
+	cbw->dCBWTag = tag;
+	cbw->dCBWDataTransferLength = data_length;
+	cbw->bmCBWFlags = direction;
+	// Subclass is 1 or 6 => cdb_len
+	cbw->bCBWCBLength = cdb_len;
+	memcpy(cbw->CBWCB, cdb, cdb_len);
+	memset(cbw->CBWCB + cdb_len, 0, sizeof(cbw->CBWCB) - cdb_len);
+}
+
 int usb_massstorage_send_command(struct p3udl_cntx *cntx, uint8_t endpoint, uint8_t lun,
-	uint8_t *cdb, uint8_t direction, int data_length, uint32_t *ret_tag)
+	uint8_t *cdb, uint8_t direction, int data_length, uint32_t *ret_tag, unsigned int timeout)
 {
-	static uint32_t tag = 1;
-	uint8_t cdb_len;
+	int cdb_len;
 	int r, size;
 	struct command_block_wrapper cbw;
 
@@ -89,33 +157,23 @@ int usb_massstorage_send_command(struct p3udl_cntx *cntx, uint8_t endpoint, uint
 		return -1;
 	}
 
-	cdb_len = cdb_length[cdb[0]];
-	if ((cdb_len == 0) || (cdb_len > sizeof(cbw.CBWCB))) {
-		usbms_err(cntx, "send_mass_storage_command: don't know how to handle this command (%02X, length %d)\n",
-			cdb[0], cdb_len);
-		return -1;
-	}
+	cdb_len = usb_massstorage_cdb_len(cntx, cdb);
+	if (cdb_len < 0)
+		return cdb_len;
 
-	memset(&cbw, 0, sizeof(cbw));
-	cbw.dCBWSignature[0] = 'U';
-	cbw.dCBWSignature[1] = 'S';
-	cbw.dCBWSignature[2] = 'B';
-	cbw.dCBWSignature[3] = 'C';
-	*ret_tag = tag;
-	cbw.dCBWTag = tag++;
-	cbw.dCBWDataTransferLength = data_length;
-	cbw.bmCBWFlags = direction;
-	cbw.bCBWLUN = lun;
-	// Subclass is 1 or 6 => cdb_len
-	cbw.bCBWCBLength = cdb_len;
-	memcpy(cbw.CBWCB, cdb, cdb_len);
+	cntx->report.cmd_start = clock_now_ns();
+	*ret_tag = cntx->tag;
+	usb_massstorage_init_cbw(&cbw, lun);
+	usb_massstorage_fill_cbw(&cbw, cntx->tag++, cdb, cdb_len, direction, data_length);
 
 	int i = 0;
 	do {
 		// The transfer length must always be exactly 31 bytes.
-		r = libusb_bulk_transfer(cntx->lu_handle, endpoint, (unsigned char*)&cbw, 31, &size, 1000);
+		r = cntx->transport->bulk(cntx, endpoint, (unsigned char*)&cbw, 31, &size, timeout);
 		if (r == LIBUSB_ERROR_PIPE) {
-			libusb_clear_halt(cntx->lu_handle, endpoint);
+			cntx->transport->clear_halt(cntx, endpoint);
+			metrics_inc(METRIC_STALLS);
+			metrics_inc(METRIC_CLEAR_HALTS);
 		}
 		i++;
 	} while ((r == LIBUSB_ERROR_PIPE) && (i<RETRY_MAX));
@@ -129,7 +187,9 @@ int usb_massstorage_send_command(struct p3udl_cntx *cntx, uint8_t endpoint, uint
 	return 0;
 }
 
-int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t expected_tag)
+/* residue, if not NULL, gets dCSWDataResidue whenever a CSW for the command came back */
+int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t expected_tag,
+		unsigned int timeout, uint32_t *residue)
 {
 	int i, r, size;
 	struct command_status_wrapper csw;
@@ -138,9 +198,11 @@ int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t e
 	// clear the stall and try again.
 	i = 0;
 	do {
-		r = libusb_bulk_transfer(cntx->lu_handle, endpoint, (unsigned char*)&csw, 13, &size, 1000);
+		r = cntx->transport->bulk(cntx, endpoint, (unsigned char*)&csw, 13, &size, timeout);
 		if (r == LIBUSB_ERROR_PIPE) {
-			libusb_clear_halt(cntx->lu_handle, endpoint);
+			cntx->transport->clear_halt(cntx, endpoint);
+			metrics_inc(METRIC_STALLS);
+			metrics_inc(METRIC_CLEAR_HALTS);
 		}
 		i++;
 	} while ((r == LIBUSB_ERROR_PIPE) && (i<RETRY_MAX));
@@ -158,6 +220,8 @@ int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t e
 		return -1;
 	}
 	// For this test, we ignore the dCSWSignature check for validity...
+	if (residue)
+		*residue = csw.dCSWDataResidue;
 	usbms_dbg(cntx, "Mass Storage Status: %02X (%s)\n", csw.bCSWStatus, csw.bCSWStatus?"FAILED":"Success");
 	if (csw.dCSWTag != expected_tag)
 		return -1;
@@ -171,8 +235,16 @@ int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t e
 			return -1;
 	}
 
-	// In theory we also should check dCSWDataResidue.  But lots of devices
-	// set it wrongly.
+	// Lots of devices set dCSWDataResidue wrongly on success so it is
+	// only looked at when a command failed.
+	if (cntx->report.cmd_start) {
+		uint64_t ns = clock_now_ns() - cntx->report.cmd_start;
+
+		report_cmd(cntx, ns);
+		xfer_sample(cntx, ns);
+	}
+	cntx->report.cmd_start = 0;
+
 	return 0;
 }
 
@@ -180,41 +252,44 @@ void usb_massstorage_sense(struct p3udl_cntx *cntx, uint8_t endpoint_in, uint8_t
 {
 	uint8_t cdb[16];	// SCSI Command Descriptor Block
 	uint8_t sense[18];
+	unsigned int timeout = xfer_timeout(cntx);
 	uint32_t expected_tag;
 	int size;
 	int rc;
 
 	// Request Sense
-	printf("Request Sense:\n");
+	usbms_dbg(cntx, "Request Sense\n");
 	memset(sense, 0, sizeof(sense));
 	memset(cdb, 0, sizeof(cdb));
 	cdb[0] = 0x03;	// Request Sense
 	cdb[4] = REQUEST_SENSE_LENGTH;
 
-	usb_massstorage_send_command(cntx, endpoint_out, 0, cdb, LIBUSB_ENDPOINT_IN, REQUEST_SENSE_LENGTH, &expected_tag);
-	rc = libusb_bulk_transfer(cntx->lu_handle, endpoint_in, (unsigned char*)&sense, REQUEST_SENSE_LENGTH, &size, 1000);
+	usb_massstorage_send_command(cntx, endpoint_out, 0, cdb, LIBUSB_ENDPOINT_IN, REQUEST_SENSE_LENGTH,
+			&expected_tag, timeout);
+	rc = cntx->transport->bulk(cntx, endpoint_in, (unsigned char*)&sense, REQUEST_SENSE_LENGTH, &size, timeout);
 	if (rc < 0)
 	{
-		printf("libusb_bulk_transfer failed: %s\n", libusb_error_name(rc));
+		usbms_err(cntx, "Request Sense failed: %s\n", libusb_strerror((enum libusb_error) rc));
 		return;
 	}
-	printf("   received %d bytes\n", size);
+	usbms_dbg(cntx, "received %d sense bytes\n", size);
 
 	if ((sense[0] != 0x70) && (sense[0] != 0x71)) {
-		printf("   ERROR No sense data\n");
+		usbms_err(cntx, "No sense data\n");
 	} else {
-		printf("   ERROR Sense: %02X %02X %02X\n", sense[2]&0x0F, sense[12], sense[13]);
+		usbms_err(cntx, "Sense: %02X %02X %02X\n", sense[2]&0x0F, sense[12], sense[13]);
 	}
 	// Strictly speaking, the get_mass_storage_status() call should come
 	// before these perr() lines.  If the status is nonzero then we must
 	// assume there's no data in the buffer.  For xusb it doesn't matter.
-	usb_massstorage_status(cntx, endpoint_in, expected_tag);
+	usb_massstorage_status(cntx, endpoint_in, expected_tag, timeout, NULL);
 }
 
 int usb_massstorage_inquiry(struct p3udl_cntx *cntx, struct mass_storage_inquiry_result *result)
 {
 	uint8_t cdb[16] = { 0 };
 	uint8_t buffer[64];
+	unsigned int timeout = xfer_timeout(cntx);
 	uint32_t expected_tag;
 	int ret = 0, size;
 
@@ -225,11 +300,12 @@ int usb_massstorage_inquiry(struct p3udl_cntx *cntx, struct mass_storage_inquiry
 	cdb[0] = 0x12;	// Inquiry
 	cdb[4] = INQUIRY_LENGTH;
 
-	ret = usb_massstorage_send_command(cntx, cntx->ep_out, cntx->lun, cdb, LIBUSB_ENDPOINT_IN, INQUIRY_LENGTH, &expected_tag);
+	ret = usb_massstorage_send_command(cntx, cntx->ep_out, cntx->lun, cdb, LIBUSB_ENDPOINT_IN, INQUIRY_LENGTH,
+			&expected_tag, timeout);
 	if (ret < 0)
 		return ret;
 
-	ret = libusb_bulk_transfer(cntx->lu_handle, cntx->ep_in, (unsigned char*)&buffer, INQUIRY_LENGTH, &size, 1000);
+	ret = cntx->transport->bulk(cntx, cntx->ep_in, (unsigned char*)&buffer, INQUIRY_LENGTH, &size, timeout);
 	if (ret < 0)
 		return ret;
 
@@ -243,9 +319,626 @@ int usb_massstorage_inquiry(struct p3udl_cntx *cntx, struct mass_storage_inquiry
 		result->rev[i/2] = buffer[32+i/2];	// instead of another loop
 	}
 
-	if (usb_massstorage_status(cntx, cntx->ep_in, expected_tag) == -2) {
+	if (usb_massstorage_status(cntx, cntx->ep_in, expected_tag, timeout, NULL) == -2) {
 		usb_massstorage_sense(cntx, cntx->ep_in, cntx->ep_out);
 	}
 
 	return ret;
 }
+
+/*
+ * One command from CBW to CSW on the synchronous path, for the handful
+ * that only go out once per board. Returns -EIO when the device says the
+ * command failed, usb_massstorage_request_sense() says why. Anything else
+ * means the transport is out of step and wants a reset recovery.
+ */
+int usb_massstorage_command(struct p3udl_cntx *cntx, uint8_t *cdb, uint8_t direction,
+		void *buf, int data_length, unsigned int timeout)
+{
+	uint32_t tag;
+	int ret, size = 0;
+
+	ret = usb_massstorage_send_command(cntx, cntx->ep_out, cntx->lun, cdb, direction, data_length,
+			&tag, timeout);
+	if (ret)
+		return ret;
+
+	if (data_length) {
+		uint8_t ep = (direction & LIBUSB_ENDPOINT_IN) ? cntx->ep_in : cntx->ep_out;
+
+		ret = cntx->transport->bulk(cntx, ep, buf, data_length, &size, timeout);
+		if (!(direction & LIBUSB_ENDPOINT_IN))
+			board_progress(cntx, size);
+		/* The device ended the data phase early, the CSW still follows once the halt is gone */
+		if (ret == LIBUSB_ERROR_PIPE) {
+			cntx->transport->clear_halt(cntx, ep);
+			metrics_inc(METRIC_STALLS);
+			metrics_inc(METRIC_CLEAR_HALTS);
+		}
+		else if (ret)
+			return ret;
+	}
+
+	ret = usb_massstorage_status(cntx, cntx->ep_in, tag, timeout, NULL);
+	if (ret == -2)
+		return -EIO;
+
+	return ret ? LIBUSB_ERROR_IO : 0;
+}
+
+/* Fixed format sense data for the last command that failed, without the noise of usb_massstorage_sense() */
+int usb_massstorage_request_sense(struct p3udl_cntx *cntx, uint8_t *key, uint8_t *asc, uint8_t *ascq)
+{
+	uint8_t cdb[16] = { 0 };
+	uint8_t sense[REQUEST_SENSE_LENGTH] = { 0 };
+
+	cdb[0] = 0x03;	// Request Sense
+	cdb[4] = REQUEST_SENSE_LENGTH;
+
+	int ret = usb_massstorage_command(cntx, cdb, LIBUSB_ENDPOINT_IN, sense, sizeof(sense), XFER_TIMEOUT_MS);
+	if (ret)
+		return ret;
+
+	if ((sense[0] & 0x7f) != 0x70 && (sense[0] & 0x7f) != 0x71)
+		return -ENODATA;
+
+	*key = sense[2] & 0x0f;
+	*asc = sense[12];
+	*ascq = sense[13];
+
+	return 0;
+}
+
+int usb_massstorage_test_unit_ready(struct p3udl_cntx *cntx)
+{
+	uint8_t cdb[16] = { 0 };
+
+	return usb_massstorage_command(cntx, cdb, LIBUSB_ENDPOINT_OUT, NULL, 0, XFER_TIMEOUT_MS);
+}
+
+static uint32_t usb_massstorage_get_be32(const uint8_t *buf)
+{
+	return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+			((uint32_t) buf[2] << 8) | buf[3];
+}
+
+static void usb_massstorage_put_be32(uint8_t *buf, uint32_t v)
+{
+	buf[0] = v >> 24;
+	buf[1] = v >> 16;
+	buf[2] = v >> 8;
+	buf[3] = v;
+}
+
+/* READ CAPACITY (10), and (16) if the medium is too big for it to describe */
+int usb_massstorage_read_capacity(struct p3udl_cntx *cntx, uint64_t *blocks, uint32_t *block_size)
+{
+	uint8_t cdb[16] = { 0 };
+	uint8_t buf[READ_CAPACITY_16_LENGTH] = { 0 };
+	int ret;
+
+	cdb[0] = 0x25;	// Read Capacity (10)
+
+	ret = usb_massstorage_command(cntx, cdb, LIBUSB_ENDPOINT_IN, buf, READ_CAPACITY_LENGTH, XFER_TIMEOUT_MS);
+	if (ret)
+		return ret;
+
+	uint64_t last = usb_massstorage_get_be32(buf);
+	*block_size = usb_massstorage_get_be32(buf + 4);
+
+	if (last == 0xFFFFFFFF) {
+		memset(cdb, 0, sizeof(cdb));
+		cdb[0] = 0x9E;	// Service Action In (16)
+		cdb[1] = 0x10;	// Read Capacity (16)
+		usb_massstorage_put_be32(cdb + 10, READ_CAPACITY_16_LENGTH);
+
+		ret = usb_massstorage_command(cntx, cdb, LIBUSB_ENDPOINT_IN, buf, READ_CAPACITY_16_LENGTH,
+				XFER_TIMEOUT_MS);
+		if (ret)
+			return ret;
+
+		last = ((uint64_t) usb_massstorage_get_be32(buf) << 32) | usb_massstorage_get_be32(buf + 4);
+		*block_size = usb_massstorage_get_be32(buf + 8);
+	}
+
+	*blocks = last + 1;
+
+	return 0;
+}
+
+/* Flushing the gadget's page cache to the medium can take a while */
+int usb_massstorage_sync_cache(struct p3udl_cntx *cntx, unsigned int timeout)
+{
+	uint8_t cdb[16] = { 0 };
+
+	cdb[0] = 0x35;	// Synchronize Cache (10), all of it
+
+	return usb_massstorage_command(cntx, cdb, LIBUSB_ENDPOINT_OUT, NULL, 0, timeout);
+}
+
+/* READ or WRITE of blocks at lba, the 10 byte form unless it can't reach */
+void usb_massstorage_rw_cdb(uint8_t *cdb, bool write, uint64_t lba, uint32_t blocks)
+{
+	memset(cdb, 0, 16);
+
+	if (lba + blocks <= 0x100000000ULL && blocks <= 0xFFFF) {
+		cdb[0] = write ? 0x2A : 0x28;
+		usb_massstorage_put_be32(cdb + 2, lba);
+		cdb[7] = blocks >> 8;
+		cdb[8] = blocks;
+	}
+	else {
+		cdb[0] = write ? 0x8A : 0x88;
+		usb_massstorage_put_be32(cdb + 2, lba >> 32);
+		usb_massstorage_put_be32(cdb + 6, lba);
+		usb_massstorage_put_be32(cdb + 10, blocks);
+	}
+}
+
+/*
+ * Queued transport: each command is a CBW/data/CSW triple submitted with
+ * libusb_submit_transfer(). Up to depth triples are kept queued on the
+ * endpoints so the device never waits for the host between commands.
+ * Transfers on an endpoint complete in submission order so the CSWs come
+ * back in the order the CBWs were sent and the tags are checked as they arrive.
+ */
+
+#define QUEUE_XFER_CBW		(1 << 0)
+#define QUEUE_XFER_DATA		(1 << 1)
+#define QUEUE_XFER_CSW		(1 << 2)
+
+struct usb_massstorage_cmd {
+	struct usb_massstorage_queue *queue;
+	/* all of these live in the board's pool */
+	struct libusb_transfer *cbw_xfer, *data_xfer, *csw_xfer;
+	struct command_block_wrapper *cbw;
+	struct command_status_wrapper *csw;
+	/* where data read into the pool goes, NULL if it went straight to the caller */
+	void *in_buf;
+	/* QUEUE_XFER_* bits for the transfers still owned by libusb and the ones that completed */
+	unsigned int pending, completed;
+	int error;
+	uint64_t submitted;
+};
+
+struct usb_massstorage_queue {
+	struct p3udl_cntx *cntx;
+	struct pool *pool;
+	struct usb_massstorage_cmd *cmds;
+	unsigned int depth;
+	/* oldest command in flight and how many are in flight */
+	unsigned int head, inflight;
+	/* commands the device took all of, see usb_massstorage_queue_abort() */
+	unsigned int retired;
+	/* the device may have taken part of a command or skipped one and taken the next */
+	bool torn;
+	/* how long to go without a command completing, 0 for the measured transfer timeout */
+	unsigned int timeout_ms;
+	int error;
+	int event;
+	/*
+	 * The callbacks can run on any thread that is handling events for
+	 * the context, they leave what they saw here for the board's own
+	 * thread to pass on in usb_massstorage_queue_flush().
+	 */
+	uint64_t sent;
+	char failure[128];
+};
+
+static int usb_massstorage_xfer_error(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return LIBUSB_SUCCESS;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static void usb_massstorage_queue_cb(struct libusb_transfer *xfer)
+{
+	struct usb_massstorage_cmd *cmd = xfer->user_data;
+	struct usb_massstorage_queue *queue = cmd->queue;
+	struct p3udl_cntx *cntx = queue->cntx;
+	/* Only the first error is interesting, everything after it is fallout */
+	bool quiet = queue->error;
+	int error = LIBUSB_SUCCESS;
+
+	unsigned int bit;
+
+	queue->event = 1;
+
+	if (xfer == cmd->cbw_xfer)
+		bit = QUEUE_XFER_CBW;
+	else if (xfer == cmd->data_xfer) {
+		bit = QUEUE_XFER_DATA;
+		if (!(xfer->endpoint & LIBUSB_ENDPOINT_IN))
+			__atomic_fetch_add(&queue->sent, xfer->actual_length, __ATOMIC_RELAXED);
+		else if (cmd->in_buf)
+			memcpy(cmd->in_buf, xfer->buffer, xfer->actual_length);
+	}
+	else
+		bit = QUEUE_XFER_CSW;
+
+	cmd->pending &= ~bit;
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED)
+		cmd->completed |= bit;
+
+	if (xfer->status == LIBUSB_TRANSFER_STALL)
+		metrics_inc(METRIC_STALLS);
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		error = usb_massstorage_xfer_error(xfer->status);
+		if (!quiet)
+			snprintf(queue->failure, sizeof(queue->failure),
+					"queued transfer on ep 0x%02x for tag %08X failed: %s",
+					xfer->endpoint, cmd->cbw->dCBWTag, libusb_strerror(error));
+	}
+	else if (xfer != cmd->csw_xfer)
+		return;
+	else if (xfer->actual_length != 13) {
+		if (!quiet)
+			snprintf(queue->failure, sizeof(queue->failure),
+					"queued status: received %d bytes (expected 13)", xfer->actual_length);
+		error = LIBUSB_ERROR_IO;
+	}
+	else if (cmd->csw->dCSWTag != cmd->cbw->dCBWTag) {
+		if (!quiet)
+			snprintf(queue->failure, sizeof(queue->failure),
+					"queued status: mismatched tags (expected %08X, received %08X)",
+					cmd->cbw->dCBWTag, cmd->csw->dCSWTag);
+		error = LIBUSB_ERROR_IO;
+	}
+	else if (cmd->csw->bCSWStatus) {
+		if (!quiet)
+			snprintf(queue->failure, sizeof(queue->failure),
+					"queued status: tag %08X FAILED (%02X)",
+					cmd->cbw->dCBWTag, cmd->csw->bCSWStatus);
+		error = LIBUSB_ERROR_IO;
+	}
+
+	if (!error) {
+		uint64_t ns = clock_now_ns() - cmd->submitted;
+
+		report_cmd(cntx, ns);
+		xfer_sample(cntx, ns);
+		return;
+	}
+
+	if (!cmd->error)
+		cmd->error = error;
+	if (!queue->error)
+		queue->error = error;
+}
+
+/* max_len is the longest data phase that will be submitted */
+struct usb_massstorage_queue *usb_massstorage_queue_new(struct p3udl_cntx *cntx, unsigned int depth,
+		size_t max_len)
+{
+	struct usb_massstorage_queue *queue = calloc(1, sizeof(*queue));
+
+	if (!queue)
+		return NULL;
+
+	queue->cntx = cntx;
+	queue->depth = depth;
+	queue->pool = pool_get(cntx, depth, max_len);
+	queue->cmds = calloc(depth, sizeof(*queue->cmds));
+	if (!queue->pool || !queue->cmds)
+		goto err;
+	cntx->report.dma_pool = queue->pool->devmem;
+
+	for (int i = 0; i < depth; i++) {
+		struct usb_massstorage_cmd *cmd = &queue->cmds[i];
+		struct pool_slot *slot = &queue->pool->slots[i];
+
+		cmd->queue = queue;
+		cmd->cbw_xfer = slot->xfers[0];
+		cmd->data_xfer = slot->xfers[1];
+		cmd->csw_xfer = slot->xfers[2];
+		cmd->cbw = (struct command_block_wrapper *) slot->hdr;
+		cmd->csw = (struct command_status_wrapper *) (slot->hdr + (POOL_HDR_SIZE / 2));
+		usb_massstorage_init_cbw(cmd->cbw, cntx->lun);
+	}
+
+	return queue;
+
+err:
+	usb_massstorage_queue_free(queue);
+	return NULL;
+}
+
+/* Pass on what the callbacks saw, from the board's own thread so progress and logs go to the right place */
+static void usb_massstorage_queue_flush(struct usb_massstorage_queue *queue)
+{
+	uint64_t sent = __atomic_exchange_n(&queue->sent, 0, __ATOMIC_RELAXED);
+
+	if (sent)
+		board_progress(queue->cntx, sent);
+	if (queue->failure[0]) {
+		usbms_err(queue->cntx, "%s\n", queue->failure);
+		queue->failure[0] = '\0';
+	}
+}
+
+/* Pump libusb until something completes or the timeout expires */
+static int usb_massstorage_queue_events(struct usb_massstorage_queue *queue)
+{
+	struct timeval tv = {
+		.tv_sec = 0,
+		.tv_usec = 100 * 1000,
+	};
+
+	queue->event = 0;
+	int ret = queue->cntx->transport->handle_events(queue->cntx, &tv, &queue->event);
+	usb_massstorage_queue_flush(queue);
+
+	return ret;
+}
+
+enum usb_massstorage_fate {
+	USB_MASSSTORAGE_NOT_TAKEN,
+	USB_MASSSTORAGE_PARTIAL,
+	USB_MASSSTORAGE_TAKEN,
+};
+
+/*
+ * What the device did with a command, going by which of its transfers
+ * made it. A command that got its data out but lost its CSW is counted
+ * as taken, there is nothing to say otherwise and sending it again would
+ * duplicate it.
+ */
+static enum usb_massstorage_fate usb_massstorage_cmd_fate(struct usb_massstorage_cmd *cmd)
+{
+	uint32_t len = cmd->cbw->dCBWDataTransferLength;
+
+	if (!(cmd->completed & QUEUE_XFER_CBW))
+		return USB_MASSSTORAGE_NOT_TAKEN;
+
+	/* Only a CSW says the device kept part of the data, reset recovery throws away the rest */
+	if (len && !(cmd->completed & QUEUE_XFER_DATA))
+		return USB_MASSSTORAGE_NOT_TAKEN;
+
+	if ((cmd->completed & QUEUE_XFER_CSW) && cmd->csw->dCSWTag == cmd->cbw->dCBWTag &&
+			cmd->csw->bCSWStatus)
+		return cmd->csw->dCSWDataResidue >= len ? USB_MASSSTORAGE_NOT_TAKEN : USB_MASSSTORAGE_PARTIAL;
+
+	return USB_MASSSTORAGE_TAKEN;
+}
+
+/* Cancel everything that is still in flight and wait for libusb to hand it all back */
+static void usb_massstorage_queue_abort(struct usb_massstorage_queue *queue)
+{
+	for (int i = 0; i < queue->inflight; i++) {
+		struct usb_massstorage_cmd *cmd = &queue->cmds[(queue->head + i) % queue->depth];
+
+		if (cmd->pending & QUEUE_XFER_CBW)
+			queue->cntx->transport->cancel(queue->cntx, cmd->cbw_xfer);
+		if (cmd->pending & QUEUE_XFER_DATA)
+			queue->cntx->transport->cancel(queue->cntx, cmd->data_xfer);
+		if (cmd->pending & QUEUE_XFER_CSW)
+			queue->cntx->transport->cancel(queue->cntx, cmd->csw_xfer);
+	}
+
+	for (;;) {
+		bool busy = false;
+
+		for (int i = 0; i < queue->inflight; i++) {
+			if (queue->cmds[(queue->head + i) % queue->depth].pending)
+				busy = true;
+		}
+
+		if (!busy)
+			break;
+
+		if (usb_massstorage_queue_events(queue) < 0)
+			break;
+	}
+
+	/*
+	 * Some commands might have made it all the way through before
+	 * the cancel landed, count them so the caller knows how far the
+	 * device actually got. Anything taken after a gap means the device
+	 * has the data out of order and resuming from the gap won't fix it.
+	 */
+	bool gap = false;
+
+	for (int i = 0; i < queue->inflight; i++) {
+		struct usb_massstorage_cmd *cmd = &queue->cmds[(queue->head + i) % queue->depth];
+
+		switch (usb_massstorage_cmd_fate(cmd)) {
+		case USB_MASSSTORAGE_TAKEN:
+			if (gap)
+				queue->torn = true;
+			else
+				queue->retired++;
+			break;
+		case USB_MASSSTORAGE_PARTIAL:
+			queue->torn = true;
+			/* fall through */
+		case USB_MASSSTORAGE_NOT_TAKEN:
+			gap = true;
+			break;
+		}
+	}
+
+	queue->inflight = 0;
+	usb_massstorage_queue_flush(queue);
+}
+
+/*
+ * Retire completed commands from the head, waiting until at most max_inflight are left.
+ * A queued command's round trip includes the time spent behind the ones ahead of it
+ * so the usual transfer timeout is also a safe limit on going without progress.
+ */
+static int usb_massstorage_queue_reap(struct usb_massstorage_queue *queue, unsigned int max_inflight)
+{
+	unsigned int timeout = queue->timeout_ms ? queue->timeout_ms : xfer_timeout(queue->cntx);
+	uint64_t progress = clock_now_ns();
+
+	for (;;) {
+		while (queue->inflight) {
+			struct usb_massstorage_cmd *cmd = &queue->cmds[queue->head];
+
+			if (cmd->pending || cmd->error)
+				break;
+
+			queue->head = (queue->head + 1) % queue->depth;
+			queue->inflight--;
+			queue->retired++;
+			progress = clock_now_ns();
+		}
+
+		if (queue->error)
+			break;
+
+		if (queue->inflight <= max_inflight) {
+			usb_massstorage_queue_flush(queue);
+			return 0;
+		}
+
+		if ((clock_now_ns() - progress) > (timeout * NSEC_PER_MSEC)) {
+			usbms_err(queue->cntx, "queued command %08X timed out\n",
+					queue->cmds[queue->head].cbw->dCBWTag);
+			queue->error = LIBUSB_ERROR_TIMEOUT;
+			queue->cntx->report.timeouts++;
+			metrics_inc(METRIC_TIMEOUTS);
+			break;
+		}
+
+		int ret = usb_massstorage_queue_events(queue);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			queue->error = ret;
+			break;
+		}
+	}
+
+	usb_massstorage_queue_abort(queue);
+	return queue->error;
+}
+
+int usb_massstorage_queue_submit(struct usb_massstorage_queue *queue, uint8_t *cdb,
+		uint8_t direction, void *buf, int data_length)
+{
+	struct p3udl_cntx *cntx = queue->cntx;
+	int ret;
+
+	if (queue->error)
+		return queue->error;
+
+	int cdb_len = usb_massstorage_cdb_len(cntx, cdb);
+	if (cdb_len < 0)
+		return cdb_len;
+
+	/* Wait for a free slot */
+	ret = usb_massstorage_queue_reap(queue, queue->depth - 1);
+	if (ret)
+		return ret;
+
+	unsigned int index = (queue->head + queue->inflight) % queue->depth;
+	struct usb_massstorage_cmd *cmd = &queue->cmds[index];
+	uint8_t data_ep = (direction & LIBUSB_ENDPOINT_IN) ? cntx->ep_in : cntx->ep_out;
+
+	/* The copy here is the one usbfs would have made, without the allocation that goes with it */
+	cmd->in_buf = NULL;
+	if (queue->pool->devmem && data_length <= queue->pool->data_len) {
+		uint8_t *staged = queue->pool->slots[index].data;
+
+		if (direction & LIBUSB_ENDPOINT_IN)
+			cmd->in_buf = buf;
+		else
+			memcpy(staged, buf, data_length);
+		buf = staged;
+	}
+
+	usb_massstorage_fill_cbw(cmd->cbw, cntx->tag++, cdb, cdb_len, direction, data_length);
+	memset(cmd->csw, 0, sizeof(*cmd->csw));
+	cmd->completed = 0;
+	cmd->error = LIBUSB_SUCCESS;
+
+	/*
+	 * No per-transfer timeouts, queued transfers would start timing out before
+	 * the device even gets to them. Stalls are caught by the reaper instead.
+	 */
+	libusb_fill_bulk_transfer(cmd->cbw_xfer, cntx->lu_handle, cntx->ep_out,
+			(unsigned char *) cmd->cbw, 31, usb_massstorage_queue_cb, cmd, 0);
+	libusb_fill_bulk_transfer(cmd->data_xfer, cntx->lu_handle, data_ep,
+			buf, data_length, usb_massstorage_queue_cb, cmd, 0);
+	libusb_fill_bulk_transfer(cmd->csw_xfer, cntx->lu_handle, cntx->ep_in,
+			(unsigned char *) cmd->csw, 13, usb_massstorage_queue_cb, cmd, 0);
+
+	queue->inflight++;
+
+	cmd->submitted = clock_now_ns();
+	ret = cntx->transport->submit(cntx, cmd->cbw_xfer);
+	if (ret)
+		goto err;
+	cmd->pending |= QUEUE_XFER_CBW;
+
+	if (data_length) {
+		ret = cntx->transport->submit(cntx, cmd->data_xfer);
+		if (ret)
+			goto err;
+		cmd->pending |= QUEUE_XFER_DATA;
+	}
+
+	ret = cntx->transport->submit(cntx, cmd->csw_xfer);
+	if (ret)
+		goto err;
+	cmd->pending |= QUEUE_XFER_CSW;
+
+	return 0;
+
+err:
+	usbms_err(cntx, "failed to submit queued command: %s\n", libusb_strerror((enum libusb_error) ret));
+	queue->error = ret;
+	usb_massstorage_queue_abort(queue);
+	return ret;
+}
+
+int usb_massstorage_queue_wait(struct usb_massstorage_queue *queue)
+{
+	if (queue->error)
+		return queue->error;
+
+	return usb_massstorage_queue_reap(queue, 0);
+}
+
+/*
+ * For commands the device can take a lot longer over than the updater's
+ * segments, writes that have to wait for the medium for one.
+ */
+void usb_massstorage_queue_set_timeout(struct usb_massstorage_queue *queue, unsigned int timeout_ms)
+{
+	queue->timeout_ms = timeout_ms;
+}
+
+unsigned int usb_massstorage_queue_retired(struct usb_massstorage_queue *queue)
+{
+	return queue->retired;
+}
+
+bool usb_massstorage_queue_torn(struct usb_massstorage_queue *queue)
+{
+	return queue->torn;
+}
+
+void usb_massstorage_queue_free(struct usb_massstorage_queue *queue)
+{
+	if (queue->inflight)
+		usb_massstorage_queue_abort(queue);
+
+	/* The transfers and buffers stay with the pool for the next queue */
+	free(queue->cmds);
+	free(queue);
+}
@@ -2,6 +2,8 @@
 
 #ifndef __USBMS_H_
 #define __USBMS_H_
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <libusb.h>
 
@@ -12,12 +14,36 @@ struct mass_storage_inquiry_result {
 };
 
 int usb_massstorage_get_maxlun(struct p3udl_cntx *cntx);
+int usb_massstorage_reset_recovery(struct p3udl_cntx *cntx);
 
 int usb_massstorage_send_command(struct p3udl_cntx *cntx,
 	uint8_t endpoint, uint8_t lun, uint8_t *cdb, uint8_t direction,
-	int data_length, uint32_t *ret_tag);
+	int data_length, uint32_t *ret_tag, unsigned int timeout);
 int usb_massstorage_inquiry(struct p3udl_cntx *cntx, struct mass_storage_inquiry_result *result);
-int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t expected_tag);
+int usb_massstorage_status(struct p3udl_cntx *cntx, uint8_t endpoint, uint32_t expected_tag,
+		unsigned int timeout, uint32_t *residue);
 void usb_massstorage_sense(struct p3udl_cntx *cntx, uint8_t endpoint_in, uint8_t endpoint_out);
 
+/* Block commands for a gadget that is a disk, u-boot's ums for one */
+int usb_massstorage_command(struct p3udl_cntx *cntx, uint8_t *cdb, uint8_t direction,
+		void *buf, int data_length, unsigned int timeout);
+int usb_massstorage_request_sense(struct p3udl_cntx *cntx, uint8_t *key, uint8_t *asc, uint8_t *ascq);
+int usb_massstorage_test_unit_ready(struct p3udl_cntx *cntx);
+int usb_massstorage_read_capacity(struct p3udl_cntx *cntx, uint64_t *blocks, uint32_t *block_size);
+int usb_massstorage_sync_cache(struct p3udl_cntx *cntx, unsigned int timeout);
+void usb_massstorage_rw_cdb(uint8_t *cdb, bool write, uint64_t lba, uint32_t blocks);
+
+/* Pipelined commands, see usbms.c */
+struct usb_massstorage_queue;
+
+struct usb_massstorage_queue *usb_massstorage_queue_new(struct p3udl_cntx *cntx, unsigned int depth,
+		size_t max_len);
+int usb_massstorage_queue_submit(struct usb_massstorage_queue *queue, uint8_t *cdb,
+		uint8_t direction, void *buf, int data_length);
+int usb_massstorage_queue_wait(struct usb_massstorage_queue *queue);
+void usb_massstorage_queue_set_timeout(struct usb_massstorage_queue *queue, unsigned int timeout_ms);
+unsigned int usb_massstorage_queue_retired(struct usb_massstorage_queue *queue);
+bool usb_massstorage_queue_torn(struct usb_massstorage_queue *queue);
+void usb_massstorage_queue_free(struct usb_massstorage_queue *queue);
+
 #endif /* __USBMS_H_ */
@@ -0,0 +1,117 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+/*
+ * Transfer timeouts and retry backoff. The timeout follows the measured
+ * command round trip in the same way TCP's retransmission timer does
+ * (RFC 6298) so a healthy link finds out about a lost transfer in tens of
+ * milliseconds instead of a second. Each timeout doubles it until a
+ * command gets through again.
+ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "clock.h"
+#include "cntx.h"
+#include "metrics.h"
+#include "xfer.h"
+
+/* Sleep between attempts is picked from [0, base << attempt) but never more than the cap */
+#define XFER_BACKOFF_BASE_US	1000
+#define XFER_BACKOFF_MAX_US	(100 * 1000)
+
+/* Forget everything measured, for when something new is on the other end */
+void xfer_reset(struct p3udl_cntx *cntx)
+{
+	struct xfer_policy *xfer = &cntx->xfer;
+
+	xfer->srtt_ns = 0;
+	xfer->rttvar_ns = 0;
+	xfer->samples = 0;
+	xfer->backoff = 0;
+	xfer->seed = (unsigned int) clock_now_ns() ^ (uintptr_t) cntx;
+}
+
+/* A command made it from CBW to a good CSW in ns */
+void xfer_sample(struct p3udl_cntx *cntx, uint64_t ns)
+{
+	struct xfer_policy *xfer = &cntx->xfer;
+
+	if (!xfer->samples) {
+		xfer->srtt_ns = ns;
+		xfer->rttvar_ns = ns / 2;
+	}
+	else {
+		uint64_t err = ns > xfer->srtt_ns ? ns - xfer->srtt_ns : xfer->srtt_ns - ns;
+
+		xfer->rttvar_ns = (3 * xfer->rttvar_ns + err) / 4;
+		xfer->srtt_ns = (7 * xfer->srtt_ns + ns) / 8;
+	}
+
+	xfer->samples++;
+	xfer->backoff = 0;
+}
+
+/* Timeout in ms for a transfer that is part of an ordinary command */
+unsigned int xfer_timeout(struct p3udl_cntx *cntx)
+{
+	struct xfer_policy *xfer = &cntx->xfer;
+	uint64_t timeout;
+
+	if (xfer->samples < XFER_MIN_SAMPLES)
+		return XFER_TIMEOUT_MS;
+
+	timeout = (xfer->srtt_ns + 4 * xfer->rttvar_ns) / NSEC_PER_MSEC;
+	if (timeout < XFER_TIMEOUT_MIN_MS)
+		timeout = XFER_TIMEOUT_MIN_MS;
+
+	for (int i = 0; i < xfer->backoff && timeout < XFER_TIMEOUT_MAX_MS; i++)
+		timeout *= 2;
+
+	return timeout < XFER_TIMEOUT_MAX_MS ? timeout : XFER_TIMEOUT_MAX_MS;
+}
+
+/*
+ * Decide if an attempt that failed with ret and started retrying at
+ * started is worth another go. Only timeouts and stalls (once the caller
+ * has done reset recovery) are, and only while there is retry budget
+ * left. A board that has gone away is given up on straight away. Waits
+ * a jittered, exponentially growing time before returning true so
+ * boards sharing a hub don't all come back at the same moment.
+ */
+bool xfer_retry(struct p3udl_cntx *cntx, int ret, uint64_t started)
+{
+	struct xfer_policy *xfer = &cntx->xfer;
+
+	if (ret != LIBUSB_ERROR_TIMEOUT && ret != LIBUSB_ERROR_PIPE)
+		return false;
+
+	if (ret == LIBUSB_ERROR_TIMEOUT) {
+		cntx->report.timeouts++;
+		metrics_inc(METRIC_TIMEOUTS);
+	}
+
+	if ((clock_now_ns() - started) > (XFER_RETRY_BUDGET_MS * NSEC_PER_MSEC))
+		return false;
+
+	unsigned int ceiling = XFER_BACKOFF_BASE_US;
+	for (int i = 0; i < xfer->backoff && ceiling < XFER_BACKOFF_MAX_US; i++)
+		ceiling *= 2;
+	if (ceiling > XFER_BACKOFF_MAX_US)
+		ceiling = XFER_BACKOFF_MAX_US;
+
+	xfer->backoff++;
+
+	unsigned int us = rand_r(&xfer->seed) % ceiling;
+	struct timespec ts = {
+		.tv_sec = us / 1000000,
+		.tv_nsec = (us % 1000000) * NSEC_PER_USEC,
+	};
+	nanosleep(&ts, NULL);
+
+	cntx->report.retries++;
+	metrics_inc(METRIC_RETRIES);
+
+	return true;
+}
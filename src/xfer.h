@@ -0,0 +1,36 @@
+//SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef __XFER_H_
+#define __XFER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct p3udl_cntx;
+
+/* Used until there is something measured to go on and for commands that make the device think */
+#define XFER_TIMEOUT_MS		1000
+/* Bounds for the measured timeout, the floor covers scheduling noise on the host */
+#define XFER_TIMEOUT_MIN_MS	20
+#define XFER_TIMEOUT_MAX_MS	2000
+/* Round trips needed before the measured timeout is trusted */
+#define XFER_MIN_SAMPLES	4
+/* How long one segment may spend being retried before giving up on it */
+#define XFER_RETRY_BUDGET_MS	4000
+
+struct xfer_policy {
+	/* smoothed command round trip and how much it wobbles */
+	uint64_t srtt_ns, rttvar_ns;
+	unsigned int samples;
+	/* timeouts since the last good round trip, each doubles the timeout */
+	unsigned int backoff;
+	/* for rand_r(), boards back off independently */
+	unsigned int seed;
+};
+
+void xfer_reset(struct p3udl_cntx *cntx);
+void xfer_sample(struct p3udl_cntx *cntx, uint64_t ns);
+unsigned int xfer_timeout(struct p3udl_cntx *cntx);
+bool xfer_retry(struct p3udl_cntx *cntx, int ret, uint64_t started);
+
+#endif /* __XFER_H_ */